@@ -15,9 +15,20 @@
 #include "panic.h"
 #include "vm.h"
 
+#ifdef VM_INSTR_STATS
+/* The instruction a core ran last; op is -1 before the first. */
+typedef struct {
+    int op;
+    uint32_t ip;
+} VM_DebugPrev;
+#endif
+
 typedef struct VM_Debug {
 #ifdef VM_INSTR_STATS
     uint64_t instr_counts[256];
+    /* [first][second] for instructions that ran back to back in memory order. */
+    uint64_t pair_counts[256][256];
+    VM_DebugPrev *pair_prev; /* per core */
 #endif
     uint32_t breakpoints[VM_DEBUG_MAX_BREAKPOINTS];
     size_t breakpoint_count;
@@ -82,6 +93,13 @@ static const char *op_name(uint8_t op) {
         [OP_FLOAD32] = "FLOAD32",
         [OP_FSTORE32] = "FSTORE32",
         [OP_INC] = "INC",
+        [OP_ADDI] = "ADDI",
+        [OP_SUBI] = "SUBI",
+        [OP_ANDI] = "ANDI",
+        [OP_ORI] = "ORI",
+        [OP_XORI] = "XORI",
+        [OP_SHLI] = "SHLI",
+        [OP_SHRI] = "SHRI",
         [OP_CAS] = "CAS",
         [OP_XADD] = "XADD",
         [OP_XCHG] = "XCHG",
@@ -97,6 +115,10 @@ static const char *op_name(uint8_t op) {
         [OP_RCALL] = "RCALL",
         [OP_RJZ] = "RJZ",
         [OP_RJNZ] = "RJNZ",
+        [OP_ROL] = "ROL",
+        [OP_ROR] = "ROR",
+        [OP_ROLI] = "ROLI",
+        [OP_RORI] = "RORI",
     };
     return names[op] ? names[op] : "UNKNOWN";
 }
@@ -289,7 +311,7 @@ static void interactive_wait(VM *vm) {
             continue;
         }
         if (strcmp(cmd, "q") == 0) {
-            vm->halted = 1;
+            vm_halt(vm);
             return;
         }
 
@@ -337,6 +359,15 @@ void vm_debug_init(VM *vm) {
         panic("debug alloc failed\n", vm);
         return;
     }
+#ifdef VM_INSTR_STATS
+    vm->debug->pair_prev = calloc((size_t)vm->smp_cores, sizeof(*vm->debug->pair_prev));
+    if (!vm->debug->pair_prev) {
+        panic("debug alloc failed\n", vm);
+        return;
+    }
+    for (int i = 0; i < vm->smp_cores; i++)
+        vm->debug->pair_prev[i].op = -1;
+#endif
     vm->debug->step_mode = parse_bool_env("VM_DEBUG_STEP") || parse_bool_env("VM_STEP");
     vm->debug->pause_on_start = parse_bool_env("VM_DEBUG_PAUSE");
     load_breakpoints_from_env(vm->debug);
@@ -345,6 +376,9 @@ void vm_debug_init(VM *vm) {
 void vm_debug_destroy(VM *vm) {
     if (!vm || !vm->debug)
         return;
+#ifdef VM_INSTR_STATS
+    free(vm->debug->pair_prev);
+#endif
     free(vm->debug);
     vm->debug = NULL;
 }
@@ -363,17 +397,57 @@ void vm_debug_pause_if_needed(VM *vm, uint32_t ip) {
     }
 }
 
-void vm_debug_count_instruction(VM *vm, uint8_t op) {
+void vm_debug_count_instruction(VM *vm, const VCPU *cpu, uint8_t op, uint32_t ip) {
 #ifdef VM_INSTR_STATS
-    if (!vm || !vm->debug)
+    if (!vm || !vm->debug || !vm->debug->pair_prev)
         return;
     vm->debug->instr_counts[op]++;
+    /* Only fall-through pairs on one core can become superinstructions. */
+    VM_DebugPrev *prev = &vm->debug->pair_prev[cpu->core_id];
+    if (prev->op >= 0 && ip == prev->ip + 8u)
+        vm->debug->pair_counts[prev->op][op]++;
+    prev->op = op;
+    prev->ip = ip;
 #else
     (void)vm;
+    (void)cpu;
     (void)op;
+    (void)ip;
 #endif
 }
 
+#ifdef VM_INSTR_STATS
+#define VM_DEBUG_TOP_PAIRS 16
+
+static void print_pair_stats(const VM_Debug *dbg) {
+    uint32_t top[VM_DEBUG_TOP_PAIRS];
+    size_t top_count = 0;
+    for (uint32_t i = 0; i < 256u * 256u; i++) {
+        const uint64_t count = dbg->pair_counts[i >> 8][i & 0xFF];
+        if (count == 0)
+            continue;
+        size_t pos = top_count;
+        while (pos > 0 && dbg->pair_counts[top[pos - 1] >> 8][top[pos - 1] & 0xFF] < count)
+            pos--;
+        if (pos >= VM_DEBUG_TOP_PAIRS)
+            continue;
+        if (top_count < VM_DEBUG_TOP_PAIRS)
+            top_count++;
+        memmove(&top[pos + 1], &top[pos], (top_count - 1 - pos) * sizeof(top[0]));
+        top[pos] = i;
+    }
+    if (top_count == 0)
+        return;
+    printf("[debug] top fall-through instruction pairs:\n");
+    for (size_t i = 0; i < top_count; i++) {
+        const uint8_t first = (uint8_t)(top[i] >> 8);
+        const uint8_t second = (uint8_t)(top[i] & 0xFF);
+        printf("  %-8s -> %-8s : %llu\n", op_name(first), op_name(second),
+               (unsigned long long)dbg->pair_counts[first][second]);
+    }
+}
+#endif
+
 void vm_debug_print_stats(const VM *vm) {
 #ifdef VM_INSTR_STATS
     if (!vm || !vm->debug)
@@ -390,6 +464,7 @@ void vm_debug_print_stats(const VM *vm) {
         printf("  %-8s (%3zu) : %llu\n", op_name((uint8_t)i), i,
                (unsigned long long)count);
     }
+    print_pair_stats(vm->debug);
 #else
     (void)vm;
 #endif
@@ -8,6 +8,7 @@
 #include <stddef.h>
 
 struct VM;
+struct VCPU;
 
 #ifdef VM_DEBUG
 
@@ -17,7 +18,7 @@ void vm_debug_init(struct VM *vm);
 void vm_debug_destroy(struct VM *vm);
 
 void vm_debug_pause_if_needed(struct VM *vm, uint32_t ip);
-void vm_debug_count_instruction(struct VM *vm, uint8_t op);
+void vm_debug_count_instruction(struct VM *vm, const struct VCPU *cpu, uint8_t op, uint32_t ip);
 void vm_debug_print_stats(const struct VM *vm);
 
 #else
@@ -28,9 +29,11 @@ static inline void vm_debug_pause_if_needed(struct VM *vm, uint32_t ip) {
     (void)vm;
     (void)ip;
 }
-static inline void vm_debug_count_instruction(struct VM *vm, uint8_t op) {
+static inline void vm_debug_count_instruction(struct VM *vm, const struct VCPU *cpu, uint8_t op, uint32_t ip) {
     (void)vm;
+    (void)cpu;
     (void)op;
+    (void)ip;
 }
 static inline void vm_debug_print_stats(const struct VM *vm) { (void)vm; }
 
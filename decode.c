@@ -0,0 +1,327 @@
+#include "decode.h"
+#include "jit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RD VM_OPERAND_RD
+#define RS1 VM_OPERAND_RS1
+#define RS2 VM_OPERAND_RS2
+
+/*
+ * Register operands per opcode. Only these fields are range-checked at
+ * decode time; unused fields are ignored like they always have been.
+ */
+static const uint8_t operand_mask[256] = {
+    [OP_ADD] = RD | RS1 | RS2,
+    [OP_SUB] = RD | RS1 | RS2,
+    [OP_MUL] = RD | RS1 | RS2,
+    [OP_DIV] = RD | RS1 | RS2,
+    [OP_PUSH] = RD,
+    [OP_POP] = RD,
+    [OP_LOAD] = RD | RS1,
+    [OP_LOAD32] = RD | RS1,
+    [OP_LOADX32] = RD | RS1 | RS2,
+    [OP_STORE] = RD | RS1,
+    [OP_STORE32] = RD | RS1,
+    [OP_STOREX32] = RD | RS1 | RS2,
+    [OP_CMP] = RD | RS1,
+    [OP_CMPI] = RD,
+    [OP_MOV] = RD | RS1,
+    [OP_MOVI] = RD,
+    [OP_MEMSET] = RD | RS1,
+    [OP_MEMCPY] = RD | RS1,
+    [OP_IN] = RD | RS1,
+    [OP_OUT] = RD | RS1,
+    [OP_INT] = RD,
+    [OP_MOD] = RD | RS1 | RS2,
+    [OP_AND] = RD | RS1 | RS2,
+    [OP_OR] = RD | RS1 | RS2,
+    [OP_XOR] = RD | RS1 | RS2,
+    [OP_NOT] = RD | RS1,
+    [OP_SHL] = RD | RS1 | RS2,
+    [OP_SHR] = RD | RS1 | RS2,
+    [OP_SAR] = RD | RS1 | RS2,
+    [OP_FADD] = RD | RS1 | RS2,
+    [OP_FSUB] = RD | RS1 | RS2,
+    [OP_FMUL] = RD | RS1 | RS2,
+    [OP_FDIV] = RD | RS1 | RS2,
+    [OP_FNEG] = RD | RS1,
+    [OP_FABS] = RD | RS1,
+    [OP_FSQRT] = RD | RS1,
+    [OP_FCMP] = RD | RS1,
+    [OP_ITOF] = RD | RS1,
+    [OP_FTOI] = RD | RS1,
+    [OP_FLOAD32] = RD | RS1,
+    [OP_FSTORE32] = RD | RS1,
+    [OP_INC] = RD,
+    [OP_ADDI] = RD | RS1,
+    [OP_SUBI] = RD | RS1,
+    [OP_ANDI] = RD | RS1,
+    [OP_ORI] = RD | RS1,
+    [OP_XORI] = RD | RS1,
+    [OP_SHLI] = RD | RS1,
+    [OP_SHRI] = RD | RS1,
+    [OP_CAS] = RD | RS1 | RS2,
+    [OP_XADD] = RD | RS1 | RS2,
+    [OP_XCHG] = RD | RS1 | RS2,
+    [OP_LDAR] = RD | RS1,
+    [OP_STLR] = RD | RS1,
+    [OP_STARTAP] = RD | RS1,
+    [OP_IPI] = RD | RS1,
+    [OP_CPUID] = RD,
+    [OP_CALLR] = RD,
+    [OP_ROL] = RD | RS1 | RS2,
+    [OP_ROR] = RD | RS1 | RS2,
+    [OP_ROLI] = RD | RS1,
+    [OP_RORI] = RD | RS1,
+};
+
+#undef RD
+#undef RS1
+#undef RS2
+
+static int operands_valid(uint8_t op, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    const uint8_t mask = operand_mask[op];
+    if ((mask & VM_OPERAND_RD) && rd >= REG_COUNT)
+        return 0;
+    if ((mask & VM_OPERAND_RS1) && rs1 >= REG_COUNT)
+        return 0;
+    if ((mask & VM_OPERAND_RS2) && rs2 >= REG_COUNT)
+        return 0;
+    return 1;
+}
+
+/*
+ * Decode the instruction at addr into *out, which no other core can see yet.
+ * out->handler stays NULL when the instruction runs past the end of RAM.
+ */
+static void decode_inst(VM *vm, VM_DecodedInst *out, vm_addr_t addr) {
+    atomic_init(&out->handler, NULL);
+    if ((size_t)addr + 8u > vm->memory_size)
+        return;
+    /* Instruction fetch is always from normal RAM (not MMIO). */
+    uint64_t inst = 0;
+    memcpy(&inst, &vm->memory[addr], sizeof(uint64_t));
+    out->op = (uint8_t)((inst >> 56) & 0xFF);
+    out->rd = (uint8_t)((inst >> 48) & 0xFF);
+    out->rs1 = (uint8_t)((inst >> 40) & 0xFF);
+    out->rs2 = (uint8_t)((inst >> 32) & 0xFF);
+    out->imm = (int32_t)(inst & 0xFFFFFFFFu);
+
+    vm_op_handler_fn handler = vm_op_handlers[out->op];
+    if (!handler || !operands_valid(out->op, out->rd, out->rs1, out->rs2)) {
+        out->op = VM_OP_INVALID;
+        handler = vm_op_invalid;
+    }
+    atomic_init(&out->handler, handler);
+}
+
+/*
+ * Copy a decoded instruction into its slot. Other cores read the slot as soon
+ * as they see its handler (vm_fetch() loads it with acquire), so the handler
+ * goes in last. Two cores filling the same slot write the same values.
+ */
+static void publish_slot(VM_DecodedInst *slot, const VM_DecodedInst *d) {
+    const vm_op_handler_fn handler = atomic_load_explicit(&d->handler, memory_order_relaxed);
+    if (!handler)
+        return;
+    slot->imm = d->imm;
+    slot->op = d->op;
+    slot->rd = d->rd;
+    slot->rs1 = d->rs1;
+    slot->rs2 = d->rs2;
+    atomic_store_explicit(&slot->handler, handler, memory_order_release);
+}
+
+#ifndef VM_DEBUG
+/*
+ * Sequences run as one superinstruction, longest first. Candidates come from
+ * the instruction-pair report of a VM_DEBUG build (vm_debug_print_stats()).
+ */
+static const struct {
+    uint8_t ops[3];
+    uint8_t len;
+    uint8_t fused;
+} fusion_rules[] = {
+    {{OP_ADDI, OP_CMP, OP_JL}, 3, VM_OP_FUSED_ADDI_CMP_JL},
+    {{OP_CMPI, OP_JNZ, 0}, 2, VM_OP_FUSED_CMPI_JNZ},
+    {{OP_CMPI, OP_RJNZ, 0}, 2, VM_OP_FUSED_CMPI_RJNZ},
+    {{OP_MOVI, OP_STORE32, 0}, 2, VM_OP_FUSED_MOVI_STORE32},
+    {{OP_LOAD32, OP_CMPI, 0}, 2, VM_OP_FUSED_LOAD32_CMPI},
+};
+
+/*
+ * Fuse *d, the decoded form of slot k, with the slots after it when they form
+ * a known sequence; those are published first, so a core that sees the fused
+ * slot sees them too. Sequences never cross a page, so the handler can read
+ * them as in[1..].
+ */
+static void fuse_slot(VM *vm, VM_DecodePage *page, uint32_t k, vm_addr_t addr, VM_DecodedInst *d) {
+    if (!atomic_load_explicit(&d->handler, memory_order_relaxed) || d->op == VM_OP_INVALID)
+        return;
+    for (size_t r = 0; r < sizeof(fusion_rules) / sizeof(fusion_rules[0]); r++) {
+        const uint32_t len = fusion_rules[r].len;
+        if (d->op != fusion_rules[r].ops[0] || k + len > VM_DECODE_SLOTS_PER_PAGE)
+            continue;
+        uint32_t i = 1;
+        for (; i < len; i++) {
+            VM_DecodedInst *next = &page->slots[k + i];
+            if (!atomic_load_explicit(&next->handler, memory_order_acquire)) {
+                VM_DecodedInst n;
+                decode_inst(vm, &n, addr + i * 8u);
+                publish_slot(next, &n);
+            }
+            if (!atomic_load_explicit(&next->handler, memory_order_acquire) ||
+                vm_decode_base_op(next->op) != fusion_rules[r].ops[i])
+                break;
+        }
+        if (i == len) {
+            d->op = fusion_rules[r].fused;
+            atomic_init(&d->handler, vm_fused_handlers[d->op]);
+            return;
+        }
+    }
+}
+#else
+/* Debug builds keep one slot per instruction for breakpoints and statistics. */
+static void fuse_slot(VM *vm, VM_DecodePage *page, uint32_t k, vm_addr_t addr, VM_DecodedInst *d) {
+    (void)vm;
+    (void)page;
+    (void)k;
+    (void)addr;
+    (void)d;
+}
+#endif
+
+static void decode_page(VM *vm, VM_DecodePage *page, size_t page_index, uint32_t phase) {
+    const vm_addr_t base = (vm_addr_t)(page_index << VM_DECODE_PAGE_SHIFT) + phase;
+    page->phase = phase;
+    atomic_init(&page->next_phase, NULL);
+    for (uint32_t i = 0; i < VM_DECODE_SLOTS_PER_PAGE; i++) {
+        VM_DecodedInst d;
+        decode_inst(vm, &d, base + i * 8u);
+        atomic_init(&page->slots[i].handler, NULL);
+        publish_slot(&page->slots[i], &d);
+    }
+    for (uint32_t i = 0; i < VM_DECODE_SLOTS_PER_PAGE; i++) {
+        VM_DecodedInst d;
+        decode_inst(vm, &d, base + i * 8u);
+        fuse_slot(vm, page, i, base + i * 8u, &d);
+        if (d.op != page->slots[i].op)
+            publish_slot(&page->slots[i], &d);
+    }
+}
+
+int vm_decode_init(VM *vm) {
+    vm->decode_page_count = (vm->memory_size + VM_DECODE_PAGE_SIZE - 1u) >> VM_DECODE_PAGE_SHIFT;
+    vm->decode_pages = calloc(vm->decode_page_count, sizeof(*vm->decode_pages));
+    if (!vm->decode_pages) {
+        vm->decode_page_count = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void vm_decode_destroy(VM *vm) {
+    if (!vm->decode_pages)
+        return;
+    for (size_t p = 0; p < vm->decode_page_count; p++) {
+        VM_DecodePage *page = atomic_load_explicit(&vm->decode_pages[p], memory_order_relaxed);
+        while (page) {
+            VM_DecodePage *next = atomic_load_explicit(&page->next_phase, memory_order_relaxed);
+            free(page);
+            page = next;
+        }
+    }
+    free(vm->decode_pages);
+    vm->decode_pages = NULL;
+    vm->decode_page_count = 0;
+}
+
+/*
+ * Slow path of vm_fetch(): the page has never been executed at this ip
+ * phase, or the slot was cleared by a write.
+ */
+const VM_DecodedInst *vm_decode_fill(VM *vm, vm_addr_t ip) {
+    const size_t page_index = (size_t)ip >> VM_DECODE_PAGE_SHIFT;
+    const uint32_t phase = ip & 7u;
+    _Atomic(VM_DecodePage *) *link = &vm->decode_pages[page_index];
+    VM_DecodePage *fresh = NULL;
+    VM_DecodePage *page;
+
+    for (;;) {
+        page = atomic_load_explicit(link, memory_order_acquire);
+        if (page) {
+            if (page->phase == phase)
+                break;
+            link = &page->next_phase;
+            continue;
+        }
+        if (!fresh) {
+            fresh = malloc(sizeof(VM_DecodePage));
+            if (!fresh)
+                return NULL;
+            decode_page(vm, fresh, page_index, phase);
+        }
+        VM_DecodePage *expected = NULL;
+        if (atomic_compare_exchange_strong_explicit(link, &expected, fresh, memory_order_acq_rel,
+                                                    memory_order_acquire)) {
+            if (link == &vm->decode_pages[page_index])
+                vm_jit_note_code_page(vm, page_index);
+            page = fresh;
+            fresh = NULL;
+            break;
+        }
+        // Another core published a page here first; it may be for this phase.
+    }
+    free(fresh);
+
+    const uint32_t k = (ip & (VM_DECODE_PAGE_SIZE - 1u)) >> 3;
+    VM_DecodedInst *slot = &page->slots[k];
+    if (!atomic_load_explicit(&slot->handler, memory_order_acquire)) {
+        VM_DecodedInst d;
+        decode_inst(vm, &d, ip);
+        fuse_slot(vm, page, k, ip, &d);
+        publish_slot(slot, &d);
+    }
+    return slot;
+}
+
+/* floor(a / 8) for possibly negative a. */
+static inline int64_t floor_div8(int64_t a) {
+    return (a >= 0) ? a / 8 : -((-a + 7) / 8);
+}
+
+void vm_decode_invalidate(VM *vm, vm_addr_t addr, size_t size) {
+    if (size == 0)
+        return;
+    const int64_t lo = (int64_t)addr;
+    const int64_t hi = (int64_t)addr + (int64_t)size; /* exclusive */
+    const size_t first = (size_t)(lo > 7 ? lo - 7 : 0) >> VM_DECODE_PAGE_SHIFT;
+    size_t last = (size_t)(hi - 1) >> VM_DECODE_PAGE_SHIFT;
+    if (last >= vm->decode_page_count)
+        last = vm->decode_page_count - 1u;
+
+    for (size_t p = first; p <= last; p++) {
+        VM_DecodePage *page = atomic_load_explicit(&vm->decode_pages[p], memory_order_acquire);
+        for (; page; page = atomic_load_explicit(&page->next_phase, memory_order_acquire)) {
+            /*
+             * Slot k covers [base + 8k, base + 8k + 8); clear those overlapping
+             * [lo, hi), plus the two before them in case they head a fused
+             * sequence that reads the overwritten slots.
+             */
+            const int64_t base = (int64_t)(p << VM_DECODE_PAGE_SHIFT) + (int64_t)page->phase;
+            int64_t k_lo = floor_div8(lo - 8 - base) + 1 - 2;
+            int64_t k_hi = floor_div8(hi - 1 - base);
+            if (k_lo < 0)
+                k_lo = 0;
+            if (k_hi > (int64_t)VM_DECODE_SLOTS_PER_PAGE - 1)
+                k_hi = (int64_t)VM_DECODE_SLOTS_PER_PAGE - 1;
+            for (int64_t k = k_lo; k <= k_hi; k++) {
+                atomic_store_explicit(&page->slots[k].handler, NULL, memory_order_relaxed);
+            }
+        }
+    }
+    vm_jit_invalidate(vm, addr, size);
+}
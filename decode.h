@@ -0,0 +1,123 @@
+#ifndef VM_DECODE_H
+#define VM_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+ * Pre-decoded instruction cache.
+ *
+ * Guest RAM is split into 4 KiB pages. The first time a page is executed
+ * every 8-byte slot in it is decoded into a VM_DecodedInst, so the
+ * interpreter never has to re-split the raw instruction word again.
+ * Slots are indexed by ip / 8 inside the page; the page remembers the
+ * ip phase (ip & 7) it was decoded with, since text is not required to
+ * be 8-byte aligned (PROGRAM_BASE is 0x201C). Executing the page at another
+ * phase decodes another copy, chained after the first, so a page that a
+ * core may be dispatching from never changes phase. Copies live until
+ * vm_decode_destroy().
+ *
+ * Writes to RAM clear the slots they overlap and the slot is decoded
+ * again on its next execution.
+ *
+ * Outside VM_DEBUG builds, common instruction sequences inside a page are
+ * fused into one superinstruction at decode time (see fusion_rules in
+ * decode.c), so the dispatcher runs them with a single handler.
+ */
+#define VM_DECODE_PAGE_SHIFT 12u
+#define VM_DECODE_PAGE_SIZE (1u << VM_DECODE_PAGE_SHIFT)
+#define VM_DECODE_SLOTS_PER_PAGE (VM_DECODE_PAGE_SIZE / 8u)
+
+/* Operand fields an opcode actually reads or writes as register indices. */
+#define VM_OPERAND_RD 0x01u
+#define VM_OPERAND_RS1 0x02u
+#define VM_OPERAND_RS2 0x04u
+
+/*
+ * Opcode 0 is not assigned by the ISA. The decoder rewrites undefined
+ * opcodes and out-of-range register operands to it so dispatch tables
+ * never see anything but a real handler.
+ */
+#define VM_OP_INVALID 0x00u
+
+/*
+ * Superinstructions. The decoder rewrites the first slot of a common
+ * sequence to one of these; its fields still describe the first instruction
+ * and the handler reads the rest from the slots that follow it. Guest code
+ * cannot use these values directly: vm_op_handlers[] has no entry for them,
+ * so they decode as VM_OP_INVALID.
+ */
+#define VM_OP_FUSED_CMPI_JNZ 0xF0u
+#define VM_OP_FUSED_CMPI_RJNZ 0xF1u
+#define VM_OP_FUSED_MOVI_STORE32 0xF2u
+#define VM_OP_FUSED_ADDI_CMP_JL 0xF3u
+#define VM_OP_FUSED_LOAD32_CMPI 0xF4u
+
+typedef struct VM_DecodedInst VM_DecodedInst;
+typedef void (*vm_op_handler_fn)(VM *vm, VCPU *cpu, const VM_DecodedInst *in);
+
+struct VM_DecodedInst {
+    _Atomic(vm_op_handler_fn) handler; /* NULL: slot not decoded yet; stored last, with release */
+    int32_t imm;
+    uint8_t op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+};
+
+struct VM_DecodePage {
+    uint32_t phase;
+    _Atomic(struct VM_DecodePage *) next_phase; /* the same RAM decoded at another phase */
+    VM_DecodedInst slots[VM_DECODE_SLOTS_PER_PAGE];
+};
+
+/* Defined next to the opcode handlers in vm.c. */
+extern const vm_op_handler_fn vm_op_handlers[256];
+extern const vm_op_handler_fn vm_fused_handlers[256];
+void vm_op_invalid(VM *vm, VCPU *cpu, const VM_DecodedInst *in);
+
+/* The opcode of the first instruction a (possibly fused) slot stands for. */
+static inline uint8_t vm_decode_base_op(uint8_t op) {
+    switch (op) {
+    case VM_OP_FUSED_CMPI_JNZ:
+    case VM_OP_FUSED_CMPI_RJNZ:
+        return OP_CMPI;
+    case VM_OP_FUSED_MOVI_STORE32:
+        return OP_MOVI;
+    case VM_OP_FUSED_ADDI_CMP_JL:
+        return OP_ADDI;
+    case VM_OP_FUSED_LOAD32_CMPI:
+        return OP_LOAD32;
+    default:
+        return op;
+    }
+}
+
+int vm_decode_init(VM *vm);
+void vm_decode_destroy(VM *vm);
+const VM_DecodedInst *vm_decode_fill(VM *vm, vm_addr_t ip);
+void vm_decode_invalidate(VM *vm, vm_addr_t addr, size_t size);
+
+/*
+ * Called after every guest RAM write. Only pays for the invalidation when
+ * one of the touched pages (or the page before, for a slot straddling the
+ * boundary) has been decoded.
+ */
+static inline void vm_decode_note_write(VM *vm, vm_addr_t addr, size_t size) {
+    if (size == 0)
+        return;
+    const size_t first = (size_t)(addr > 7u ? addr - 7u : 0u) >> VM_DECODE_PAGE_SHIFT;
+    size_t last = ((size_t)addr + size - 1u) >> VM_DECODE_PAGE_SHIFT;
+    if (last >= vm->decode_page_count)
+        last = vm->decode_page_count - 1u;
+    for (size_t p = first; p <= last; p++) {
+        if (atomic_load_explicit(&vm->decode_pages[p], memory_order_relaxed)) {
+            vm_decode_invalidate(vm, addr, size);
+            return;
+        }
+    }
+}
+
+#endif // VM_DECODE_H
@@ -0,0 +1,131 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io_devices/disk/disk_cow.h"
+
+/*
+ * vm-disk: host-side tool for copy-on-write overlay disk images (see
+ * io_devices/disk/disk_cow.h). Any image given to the VM as its disk may
+ * be an overlay; the VM tells the two kinds apart by the header.
+ */
+
+static void print_usage(const char *prog) {
+    printf("Usage: %s create [--size <size>[K|M|G]] <overlay> [<base>]\n"
+           "       %s info <image>\n"
+           "       %s commit <overlay>\n"
+           "       %s compact <overlay>\n",
+           prog, prog, prog, prog);
+    printf("create: a new, empty overlay over <base> (raw or overlay); a relative <base> is\n"
+           "        relative to the overlay's directory. --size defaults to the base's size.\n");
+    printf("info: size, clusters written and the base chain.\n");
+    printf("commit: write the overlay's clusters into its base, then empty the overlay.\n");
+    printf("compact: drop the clusters that read the same as the base, and any left\n"
+           "         unreferenced by an interrupted write.\n");
+    printf("The VM must not be running on the images involved.\n");
+}
+
+/* Bytes with an optional binary K/M/G suffix. */
+static int parse_size(const char *s, uint64_t *out) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno != 0 || end == s || *s == '-')
+        return 0;
+    unsigned int shift = 0;
+    if (*end == 'K' || *end == 'k')
+        shift = 10;
+    else if (*end == 'M' || *end == 'm')
+        shift = 20;
+    else if (*end == 'G' || *end == 'g')
+        shift = 30;
+    if (shift != 0)
+        end++;
+    if (*end != '\0' || v == 0 || v > (UINT64_MAX >> 30))
+        return 0;
+    *out = (uint64_t)v << shift;
+    return 1;
+}
+
+static int disk_info(const char *path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    if (!disk_cow_probe(fd)) {
+        struct stat st;
+        const int ok = fstat(fd, &st) == 0;
+        if (ok)
+            printf("%s: raw, %llu bytes\n", path, (unsigned long long)st.st_size);
+        else
+            perror(path);
+        close(fd);
+        return ok ? 0 : 1;
+    }
+    DiskCow *cow = disk_cow_open(path, fd, 0);
+    if (!cow)
+        return 1;
+    const char *name = path;
+    for (const DiskCow *c = cow; c; c = c->base) {
+        const uint32_t written = disk_cow_allocated(c);
+        printf("%s: overlay, %llu bytes, %u of %u clusters of %u KiB written (%llu KiB)\n", name,
+               (unsigned long long)c->size, written, c->clusters, (1u << c->cluster_bits) >> 10,
+               (unsigned long long)written << (c->cluster_bits - 10u));
+        if (!c->base_path)
+            printf("  base: none, unwritten clusters read as zeros\n");
+        else if (!c->base)
+            printf("  base: %s (raw)\n", c->base_path);
+        else
+            printf("  base: %s\n", c->base_path);
+        name = c->base_path;
+    }
+    disk_cow_close(cow);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return argc == 2 && (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) ? 0 : 1;
+    }
+    const char *cmd = argv[1];
+    if (strcmp(cmd, "create") == 0) {
+        uint64_t size = 0;
+        int i = 2;
+        if (strcmp(argv[i], "--size") == 0) {
+            if (i + 1 >= argc || !parse_size(argv[i + 1], &size)) {
+                printf("Invalid --size value. Expected bytes with an optional K, M or G suffix.\n");
+                return 1;
+            }
+            i += 2;
+        }
+        if (argc - i < 1 || argc - i > 2) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (argc - i == 1 && size == 0) {
+            printf("An overlay without a base needs --size.\n");
+            return 1;
+        }
+        return disk_cow_create(argv[i], argc - i == 2 ? argv[i + 1] : NULL, size) ? 0 : 1;
+    }
+    if (argc != 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(cmd, "info") == 0)
+        return disk_info(argv[2]);
+    if (strcmp(cmd, "commit") == 0)
+        return disk_cow_commit(argv[2]) ? 0 : 1;
+    if (strcmp(cmd, "compact") == 0)
+        return disk_cow_compact(argv[2]) ? 0 : 1;
+    printf("Unknown command: %s\n", cmd);
+    print_usage(argv[0]);
+    return 1;
+}
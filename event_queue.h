@@ -0,0 +1,79 @@
+#ifndef VM_EVENT_QUEUE_H
+#define VM_EVENT_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Bounded lock-free queue from device/host threads to the vCPU thread.
+ *
+ * Used in uniprocessor mode (vm->uniprocessor), where the vCPU touches
+ * device state without locks: anything another thread wants to change there
+ * is posted here and applied by the vCPU at its next batch boundary. Any
+ * number of producers, exactly one consumer. Interrupts do not go through
+ * here, since a full queue would drop them; see vm->irq_posted.
+ */
+#define VM_EVENT_QUEUE_SIZE 256u /* power of two */
+
+enum {
+    VM_EVENT_SERIAL_RX = 2, /* arg: received byte */
+};
+
+typedef struct {
+    atomic_uint seq;
+    uint32_t kind;
+    uint32_t arg;
+} VM_Event;
+
+typedef struct {
+    VM_Event slots[VM_EVENT_QUEUE_SIZE];
+    atomic_uint head; /* next slot to claim, shared by producers */
+    unsigned int tail; /* consumer only */
+} VM_EventQueue;
+
+static inline void vm_event_queue_init(VM_EventQueue *q) {
+    for (unsigned int i = 0; i < VM_EVENT_QUEUE_SIZE; i++)
+        atomic_init(&q->slots[i].seq, i);
+    atomic_init(&q->head, 0);
+    q->tail = 0;
+}
+
+/* Returns 0 when the queue is full. */
+static inline int vm_event_push(VM_EventQueue *q, uint32_t kind, uint32_t arg) {
+    unsigned int pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    VM_Event *ev;
+    for (;;) {
+        ev = &q->slots[pos & (VM_EVENT_QUEUE_SIZE - 1u)];
+        const unsigned int seq = atomic_load_explicit(&ev->seq, memory_order_acquire);
+        const int diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1u,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+    ev->kind = kind;
+    ev->arg = arg;
+    atomic_store_explicit(&ev->seq, pos + 1u, memory_order_release);
+    return 1;
+}
+
+/* Consumer side. Returns 0 when the queue is empty. */
+static inline int vm_event_pop(VM_EventQueue *q, uint32_t *kind, uint32_t *arg) {
+    const unsigned int pos = q->tail;
+    VM_Event *ev = &q->slots[pos & (VM_EVENT_QUEUE_SIZE - 1u)];
+    const unsigned int seq = atomic_load_explicit(&ev->seq, memory_order_acquire);
+    if ((int)(seq - (pos + 1u)) < 0)
+        return 0;
+    *kind = ev->kind;
+    *arg = ev->arg;
+    atomic_store_explicit(&ev->seq, pos + VM_EVENT_QUEUE_SIZE, memory_order_release);
+    q->tail = pos + 1u;
+    return 1;
+}
+
+#endif // VM_EVENT_QUEUE_H
@@ -4,33 +4,38 @@
 #ifndef VM_FETCH_H
 #define VM_FETCH_H
 
-#include <string.h>
-
+#include "decode.h"
 #include "panic.h"
 #include "vm.h"
 
-#define FETCH64(vm, op, rd, rs1, rs2, imm)                                                         \
-    do {                                                                                           \
-        VCPU *cpu = vm_current_cpu((vm));                                                          \
-        if (!cpu) {                                                                                \
-            panic("No active CPU context\n", (vm));                                                \
-            return;                                                                                \
-        }                                                                                          \
-        const vm_addr_t ip = (vm_addr_t)cpu->ip;                                                   \
-        if ((size_t)ip + 8u > (vm)->memory_size) {                                                 \
-            panic("IP out of bounds\n", (vm));                                                     \
-            return;                                                                                \
-        }                                                                                          \
-        cpu->last_ip = ip;                                                                         \
-        /* Fast path: instruction fetch is always from normal RAM (not MMIO). */                  \
-        uint64_t inst = 0;                                                                         \
-        memcpy(&inst, &((vm)->memory[ip]), sizeof(uint64_t));                                      \
-        cpu->ip = (size_t)(ip + 8u);                                                               \
-        op = (inst >> 56) & 0xFF;                                                                  \
-        rd = (inst >> 48) & 0xFF;                                                                  \
-        rs1 = (inst >> 40) & 0xFF;                                                                 \
-        rs2 = (inst >> 32) & 0xFF;                                                                 \
-        imm = (int32_t)(inst & 0xFFFFFFFFu);                                                       \
-    } while (0)
+/*
+ * Fetch the instruction at cpu->ip from the decoded-instruction cache and
+ * advance ip past it. Returns NULL after a panic.
+ */
+static inline const VM_DecodedInst *vm_fetch(VM *vm, VCPU *cpu) {
+    const vm_addr_t ip = (vm_addr_t)cpu->ip;
+    if ((size_t)ip + 8u > vm->memory_size) {
+        panic("IP out of bounds\n", vm);
+        return NULL;
+    }
+    const VM_DecodedInst *in = NULL;
+    const VM_DecodePage *page =
+        atomic_load_explicit(&vm->decode_pages[ip >> VM_DECODE_PAGE_SHIFT], memory_order_acquire);
+    while (page && page->phase != (ip & 7u))
+        page = atomic_load_explicit(&page->next_phase, memory_order_acquire);
+    if (page) {
+        in = &page->slots[(ip & (VM_DECODE_PAGE_SIZE - 1u)) >> 3];
+    }
+    if (!in || !atomic_load_explicit(&in->handler, memory_order_acquire)) {
+        in = vm_decode_fill(vm, ip);
+        if (!in) {
+            panic("Instruction decode failed\n", vm);
+            return NULL;
+        }
+    }
+    cpu->last_ip = ip;
+    cpu->ip = (size_t)(ip + 8u);
+    return in;
+}
 
 #endif // VM_FETCH_H
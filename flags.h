@@ -5,10 +5,115 @@
 #ifndef VM_FLAGS_H
 #define VM_FLAGS_H
 #pragma once
+#include <stdint.h>
+
+#include "vm.h"
+
 #define FLAG_CF 0x01
 #define FLAG_PF 0x02
 #define FLAG_AF 0x04
 #define FLAG_ZF 0x08
 #define FLAG_SF 0x10
 #define FLAG_OF 0x20
-#endif //VM_FLAGS_H
\ No newline at end of file
+
+#define FLAG_ARITH_MASK (FLAG_CF | FLAG_ZF | FLAG_SF | FLAG_OF)
+
+/*
+ * Condition flags are evaluated lazily. Flag-producing instructions only
+ * record what they did (cpu->flags_kind plus operands and result); ZF/SF/CF/OF
+ * are folded back into cpu->flags when something actually reads them:
+ * conditional jumps, interrupt entry and the debugger/dump paths.
+ *
+ * Bits outside FLAG_ARITH_MASK are never touched lazily, so cpu->flags is
+ * always current for them.
+ */
+enum {
+    VM_FLAGS_LIVE = 0, /* cpu->flags holds the real value */
+    VM_FLAGS_ADD,
+    VM_FLAGS_SUB,
+    VM_FLAGS_LOGIC,
+};
+
+static inline unsigned int vm_flags_value(const VCPU *cpu) {
+    const int32_t a = cpu->flags_a;
+    const int32_t b = cpu->flags_b;
+    const int32_t res = cpu->flags_res;
+    unsigned int f = cpu->flags;
+
+    if (cpu->flags_kind == VM_FLAGS_LIVE)
+        return f;
+
+    f &= ~(unsigned int)FLAG_ARITH_MASK;
+    if (res == 0)
+        f |= FLAG_ZF;
+    if (res < 0)
+        f |= FLAG_SF;
+
+    switch (cpu->flags_kind) {
+    case VM_FLAGS_ADD:
+        if ((uint32_t) a + (uint32_t) b < (uint32_t) a)
+            f |= FLAG_CF;
+        if ((a > 0 && b > 0 && res < 0) || (a < 0 && b < 0 && res > 0))
+            f |= FLAG_OF;
+        break;
+    case VM_FLAGS_SUB:
+        if ((uint32_t) a < (uint32_t) b)
+            f |= FLAG_CF;
+        if ((a > 0 && b < 0 && res < 0) || (a < 0 && b > 0 && res > 0))
+            f |= FLAG_OF;
+        break;
+    default:
+        break;
+    }
+    return f;
+}
+
+static inline unsigned int vm_flags_materialize(VCPU *cpu) {
+    if (cpu->flags_kind != VM_FLAGS_LIVE) {
+        cpu->flags = vm_flags_value(cpu);
+        cpu->flags_kind = VM_FLAGS_LIVE;
+    }
+    return cpu->flags;
+}
+
+/* SF != OF, the signed "less than" of JL/JLE/JG/JGE. The two bits differ, so compare them as booleans. */
+static inline int vm_flags_signed_less(unsigned int f) {
+    return !(f & FLAG_SF) != !(f & FLAG_OF);
+}
+
+/* Replace ZF/SF/CF/OF with an explicit value. */
+static inline void vm_flags_set(VCPU *cpu, unsigned int arith) {
+    cpu->flags = (cpu->flags & ~(unsigned int)FLAG_ARITH_MASK) | (arith & FLAG_ARITH_MASK);
+    cpu->flags_kind = VM_FLAGS_LIVE;
+}
+
+static inline void update_add_flags(VCPU *cpu, int32_t a, int32_t b, int32_t result) {
+    cpu->flags_kind = VM_FLAGS_ADD;
+    cpu->flags_a = a;
+    cpu->flags_b = b;
+    cpu->flags_res = result;
+}
+
+static inline void update_sub_flags(VCPU *cpu, int32_t a, int32_t b, int32_t result) {
+    cpu->flags_kind = VM_FLAGS_SUB;
+    cpu->flags_a = a;
+    cpu->flags_b = b;
+    cpu->flags_res = result;
+}
+
+/* ZF/SF from result, CF/OF left as they were. */
+static inline void update_zf_sf(VCPU *cpu, int32_t result) {
+    unsigned int f = vm_flags_materialize(cpu) & (FLAG_CF | FLAG_OF);
+    if (result == 0)
+        f |= FLAG_ZF;
+    if (result < 0)
+        f |= FLAG_SF;
+    vm_flags_set(cpu, f);
+}
+
+/* ZF/SF from result, CF/OF cleared. */
+static inline void update_logic_flags(VCPU *cpu, int32_t result) {
+    cpu->flags_kind = VM_FLAGS_LOGIC;
+    cpu->flags_res = result;
+}
+#endif //VM_FLAGS_H
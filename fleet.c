@@ -0,0 +1,557 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libvm.h"
+
+/*
+ * vm-fleet: run a manifest of guest jobs inside one process on a small pool
+ * of host threads and write what became of each as JSON.
+ *
+ * Guests never get vCPU threads of their own. Every worker owns a queue of
+ * live VMs and runs them in turn, FLEET_QUANTUM instructions at a time
+ * through vm_step(); a worker with nothing left to run opens the next job
+ * from the manifest or steals a live VM from the back of another worker's
+ * queue. At most --max-live VMs exist at once. A worker that finds none of
+ * these sleeps until a queue gets a VM to spare or a job finishes.
+ */
+
+#define FLEET_QUANTUM (1u << 16)
+#define FLEET_SERIAL_MAX (64u * 1024u)
+#define FLEET_THREADS_MAX 256
+
+enum {
+    FLEET_PENDING = 0,
+    FLEET_HALTED,
+    FLEET_PANICKED,
+    FLEET_TIMEOUT,
+    FLEET_ERROR, /* the VM could not be created */
+};
+
+static const char *const fleet_state_names[] = {
+    [FLEET_PENDING] = "pending",
+    [FLEET_HALTED] = "halted",
+    [FLEET_PANICKED] = "panicked",
+    [FLEET_TIMEOUT] = "timeout",
+    [FLEET_ERROR] = "error",
+};
+
+typedef struct {
+    /* From the manifest. */
+    char *binary;
+    char *disk;
+    int smp;
+    uint64_t timeout_ms;
+
+    /* Only touched by the worker currently holding the job. */
+    VM *vm;
+    uint64_t start_ns;
+    char *serial;
+    size_t serial_len;
+    int serial_truncated;
+
+    /* Result, final once the job is counted in Fleet.finished. */
+    int state;
+    int exit_code;
+    uint64_t cycles;
+    uint64_t wall_ns;
+    char *panic_message;
+} FleetJob;
+
+/* Live VMs of one worker. The owner runs from the front; thieves take from the back. */
+typedef struct {
+    pthread_mutex_t lock;
+    FleetJob **items;
+    size_t head;
+    size_t count;
+    size_t cap;
+} FleetQueue;
+
+typedef struct {
+    FleetJob *jobs;
+    size_t job_count;
+    FleetQueue *queues;
+    int threads;
+    int max_live;
+    atomic_size_t next_job;
+    atomic_int live;
+    atomic_size_t finished;
+
+    /* Idle workers wait on `wake` until `events` moves past what they saw. */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t wake;
+    atomic_uint events;
+    atomic_int idle;
+} Fleet;
+
+typedef struct {
+    Fleet *fleet;
+    int index;
+} FleetWorker;
+
+static uint64_t fleet_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int fleet_queue_init(FleetQueue *q, size_t cap) {
+    pthread_mutex_init(&q->lock, NULL);
+    q->items = calloc(cap, sizeof(FleetJob *));
+    q->head = 0;
+    q->count = 0;
+    q->cap = cap;
+    return q->items != NULL;
+}
+
+static void fleet_queue_destroy(FleetQueue *q) {
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+}
+
+/* Never full: a queue holds at most max_live jobs, its capacity. Returns the new count. */
+static size_t fleet_queue_push(FleetQueue *q, FleetJob *job) {
+    pthread_mutex_lock(&q->lock);
+    q->items[(q->head + q->count) % q->cap] = job;
+    const size_t count = ++q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+static FleetJob *fleet_queue_pop_front(FleetQueue *q) {
+    FleetJob *job = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        job = q->items[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+static FleetJob *fleet_queue_steal(FleetQueue *q) {
+    FleetJob *job = NULL;
+    pthread_mutex_lock(&q->lock);
+    /* Leave a worker its last VM; moving it would only shuffle load around. */
+    if (q->count > 1) {
+        q->count--;
+        job = q->items[(q->head + q->count) % q->cap];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+/* Something an idle worker may be waiting for happened. Cheap while nobody is idle. */
+static void fleet_wake(Fleet *fleet) {
+    atomic_fetch_add(&fleet->events, 1);
+    if (atomic_load(&fleet->idle) == 0)
+        return;
+    pthread_mutex_lock(&fleet->idle_lock);
+    pthread_cond_broadcast(&fleet->wake);
+    pthread_mutex_unlock(&fleet->idle_lock);
+}
+
+static void fleet_serial_out(void *opaque, uint8_t c) {
+    FleetJob *job = opaque;
+    if (job->serial_len + 1 >= FLEET_SERIAL_MAX) {
+        job->serial_truncated = 1;
+        return;
+    }
+    job->serial[job->serial_len++] = (char)c;
+}
+
+/* Returns 0 if the VM could not be created; the job is then finished as FLEET_ERROR. */
+static int fleet_job_open(FleetJob *job) {
+    job->start_ns = fleet_now_ns();
+    job->serial = malloc(FLEET_SERIAL_MAX);
+    if (!job->serial)
+        return 0;
+    VM_Config config = {0};
+    config.binary = job->binary;
+    config.disk_path = job->disk;
+    config.smp_cores = job->smp;
+    config.serial_out = fleet_serial_out;
+    config.serial_opaque = job;
+    job->vm = vm_open(&config);
+    return job->vm != NULL;
+}
+
+static void fleet_job_finish(Fleet *fleet, FleetJob *job, int state) {
+    job->state = state;
+    job->wall_ns = fleet_now_ns() - job->start_ns;
+    if (job->vm) {
+        job->exit_code = vm_exit_code(job->vm);
+        job->cycles = vm_cycles(job->vm);
+        const char *msg = vm_panic_message(job->vm);
+        job->panic_message = msg ? strdup(msg) : NULL;
+        vm_destroy(job->vm);
+        job->vm = NULL;
+        atomic_fetch_sub(&fleet->live, 1);
+    }
+    atomic_fetch_add(&fleet->finished, 1);
+    /* A live slot, or the last job: either way the idle workers have something to do. */
+    fleet_wake(fleet);
+}
+
+/* One quantum of `job`. Returns 1 while it still has to run. */
+static int fleet_job_run(Fleet *fleet, FleetJob *job) {
+    vm_step(job->vm, FLEET_QUANTUM);
+    switch (vm_state(job->vm)) {
+    case VM_STATE_HALTED:
+        fleet_job_finish(fleet, job, FLEET_HALTED);
+        return 0;
+    case VM_STATE_PANICKED:
+        fleet_job_finish(fleet, job, FLEET_PANICKED);
+        return 0;
+    default:
+        break;
+    }
+    if (job->timeout_ms && (fleet_now_ns() - job->start_ns) / 1000000ull >= job->timeout_ms) {
+        vm_stop(job->vm);
+        fleet_job_finish(fleet, job, FLEET_TIMEOUT);
+        return 0;
+    }
+    return 1;
+}
+
+/* Claim a live-VM slot and the next unopened job, if there are both. */
+static FleetJob *fleet_take_new(Fleet *fleet) {
+    if (atomic_fetch_add(&fleet->live, 1) >= fleet->max_live) {
+        atomic_fetch_sub(&fleet->live, 1);
+        return NULL;
+    }
+    const size_t index = atomic_fetch_add(&fleet->next_job, 1);
+    if (index >= fleet->job_count) {
+        atomic_fetch_sub(&fleet->live, 1);
+        return NULL;
+    }
+    FleetJob *job = &fleet->jobs[index];
+    if (!fleet_job_open(job)) {
+        atomic_fetch_sub(&fleet->live, 1);
+        fleet_job_finish(fleet, job, FLEET_ERROR);
+        return NULL;
+    }
+    return job;
+}
+
+static FleetJob *fleet_steal(Fleet *fleet, int self) {
+    for (int i = 1; i < fleet->threads; i++) {
+        FleetJob *job = fleet_queue_steal(&fleet->queues[(self + i) % fleet->threads]);
+        if (job)
+            return job;
+    }
+    return NULL;
+}
+
+static FleetJob *fleet_find_work(Fleet *fleet, int self) {
+    /* Top up with new jobs first so the live set fills evenly across workers. */
+    FleetJob *job = fleet_take_new(fleet);
+    if (!job)
+        job = fleet_queue_pop_front(&fleet->queues[self]);
+    if (!job)
+        job = fleet_steal(fleet, self);
+    return job;
+}
+
+/*
+ * Nothing to run: sleep until fleet_wake(). Announcing the wait before the
+ * last look for work means a wake in between is either seen by that look or
+ * moves `events` past `seen`.
+ */
+static FleetJob *fleet_idle(Fleet *fleet, int self) {
+    atomic_fetch_add(&fleet->idle, 1);
+    const unsigned int seen = atomic_load(&fleet->events);
+    FleetJob *job = fleet_find_work(fleet, self);
+    if (!job) {
+        pthread_mutex_lock(&fleet->idle_lock);
+        while (atomic_load(&fleet->events) == seen && atomic_load(&fleet->finished) < fleet->job_count)
+            pthread_cond_wait(&fleet->wake, &fleet->idle_lock);
+        pthread_mutex_unlock(&fleet->idle_lock);
+    }
+    atomic_fetch_sub(&fleet->idle, 1);
+    return job;
+}
+
+static void *fleet_worker(void *arg) {
+    FleetWorker *worker = arg;
+    Fleet *fleet = worker->fleet;
+    FleetQueue *own = &fleet->queues[worker->index];
+    while (atomic_load(&fleet->finished) < fleet->job_count) {
+        FleetJob *job = fleet_find_work(fleet, worker->index);
+        if (!job)
+            job = fleet_idle(fleet, worker->index);
+        if (!job)
+            continue;
+        /* A second VM in a queue is one a thief may take. */
+        if (fleet_job_run(fleet, job) && fleet_queue_push(own, job) > 1)
+            fleet_wake(fleet);
+    }
+    return NULL;
+}
+
+static void json_string(FILE *out, const char *s, size_t len) {
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", out);
+        else if (c == '\r')
+            fputs("\\r", out);
+        else if (c == '\t')
+            fputs("\\t", out);
+        else if (c < 0x20 || c >= 0x7F)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void fleet_write_results(FILE *out, const Fleet *fleet) {
+    fprintf(out, "{\n  \"jobs\": [\n");
+    for (size_t i = 0; i < fleet->job_count; i++) {
+        const FleetJob *job = &fleet->jobs[i];
+        fprintf(out, "    {\"binary\": ");
+        json_string(out, job->binary, strlen(job->binary));
+        fprintf(out, ", \"disk\": ");
+        json_string(out, job->disk, strlen(job->disk));
+        fprintf(out, ", \"smp\": %d, \"timeout_ms\": %llu, \"state\": \"%s\", \"exit_code\": %d",
+                job->smp, (unsigned long long)job->timeout_ms, fleet_state_names[job->state],
+                job->exit_code);
+        fprintf(out, ", \"cycles\": %llu, \"wall_ms\": %.3f",
+                (unsigned long long)job->cycles, (double)job->wall_ns / 1e6);
+        fprintf(out, ", \"panic\": ");
+        if (job->panic_message)
+            json_string(out, job->panic_message, strlen(job->panic_message));
+        else
+            fputs("null", out);
+        fprintf(out, ", \"serial\": ");
+        json_string(out, job->serial ? job->serial : "", job->serial_len);
+        fprintf(out, ", \"serial_truncated\": %s}%s\n",
+                job->serial_truncated ? "true" : "false", i + 1 < fleet->job_count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+/*
+ * One job per line: `<binary> <disk image> <smp> <timeout ms>`, separated by
+ * whitespace. Blank lines and lines starting with '#' are skipped. A timeout
+ * of 0 lets the job run until it stops by itself.
+ */
+static int fleet_load_manifest(const char *path, Fleet *fleet) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return 0;
+    }
+    size_t cap = 0;
+    char line[4096];
+    int line_no = 0;
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        line_no++;
+        char binary[1024];
+        char disk[1024];
+        int smp = 0;
+        unsigned long long timeout_ms = 0;
+        char extra = 0;
+        const char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+            continue;
+        if (sscanf(p, "%1023s %1023s %d %llu %c", binary, disk, &smp, &timeout_ms, &extra) != 4 ||
+            smp < 1 || smp > 64) {
+            fprintf(stderr, "%s:%d: expected `<binary> <disk> <smp 1-64> <timeout ms>`\n", path, line_no);
+            ok = 0;
+            break;
+        }
+        if (fleet->job_count == cap) {
+            cap = cap ? cap * 2 : 64;
+            FleetJob *jobs = realloc(fleet->jobs, cap * sizeof(FleetJob));
+            if (!jobs) {
+                ok = 0;
+                break;
+            }
+            fleet->jobs = jobs;
+        }
+        FleetJob *job = &fleet->jobs[fleet->job_count];
+        memset(job, 0, sizeof(*job));
+        job->binary = strdup(binary);
+        job->disk = strdup(disk);
+        job->smp = smp;
+        job->timeout_ms = timeout_ms;
+        fleet->job_count++;
+        ok = job->binary && job->disk;
+    }
+    fclose(fp);
+    return ok;
+}
+
+static void print_usage(const char *prog) {
+    printf("Usage: %s [--threads <n>] [--max-live <n>] [--out <file>] [--verbose] <manifest>\n", prog);
+    printf("Manifest lines: <binary> <disk image> <smp> <timeout ms>\n");
+    printf("Defaults: --threads <online CPUs> --max-live 4 x threads, results on stdout.\n");
+    printf("VM diagnostics are discarded unless --verbose is given.\n");
+}
+
+static int parse_count(const char *s, int max, int *out) {
+    char *end = NULL;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v < 1 || v > max)
+        return 0;
+    *out = (int)v;
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    const char *manifest = NULL;
+    const char *out_path = NULL;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = online > 0 ? (online < FLEET_THREADS_MAX ? (int)online : FLEET_THREADS_MAX) : 1;
+    int max_live = 0;
+    int verbose = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0) {
+            if (i + 1 >= argc || !parse_count(argv[i + 1], FLEET_THREADS_MAX, &threads)) {
+                printf("Invalid --threads value. Expected integer in [1, %d].\n", FLEET_THREADS_MAX);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--max-live") == 0) {
+            if (i + 1 >= argc || !parse_count(argv[i + 1], 65536, &max_live)) {
+                printf("Invalid --max-live value. Expected integer in [1, 65536].\n");
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--out") == 0) {
+            if (i + 1 >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] != '-' && !manifest) {
+            manifest = argv[i];
+        } else {
+            printf("Unknown argument: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!manifest) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (max_live == 0)
+        max_live = threads * 4;
+
+    Fleet fleet;
+    memset(&fleet, 0, sizeof(fleet));
+    if (!fleet_load_manifest(manifest, &fleet))
+        return 1;
+
+    /* The VMs print boot and panic diagnostics to stdout; keep it for the JSON. */
+    FILE *out = NULL;
+    if (out_path) {
+        out = fopen(out_path, "w");
+        if (!out) {
+            perror(out_path);
+            return 1;
+        }
+    } else {
+        const int fd = dup(STDOUT_FILENO);
+        out = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!out) {
+            perror("stdout");
+            return 1;
+        }
+    }
+    fflush(stdout);
+    if (!verbose) {
+        const int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+    }
+
+    fleet.threads = threads;
+    fleet.max_live = max_live;
+    atomic_init(&fleet.next_job, 0);
+    atomic_init(&fleet.live, 0);
+    atomic_init(&fleet.finished, 0);
+    pthread_mutex_init(&fleet.idle_lock, NULL);
+    pthread_cond_init(&fleet.wake, NULL);
+    atomic_init(&fleet.events, 0);
+    atomic_init(&fleet.idle, 0);
+    fleet.queues = calloc((size_t)threads, sizeof(FleetQueue));
+    pthread_t *thread_ids = calloc((size_t)threads, sizeof(pthread_t));
+    FleetWorker *workers = calloc((size_t)threads, sizeof(FleetWorker));
+    if (!fleet.queues || !thread_ids || !workers) {
+        fprintf(stderr, "vm-fleet: out of memory\n");
+        return 1;
+    }
+    int created = 0;
+    for (int i = 0; i < threads; i++) {
+        if (!fleet_queue_init(&fleet.queues[i], (size_t)max_live)) {
+            fprintf(stderr, "vm-fleet: out of memory\n");
+            return 1;
+        }
+    }
+    const uint64_t start_ns = fleet_now_ns();
+    for (int i = 0; i < threads; i++) {
+        workers[i].fleet = &fleet;
+        workers[i].index = i;
+        if (pthread_create(&thread_ids[i], NULL, fleet_worker, &workers[i]) != 0)
+            break;
+        created++;
+    }
+    if (created == 0) {
+        fprintf(stderr, "vm-fleet: cannot start worker threads\n");
+        return 1;
+    }
+    /* Fewer workers than asked for still drain the jobs; the others' queues just stay empty. */
+    for (int i = 0; i < created; i++)
+        pthread_join(thread_ids[i], NULL);
+    const uint64_t elapsed_ns = fleet_now_ns() - start_ns;
+
+    fleet_write_results(out, &fleet);
+    fclose(out);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < fleet.job_count; i++) {
+        FleetJob *job = &fleet.jobs[i];
+        failed += job->state != FLEET_HALTED || job->exit_code != 0;
+        free(job->binary);
+        free(job->disk);
+        free(job->serial);
+        free(job->panic_message);
+    }
+    fprintf(stderr, "vm-fleet: %zu jobs, %zu failed, %.3f s on %d threads\n",
+            fleet.job_count, failed, (double)elapsed_ns / 1e9, created);
+    for (int i = 0; i < threads; i++)
+        fleet_queue_destroy(&fleet.queues[i]);
+    pthread_mutex_destroy(&fleet.idle_lock);
+    pthread_cond_destroy(&fleet.wake);
+    free(fleet.queues);
+    free(fleet.jobs);
+    free(thread_ids);
+    free(workers);
+    return failed ? 1 : 0;
+}
@@ -28,24 +28,15 @@ static inline int32_t f32_as_reg(float f) {
 static inline bool f32_is_nan(float f) {
     return isnan(f);
 }
-static inline void clear_all_flags(VM *vm) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
-    cpu->flags &= ~(FLAG_ZF | FLAG_SF | FLAG_CF | FLAG_OF);
-}
-static inline void update_fcmp_flags(VM *vm, float a , float b) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
-    clear_all_flags(vm);
-
+static inline void update_fcmp_flags(VCPU *cpu, float a , float b) {
     if (f32_is_nan(a) || f32_is_nan(b)) {
-        cpu->flags |= FLAG_OF;
+        vm_flags_set(cpu, FLAG_OF);
         return;
     }
-    if (a == b) cpu->flags |= FLAG_ZF;
-    if (a < b) cpu->flags |= FLAG_SF;
-    if (a > b) cpu->flags |= FLAG_CF;
+    unsigned int f = 0;
+    if (a == b) f |= FLAG_ZF;
+    if (a < b) f |= FLAG_SF;
+    if (a > b) f |= FLAG_CF;
+    vm_flags_set(cpu, f);
 }
 #endif //VM_FLOAT_H
@@ -1,5 +1,6 @@
 #include "stack.h"
 #include "vm.h"
+#include "flags.h"
 #include "interrupt.h"
 #include "memory.h"
 #include "panic.h"
@@ -16,18 +17,15 @@ static inline uint64_t irq_bit_mask(uint32_t int_no) {
     return 1ULL << (int_no & 63);
 }
 
-static inline void isr_push_u32(VM *vm, uint32_t v) {
-    isr_push(vm, (uint64_t)v);
+static inline void isr_push_u32(VM *vm, VCPU *cpu, uint32_t v) {
+    isr_push(vm, cpu, (uint64_t)v);
 }
 
-static inline uint32_t isr_pop_u32(VM *vm) {
-    return (uint32_t)isr_pop(vm);
+static inline uint32_t isr_pop_u32(VM *vm, VCPU *cpu) {
+    return (uint32_t)isr_pop(vm, cpu);
 }
 
-void vm_enter_interrupt(VM *vm, uint32_t int_no) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
+void vm_enter_interrupt(VM *vm, VCPU *cpu, uint32_t int_no) {
     if (int_no >= IVT_SIZE)
         return;
 
@@ -38,11 +36,11 @@ void vm_enter_interrupt(VM *vm, uint32_t int_no) {
     if (isr_ip == UINT64_MAX)
         return;
 
-    isr_push(vm, (uint64_t)cpu->ip);
-    isr_push(vm, (uint64_t)cpu->flags);
+    isr_push(vm, cpu, (uint64_t)cpu->ip);
+    isr_push(vm, cpu, (uint64_t)vm_flags_materialize(cpu));
 
     for (uint32_t i = 0; i < REG_COUNT; i++) {
-        isr_push_u32(vm, cpu->regs[i]);
+        isr_push_u32(vm, cpu, cpu->regs[i]);
     }
 
     /*
@@ -55,28 +53,25 @@ void vm_enter_interrupt(VM *vm, uint32_t int_no) {
     cpu->in_interrupt = 1;
 }
 
-void vm_iret(VM *vm) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
+void vm_iret(VM *vm, VCPU *cpu) {
     if (!cpu->in_interrupt)
         return;
 
     for (int i = (int)REG_COUNT - 1; i >= 0; i--) {
-        cpu->regs[i] = isr_pop_u32(vm);
+        cpu->regs[i] = isr_pop_u32(vm, cpu);
     }
 
-    cpu->flags = (unsigned int)isr_pop(vm);
+    cpu->flags = (unsigned int)isr_pop(vm, cpu);
+    cpu->flags_kind = VM_FLAGS_LIVE;
 
-    cpu->ip = (size_t)(vm_addr_t)isr_pop(vm);
+    cpu->ip = (size_t)(vm_addr_t)isr_pop(vm, cpu);
 
     cpu->in_interrupt = 0;
+    /* Anything that arrived during the ISR was consumed without delivery. */
+    vm_cpu_attention(cpu, VM_ATTN_IRQ);
 }
 
-void vm_handle_interrupts(VM *vm) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
+void vm_handle_interrupts(VM *vm, VCPU *cpu) {
     if (cpu->in_interrupt)
         return;
     if (cpu->irq_masked)
@@ -85,6 +80,22 @@ void vm_handle_interrupts(VM *vm) {
     const int core_id = cpu->core_id;
     const size_t base = (size_t)core_id * (size_t)IRQ_BITMAP_WORDS;
 
+    if (vm->uniprocessor) {
+        // Only this thread touches the bitmap (see trigger_interrupt_target).
+        for (uint32_t w = 0; w < IRQ_BITMAP_WORDS; w++) {
+            const uint_fast64_t word = atomic_load_explicit(&vm->interrupt_bitmap[base + w], memory_order_relaxed);
+            if (word == 0)
+                continue;
+            const int bit = __builtin_ctzll((unsigned long long)word);
+            atomic_store_explicit(&vm->interrupt_bitmap[base + w], word & (word - 1u), memory_order_relaxed);
+            vm_enter_interrupt(vm, cpu, (uint32_t)(w * 64u + (uint32_t)bit));
+            if (!cpu->in_interrupt)
+                vm_cpu_attention(cpu, VM_ATTN_IRQ);
+            return;
+        }
+        return;
+    }
+
     // O(IRQ_BITMAP_WORDS) fast path: only 4 words when IVT_SIZE is 256.
     for (uint32_t w = 0; w < IRQ_BITMAP_WORDS; w++) {
         uint_fast64_t word = atomic_load(&vm->interrupt_bitmap[base + w]);
@@ -102,7 +113,10 @@ void vm_handle_interrupts(VM *vm) {
             const uint_fast64_t desired = expected & (uint_fast64_t)(~mask);
             if (atomic_compare_exchange_weak(&vm->interrupt_bitmap[base + w], &expected, desired)) {
                 const uint32_t int_no = (uint32_t)(w * 64u + (uint32_t)bit);
-                vm_enter_interrupt(vm, int_no);
+                vm_enter_interrupt(vm, cpu, int_no);
+                /* No ISR registered: look at the next pending bit next batch. */
+                if (!cpu->in_interrupt)
+                    vm_cpu_attention(cpu, VM_ATTN_IRQ);
                 return;
             }
             word = atomic_load(&vm->interrupt_bitmap[base + w]);
@@ -128,7 +142,7 @@ void init_ivt(VM *vm) {
 
 void register_isr(VM *vm, uint32_t int_no, uint64_t isr_ip) {
     if (int_no >= IVT_SIZE) {
-        panic(panic_format("Invalid interrupt number %u\n", int_no), vm);
+        panicf(vm, "Invalid interrupt number %u\n", int_no);
         return;
     }
     vm_write64(vm, IVT_BASE + int_no * 8, (uint64_t)(vm_addr_t)isr_ip);
@@ -148,5 +162,17 @@ void trigger_interrupt_target(VM *vm, int core_id, uint32_t int_no) {
 
     const size_t idx = irq_word_index(core_id, int_no);
     const uint64_t mask = irq_bit_mask(int_no);
-    atomic_fetch_or(&vm->interrupt_bitmap[idx], (uint_fast64_t)mask);
+    if (vm->uniprocessor) {
+        // Off the vCPU thread (timer, host input): let the vCPU merge the bit.
+        if (!vm_tls_vcpu) {
+            atomic_fetch_or_explicit(&vm->irq_posted[int_no >> 6], (uint_fast64_t)mask, memory_order_release);
+            vm_cpu_attention(&vm->cpus[0], VM_ATTN_EVENTS);
+            return;
+        }
+        const uint_fast64_t word = atomic_load_explicit(&vm->interrupt_bitmap[idx], memory_order_relaxed);
+        atomic_store_explicit(&vm->interrupt_bitmap[idx], word | (uint_fast64_t)mask, memory_order_relaxed);
+    } else {
+        atomic_fetch_or(&vm->interrupt_bitmap[idx], (uint_fast64_t)mask);
+    }
+    vm_cpu_attention(&vm->cpus[core_id], VM_ATTN_IRQ);
 }
@@ -6,14 +6,14 @@
 #include "vm.h"
 
 #define BSP_CORE 0
-void vm_handle_interrupts(VM *vm);
+void vm_handle_interrupts(VM *vm, VCPU *cpu);
 void init_ivt(VM *vm);
 void register_isr(VM *vm, uint32_t int_no, uint64_t isr_ip);
 void trigger_interrupt(VM *vm, uint32_t int_no);
 void trigger_interrupt_target(VM *vm, int core_id, uint32_t int_no);
 
-void vm_enter_interrupt(VM *vm, uint32_t int_no);
-void vm_iret(VM *vm);
+void vm_enter_interrupt(VM *vm, VCPU *cpu, uint32_t int_no);
+void vm_iret(VM *vm, VCPU *cpu);
 
 typedef enum InterruptNo {
     INT_KEYBOARD        = 0x00,
@@ -21,6 +21,7 @@ typedef enum InterruptNo {
     INT_DISK_COMPLETE   = 0x02,
     INT_SERIAL          = 0x03,
     INT_TIMER           = 0x04,
+    INT_BLK_COMPLETE    = 0x05,
 } InterruptNo;
 
 #endif // VM_INTERRUPT_H
@@ -10,14 +10,20 @@ int vm_serial_rx_enqueue(VM *vm, uint8_t c) {
     if (!vm) {
         return 0;
     }
+    if (vm->uniprocessor && !vm_tls_vcpu) {
+        return vm_post_event(vm, VM_EVENT_SERIAL_RX, c);
+    }
+    return vm_serial_rx_push(vm, c);
+}
 
-    vm_shared_lock(vm);
+int vm_serial_rx_push(VM *vm, uint8_t c) {
+    vm_serial_lock(vm);
 
     const uint16_t head = vm->serial_rx_head;
     const uint16_t tail = vm->serial_rx_tail;
     const uint16_t next = (uint16_t)((head + 1u) & SERIAL_RX_FIFO_MASK);
     if (next == tail) {
-        vm_shared_unlock(vm);
+        vm_serial_unlock(vm);
         return 0;
     }
 
@@ -33,51 +39,126 @@ int vm_serial_rx_enqueue(VM *vm, uint8_t c) {
         }
     }
 
-    vm_shared_unlock(vm);
+    vm_serial_unlock(vm);
     return 1;
 }
 
+/*
+ * Port locking: the serial ports share vm->serial_lock with the RX path,
+ * the disk registers are read by the disk worker under vm->disk.mutex, and
+ * everything else falls back to vm->shared_lock.
+ */
+static int is_disk_port(const int addr) {
+    return addr >= DISK_CMD && addr <= DISK_STATUS;
+}
+
+static void set_disk_reg(VM *vm, const int addr, const int value) {
+    pthread_mutex_lock(&vm->disk.mutex);
+    switch (addr) {
+    case DISK_LBA:
+        vm->disk.lba = value;
+        break;
+    case DISK_MEM:
+        vm->disk.mem_addr = value;
+        break;
+    case DISK_COUNT:
+        vm->disk.count = value;
+        break;
+    default:
+        break;
+    }
+    vm->io[addr] = value;
+    pthread_mutex_unlock(&vm->disk.mutex);
+}
+
 void accept_io(VM *vm, const int addr, const int value) {
     if (addr < 0 || addr >= IO_SIZE)
         return;
-    vm_shared_lock(vm);
 
     switch (addr) {
     case SCREEN: {
         unsigned char c = (unsigned char)value;
-        write(STDOUT_FILENO, &c, 1);
+        if (vm->serial_out)
+            vm->serial_out(vm->serial_opaque, c);
+        else
+            write(STDOUT_FILENO, &c, 1);
+        vm_serial_lock(vm);
         vm->io[SCREEN] = value;
+        vm_serial_unlock(vm);
         break;
     }
 
     case SCREEN_ATTRIBUTE:
+        vm_serial_lock(vm);
         vm->io[SCREEN_ATTRIBUTE] = (vm->io[SCREEN_ATTRIBUTE] & 0xFF) |
             ((value & 0xFF) << 8);
+        vm_serial_unlock(vm);
         break;
 
     case DISK_CMD:
-        vm->io[DISK_CMD] = value;
+        set_disk_reg(vm, addr, value);
         disk_cmd(vm, value);
         break;
 
-    case DISK_LBA:
-        vm->disk.lba = value;
-        vm->io[DISK_LBA] = value;
-        break;
-
-    case DISK_MEM:
-        vm->disk.mem_addr = value;
-        vm->io[DISK_MEM] = value;
-        break;
-
-    case DISK_COUNT:
-        vm->disk.count = value;
-        vm->io[DISK_COUNT] = value;
+    case VM_CONTROL:
+        vm_control_request(vm, (uint32_t)value & ~VM_CONTROL_FROM_HOST);
         break;
 
     default:
+        if (is_disk_port(addr)) {
+            set_disk_reg(vm, addr, value);
+            break;
+        }
+        vm_shared_lock(vm);
         vm->io[addr] = value;
+        vm_shared_unlock(vm);
         break;
     }
-    vm_shared_unlock(vm);
+}
+
+int read_io(VM *vm, const int addr) {
+    int v = 0;
+    if (addr == KEYBOARD) {
+        vm_serial_lock(vm);
+        if (vm->serial_rx_tail != vm->serial_rx_head) {
+            v = (int)vm->serial_rx_fifo[vm->serial_rx_tail];
+            vm->serial_rx_tail = (uint16_t)((vm->serial_rx_tail + 1u) & SERIAL_RX_FIFO_MASK);
+        }
+        if (vm->serial_rx_tail != vm->serial_rx_head) {
+            vm->io[KEYBOARD] = (int)vm->serial_rx_fifo[vm->serial_rx_tail];
+            vm->io[SCREEN_ATTRIBUTE] |= SERIAL_STATUS_RX_READY;
+        } else {
+            vm->io[KEYBOARD] = 0;
+            vm->io[SCREEN_ATTRIBUTE] &= ~SERIAL_STATUS_RX_READY;
+        }
+        /*
+         * RX read acts as IRQ acknowledge: clear serial/keyboard bits on core 0.
+         * This prevents stale pending bits from retriggering the same input forever.
+         */
+        {
+            const size_t word_idx = ((size_t)INT_SERIAL >> 6);
+            const uint_fast64_t serial_mask = (uint_fast64_t)(1ULL << (INT_SERIAL & 63u));
+            const uint_fast64_t keyboard_mask = (uint_fast64_t)(1ULL << (INT_KEYBOARD & 63u));
+            const uint_fast64_t clear_mask = ~(serial_mask | keyboard_mask);
+            atomic_fetch_and(&vm->interrupt_bitmap[word_idx], clear_mask);
+        }
+        if (vm->serial_rx_tail != vm->serial_rx_head &&
+            ((vm->io[SCREEN_ATTRIBUTE] >> 8) & SERIAL_CTRL_RX_INT_ENABLE)) {
+            trigger_interrupt(vm, INT_SERIAL);
+        }
+        vm_serial_unlock(vm);
+    } else if (addr == SCREEN_ATTRIBUTE || addr == SCREEN) {
+        vm_serial_lock(vm);
+        v = addr == SCREEN ? vm->io[SCREEN] : (vm->io[SCREEN_ATTRIBUTE] & 0xFF);
+        vm_serial_unlock(vm);
+    } else if (is_disk_port(addr)) {
+        pthread_mutex_lock(&vm->disk.mutex);
+        v = vm->io[addr];
+        pthread_mutex_unlock(&vm->disk.mutex);
+    } else {
+        vm_shared_lock(vm);
+        v = vm->io[addr];
+        vm_shared_unlock(vm);
+    }
+    return v;
 }
@@ -4,7 +4,11 @@
 #include <stdint.h>
 
 void accept_io(VM *vm, int addr, int value);
+/* OUT's counterpart for IN; addr must already be in [0, IO_SIZE). */
+int read_io(VM *vm, int addr);
 int vm_serial_rx_enqueue(VM *vm, uint8_t c);
+/* vm_serial_rx_enqueue() without the uniprocessor hand-off, vCPU thread only. */
+int vm_serial_rx_push(VM *vm, uint8_t c);
 
 enum IO_TABLE {
     SCREEN = 0x01,
@@ -15,6 +19,7 @@ enum IO_TABLE {
     DISK_MEM = 0x12,
     DISK_COUNT = 0x13,
     DISK_STATUS = 0x14,
+    VM_CONTROL = 0x20,
     CPU_CTX_CSP = 0xF0,
     CPU_CTX_DSP = 0xF1,
     CPU_CTX_IRQ_MASK = 0xF2,
@@ -25,4 +30,19 @@ enum IO_TABLE {
 #define SERIAL_STATUS_RX_READY 0x01
 #define SERIAL_STATUS_TX_READY 0x02
 #define SERIAL_CTRL_RX_INT_ENABLE 0x01
+
+// VM_CONTROL: OUT issues a command to the host side, IN reads back the status.
+// Commands run once the issuing vCPU finishes its current instruction.
+// Some take an argument: OUT (arg << 8) | cmd. Some statuses carry one the same way.
+#define VM_CONTROL_CMD_SNAPSHOT 1
+#define VM_CONTROL_CMD_CHECKPOINT 2 /* delta against the last snapshot/checkpoint */
+#define VM_CONTROL_CMD_FORK 3       /* arg: number of clones to fork */
+#define VM_CONTROL_CMD_EXIT 4       /* arg: host exit status (0-255); stops the VM */
+#define VM_CONTROL_ARG_SHIFT 8
+#define VM_CONTROL_STATUS_NONE 0
+#define VM_CONTROL_STATUS_SAVED 1
+#define VM_CONTROL_STATUS_FAILED 2
+#define VM_CONTROL_STATUS_RESTORED 3
+#define VM_CONTROL_STATUS_FORKED 4  /* original process; arg: clones started */
+#define VM_CONTROL_STATUS_CLONE 5   /* a clone; arg: its index, from 1 */
 #endif
@@ -0,0 +1,588 @@
+#include "blk_mmio_register.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../disk/disk.h"
+#include "../../interrupt.h"
+#include "../../memory.h"
+#include "../../mmio.h"
+#include "../../panic.h"
+#ifdef VM_IO_URING
+#include <linux/fs.h>
+
+#include "blk_uring.h"
+
+#define BLK_URING_ENTRIES 256u
+#define BLK_URING_STOP UINT64_MAX
+#define BLK_URING_TIMER (UINT64_MAX - 1u)
+/* Guest RAM is registered in pieces of this size, the kernel's limit per buffer. */
+#define BLK_URING_BUF_SHIFT 30u
+#define BLK_URING_REAP 64u
+#endif
+
+/*
+ * Submission entry: u16 op, u16 tag, u32 lba, u32 mem_addr, u32 count (sectors).
+ * Completion entry: u16 tag, u16 status, u32 reserved.
+ */
+
+static int blk_ram_range(const VM *vm, uint64_t addr, uint64_t len) {
+    return addr + len <= vm->memory_size;
+}
+
+static void blk_complete(VM *vm, BlkRequest *r, uint16_t status);
+#ifdef VM_IO_URING
+static void blk_uring_queue(VM *vm, BlkRequest *r);
+#endif
+
+static int blk_started(const BlkDevice *blk) {
+    return blk->worker_count > 0 || blk->uring;
+}
+
+static void blk_raise(VM *vm, BlkQueue *q, uint32_t qi) {
+    q->unsignalled = 0;
+    q->irq_deadline_ns = 0;
+    trigger_interrupt_target(vm, (int)(qi % (uint32_t)vm->smp_cores), INT_BLK_COMPLETE);
+}
+
+/*
+ * Queue every submitted entry the completion ring has room for. That also
+ * bounds the requests in flight by the queue size, so `free` never runs
+ * out first. Lock held.
+ */
+static void blk_fetch(VM *vm, uint32_t qi) {
+    BlkDevice *blk = &vm->blk;
+    BlkQueue *q = &blk->queues[qi];
+    int fetched = 0;
+    /* Completions the guest has not consumed yet still hold their CQ slot. */
+    while (q->size && q->sq_head != q->sq_tail && q->sq_head - q->cq_head < q->size && q->free) {
+        const uint32_t slot = q->sq_head & (q->size - 1u);
+        const uint8_t *sqe = &vm->memory[q->sq_addr + slot * BLK_SQE_SIZE];
+        BlkRequest *r = q->free;
+        q->free = r->next;
+        memcpy(&r->op, sqe, 2);
+        memcpy(&r->tag, sqe + 2, 2);
+        memcpy(&r->lba, sqe + 4, 4);
+        memcpy(&r->mem_addr, sqe + 8, 4);
+        memcpy(&r->count, sqe + 12, 4);
+        r->queue = qi;
+        r->next = NULL;
+        q->sq_head++;
+        q->inflight++;
+        fetched++;
+#ifdef VM_IO_URING
+        if (blk->uring) {
+            blk_uring_queue(vm, r);
+            continue;
+        }
+#endif
+        if (blk->pending_tail)
+            blk->pending_tail->next = r;
+        else
+            blk->pending_head = r;
+        blk->pending_tail = r;
+    }
+#ifdef VM_IO_URING
+    /* The whole batch in one system call. */
+    if (blk->uring) {
+        blk_uring_submit(blk->uring);
+        return;
+    }
+#endif
+    if (fetched == 1)
+        pthread_cond_signal(&blk->work);
+    else if (fetched > 1)
+        pthread_cond_broadcast(&blk->work);
+}
+
+static uint16_t blk_check(const VM *vm, const BlkRequest *r) {
+    const uint64_t bytes = (uint64_t)r->count * DISK_SECTOR_SIZE;
+    if (r->op == BLK_OP_FLUSH)
+        return vm->disk.path ? BLK_STATUS_OK : BLK_STATUS_IO_ERROR;
+    if ((r->op != BLK_OP_READ && r->op != BLK_OP_WRITE && r->op != BLK_OP_WRITE_FUA) ||
+        !blk_ram_range(vm, r->mem_addr, bytes) ||
+        (uint64_t)r->lba * DISK_SECTOR_SIZE + bytes > vm->disk_size_bytes)
+        return BLK_STATUS_BAD_REQUEST;
+    if (!vm->disk.path)
+        return BLK_STATUS_IO_ERROR;
+    return BLK_STATUS_OK;
+}
+
+static uint16_t blk_execute(VM *vm, const BlkRequest *r) {
+    const uint16_t status = blk_check(vm, r);
+    if (status != BLK_STATUS_OK)
+        return status;
+    if (r->op == BLK_OP_FLUSH)
+        return disk_flush(&vm->disk) ? BLK_STATUS_OK : BLK_STATUS_IO_ERROR;
+    const uint64_t bytes = (uint64_t)r->count * DISK_SECTOR_SIZE;
+    const int cmd = r->op == BLK_OP_READ ? DISK_CMD_READ
+                  : r->op == BLK_OP_WRITE_FUA ? DISK_CMD_WRITE_FUA : DISK_CMD_WRITE;
+    if (!disk_transfer(&vm->disk, cmd, r->lba, &vm->memory[r->mem_addr], r->count))
+        return BLK_STATUS_IO_ERROR;
+    if (cmd == DISK_CMD_READ)
+        vm_ram_note_write(vm, r->mem_addr, (size_t)bytes);
+    return BLK_STATUS_OK;
+}
+
+/* Make sure something wakes up for a newly armed coalescing deadline. Lock held. */
+static void blk_arm_timer(VM *vm, uint32_t usec) {
+#ifdef VM_IO_URING
+    if (vm->blk.uring) {
+        (void)blk_uring_timeout(vm->blk.uring, (uint64_t)usec * 1000u, BLK_URING_TIMER);
+        return;
+    }
+#endif
+    (void)usec;
+    /* An idle worker sleeps until the earliest deadline. */
+    pthread_cond_broadcast(&vm->blk.work);
+}
+
+/*
+ * Post the completion and decide whether it interrupts now: once the
+ * coalescing count is reached, once the queue has nothing left in flight
+ * (nothing else would come to push it out), or when the coalescing timer
+ * has run out. Lock held.
+ */
+static void blk_complete(VM *vm, BlkRequest *r, uint16_t status) {
+    const uint32_t qi = r->queue;
+    BlkQueue *q = &vm->blk.queues[qi];
+    const uint32_t addr = q->cq_addr + (q->cq_tail & (q->size - 1u)) * BLK_CQE_SIZE;
+    uint8_t cqe[BLK_CQE_SIZE] = {0};
+    memcpy(cqe, &r->tag, 2);
+    memcpy(cqe + 2, &status, 2);
+    memcpy(&vm->memory[addr], cqe, sizeof(cqe));
+    vm_ram_note_write(vm, addr, sizeof(cqe));
+    q->cq_tail++;
+    q->inflight--;
+    q->unsignalled++;
+    r->next = q->free;
+    q->free = r;
+
+    const uint32_t count = q->irq_coalesce & 0xFFFFu;
+    const uint32_t usec = q->irq_coalesce >> 16;
+    const uint64_t now = host_monotonic_time_ns();
+    if (q->unsignalled >= (count ? count : 1u) || q->inflight == 0 ||
+        (q->irq_deadline_ns && now >= q->irq_deadline_ns)) {
+        blk_raise(vm, q, qi);
+    } else if (usec && !q->irq_deadline_ns) {
+        q->irq_deadline_ns = now + (uint64_t)usec * 1000u;
+        blk_arm_timer(vm, usec);
+    }
+    if (q->inflight == 0)
+        pthread_cond_broadcast(&vm->blk.idle);
+}
+
+/* Raise the interrupts whose coalescing timer ran out; returns the next deadline, 0 if none. Lock held. */
+static uint64_t blk_fire_timers(VM *vm) {
+    const uint64_t now = host_monotonic_time_ns();
+    uint64_t next = 0;
+    for (uint32_t qi = 0; qi < BLK_QUEUES; qi++) {
+        BlkQueue *q = &vm->blk.queues[qi];
+        if (!q->irq_deadline_ns)
+            continue;
+        if (now >= q->irq_deadline_ns)
+            blk_raise(vm, q, qi);
+        else if (!next || q->irq_deadline_ns < next)
+            next = q->irq_deadline_ns;
+    }
+    return next;
+}
+
+static void *blk_worker(void *arg) {
+    VM *vm = arg;
+    BlkDevice *blk = &vm->blk;
+    pthread_mutex_lock(&blk->lock);
+    while (blk->running) {
+        BlkRequest *r = blk->pending_head;
+        if (!r) {
+            const uint64_t deadline = blk_fire_timers(vm);
+            if (deadline) {
+                struct timespec ts;
+                ts.tv_sec = (time_t)(deadline / 1000000000u);
+                ts.tv_nsec = (long)(deadline % 1000000000u);
+                pthread_cond_timedwait(&blk->work, &blk->lock, &ts);
+            } else {
+                pthread_cond_wait(&blk->work, &blk->lock);
+            }
+            continue;
+        }
+        blk->pending_head = r->next;
+        if (!blk->pending_head)
+            blk->pending_tail = NULL;
+        pthread_mutex_unlock(&blk->lock);
+        /* The guest buffer is used in place; other requests run meanwhile. */
+        const uint16_t status = blk_execute(vm, r);
+        pthread_mutex_lock(&blk->lock);
+        blk_complete(vm, r, status);
+    }
+    pthread_mutex_unlock(&blk->lock);
+    return NULL;
+}
+
+#ifdef VM_IO_URING
+/*
+ * One SQE per request, straight on guest RAM: a fixed-buffer op when RAM
+ * could be registered and the request stays within one piece of it. Lock held.
+ */
+static void blk_uring_queue(VM *vm, BlkRequest *r) {
+    BlkUring *u = vm->blk.uring;
+    const uint16_t status = blk_check(vm, r);
+    const int io = status == BLK_STATUS_OK && (r->op == BLK_OP_FLUSH || r->count > 0);
+    struct io_uring_sqe *sqe = NULL;
+    if (io) {
+        sqe = blk_uring_get_sqe(u);
+        if (!sqe && blk_uring_submit(u))
+            sqe = blk_uring_get_sqe(u);
+    }
+    if (!sqe) {
+        blk_complete(vm, r, io ? BLK_STATUS_IO_ERROR : status);
+        return;
+    }
+    if (u->fixed_files) {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = vm->disk.fd;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)r;
+    if (r->op == BLK_OP_FLUSH) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        return;
+    }
+    const uint32_t bytes = r->count * DISK_SECTOR_SIZE;
+    const uint32_t buf = r->mem_addr >> BLK_URING_BUF_SHIFT;
+    const int fixed = u->fixed_buffers && (r->mem_addr + bytes - 1u) >> BLK_URING_BUF_SHIFT == buf;
+    if (r->op == BLK_OP_READ)
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    else
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    /* Durable for just this write, where the thread backend has to flush the whole image. */
+    if (r->op == BLK_OP_WRITE_FUA)
+        sqe->rw_flags = RWF_DSYNC;
+    sqe->off = (uint64_t)r->lba * DISK_SECTOR_SIZE;
+    sqe->addr = (uint64_t)(uintptr_t)&vm->memory[r->mem_addr];
+    sqe->len = bytes;
+    sqe->buf_index = (uint16_t)(fixed ? buf : 0u);
+}
+
+static void *blk_reaper(void *arg) {
+    VM *vm = arg;
+    BlkDevice *blk = &vm->blk;
+    BlkUring *u = blk->uring;
+    BlkUringCqe cqes[BLK_URING_REAP];
+    int stop = 0;
+    while (!stop) {
+        blk_uring_wait(u);
+        const unsigned n = blk_uring_reap(u, cqes, BLK_URING_REAP);
+        if (n == 0)
+            continue;
+        pthread_mutex_lock(&blk->lock);
+        for (unsigned i = 0; i < n; i++) {
+            if (cqes[i].user_data == BLK_URING_STOP) {
+                stop = 1;
+            } else if (cqes[i].user_data == BLK_URING_TIMER) {
+                (void)blk_fire_timers(vm);
+            } else {
+                BlkRequest *r = (BlkRequest *)(uintptr_t)cqes[i].user_data;
+                const size_t bytes = r->op == BLK_OP_FLUSH ? 0 : (size_t)r->count * DISK_SECTOR_SIZE;
+                /* Requests lie within the image, so a short transfer is an error too. */
+                const int ok = cqes[i].res >= 0 && (size_t)cqes[i].res == bytes;
+                if (ok && r->op == BLK_OP_READ)
+                    vm_ram_note_write(vm, r->mem_addr, bytes);
+                blk_complete(vm, r, ok ? BLK_STATUS_OK : BLK_STATUS_IO_ERROR);
+            }
+        }
+        pthread_mutex_unlock(&blk->lock);
+    }
+    return NULL;
+}
+
+/* Lock held. Returns 0 when io_uring cannot be used here. */
+static int blk_uring_start(VM *vm) {
+    BlkDevice *blk = &vm->blk;
+    /* Overlay images (a clone's too) need disk_transfer() to find their clusters. */
+    if (!vm->disk.path || vm->disk.cow)
+        return 0;
+    BlkUring *u = malloc(sizeof(*u));
+    if (!u || !blk_uring_init(u, BLK_URING_ENTRIES, 2u * BLK_QUEUES * BLK_QUEUE_SIZE_MAX)) {
+        free(u);
+        return 0;
+    }
+    (void)blk_uring_register_files(u, &vm->disk.fd, 1);
+    /* Pinning RAM can exceed RLIMIT_MEMLOCK; plain reads and writes still work then. */
+    struct iovec iov[(VM_MEM_MAX >> BLK_URING_BUF_SHIFT) + 1];
+    unsigned pieces = 0;
+    for (size_t off = 0; off < vm->memory_size; off += (size_t)1 << BLK_URING_BUF_SHIFT) {
+        const size_t left = vm->memory_size - off;
+        iov[pieces].iov_base = vm->memory + off;
+        iov[pieces].iov_len = left < ((size_t)1 << BLK_URING_BUF_SHIFT) ? left : (size_t)1 << BLK_URING_BUF_SHIFT;
+        pieces++;
+    }
+    (void)blk_uring_register_buffers(u, iov, pieces);
+    blk->uring = u;
+    if (pthread_create(&blk->reaper, NULL, blk_reaper, vm) != 0) {
+        blk->uring = NULL;
+        blk_uring_destroy(u);
+        free(u);
+        return 0;
+    }
+    printf("[blk] io_uring backend (%s file, %s RAM)\n", u->fixed_files ? "registered" : "plain",
+           u->fixed_buffers ? "registered" : "plain");
+    return 1;
+}
+
+static void blk_uring_stop(VM *vm) {
+    BlkDevice *blk = &vm->blk;
+    if (!blk->uring)
+        return;
+    pthread_mutex_lock(&blk->lock);
+    (void)blk_uring_nop(blk->uring, BLK_URING_STOP);
+    pthread_mutex_unlock(&blk->lock);
+    pthread_join(blk->reaper, NULL);
+    blk_uring_destroy(blk->uring);
+    free(blk->uring);
+    blk->uring = NULL;
+}
+#endif
+
+/* The timed waits count on CLOCK_MONOTONIC, like host_monotonic_time_ns(). */
+static void blk_cond_init(BlkDevice *blk) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&blk->work, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&blk->idle, NULL);
+}
+
+/* Start the backend the VM was configured with. Lock held. */
+static void blk_start(VM *vm) {
+    BlkDevice *blk = &vm->blk;
+    blk->running = true;
+    if (blk->backend == VM_DISK_IO_URING) {
+#ifdef VM_IO_URING
+        if (blk_uring_start(vm))
+            return;
+#endif
+        printf("[blk] io_uring is not available, using worker threads\n");
+        blk->backend = VM_DISK_IO_THREADS;
+    }
+    while (blk->worker_count < BLK_WORKERS &&
+           pthread_create(&blk->workers[blk->worker_count], NULL, blk_worker, vm) == 0)
+        blk->worker_count++;
+    if (blk->worker_count == 0) {
+        blk->running = false;
+        panic("Failed to create block queue workers", vm);
+    }
+}
+
+static void blk_wait_idle(BlkDevice *blk, const BlkQueue *q) {
+    while (q->inflight)
+        pthread_cond_wait(&blk->idle, &blk->lock);
+}
+
+/* Writing BLK_Q_SIZE resets the queue, then enables it if the size and both rings are valid. Lock held. */
+static void blk_queue_reset(VM *vm, uint32_t qi, uint32_t size) {
+    BlkQueue *q = &vm->blk.queues[qi];
+    blk_wait_idle(&vm->blk, q);
+    q->size = 0;
+    q->sq_tail = q->sq_head = 0;
+    q->cq_tail = q->cq_head = 0;
+    q->unsignalled = 0;
+    q->irq_deadline_ns = 0;
+    if (size == 0)
+        return;
+    if (size > BLK_QUEUE_SIZE_MAX || (size & (size - 1u)) != 0 ||
+        !blk_ram_range(vm, q->sq_addr, (uint64_t)size * BLK_SQE_SIZE) ||
+        !blk_ram_range(vm, q->cq_addr, (uint64_t)size * BLK_CQE_SIZE)) {
+        fprintf(stderr, "[blk] queue %u: bad size %u or ring address\n", qi, size);
+        return;
+    }
+    q->size = size;
+    if (!blk_started(&vm->blk))
+        blk_start(vm);
+}
+
+static uint32_t blk_read32(VM *vm, uint32_t addr) {
+    const uint32_t offset = addr - BLK_BASE;
+    if (offset < BLK_QUEUE_REGS) {
+        const uint64_t sectors = vm->disk_size_bytes / DISK_SECTOR_SIZE;
+        switch (offset) {
+            case BLK_REG_MAGIC: return BLK_MAGIC;
+            case BLK_REG_QUEUES: return BLK_QUEUES;
+            case BLK_REG_QUEUE_SIZE_MAX: return BLK_QUEUE_SIZE_MAX;
+            case BLK_REG_CAPACITY_LO: return (uint32_t)(sectors & 0xFFFFFFFFu);
+            case BLK_REG_CAPACITY_HI: return (uint32_t)(sectors >> 32);
+            default: return 0;
+        }
+    }
+    const uint32_t qi = offset / BLK_QUEUE_REGS - 1u;
+    const BlkQueue *q = &vm->blk.queues[qi];
+    uint32_t v = 0;
+    pthread_mutex_lock(&vm->blk.lock);
+    switch (offset % BLK_QUEUE_REGS) {
+        case BLK_Q_SQ_ADDR: v = q->sq_addr; break;
+        case BLK_Q_CQ_ADDR: v = q->cq_addr; break;
+        case BLK_Q_SIZE: v = q->size; break;
+        case BLK_Q_SQ_TAIL: v = q->sq_tail; break;
+        case BLK_Q_SQ_HEAD: v = q->sq_head; break;
+        case BLK_Q_CQ_TAIL: v = q->cq_tail; break;
+        case BLK_Q_CQ_HEAD: v = q->cq_head; break;
+        case BLK_Q_IRQ_COALESCE: v = q->irq_coalesce; break;
+        default: break;
+    }
+    pthread_mutex_unlock(&vm->blk.lock);
+    return v;
+}
+
+static void blk_write32(VM *vm, uint32_t addr, uint32_t value) {
+    const uint32_t offset = addr - BLK_BASE;
+    if (offset < BLK_QUEUE_REGS) {
+        fprintf(stderr, "Attempted to write to read-only BLK MMIO at 0x%08x\n", addr);
+        return;
+    }
+    const uint32_t qi = offset / BLK_QUEUE_REGS - 1u;
+    BlkQueue *q = &vm->blk.queues[qi];
+    pthread_mutex_lock(&vm->blk.lock);
+    switch (offset % BLK_QUEUE_REGS) {
+        /* The rings cannot move under an enabled queue. */
+        case BLK_Q_SQ_ADDR:
+            if (!q->size)
+                q->sq_addr = value;
+            break;
+        case BLK_Q_CQ_ADDR:
+            if (!q->size)
+                q->cq_addr = value;
+            break;
+        case BLK_Q_SIZE:
+            blk_queue_reset(vm, qi, value);
+            break;
+        case BLK_Q_SQ_TAIL:
+            if (q->size) {
+                q->sq_tail = value;
+                blk_fetch(vm, qi);
+            }
+            break;
+        case BLK_Q_CQ_HEAD:
+            /* Consuming frees CQ slots, which may let more submissions in. */
+            if (q->size && value - q->cq_head <= q->cq_tail - q->cq_head) {
+                q->cq_head = value;
+                blk_fetch(vm, qi);
+            }
+            break;
+        case BLK_Q_IRQ_COALESCE:
+            q->irq_coalesce = value;
+            break;
+        default:
+            break;
+    }
+    pthread_mutex_unlock(&vm->blk.lock);
+}
+
+void register_blk_mmio(VM *vm) {
+    const MMIO_Device blk_dev = {
+        .start = BLK_BASE,
+        .end = BLK_BASE + BLK_SIZE - 1u,
+        .read32 = blk_read32,
+        .write32 = blk_write32,
+        /* Shared with the workers, so the device takes its own lock. */
+        .sync = VM_MMIO_SYNC_NONE,
+    };
+    memset(&vm->blk, 0, sizeof(vm->blk));
+    for (uint32_t qi = 0; qi < BLK_QUEUES; qi++) {
+        BlkQueue *q = &vm->blk.queues[qi];
+        for (uint32_t i = BLK_QUEUE_SIZE_MAX; i-- > 0;) {
+            q->reqs[i].next = q->free;
+            q->free = &q->reqs[i];
+        }
+    }
+    pthread_mutex_init(&vm->blk.lock, NULL);
+    blk_cond_init(&vm->blk);
+    const int id = vm_mmio_register(vm, &blk_dev);
+    if (id > 0) {
+        printf("Registered block queue device to MMIO ID %d\n", id);
+    }
+}
+
+void blk_close(VM *vm) {
+    BlkDevice *blk = &vm->blk;
+    pthread_mutex_lock(&blk->lock);
+    /* No request may still be writing into RAM once this returns. */
+    for (uint32_t qi = 0; qi < BLK_QUEUES; qi++)
+        blk_wait_idle(blk, &blk->queues[qi]);
+    blk->running = false;
+    pthread_cond_broadcast(&blk->work);
+    pthread_mutex_unlock(&blk->lock);
+    for (int i = 0; i < blk->worker_count; i++)
+        pthread_join(blk->workers[i], NULL);
+    blk->worker_count = 0;
+#ifdef VM_IO_URING
+    blk_uring_stop(vm);
+#endif
+    pthread_mutex_destroy(&blk->lock);
+    pthread_cond_destroy(&blk->work);
+    pthread_cond_destroy(&blk->idle);
+}
+
+void blk_quiesce(VM *vm) {
+    pthread_mutex_lock(&vm->blk.lock);
+    for (uint32_t qi = 0; qi < BLK_QUEUES; qi++)
+        blk_wait_idle(&vm->blk, &vm->blk.queues[qi]);
+}
+
+void blk_resume(VM *vm) {
+    pthread_mutex_unlock(&vm->blk.lock);
+}
+
+void blk_restart(VM *vm) {
+    pthread_mutex_lock(&vm->blk.lock);
+    for (uint32_t qi = 0; qi < BLK_QUEUES; qi++) {
+        BlkQueue *q = &vm->blk.queues[qi];
+        if (!q->size)
+            continue;
+        if (!blk_started(&vm->blk))
+            blk_start(vm);
+        if (q->unsignalled)
+            blk_raise(vm, q, qi);
+        blk_fetch(vm, qi);
+    }
+    pthread_mutex_unlock(&vm->blk.lock);
+}
+
+void blk_fork_child(VM *vm) {
+    BlkDevice *blk = &vm->blk;
+    /* The parent's workers may have been waiting on these. */
+    blk_cond_init(blk);
+    const bool started = blk_started(blk);
+#ifdef VM_IO_URING
+    /* The ring belongs to the parent; a clone's disk is an overlay, which the workers serve. */
+    if (blk->uring) {
+        blk_uring_destroy(blk->uring);
+        free(blk->uring);
+        blk->uring = NULL;
+    }
+#endif
+    blk->backend = VM_DISK_IO_THREADS;
+    if (!started)
+        return;
+    pthread_mutex_lock(&blk->lock);
+    blk->worker_count = 0;
+    blk_start(vm);
+    pthread_mutex_unlock(&blk->lock);
+}
+
+void blk_fork_parent(VM *vm) {
+#ifdef VM_IO_URING
+    /* Like a clone's, the original's disk is an overlay now, which only disk_transfer() can serve. */
+    if (!vm->blk.uring)
+        return;
+    blk_uring_stop(vm);
+    vm->blk.backend = VM_DISK_IO_THREADS;
+    blk_restart(vm);
+#else
+    (void)vm;
+#endif
+}
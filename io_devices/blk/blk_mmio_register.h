@@ -0,0 +1,32 @@
+#ifndef BLK_MMIO_REGISTER_H
+#define BLK_MMIO_REGISTER_H
+
+#include "../../vm.h"
+
+/*
+ * Multi-queue block device on the image behind the DISK_* ports.
+ *
+ * Each queue pair is a submission ring the guest fills and a completion
+ * ring the device fills, both in guest RAM. Requests are served by a pool of
+ * BLK_WORKERS threads, or by one io_uring per VM (vm->blk.backend), so many
+ * are in flight at once and they complete out of order, each completion
+ * naming its request by tag. INT_BLK_COMPLETE is
+ * coalesced per queue and goes to core q % smp_cores. See README.md.
+ */
+void register_blk_mmio(VM *vm);
+/* Wait for requests in flight, then stop the backend; vm_destroy only. */
+void blk_close(VM *vm);
+/*
+ * Wait until no request is in flight and return holding vm->blk.lock, so
+ * none starts until blk_resume(). For snapshots and fork().
+ */
+void blk_quiesce(VM *vm);
+void blk_resume(VM *vm);
+/* After the queue registers were restored from a snapshot: start the backend, fetch what is queued, raise owed interrupts. */
+void blk_restart(VM *vm);
+/* In a clone forked by VM_CONTROL_CMD_FORK, after blk_resume(): restart the workers fork() did not copy.
+ * Clones always use the worker threads; the parent keeps its io_uring. */
+void blk_fork_child(VM *vm);
+/* In the original VM, after disk_fork_parent() moved it onto an overlay: hand io_uring's work to the workers. */
+void blk_fork_parent(VM *vm);
+#endif
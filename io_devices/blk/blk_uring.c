@@ -0,0 +1,168 @@
+/* syscall() and MAP_POPULATE, see jit.c. */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#include "blk_uring.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* The kernel reads and writes the ring indices concurrently. */
+static unsigned ring_load(const unsigned *p) {
+    return atomic_load_explicit((_Atomic unsigned *)p, memory_order_acquire);
+}
+
+static void ring_store(unsigned *p, unsigned v) {
+    atomic_store_explicit((_Atomic unsigned *)p, v, memory_order_release);
+}
+
+static void *ring_map(int fd, size_t size, off_t offset) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+int blk_uring_init(BlkUring *u, unsigned sq_entries, unsigned cq_entries) {
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    u->fd = (int)syscall(__NR_io_uring_setup, sq_entries, &p);
+    if (u->fd < 0)
+        return 0;
+    /* Completions must never be dropped: each one finishes a guest request. */
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        close(u->fd);
+        errno = ENOSYS;
+        return 0;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = ring_map(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+    u->cq_ring = ring_map(u->fd, u->cq_ring_size, IORING_OFF_CQ_RING);
+    u->sqes = ring_map(u->fd, u->sqes_size, IORING_OFF_SQES);
+    if (!u->sq_ring || !u->cq_ring || !u->sqes) {
+        blk_uring_destroy(u);
+        return 0;
+    }
+
+    uint8_t *sq = u->sq_ring;
+    uint8_t *cq = u->cq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    /* SQ slot i always holds SQE i. */
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        u->sq_array[i] = i;
+    return 1;
+}
+
+void blk_uring_destroy(BlkUring *u) {
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+int blk_uring_register_files(BlkUring *u, const int *fds, unsigned count) {
+    u->fixed_files = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, fds, count) == 0;
+    return u->fixed_files;
+}
+
+int blk_uring_register_buffers(BlkUring *u, const struct iovec *iov, unsigned count) {
+    u->fixed_buffers = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+    return u->fixed_buffers;
+}
+
+struct io_uring_sqe *blk_uring_get_sqe(BlkUring *u) {
+    const unsigned tail = *u->sq_tail + u->sq_pending;
+    if (tail - ring_load(u->sq_head) > *u->sq_mask)
+        return NULL;
+    struct io_uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_pending++;
+    return sqe;
+}
+
+int blk_uring_submit(BlkUring *u) {
+    if (u->sq_pending == 0)
+        return 1;
+    ring_store(u->sq_tail, *u->sq_tail + u->sq_pending);
+    u->sq_pending = 0;
+    /* Without SQPOLL the kernel consumes every published entry here, or fails them all. */
+    unsigned left = *u->sq_tail - ring_load(u->sq_head);
+    while (left > 0) {
+        const long n = syscall(__NR_io_uring_enter, u->fd, left, 0, 0, NULL, 0);
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return 0;
+        /* EAGAIN/EBUSY: the reaper has to make room in the completion ring first. */
+        if (n < 0 && errno != EINTR)
+            sched_yield();
+        if (n > 0)
+            left -= (unsigned)n;
+    }
+    return 1;
+}
+
+int blk_uring_nop(BlkUring *u, uint64_t user_data) {
+    struct io_uring_sqe *sqe = blk_uring_get_sqe(u);
+    if (!sqe && blk_uring_submit(u))
+        sqe = blk_uring_get_sqe(u);
+    if (!sqe)
+        return 0;
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = user_data;
+    return blk_uring_submit(u);
+}
+
+int blk_uring_timeout(BlkUring *u, uint64_t ns, uint64_t user_data) {
+    struct io_uring_sqe *sqe = blk_uring_get_sqe(u);
+    if (!sqe && blk_uring_submit(u))
+        sqe = blk_uring_get_sqe(u);
+    if (!sqe)
+        return 0;
+    u->timeout.tv_sec = (int64_t)(ns / 1000000000u);
+    u->timeout.tv_nsec = (long long)(ns % 1000000000u);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&u->timeout;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+    return blk_uring_submit(u);
+}
+
+void blk_uring_wait(BlkUring *u) {
+    if (ring_load(u->cq_tail) != *u->cq_head)
+        return;
+    syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+unsigned blk_uring_reap(BlkUring *u, BlkUringCqe *out, unsigned max) {
+    unsigned head = *u->cq_head;
+    const unsigned tail = ring_load(u->cq_tail);
+    unsigned n = 0;
+    for (; head != tail && n < max; head++, n++) {
+        const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        out[n].user_data = cqe->user_data;
+        out[n].res = cqe->res;
+    }
+    ring_store(u->cq_head, head);
+    return n;
+}
@@ -0,0 +1,61 @@
+#ifndef BLK_URING_H
+#define BLK_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+
+/*
+ * Just enough io_uring, on the raw system calls, for the block queue
+ * device's VM_DISK_IO_URING backend. One thread at a time fills the
+ * submission ring and one thread drains the completion ring.
+ */
+typedef struct BlkUring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sq_pending; /* filled in since the last blk_uring_submit() */
+    struct __kernel_timespec timeout; /* read by the kernel while blk_uring_timeout() submits */
+    int fixed_files;     /* 1 when the files were registered (IOSQE_FIXED_FILE) */
+    int fixed_buffers;   /* 1 when guest RAM was registered (READ/WRITE_FIXED) */
+} BlkUring;
+
+/* What the caller needs of a completion; struct io_uring_cqe cannot be put in an array. */
+typedef struct {
+    uint64_t user_data;
+    int32_t res;
+} BlkUringCqe;
+
+/* Returns 0 (errno set) when the kernel has no usable io_uring. */
+int blk_uring_init(BlkUring *u, unsigned sq_entries, unsigned cq_entries);
+void blk_uring_destroy(BlkUring *u);
+int blk_uring_register_files(BlkUring *u, const int *fds, unsigned count);
+int blk_uring_register_buffers(BlkUring *u, const struct iovec *iov, unsigned count);
+
+/* A zeroed entry to fill in, NULL when the submission ring is full. */
+struct io_uring_sqe *blk_uring_get_sqe(BlkUring *u);
+/* Hand everything filled in so far to the kernel in one call. Returns 0 on failure. */
+int blk_uring_submit(BlkUring *u);
+/* Queue a no-op, or a timeout firing `ns` from now, and submit it right away. Returns 0 on failure. */
+int blk_uring_nop(BlkUring *u, uint64_t user_data);
+int blk_uring_timeout(BlkUring *u, uint64_t ns, uint64_t user_data);
+/* Block until at least one completion is ready. */
+void blk_uring_wait(BlkUring *u);
+/* Take up to `max` completions off the ring; returns how many. */
+unsigned blk_uring_reap(BlkUring *u, BlkUringCqe *out, unsigned max);
+
+#endif
@@ -1,12 +1,20 @@
 //
 // Created by Max Wang on 2025/12/30.
 //
+/* realpath(), see jit.c. */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include "../../vm.h"
 #include "disk.h"
+#include "disk_cow.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "../../panic.h"
 
@@ -23,18 +31,75 @@ static int is_valid_dma(VM *vm, size_t addr, size_t count) {
     return 1;
 }
 
-static uint64_t disk_detect_size_bytes(FILE *fp) {
-    if (!fp) {
+static uint64_t disk_detect_size_bytes(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
         return DISK_SIZE;
     }
-    if (fseek(fp, 0, SEEK_END) != 0) {
-        return DISK_SIZE;
+    return (uint64_t)st.st_size;
+}
+
+int disk_file_io(int fd, int cmd, uint64_t lba, uint8_t *buf, uint32_t count) {
+    const size_t bytes = (size_t)count * DISK_SECTOR_SIZE;
+    const off_t off = (off_t)(lba * DISK_SECTOR_SIZE);
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = cmd == DISK_CMD_READ
+            ? pread(fd, buf + done, bytes - done, off + (off_t)done)
+            : pwrite(fd, buf + done, bytes - done, off + (off_t)done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (size_t)n;
     }
-    long end = ftell(fp);
-    if (end < 0) {
-        return DISK_SIZE;
+    if (done == bytes)
+        return 1;
+    if (cmd == DISK_CMD_READ) {
+        memset(buf + done, 0, bytes - done);
+        return 1;
     }
-    return (uint64_t)(unsigned long)end;
+    return 0;
+}
+
+int disk_transfer(Disk *disk, int cmd, uint64_t lba, uint8_t *buf, uint32_t count) {
+    const int io = cmd == DISK_CMD_READ ? DISK_CMD_READ : DISK_CMD_WRITE;
+    const int ok = disk->cow ? disk_cow_io(disk->cow, io, lba, buf, count)
+                             : disk_file_io(disk->fd, io, lba, buf, count);
+    /* No per-write durability on a host file, so FUA flushes the whole image. */
+    return ok && (cmd != DISK_CMD_WRITE_FUA || disk_flush(disk));
+}
+
+int disk_flush(Disk *disk) {
+    if (disk->cow)
+        return disk_cow_flush(disk->cow);
+    return fdatasync(disk->fd) == 0;
+}
+
+/*
+ * Move `count` sectors between the image and guest RAM at `mem_addr`
+ * without a bounce buffer: pread/pwrite work on the validated range of
+ * vm->memory itself. Like a real DMA engine this takes no CPU-side lock;
+ * a guest touching the buffer before DISK_COMPLETE sees a partial transfer.
+ */
+static void disk_dma(VM *vm, int cmd, uint64_t lba, uint64_t mem_addr, uint32_t count) {
+    if (cmd == DISK_CMD_FLUSH) {
+        if (!disk_flush(&vm->disk))
+            fprintf(stderr, "[Disk] FLUSH error: %s\n", strerror(errno));
+        return;
+    }
+    if (!is_valid_dma(vm, mem_addr, count)) {
+        fprintf(stderr, "[Disk] DMA Violation @ Addr 0x%lx, Count %d\n", mem_addr, count);
+        return;
+    }
+    if (cmd != DISK_CMD_READ && cmd != DISK_CMD_WRITE && cmd != DISK_CMD_WRITE_FUA)
+        return;
+    const size_t bytes = (size_t)count * DISK_SECTOR_SIZE;
+    if (!disk_transfer(&vm->disk, cmd, lba, &vm->memory[mem_addr], count))
+        fprintf(stderr, "[Disk] %s error @ LBA %lu: %s\n",
+                cmd == DISK_CMD_READ ? "READ" : "WRITE", (unsigned long)lba, strerror(errno));
+    if (cmd == DISK_CMD_READ)
+        vm_ram_note_write(vm, (vm_addr_t)mem_addr, bytes);
 }
 
 void* disk_worker(void *arg) {
@@ -58,68 +123,56 @@ void* disk_worker(void *arg) {
 
         pthread_mutex_unlock(&vm->disk.mutex);
 
-        if (!is_valid_dma(vm, mem_addr, count)) {
-            fprintf(stderr, "[Disk] DMA Violation @ Addr 0x%lx, Count %d\n", mem_addr, count);
-        } else {
-            fseek(vm->disk.fp, lba * DISK_SECTOR_SIZE, SEEK_SET);
-            size_t bytes = (size_t)count * DISK_SECTOR_SIZE;
-
-            if (cmd == DISK_CMD_READ) {
-                uint8_t *buf = malloc(bytes);
-                if (!buf) {
-                    fprintf(stderr, "[Disk] OOM during READ DMA\n");
-                } else {
-                    fread(buf, DISK_SECTOR_SIZE, count, vm->disk.fp);
-                    vm_shared_lock(vm);
-                    memcpy(&vm->memory[mem_addr], buf, bytes);
-                    vm_shared_unlock(vm);
-                    free(buf);
-                }
-            } else if (cmd ==DISK_CMD_WRITE) {
-                uint8_t *buf = malloc(bytes);
-                if (!buf) {
-                    fprintf(stderr, "[Disk] OOM during WRITE DMA\n");
-                } else {
-                    vm_shared_lock(vm);
-                    memcpy(buf, &vm->memory[mem_addr], bytes);
-                    vm_shared_unlock(vm);
-                    fwrite(buf, DISK_SECTOR_SIZE, count, vm->disk.fp);
-                    fflush(vm->disk.fp);
-                    free(buf);
-                }
-            }
-        }
+        disk_dma(vm, cmd, lba, mem_addr, count);
 
         pthread_mutex_lock(&vm->disk.mutex);
         vm->disk.current_cmd = DISK_CMD_NONE;
         vm->disk.op_complete = true;
         pthread_mutex_unlock(&vm->disk.mutex);
+        vm_cpu_attention(&vm->cpus[BSP_CORE], VM_ATTN_DISK);
     }
     return NULL;
 }
 
 void disk_init(VM *vm, const char *path) {
-    printf("cwd: %s\n", getcwd(NULL, 0));
+    char *cwd = getcwd(NULL, 0);
+    printf("cwd: %s\n", cwd ? cwd : "?");
+    free(cwd);
 
-    vm->disk.fp = fopen(path, "r+b");
-    if (!vm->disk.fp) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
         printf("[Disk] Creating new image: %s\n", path);
-        vm->disk.fp = fopen(path, "w+b");
-        if (!vm->disk.fp) {
-            perror("fopen");
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            perror("open");
             panic("Cannot create disk image", vm);
             return;
         }
-        if (ftruncate(fileno(vm->disk.fp), DISK_SIZE) != 0) {
+        if (ftruncate(fd, DISK_SIZE) != 0) {
             panic("ftruncate faild",vm);
+            close(fd);
+            return;
+        }
+    }
+    vm->disk.fd = fd;
+    vm->disk.cow = NULL;
+    vm->disk_size_bytes = disk_detect_size_bytes(fd);
+    if (disk_cow_probe(fd)) {
+        /* An overlay: the size is the virtual disk's, and fd belongs to the overlay now. */
+        vm->disk.fd = -1;
+        vm->disk.cow = disk_cow_open(path, fd, 1);
+        if (!vm->disk.cow) {
+            panic("Cannot open disk overlay", vm);
+            return;
         }
-        fclose(vm->disk.fp);
-        vm->disk.fp = fopen(path, "r+b");
+        vm->disk_size_bytes = vm->disk.cow->size;
+        printf("[Disk] Overlay over %s, %u clusters written\n",
+               vm->disk.cow->base_path ? vm->disk.cow->base_path : "zeros", disk_cow_allocated(vm->disk.cow));
     }
+    vm->disk.path = strdup(path);
     vm->disk.lba = 0;
     vm->disk.mem_addr = 0;
     vm->disk.count = 0;
-    vm->disk_size_bytes = disk_detect_size_bytes(vm->disk.fp);
     vm->disk.status = DISK_STATUS_FREE;
     vm->disk.current_cmd = DISK_CMD_NONE;
     vm->disk.op_complete = false;
@@ -129,13 +182,22 @@ void disk_init(VM *vm, const char *path) {
     pthread_cond_init(&vm->disk.cond_var, NULL);
 
     if (pthread_create(&vm->disk.worker_thread, NULL, disk_worker, vm) != 0) {
+        vm->disk.thread_running = false;
         panic("Failed to create disk worker", vm);
+        return;
     }
 
     printf("[Disk] Created disk worker thread. Image: %s\n", path);
 }
 
 void disk_close(VM *vm) {
+    /* disk_init never ran, or failed before the worker started. */
+    if (!vm->disk.thread_running) {
+        if (vm->disk.cow) disk_cow_close(vm->disk.cow);
+        else if (vm->disk.path) close(vm->disk.fd);
+        free(vm->disk.path);
+        return;
+    }
     pthread_mutex_lock(&vm->disk.mutex);
     vm->disk.thread_running = false;
     pthread_cond_signal(&vm->disk.cond_var);
@@ -145,43 +207,70 @@ void disk_close(VM *vm) {
     pthread_mutex_destroy(&vm->disk.mutex);
     pthread_cond_destroy(&vm->disk.cond_var);
 
-    if (vm->disk.fp) fclose(vm->disk.fp);
-}
+    /* Like a disk cache at power-off: whatever the guest wrote is kept. */
+    if (vm->disk.path && !disk_flush(&vm->disk))
+        fprintf(stderr, "[Disk] FLUSH error: %s\n", strerror(errno));
 
-void disk_read(VM *vm) {
-    size_t addr = vm->disk.mem_addr;
-    size_t bytes = (size_t)vm->disk.count * DISK_SECTOR_SIZE;
-    fseek(vm->disk.fp, vm->disk.lba * DISK_SECTOR_SIZE, SEEK_SET);
+    if (vm->disk.cow) disk_cow_close(vm->disk.cow);
+    else if (vm->disk.path) close(vm->disk.fd);
+    free(vm->disk.path);
+}
 
-    if (bytes == 0) {
-        return;
+/* Move the disk onto a new overlay at `overlay_path` over its current image, which it then only reads. */
+static int disk_switch_to_overlay(VM *vm, const char *overlay_path) {
+    Disk *disk = &vm->disk;
+    char *base = realpath(disk->path, NULL);
+    char *path = strdup(overlay_path);
+    DiskCow *cow = NULL;
+    if (base && path && disk_cow_create(overlay_path, base, vm->disk_size_bytes)) {
+        const int fd = open(overlay_path, O_RDWR);
+        cow = fd >= 0 ? disk_cow_open(overlay_path, fd, 1) : NULL;
     }
-    uint8_t *buf = malloc(bytes);
-    if (!buf) {
-        fprintf(stderr, "[Disk] OOM during legacy disk_read\n");
-        return;
+    free(base);
+    if (!cow) {
+        perror(overlay_path);
+        free(path);
+        return 0;
     }
-    fread(buf, 1, bytes, vm->disk.fp);
+    if (disk->cow) disk_cow_close(disk->cow);
+    else close(disk->fd);
+    disk->fd = -1;
+    disk->cow = cow;
+    free(disk->path);
+    disk->path = path;
+    return 1;
+}
 
-    for (size_t i = 0; i < bytes; i++) {
-        vm_write8(vm, addr + i, buf[i]);
-    }
-    free(buf);
+int disk_fork_parent(VM *vm, const char *overlay_path) {
+    if (!vm->disk.path)
+        return 1;
+    if (!disk_switch_to_overlay(vm, overlay_path))
+        return 0;
+    printf("[Disk] Forked: now writing %s\n", overlay_path);
+    return 1;
 }
 
-void disk_write(const VM *vm) {
-    size_t addr = vm->disk.mem_addr;
-    fseek(vm->disk.fp, vm->disk.lba * DISK_SECTOR_SIZE, SEEK_SET);
+int disk_fork_child(VM *vm, const char *overlay_path) {
+    Disk *disk = &vm->disk;
+    /* The image stays shared with the parent, which moves off it too, so it is only ever read. */
+    if (!disk->path || !disk_switch_to_overlay(vm, overlay_path))
+        return 0;
 
-    uint8_t buf[DISK_SECTOR_SIZE * vm->disk.count];
-    for (size_t i = 0; i < vm->disk.count * DISK_SECTOR_SIZE; i++) {
-        buf[i] = vm_read8((VM *)vm, addr + i);
+    pthread_cond_init(&disk->cond_var, NULL);
+    disk->thread_running = true;
+    if (pthread_create(&disk->worker_thread, NULL, disk_worker, vm) != 0) {
+        fprintf(stderr, "[Disk] Failed to create disk worker\n");
+        return 0;
     }
+    return 1;
+}
+
+void disk_read(VM *vm) {
+    disk_dma(vm, DISK_CMD_READ, vm->disk.lba, vm->disk.mem_addr, vm->disk.count);
+}
 
-    fwrite(buf, 1, vm->disk.count * DISK_SECTOR_SIZE, vm->disk.fp);
-    fflush(vm->disk.fp);
-    int fd = fileno(vm->disk.fp);
-    if (fd >= 0) fsync(fd);
+void disk_write(VM *vm) {
+    disk_dma(vm, DISK_CMD_WRITE, vm->disk.lba, vm->disk.mem_addr, vm->disk.count);
 }
 
 void disk_cmd(VM *vm, const int value) {
@@ -11,9 +11,41 @@
 #define DISK_CMD_NONE 0
 #define DISK_CMD_READ 1
 #define DISK_CMD_WRITE 2
+/* Make every write completed so far durable. */
+#define DISK_CMD_FLUSH 3
+/* A write that is durable once it completes (force unit access). */
+#define DISK_CMD_WRITE_FUA 4
+
+struct DiskCow;
 
 void disk_init(VM *vm, const char *path);
 void disk_cmd(VM *vm, int value);
 void disk_tick(VM *vm);
 void disk_close(VM *vm);
+/*
+ * Move `count` sectors between the image (raw or an overlay, see disk_cow.h)
+ * and `buf`. Any number of threads may call this at once. Returns 0 on I/O errors.
+ */
+int disk_transfer(Disk *disk, int cmd, uint64_t lba, uint8_t *buf, uint32_t count);
+/*
+ * Writes stay in the host's page cache until a flush, which is a plain
+ * fdatasync of the image file. An overlay's table entries are written right
+ * after their clusters' data (see disk_cow.h), so they need nothing more.
+ * Returns 0 on I/O errors.
+ */
+int disk_flush(Disk *disk);
+/* disk_transfer() on a raw image file, DISK_CMD_READ or _WRITE. Reads past its end return zeros. */
+int disk_file_io(int fd, int cmd, uint64_t lba, uint8_t *buf, uint32_t count);
+/*
+ * In a clone forked by VM_CONTROL_CMD_FORK, with the disk idle: restart the
+ * worker thread fork() did not copy and switch to a new overlay at
+ * `overlay_path` over the shared image. Returns 0 on failure.
+ */
+int disk_fork_child(VM *vm, const char *overlay_path);
+/*
+ * In the original VM, with the disk idle and its clones forked: switch to a
+ * new overlay at `overlay_path` too, so the image under the clones' overlays
+ * is never written again. Returns 0 on failure.
+ */
+int disk_fork_parent(VM *vm, const char *overlay_path);
 #endif // VM_DISK_H
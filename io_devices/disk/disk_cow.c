@@ -0,0 +1,415 @@
+#include "../../vm.h"
+#include "disk.h"
+#include "disk_cow.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A base chain longer than this is taken for a loop. */
+#define DISK_COW_CHAIN_MAX 16
+
+static int write_at(int fd, const void *buf, size_t len, off_t off) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        const ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 1;
+}
+
+static int read_at(int fd, void *buf, size_t len, off_t off) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        const ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 1;
+}
+
+static uint32_t cow_sectors_per_cluster(const DiskCow *cow) {
+    return (uint32_t)(((uint64_t)1 << cow->cluster_bits) / DISK_SECTOR_SIZE);
+}
+
+/* Clusters before the first data cluster: the header block and the table. */
+static uint64_t cow_data_start(uint32_t cluster_bits, uint32_t clusters) {
+    const uint64_t cluster = (uint64_t)1 << cluster_bits;
+    return (DISK_COW_TABLE + (uint64_t)clusters * sizeof(uint32_t) + cluster - 1u) / cluster;
+}
+
+/* Header and base path; 0 if this is not a usable overlay. `base` holds DISK_COW_BASE_MAX + 1 bytes. */
+static int cow_read_header(int fd, DiskCowHeader *h, char *base) {
+    if (!read_at(fd, h, sizeof(*h), 0) || memcmp(h->magic, DISK_COW_MAGIC, sizeof(h->magic)) != 0)
+        return 0;
+    if (h->version != DISK_COW_VERSION || h->cluster_bits < 12u || h->cluster_bits > 24u ||
+        h->size == 0 || h->size % DISK_SECTOR_SIZE != 0 || h->base_len > DISK_COW_BASE_MAX ||
+        h->clusters != (h->size + ((uint64_t)1 << h->cluster_bits) - 1u) >> h->cluster_bits)
+        return 0;
+    if (!read_at(fd, base, h->base_len, sizeof(*h)))
+        return 0;
+    base[h->base_len] = '\0';
+    return strlen(base) == h->base_len;
+}
+
+/* A relative base path is relative to the overlay's directory. */
+static char *cow_resolve(const char *path, const char *base) {
+    const char *slash = strrchr(path, '/');
+    if (base[0] == '/' || !slash)
+        return strdup(base);
+    const size_t dir = (size_t)(slash - path) + 1u;
+    char *out = malloc(dir + strlen(base) + 1u);
+    if (out) {
+        memcpy(out, path, dir);
+        strcpy(out + dir, base);
+    }
+    return out;
+}
+
+/* Virtual size of a raw image or an overlay; 0 on failure. */
+static uint64_t cow_image_size(int fd) {
+    DiskCowHeader h;
+    char base[DISK_COW_BASE_MAX + 1];
+    if (disk_cow_probe(fd))
+        return cow_read_header(fd, &h, base) ? h.size : 0;
+    struct stat st;
+    return fstat(fd, &st) == 0 && st.st_size > 0 ? (uint64_t)st.st_size : 0;
+}
+
+int disk_cow_probe(int fd) {
+    char magic[8];
+    return read_at(fd, magic, sizeof(magic), 0) && memcmp(magic, DISK_COW_MAGIC, sizeof(magic)) == 0;
+}
+
+int disk_cow_create(const char *path, const char *base_path, uint64_t size) {
+    DiskCowHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DISK_COW_MAGIC, sizeof(h.magic));
+    h.version = DISK_COW_VERSION;
+    h.cluster_bits = DISK_COW_CLUSTER_BITS;
+    if (base_path) {
+        if (strlen(base_path) > DISK_COW_BASE_MAX) {
+            fprintf(stderr, "%s: base path too long\n", base_path);
+            return 0;
+        }
+        h.base_len = (uint32_t)strlen(base_path);
+        char *resolved = cow_resolve(path, base_path);
+        const int fd = resolved ? open(resolved, O_RDONLY) : -1;
+        const uint64_t base_size = fd >= 0 ? cow_image_size(fd) : 0;
+        if (fd < 0)
+            perror(resolved ? resolved : base_path);
+        else
+            close(fd);
+        free(resolved);
+        if (fd < 0)
+            return 0;
+        if (size == 0)
+            size = base_size;
+    }
+    if (size == 0 || size % DISK_SECTOR_SIZE != 0) {
+        fprintf(stderr, "%s: size must be a nonzero multiple of %d bytes\n", path, DISK_SECTOR_SIZE);
+        return 0;
+    }
+    if ((size - 1u) >> h.cluster_bits >= UINT32_MAX) {
+        fprintf(stderr, "%s: size too large\n", path);
+        return 0;
+    }
+    h.size = size;
+    h.clusters = (uint32_t)((size + ((uint64_t)1 << h.cluster_bits) - 1u) >> h.cluster_bits);
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    /* The table starts out as a hole, which reads as all clusters in the base. */
+    const int ok = fd >= 0 && write_at(fd, &h, sizeof(h), 0) &&
+                   write_at(fd, base_path ? base_path : "", h.base_len, sizeof(h)) &&
+                   ftruncate(fd, (off_t)(cow_data_start(h.cluster_bits, h.clusters) << h.cluster_bits)) == 0;
+    if (!ok)
+        perror(path);
+    if (fd >= 0)
+        close(fd);
+    return ok;
+}
+
+static DiskCow *cow_open(const char *path, int fd, int writable, int base_writable, int depth) {
+    DiskCowHeader h;
+    char base[DISK_COW_BASE_MAX + 1];
+    if (!cow_read_header(fd, &h, base)) {
+        fprintf(stderr, "%s: not a valid overlay image\n", path);
+        close(fd);
+        return NULL;
+    }
+    if (depth >= DISK_COW_CHAIN_MAX) {
+        fprintf(stderr, "%s: base chain is longer than %d images\n", path, DISK_COW_CHAIN_MAX);
+        close(fd);
+        return NULL;
+    }
+    DiskCow *cow = calloc(1, sizeof(*cow));
+    if (!cow) {
+        close(fd);
+        return NULL;
+    }
+    cow->fd = fd;
+    cow->writable = writable;
+    cow->size = h.size;
+    cow->cluster_bits = h.cluster_bits;
+    cow->clusters = h.clusters;
+    cow->data_start = cow_data_start(h.cluster_bits, h.clusters);
+    cow->base_fd = -1;
+    pthread_mutex_init(&cow->alloc_lock, NULL);
+    cow->table = malloc((size_t)h.clusters * sizeof(uint32_t));
+    int ok = cow->table && read_at(fd, (void *)cow->table, (size_t)h.clusters * sizeof(uint32_t), DISK_COW_TABLE);
+    for (uint32_t c = 0; ok && c < h.clusters; c++) {
+        const uint32_t idx = atomic_load_explicit(&cow->table[c], memory_order_relaxed);
+        ok = idx == 0 || idx >= cow->data_start;
+    }
+    if (!ok)
+        fprintf(stderr, "%s: bad cluster table\n", path);
+
+    /* Anything past the last table entry is an allocation that did not make it into the table. */
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0;
+    if (ok) {
+        const uint64_t end = ((uint64_t)st.st_size + ((uint64_t)1 << h.cluster_bits) - 1u) >> h.cluster_bits;
+        ok = end <= UINT32_MAX;
+        cow->next_cluster = (uint32_t)(end > cow->data_start ? end : cow->data_start);
+    }
+
+    if (ok && h.base_len) {
+        cow->base_path = cow_resolve(path, base);
+        const int bfd = cow->base_path ? open(cow->base_path, base_writable ? O_RDWR : O_RDONLY) : -1;
+        if (bfd < 0) {
+            perror(cow->base_path ? cow->base_path : base);
+            ok = 0;
+        } else if (disk_cow_probe(bfd)) {
+            cow->base = cow_open(cow->base_path, bfd, base_writable, 0, depth + 1);
+            ok = cow->base != NULL;
+        } else {
+            cow->base_fd = bfd;
+        }
+    }
+    if (!ok) {
+        disk_cow_close(cow);
+        return NULL;
+    }
+    return cow;
+}
+
+DiskCow *disk_cow_open(const char *path, int fd, int writable) {
+    return cow_open(path, fd, writable, 0, 0);
+}
+
+void disk_cow_close(DiskCow *cow) {
+    if (!cow)
+        return;
+    if (cow->base)
+        disk_cow_close(cow->base);
+    if (cow->base_fd >= 0)
+        close(cow->base_fd);
+    close(cow->fd);
+    pthread_mutex_destroy(&cow->alloc_lock);
+    free((void *)cow->table);
+    free(cow->base_path);
+    free(cow);
+}
+
+/* Sectors of the base; past its end, and without one, zeros. */
+static int cow_base_read(DiskCow *cow, uint64_t lba, uint8_t *buf, uint32_t count) {
+    if (cow->base)
+        return disk_cow_io(cow->base, DISK_CMD_READ, lba, buf, count);
+    if (cow->base_fd >= 0)
+        return disk_file_io(cow->base_fd, DISK_CMD_READ, lba, buf, count);
+    memset(buf, 0, (size_t)count * DISK_SECTOR_SIZE);
+    return 1;
+}
+
+/*
+ * First write to cluster `c`: the base's copy of it, with the write merged
+ * in, goes to a new cluster at the end of the file, then into the table.
+ */
+static int cow_write_new(DiskCow *cow, uint32_t c, uint32_t in, uint8_t *buf, uint32_t count) {
+    const uint32_t spc = cow_sectors_per_cluster(cow);
+    pthread_mutex_lock(&cow->alloc_lock);
+    uint32_t idx = atomic_load_explicit(&cow->table[c], memory_order_relaxed);
+    int ok;
+    if (idx) {
+        /* Another writer got here first. */
+        ok = disk_file_io(cow->fd, DISK_CMD_WRITE, (uint64_t)idx * spc + in, buf, count);
+    } else {
+        uint8_t *data = count == spc ? buf : malloc((size_t)spc * DISK_SECTOR_SIZE);
+        ok = data == buf || (data && cow_base_read(cow, (uint64_t)c * spc, data, spc));
+        if (ok && data != buf)
+            memcpy(data + (size_t)in * DISK_SECTOR_SIZE, buf, (size_t)count * DISK_SECTOR_SIZE);
+        idx = cow->next_cluster;
+        ok = ok && idx != 0 && disk_file_io(cow->fd, DISK_CMD_WRITE, (uint64_t)idx * spc, data, spc) &&
+             write_at(cow->fd, &idx, sizeof(idx), (off_t)(DISK_COW_TABLE + (uint64_t)c * sizeof(uint32_t)));
+        if (ok) {
+            /* Wraps to 0 at the format's limit, which refuses further allocations. */
+            cow->next_cluster++;
+            atomic_store_explicit(&cow->table[c], idx, memory_order_release);
+        }
+        if (data != buf)
+            free(data);
+    }
+    pthread_mutex_unlock(&cow->alloc_lock);
+    return ok;
+}
+
+int disk_cow_io(DiskCow *cow, int cmd, uint64_t lba, uint8_t *buf, uint32_t count) {
+    if (cmd == DISK_CMD_WRITE && (!cow->writable || (lba + count) * DISK_SECTOR_SIZE > cow->size)) {
+        errno = cow->writable ? ENOSPC : EROFS;
+        return 0;
+    }
+    const uint32_t spc = cow_sectors_per_cluster(cow);
+    uint32_t i = 0;
+    while (i < count) {
+        const uint64_t sector = lba + i;
+        const uint64_t c = sector / spc;
+        const uint32_t in = (uint32_t)(sector % spc);
+        const uint32_t run = spc - in < count - i ? spc - in : count - i;
+        uint8_t *p = buf + (size_t)i * DISK_SECTOR_SIZE;
+        const uint32_t idx = c < cow->clusters ? atomic_load_explicit(&cow->table[c], memory_order_acquire) : 0;
+        int ok;
+        if (c >= cow->clusters) {
+            memset(p, 0, (size_t)run * DISK_SECTOR_SIZE);
+            ok = 1;
+        } else if (cmd == DISK_CMD_READ) {
+            ok = idx ? disk_file_io(cow->fd, cmd, (uint64_t)idx * spc + in, p, run)
+                     : cow_base_read(cow, sector, p, run);
+        } else {
+            ok = idx ? disk_file_io(cow->fd, cmd, (uint64_t)idx * spc + in, p, run)
+                     : cow_write_new(cow, (uint32_t)c, in, p, run);
+        }
+        if (!ok)
+            return 0;
+        i += run;
+    }
+    return 1;
+}
+
+int disk_cow_flush(DiskCow *cow) {
+    return fdatasync(cow->fd) == 0;
+}
+
+uint32_t disk_cow_allocated(const DiskCow *cow) {
+    uint32_t n = 0;
+    for (uint32_t c = 0; c < cow->clusters; c++)
+        n += atomic_load_explicit(&cow->table[c], memory_order_relaxed) != 0;
+    return n;
+}
+
+/* Whole clusters for the maintenance commands; the last one may end past the disk. */
+static uint32_t cow_cluster_sectors(const DiskCow *cow, uint32_t c) {
+    const uint32_t spc = cow_sectors_per_cluster(cow);
+    const uint64_t left = cow->size / DISK_SECTOR_SIZE - (uint64_t)c * spc;
+    return left < spc ? (uint32_t)left : spc;
+}
+
+int disk_cow_commit(const char *path) {
+    const int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror(path);
+        return 0;
+    }
+    DiskCow *cow = cow_open(path, fd, 1, 1, 0);
+    if (!cow)
+        return 0;
+    if (!cow->base_path) {
+        fprintf(stderr, "%s: has no base to commit to\n", path);
+        disk_cow_close(cow);
+        return 0;
+    }
+    const uint32_t spc = cow_sectors_per_cluster(cow);
+    uint8_t *data = malloc((size_t)spc * DISK_SECTOR_SIZE);
+    int ok = data != NULL;
+    for (uint32_t c = 0; ok && c < cow->clusters; c++) {
+        const uint32_t idx = atomic_load_explicit(&cow->table[c], memory_order_relaxed);
+        if (!idx)
+            continue;
+        const uint32_t n = cow_cluster_sectors(cow, c);
+        ok = disk_file_io(cow->fd, DISK_CMD_READ, (uint64_t)idx * spc, data, n) &&
+             (cow->base ? disk_cow_io(cow->base, DISK_CMD_WRITE, (uint64_t)c * spc, data, n)
+                        : disk_file_io(cow->base_fd, DISK_CMD_WRITE, (uint64_t)c * spc, data, n));
+    }
+    free(data);
+    if (!ok)
+        perror(path);
+    /* Only once the base has everything: cut the table and the data back to a hole. */
+    ok = ok && (cow->base ? disk_cow_flush(cow->base) : fdatasync(cow->base_fd) == 0) &&
+         ftruncate(cow->fd, DISK_COW_TABLE) == 0 &&
+         ftruncate(cow->fd, (off_t)(cow->data_start << cow->cluster_bits)) == 0;
+    if (!ok)
+        fprintf(stderr, "%s: commit failed\n", path);
+    disk_cow_close(cow);
+    return ok;
+}
+
+int disk_cow_compact(const char *path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 0;
+    }
+    DiskCowHeader h;
+    char base[DISK_COW_BASE_MAX + 1];
+    if (!cow_read_header(fd, &h, base)) {
+        fprintf(stderr, "%s: not a valid overlay image\n", path);
+        close(fd);
+        return 0;
+    }
+    DiskCow *cow = disk_cow_open(path, fd, 0);
+    if (!cow)
+        return 0;
+
+    /* Build the compacted copy next to the original, then swap it in. */
+    char *tmp = malloc(strlen(path) + sizeof(".compact"));
+    if (tmp)
+        sprintf(tmp, "%s.compact", path);
+    int ok = tmp && disk_cow_create(tmp, h.base_len ? base : NULL, h.size);
+    const int out_fd = ok ? open(tmp, O_RDWR) : -1;
+    DiskCow *out = out_fd >= 0 ? disk_cow_open(tmp, out_fd, 1) : NULL;
+    const uint32_t spc = cow_sectors_per_cluster(cow);
+    uint8_t *data = malloc((size_t)spc * DISK_SECTOR_SIZE);
+    uint8_t *below = malloc((size_t)spc * DISK_SECTOR_SIZE);
+    ok = out && data && below;
+    for (uint32_t c = 0; ok && c < cow->clusters; c++) {
+        const uint32_t idx = atomic_load_explicit(&cow->table[c], memory_order_relaxed);
+        if (!idx)
+            continue;
+        const uint32_t n = cow_cluster_sectors(cow, c);
+        ok = disk_file_io(cow->fd, DISK_CMD_READ, (uint64_t)idx * spc, data, n) &&
+             cow_base_read(cow, (uint64_t)c * spc, below, n);
+        if (ok && memcmp(data, below, (size_t)n * DISK_SECTOR_SIZE) != 0)
+            ok = disk_cow_io(out, DISK_CMD_WRITE, (uint64_t)c * spc, data, n);
+    }
+    free(below);
+    free(data);
+    if (out) {
+        printf("%s: %u -> %u clusters\n", path, disk_cow_allocated(cow), disk_cow_allocated(out));
+        ok = ok && disk_cow_flush(out);
+        disk_cow_close(out);
+    }
+    disk_cow_close(cow);
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "%s: compact failed\n", path);
+        if (tmp)
+            unlink(tmp);
+    }
+    free(tmp);
+    return ok;
+}
@@ -0,0 +1,85 @@
+#ifndef VM_DISK_COW_H
+#define VM_DISK_COW_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Copy-on-write overlay image: a sparse file holding only the clusters
+ * written since it was created, over a base image that is only ever read.
+ * The base is a raw image or another overlay. Layout, in host byte order
+ * like snapshots:
+ *
+ *   0                header (DiskCowHeader), then the base path
+ *   DISK_COW_TABLE   u32 per cluster: where its data is, in clusters from
+ *                    the start of the file; 0 while it is still in the base
+ *   data_start       data clusters, appended as they are first written
+ *
+ * A new overlay is a header and a hole, so it costs one block of disk.
+ * A new cluster's table entry is written right after its data, so both
+ * survive the process dying; disk_cow_flush() makes them survive the host.
+ * A process dying in between orphans the cluster, which compact cleans up.
+ */
+#define DISK_COW_MAGIC "LAMPCOW1"
+#define DISK_COW_VERSION 1u
+#define DISK_COW_CLUSTER_BITS 16u
+#define DISK_COW_TABLE 4096u
+#define DISK_COW_BASE_MAX (DISK_COW_TABLE - 64u)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint64_t size;     /* virtual disk size in bytes */
+    uint32_t clusters; /* cluster table entries */
+    uint32_t base_len; /* bytes of base path after the header; 0: unwritten clusters read as zeros */
+} DiskCowHeader;
+
+typedef struct DiskCow {
+    int fd;
+    int writable;
+    uint64_t size;
+    uint32_t cluster_bits;
+    uint32_t clusters;
+    uint64_t data_start;     /* in clusters */
+    _Atomic uint32_t *table; /* mirrors the table in the file */
+    uint32_t next_cluster;   /* where the next allocation goes; alloc_lock */
+    pthread_mutex_t alloc_lock;
+    char *base_path;         /* as resolved, NULL without a base */
+    int base_fd;             /* raw base, -1 otherwise */
+    struct DiskCow *base;    /* overlay base, NULL otherwise */
+} DiskCow;
+
+/* 1 if `fd` starts with an overlay header. */
+int disk_cow_probe(int fd);
+/*
+ * Create an overlay at `path` over `base_path`, stored as given and resolved
+ * from the overlay's directory when relative. `size` 0 takes the base's size;
+ * without a base it is required. Returns 0 on failure, with a message on stderr.
+ */
+int disk_cow_create(const char *path, const char *base_path, uint64_t size);
+/* Open an overlay and its chain of bases; `fd` is taken over either way. Returns NULL on failure. */
+DiskCow *disk_cow_open(const char *path, int fd, int writable);
+/* Does not flush: a fork()ed child closes its parent's overlay with this. */
+void disk_cow_close(DiskCow *cow);
+/*
+ * Move `count` sectors like disk_transfer(). Reads of unwritten clusters come
+ * from the base; the first write to a cluster copies it over. Any number of
+ * threads may call this at once. Returns 0 on I/O errors.
+ */
+int disk_cow_io(DiskCow *cow, int cmd, uint64_t lba, uint8_t *buf, uint32_t count);
+/* Make the data and table entries written so far durable. Returns 0 on I/O errors. */
+int disk_cow_flush(DiskCow *cow);
+/* Clusters that have their own data. */
+uint32_t disk_cow_allocated(const DiskCow *cow);
+
+/*
+ * Host-side maintenance, for vm-disk; nothing else may have the overlay open.
+ * commit writes every allocated cluster back into the base, then empties
+ * the overlay. compact rewrites the overlay without unreferenced clusters
+ * and without clusters that read the same as the base. Both return 0 on
+ * failure, with a message on stderr.
+ */
+int disk_cow_commit(const char *path);
+int disk_cow_compact(const char *path);
+#endif // VM_DISK_COW_H
@@ -4,133 +4,125 @@
 #include "frame.h"
 
 #include <stdlib.h>
-#define SCREEN_WIDTH 80
-#define SCREEN_HEIGHT 25
 #define FLUSH_THRESHOLD 3
 
-int cursor_x = 0;
-int cursor_y = 0;
-static int refresh_counter = 0;
-Cell screen[SCREEN_HEIGHT][SCREEN_WIDTH];
-DirtyRect dirty = {0, 0, 0, 0, 0};
-uint16_t vga_memory[SCREEN_HEIGHT * SCREEN_WIDTH];
 #define VGA_ADDR(x, y) ((y) * SCREEN_WIDTH + (x))
 
-void set_dirty(int value) { dirty.dirty = value; }
+void set_dirty(TextScreen *ts, int value) { ts->dirty.dirty = value; }
 
-void init_screen(void) {
+void init_screen(TextScreen *ts) {
     for (int y = 0; y < SCREEN_HEIGHT; y++) {
         for (int x = 0; x < SCREEN_WIDTH; x++) {
-            screen[y][x].ch = ' ';
-            screen[y][x].attr = 0x07;
+            ts->screen[y][x].ch = ' ';
+            ts->screen[y][x].attr = 0x07;
         }
     }
-    cursor_x = 0;
-    cursor_y = 0;
-    dirty.dirty = 1;
-    dirty.x1 = 0;
-    dirty.y1 = 0;
-    dirty.x2 = SCREEN_WIDTH - 1;
-    dirty.y2 = SCREEN_HEIGHT - 1;
+    ts->cursor_x = 0;
+    ts->cursor_y = 0;
+    ts->dirty.dirty = 1;
+    ts->dirty.x1 = 0;
+    ts->dirty.y1 = 0;
+    ts->dirty.x2 = SCREEN_WIDTH - 1;
+    ts->dirty.y2 = SCREEN_HEIGHT - 1;
 }
 
-void scroll_up(void) {
-    memmove(&screen[0][0], &screen[1][0], sizeof(Cell) * (SCREEN_HEIGHT - 1) * SCREEN_WIDTH);
+void scroll_up(TextScreen *ts) {
+    memmove(&ts->screen[0][0], &ts->screen[1][0], sizeof(Cell) * (SCREEN_HEIGHT - 1) * SCREEN_WIDTH);
     for (int x = 0; x < SCREEN_WIDTH; x++) {
-        screen[SCREEN_HEIGHT - 1][x].ch = ' ';
-        screen[SCREEN_HEIGHT - 1][x].attr = 0x07;
+        ts->screen[SCREEN_HEIGHT - 1][x].ch = ' ';
+        ts->screen[SCREEN_HEIGHT - 1][x].attr = 0x07;
     }
-    dirty.dirty = 1;
-    dirty.x1 = 0;
-    dirty.y1 = 0;
-    dirty.x2 = SCREEN_WIDTH - 1;
-    dirty.y2 = SCREEN_HEIGHT - 1;
-    if (cursor_y > 0)
-        cursor_y--;
+    ts->dirty.dirty = 1;
+    ts->dirty.x1 = 0;
+    ts->dirty.y1 = 0;
+    ts->dirty.x2 = SCREEN_WIDTH - 1;
+    ts->dirty.y2 = SCREEN_HEIGHT - 1;
+    if (ts->cursor_y > 0)
+        ts->cursor_y--;
 }
 
-void put_char_with_attr(char c, char attr) {
+void put_char_with_attr(TextScreen *ts, char c, char attr) {
     if (c == '\n') {
-        cursor_x = 0;
-        cursor_y++;
-        if (cursor_y >= SCREEN_HEIGHT)
-            scroll_up();
+        ts->cursor_x = 0;
+        ts->cursor_y++;
+        if (ts->cursor_y >= SCREEN_HEIGHT)
+            scroll_up(ts);
     } else {
-        screen[cursor_y][cursor_x].ch = c;
-        screen[cursor_y][cursor_x].attr = attr;
+        ts->screen[ts->cursor_y][ts->cursor_x].ch = c;
+        ts->screen[ts->cursor_y][ts->cursor_x].attr = attr;
 
-        if (!dirty.dirty) {
-            dirty.x1 = cursor_x;
-            dirty.y1 = cursor_y;
-            dirty.x2 = cursor_x;
-            dirty.y2 = cursor_y;
-            dirty.dirty = 1;
+        if (!ts->dirty.dirty) {
+            ts->dirty.x1 = ts->cursor_x;
+            ts->dirty.y1 = ts->cursor_y;
+            ts->dirty.x2 = ts->cursor_x;
+            ts->dirty.y2 = ts->cursor_y;
+            ts->dirty.dirty = 1;
         } else {
-            if (cursor_x < dirty.x1)
-                dirty.x1 = cursor_x;
-            if (cursor_x > dirty.x2)
-                dirty.x2 = cursor_x;
-            if (cursor_y < dirty.y1)
-                dirty.y1 = cursor_y;
-            if (cursor_y > dirty.y2)
-                dirty.y2 = cursor_y;
+            if (ts->cursor_x < ts->dirty.x1)
+                ts->dirty.x1 = ts->cursor_x;
+            if (ts->cursor_x > ts->dirty.x2)
+                ts->dirty.x2 = ts->cursor_x;
+            if (ts->cursor_y < ts->dirty.y1)
+                ts->dirty.y1 = ts->cursor_y;
+            if (ts->cursor_y > ts->dirty.y2)
+                ts->dirty.y2 = ts->cursor_y;
         }
 
-        cursor_x++;
-        if (cursor_x >= SCREEN_WIDTH) {
-            cursor_x = 0;
-            cursor_y++;
-            if (cursor_y >= SCREEN_HEIGHT)
-                scroll_up();
+        ts->cursor_x++;
+        if (ts->cursor_x >= SCREEN_WIDTH) {
+            ts->cursor_x = 0;
+            ts->cursor_y++;
+            if (ts->cursor_y >= SCREEN_HEIGHT)
+                scroll_up(ts);
         }
     }
 
-    refresh_counter++;
-    if (refresh_counter >= FLUSH_THRESHOLD || c == '\n') {
-        render_vga_screen();
+    ts->refresh_counter++;
+    if (ts->refresh_counter >= FLUSH_THRESHOLD || c == '\n') {
+        render_vga_screen(ts);
     }
 }
 
-void flush_to_vga(void) {
-    if (!dirty.dirty)
+void flush_to_vga(TextScreen *ts) {
+    if (!ts->dirty.dirty)
         return;
-    for (int y = dirty.y1; y <= dirty.y2; y++) {
-        for (int x = dirty.x1; x <= dirty.x2; x++) {
-            vga_memory[VGA_ADDR(x, y)] = ((uint16_t)screen[y][x].attr << 8) |
-                (uint8_t)screen[y][x].ch;
+    for (int y = ts->dirty.y1; y <= ts->dirty.y2; y++) {
+        for (int x = ts->dirty.x1; x <= ts->dirty.x2; x++) {
+            ts->vga_memory[VGA_ADDR(x, y)] = ((uint16_t)ts->screen[y][x].attr << 8) |
+                (uint8_t)ts->screen[y][x].ch;
         }
     }
-    dirty.dirty = 0;
+    ts->dirty.dirty = 0;
 }
 void clear_screen(void) { system("clear"); }
-void render_vga_screen(void) {
-    flush_to_vga();
+void render_vga_screen(TextScreen *ts) {
+    flush_to_vga(ts);
 
     for (int y = 0; y < SCREEN_HEIGHT; y++) {
         for (int x = 0; x < SCREEN_WIDTH; x++) {
-            putchar(vga_memory[VGA_ADDR(x, y)] & 0xFF);
+            putchar(ts->vga_memory[VGA_ADDR(x, y)] & 0xFF);
         }
         putchar('\n');
     }
     fflush(stdout);
-    refresh_counter = 0;
+    ts->refresh_counter = 0;
 }
-void render_screen_dirty(void) {
-    if (!dirty.dirty)
+void render_screen_dirty(TextScreen *ts) {
+    if (!ts->dirty.dirty)
         return;
-    for (int y = dirty.y1; y <= dirty.y2; y++) {
-        for (int x = dirty.x1; x <= dirty.x2; x++) {
-            vga_memory[VGA_ADDR(x, y)] = ((uint16_t)screen[y][x].attr << 8) |
-                (uint8_t)screen[y][x].ch;
+    for (int y = ts->dirty.y1; y <= ts->dirty.y2; y++) {
+        for (int x = ts->dirty.x1; x <= ts->dirty.x2; x++) {
+            ts->vga_memory[VGA_ADDR(x, y)] = ((uint16_t)ts->screen[y][x].attr << 8) |
+                (uint8_t)ts->screen[y][x].ch;
         }
     }
-    dirty.dirty = 0;
+    ts->dirty.dirty = 0;
 }
-void flush_screen_final(void) {
-    dirty.dirty = 1;
-    dirty.x1 = 0;
-    dirty.y1 = 0;
-    dirty.x2 = SCREEN_WIDTH - 1;
-    dirty.y2 = SCREEN_HEIGHT - 1;
-    render_vga_screen();
+void flush_screen_final(TextScreen *ts) {
+    ts->dirty.dirty = 1;
+    ts->dirty.x1 = 0;
+    ts->dirty.y1 = 0;
+    ts->dirty.x2 = SCREEN_WIDTH - 1;
+    ts->dirty.y2 = SCREEN_HEIGHT - 1;
+    render_vga_screen(ts);
 }
@@ -11,19 +11,30 @@ typedef struct {
     int dirty;
 } DirtyRect;
 
-void init_screen(void);
+#define SCREEN_WIDTH 80
+#define SCREEN_HEIGHT 25
 
-void scroll_up(void);
+/* One text console; each owner keeps its own, nothing here is shared. */
+typedef struct {
+    Cell screen[SCREEN_HEIGHT][SCREEN_WIDTH];
+    uint16_t vga_memory[SCREEN_HEIGHT * SCREEN_WIDTH];
+    DirtyRect dirty;
+    int cursor_x;
+    int cursor_y;
+    int refresh_counter;
+} TextScreen;
+
+void init_screen(TextScreen *ts);
 
-void put_char_with_attr(char c, char attr);
+void scroll_up(TextScreen *ts);
 
-void flush_to_vga(void);
+void put_char_with_attr(TextScreen *ts, char c, char attr);
 
-void render_vga_screen(void);
+void flush_to_vga(TextScreen *ts);
 
-void flush_screen_dirty(void);
+void render_vga_screen(TextScreen *ts);
 
-void render_screen_dirty(void);
+void render_screen_dirty(TextScreen *ts);
 
 void enable_raw_mode(void);
 
@@ -33,6 +44,6 @@ int get_key_nonblocking(void);
 
 void vm_handle_keyboard(VM *vm);
 
-void flush_screen_final(void);
+void flush_screen_final(TextScreen *ts);
 
 #endif // VM_FRAME_H
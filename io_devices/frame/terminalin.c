@@ -10,7 +10,8 @@
 #include "../../vm.h"
 #include "../../io.h"
 #include "frame.h"
-struct termios orig_termios;
+/* The terminal belongs to the process, not to any one VM. */
+static struct termios orig_termios;
 
 void enable_raw_mode(void) {
     tcgetattr(STDIN_FILENO, &orig_termios);
@@ -1,4 +1,5 @@
 #include "sysinfo_mmio_register.h"
+#include "../../mmio.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -19,7 +20,9 @@ static uint32_t sysinfo_feature_bits(const VM *vm) {
     uint32_t bits = SYSINFO_FEATURE_TIME_MMIO |
                     SYSINFO_FEATURE_FB_MMIO |
                     SYSINFO_FEATURE_DISK_IO |
-                    SYSINFO_FEATURE_TIMER_IRQ;
+                    SYSINFO_FEATURE_TIMER_IRQ |
+                    SYSINFO_FEATURE_BLK_QUEUE |
+                    SYSINFO_FEATURE_DISK_FLUSH;
     if (vm->smp_cores > 1) {
         bits |= SYSINFO_FEATURE_SMP;
     }
@@ -99,19 +102,22 @@ static uint32_t sysinfo_read32(VM *vm, uint32_t addr) {
 static void sysinfo_write32(VM *vm, uint32_t addr, uint32_t value) {
     (void)value;
     fprintf(stderr, "Attempted write to read-only SYSINFO MMIO at 0x%08x\n", addr);
-    vm->halted = 1;
+    vm_halt(vm);
 }
 
 void register_sysinfo_mmio(VM *vm) {
-    static MMIO_Device sysinfo_dev;
     sysinfo_init_vendor(vm);
-    sysinfo_dev.start = SYSINFO_BASE;
-    sysinfo_dev.end = SYSINFO_BASE + SYSINFO_SIZE - 1u;
-    sysinfo_dev.read32 = sysinfo_read32;
-    sysinfo_dev.write32 = sysinfo_write32;
+    const MMIO_Device sysinfo_dev = {
+        .start = SYSINFO_BASE,
+        .end = SYSINFO_BASE + SYSINFO_SIZE - 1u,
+        .read32 = sysinfo_read32,
+        .write32 = sysinfo_write32,
+        /* Fixed at vm_create, read-only afterwards. */
+        .sync = VM_MMIO_SYNC_NONE,
+    };
 
-    if (vm->mmio_count < MAX_MMIO_DEVICES) {
-        vm->mmio_devices[vm->mmio_count++] = &sysinfo_dev;
-        printf("Registered VM SysInfo to MMIO ID %d\n", vm->mmio_count);
+    const int id = vm_mmio_register(vm, &sysinfo_dev);
+    if (id > 0) {
+        printf("Registered VM SysInfo to MMIO ID %d\n", id);
     }
 }
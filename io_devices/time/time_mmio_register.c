@@ -7,9 +7,11 @@
 #include <stdlib.h>
 
 #include "timer.h"
+#include "../../mmio.h"
 #include "../../panic.h"
 
 uint32_t time_read32(VM *vm, uint32_t addr) {
+    const VCPU *cpu = vm_current_cpu(vm);
     uint32_t offset = addr - TIME_BASE;
 
     if (offset == 0x00) return 1; // Control
@@ -20,7 +22,7 @@ uint32_t time_read32(VM *vm, uint32_t addr) {
         return t.lo;
     }
     if (offset == 0x08) { // high: read same latched value
-        return (uint32_t)(vm->latched_realtime >> 32);
+        return (uint32_t)(cpu->latched_realtime >> 32);
     }
 
     // Monotonic
@@ -29,7 +31,7 @@ uint32_t time_read32(VM *vm, uint32_t addr) {
         return t.lo;
     }
     if (offset == 0x10) { // high
-        return (uint32_t)(vm->latched_monotonic >> 32);
+        return (uint32_t)(cpu->latched_monotonic >> 32);
     }
 
     // Boot
@@ -38,7 +40,7 @@ uint32_t time_read32(VM *vm, uint32_t addr) {
         return t.lo;
     }
     if (offset == 0x18) { // high
-        return (uint32_t)(vm->latched_boottime >> 32);
+        return (uint32_t)(cpu->latched_boottime >> 32);
     }
 
     printf("Unknown MMIO Register Offset: 0x%08x\n", offset);
@@ -54,33 +56,47 @@ void time_write32(VM *vm, uint32_t addr, uint32_t value) {
     }
 
     fprintf(stderr, "Attempted to write to read-only TIME MMIO at 0x%08x\n", addr);
-    vm->halted = 1;
+    vm_halt(vm);
 }
 
 
-static void initialize_timer_related(VM *vm) {
-    atomic_init(&vm->timer_enabled, false);
-    atomic_init(&vm->timer_period_us, 0u);
-    atomic_init(&vm->timer_next_deadline_ns, 0u);
-    atomic_init(&vm->timer_thread_running, true);
+static void start_timer_thread(VM *vm) {
     vm->timer_thread_started = 0;
-
     if (pthread_create(&vm->timer_worker_thread, NULL, timer_tick, vm) != 0) {
         panic("Failed to create timer worker", vm);
+        return;
     }
     vm->timer_thread_started = 1;
 }
+
+static void initialize_timer_related(VM *vm) {
+    atomic_init(&vm->timer_enabled, false);
+    atomic_init(&vm->timer_period_us, 0u);
+    atomic_init(&vm->timer_next_deadline_ns, 0u);
+    atomic_init(&vm->timer_thread_running, true);
+    start_timer_thread(vm);
+}
 #pragma GCC diagnostic pop
 
+void time_fork_child(VM *vm) {
+    if (!vm->timer_thread_started)
+        return;
+    atomic_store(&vm->timer_thread_running, true);
+    start_timer_thread(vm);
+}
+
 void register_time_mmio(VM *vm) {
-    static MMIO_Device time_dev;
-    time_dev.start = TIME_BASE;
-    time_dev.end = TIME_BASE + 23;
-    time_dev.read32 = time_read32;
-    time_dev.write32 = time_write32;
+    const MMIO_Device time_dev = {
+        .start = TIME_BASE,
+        .end = TIME_BASE + 23,
+        .read32 = time_read32,
+        .write32 = time_write32,
+        /* Latches are per vCPU and the timer state is atomic. */
+        .sync = VM_MMIO_SYNC_NONE,
+    };
     initialize_timer_related(vm);
-    if (vm->mmio_count < MAX_MMIO_DEVICES) {
-        vm->mmio_devices[vm->mmio_count++] = &time_dev;
-        printf("Registered VM Timer to MMIO ID %d\n", vm->mmio_count);
+    const int id = vm_mmio_register(vm, &time_dev);
+    if (id > 0) {
+        printf("Registered VM Timer to MMIO ID %d\n", id);
     }
 }
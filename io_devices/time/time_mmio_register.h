@@ -7,4 +7,6 @@
 //0x002000          | 0x00201B    | 28 B
 #include "../../vm.h"
 void register_time_mmio(VM *vm);
+/* In a clone forked by VM_CONTROL_CMD_FORK: restart the tick thread, keeping the timer's programmed state. */
+void time_fork_child(VM *vm);
 #endif // VM_MMIO_REGISTER_H
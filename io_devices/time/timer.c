@@ -13,26 +13,27 @@
 #define TIMER_MIN_PERIOD_US 1000u
 
 struct time_struct get_timer(VM *vm, uint32_t timer) {
+    VCPU *cpu = vm_current_cpu(vm);
     switch (timer) {
         case REALTIME: {
-            vm->latched_realtime = host_unix_time_ns();
+            cpu->latched_realtime = host_unix_time_ns();
             return (struct time_struct){
-                .lo = (uint32_t)(vm->latched_realtime & 0xFFFFFFFFu),
-                .hi = (uint32_t)(vm->latched_realtime >> 32),
+                .lo = (uint32_t)(cpu->latched_realtime & 0xFFFFFFFFu),
+                .hi = (uint32_t)(cpu->latched_realtime >> 32),
             };
         }
         case MONOTONIC: {
-            vm->latched_monotonic = host_monotonic_time_ns();
+            cpu->latched_monotonic = host_monotonic_time_ns();
             return (struct time_struct){
-                .lo = (uint32_t)(vm->latched_monotonic & 0xFFFFFFFFu),
-                .hi = (uint32_t)(vm->latched_monotonic >> 32),
+                .lo = (uint32_t)(cpu->latched_monotonic & 0xFFFFFFFFu),
+                .hi = (uint32_t)(cpu->latched_monotonic >> 32),
             };
         }
         case BOOT: {
-            vm->latched_boottime = host_monotonic_time_ns() - vm->start_monotonic_ns;
+            cpu->latched_boottime = host_monotonic_time_ns() - vm->start_monotonic_ns;
             return (struct time_struct){
-                .lo = (uint32_t)(vm->latched_boottime & 0xFFFFFFFFu),
-                .hi = (uint32_t)(vm->latched_boottime >> 32),
+                .lo = (uint32_t)(cpu->latched_boottime & 0xFFFFFFFFu),
+                .hi = (uint32_t)(cpu->latched_boottime >> 32),
             };
         }
         default:
@@ -5,20 +5,18 @@
 #include "../../interrupt.h"
 #include "../../vm.h"
 
-static SDL_Window *window = NULL;
-static SDL_Renderer *renderer = NULL;
-static SDL_Texture *texture = NULL;
-
-int vga_display_init(void) {
-    if (SDL_Init(SDL_INIT_VIDEO) != 0)
+int vga_display_init(display *d) {
+    memset(d, 0, sizeof(*d));
+    /* Reference counted by SDL, so every VM's display can init and quit its own. */
+    if (SDL_InitSubSystem(SDL_INIT_VIDEO) != 0)
         return -1;
 
-    window = SDL_CreateWindow(
+    d->window = SDL_CreateWindow(
         "VM Display", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, FB_WIDTH, FB_HEIGHT, SDL_WINDOW_BORDERLESS);
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    texture = SDL_CreateTexture(
-        renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, FB_WIDTH, FB_HEIGHT);
+    d->renderer = SDL_CreateRenderer(d->window, -1, SDL_RENDERER_ACCELERATED);
+    d->texture = SDL_CreateTexture(
+        d->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, FB_WIDTH, FB_HEIGHT);
 
     SDL_StartTextInput();
     return 0;
@@ -35,26 +33,43 @@ static void serial_rx_push_normalized(VM *vm, uint8_t c) {
     serial_rx_push(vm, c);
 }
 
-void display_update(VM *vm) {
+void display_update(display *d, VM *vm) {
     //printf("first 16 pixels:");
     //for (int i = 0; i < 16; i++) {
     //    printf(" %08x", ((uint32_t *)vm->fb)[i]);
     //}
     //printf("\n");
 
-    const size_t row_bytes = (size_t)FB_WIDTH * (size_t)FB_BPP;
-    uint8_t *front = (uint8_t *)vm->fb_front;
-    const uint8_t *back = (const uint8_t *)vm->fb;
-    for (size_t row = 0; row < FB_HEIGHT; row++) {
-        vm_fb_row_lock(vm, row);
-        memcpy(front + row * row_bytes, back + row * row_bytes, row_bytes);
-        vm_fb_row_unlock(vm, row);
+    /*
+     * Upload runs of rows dirtied since the last frame straight from the
+     * guest framebuffer. A vCPU may set a row's bit before its pixel store
+     * is visible here, so rows dirty last frame are uploaded once more.
+     */
+    uint64_t upload[FB_DIRTY_WORDS];
+    for (size_t i = 0; i < FB_DIRTY_WORDS; i++) {
+        const uint64_t now = atomic_exchange_explicit(&vm->fb_dirty[i], 0, memory_order_acquire);
+        upload[i] = now | d->last_dirty[i];
+        d->last_dirty[i] = now;
+    }
+
+    const int row_bytes = FB_WIDTH * FB_BPP;
+    const uint8_t *fb = (const uint8_t *)vm->fb;
+    int row = 0;
+    while (row < FB_HEIGHT) {
+        if (!(upload[row / 64] >> (row % 64) & 1u)) {
+            row++;
+            continue;
+        }
+        const int first = row;
+        while (row < FB_HEIGHT && (upload[row / 64] >> (row % 64) & 1u))
+            row++;
+        const SDL_Rect rect = {0, first, FB_WIDTH, row - first};
+        SDL_UpdateTexture(d->texture, &rect, fb + (size_t)first * (size_t)row_bytes, row_bytes);
     }
 
-    SDL_UpdateTexture(texture, NULL, vm->fb_front, FB_WIDTH * FB_BPP);
-    SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
+    SDL_RenderClear(d->renderer);
+    SDL_RenderCopy(d->renderer, d->texture, NULL, NULL);
+    SDL_RenderPresent(d->renderer);
     //printf("flushed\n");
 }
 
@@ -63,7 +78,7 @@ void display_poll_events(VM *vm) {
     while (SDL_PollEvent(&e)) {
         switch (e.type) {
             case SDL_QUIT:
-                vm->halted = 1;
+                vm_halt(vm);
                 break;
             case SDL_TEXTINPUT: {
                 const char *p = e.text.text;
@@ -98,10 +113,10 @@ void display_poll_events(VM *vm) {
     }
 }
 
-void display_shutdown(void) {
+void display_shutdown(display *d) {
     SDL_StopTextInput();
-    SDL_DestroyTexture(texture);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
-    SDL_Quit();
+    SDL_DestroyTexture(d->texture);
+    SDL_DestroyRenderer(d->renderer);
+    SDL_DestroyWindow(d->window);
+    SDL_QuitSubSystem(SDL_INIT_VIDEO);
 }
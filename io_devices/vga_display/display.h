@@ -14,14 +14,16 @@
 typedef struct {
     uint32_t *vram;
 } frame_buffer;
+/* One window per VM, owned by whoever runs its display loop. */
 typedef struct {
     SDL_Window *window;
     SDL_Renderer *renderer;
     SDL_Texture *texture;
+    uint64_t last_dirty[FB_DIRTY_WORDS]; /* rows uploaded last frame, see display_update */
 } display;
-int vga_display_init(void);
+int vga_display_init(display *d);
 void display_poll_events(VM *vm);
-void display_update(VM *vm);
-void display_shutdown(void);
+void display_update(display *d, VM *vm);
+void display_shutdown(display *d);
 
 #endif // VM_DISPLAY_H
@@ -3,6 +3,7 @@
 //
 
 #include "vga_mmio_register.h"
+#include "../../mmio.h"
 
 
 static inline size_t fb_pixel_index(VM *vm, uint32_t addr) {
@@ -17,36 +18,31 @@ static inline size_t fb_pixel_index(VM *vm, uint32_t addr) {
 }
 
 uint32_t fb_read32(VM *vm, uint32_t addr) {
-    size_t pixel_index = fb_pixel_index(vm, addr);
-    const size_t row = vm_fb_row_from_pixel_index(pixel_index);
-    vm_fb_row_lock(vm, row);
-    uint32_t value = vm->fb[pixel_index];
-    vm_fb_row_unlock(vm, row);
-    return value;
+    return vm->fb[fb_pixel_index(vm, addr)];
 }
 
 void fb_write32(VM *vm, uint32_t addr, uint32_t value) {
     size_t pixel_index = fb_pixel_index(vm, addr);
-    const size_t row = vm_fb_row_from_pixel_index(pixel_index);
-    vm_fb_row_lock(vm, row);
     vm->fb[pixel_index] = value;
-    vm_fb_row_unlock(vm, row);
+    vm_fb_mark_dirty(vm, vm_fb_row_from_pixel_index(pixel_index));
 }
 
 void register_fb_mmio(VM *vm) {
-    static MMIO_Device fb_dev;
-    static MMIO_Device fb_legacy_dev;
-    fb_dev.start = FB_BASE(vm->memory_size);
-    fb_dev.end = FB_BASE(vm->memory_size) + FB_SIZE - 1;
-    fb_dev.read32 = fb_read32;
-    fb_dev.write32 = fb_write32;
-    vm->mmio_devices[vm->mmio_count++] = &fb_dev;
-    printf("Registered VM Screen to MMIO ID %d\n", vm->mmio_count);
+    const MMIO_Device fb_dev = {
+        .start = FB_BASE(vm->memory_size),
+        .end = FB_BASE(vm->memory_size) + FB_SIZE - 1,
+        .read32 = fb_read32,
+        .write32 = fb_write32,
+        .sync = VM_MMIO_SYNC_NONE, /* lock-free, see vm_fb_mark_dirty */
+    };
+    printf("Registered VM Screen to MMIO ID %d\n", vm_mmio_register(vm, &fb_dev));
 
-    fb_legacy_dev.start = FB_LEGACY_BASE;
-    fb_legacy_dev.end = FB_LEGACY_BASE + FB_SIZE - 1;
-    fb_legacy_dev.read32 = fb_read32;
-    fb_legacy_dev.write32 = fb_write32;
-    vm->mmio_devices[vm->mmio_count++] = &fb_legacy_dev;
-    printf("Registered VM Screen legacy alias to MMIO ID %d\n", vm->mmio_count);
+    const MMIO_Device fb_legacy_dev = {
+        .start = FB_LEGACY_BASE,
+        .end = FB_LEGACY_BASE + FB_SIZE - 1,
+        .read32 = fb_read32,
+        .write32 = fb_write32,
+        .sync = VM_MMIO_SYNC_NONE, /* lock-free, see vm_fb_mark_dirty */
+    };
+    printf("Registered VM Screen legacy alias to MMIO ID %d\n", vm_mmio_register(vm, &fb_legacy_dev));
 }
@@ -0,0 +1,1510 @@
+/*
+ * MAP_ANONYMOUS is not part of POSIX.1-2008; ask for the default glibc/BSD
+ * feature set on top of the _POSIX_C_SOURCE the build already defines.
+ */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include "jit.h"
+
+#ifdef VM_JIT
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "decode.h"
+#include "flags.h"
+#include "memory.h"
+#include "stack.h"
+
+/*
+ * Tiered execution. The interpreter stays the reference implementation; the
+ * JIT only takes over guest code that has proven hot.
+ *
+ * - The interpreter stops after every control transfer (see the BRANCH kind
+ *   in VM_OPCODE_TABLE), so vm_jit_execute() sees every block entry and
+ *   counts it. At VM_JIT_HOT_THRESHOLD the straight-line run starting there
+ *   is translated, up to and including its first control transfer.
+ * - Guest registers used by a block live in host registers while it runs and
+ *   are written back at every exit.
+ * - LOAD32/STORE32 access vm->memory directly when the page map says the
+ *   page is plain RAM (and, for stores, holds no decoded code). Everything
+ *   else goes through vm_read32()/vm_write32().
+ * - Condition flags follow the lazy scheme from flags.h: the last producer
+ *   before an exit records its operands, conditional branches recompute the
+ *   host flags from them.
+ * - Exits to a constant guest ip are chained: the first time one is taken
+ *   vm_jit_execute() patches its jump to the target block, after which
+ *   control flows block to block without leaving translated code. RET and
+ *   CALLR look their target up in a small hashed cache (ibtc) inline.
+ *   Either way the chain stops once the batch budget is spent and control
+ *   returns to vm_thread() for interrupt delivery.
+ * - Opcodes without a translation end the block and are left to the
+ *   interpreter.
+ *
+ * Writes to translated code reach vm_jit_invalidate() through the decode
+ * cache. Code memory is only reused by vm_jit_flush(), with every other vCPU
+ * parked, so a block another core is still running when it is invalidated is
+ * safe to finish; that is the same benign race the decode cache already
+ * accepts. A full code buffer stops compilation until the vCPU that filled
+ * it flushes the whole cache at its next batch boundary (VM_ATTN_JIT_FULL).
+ */
+
+enum {
+    VM_JIT_TABLE_BITS = 16,
+    VM_JIT_HOT_THRESHOLD = 32,
+    VM_JIT_MAX_BLOCK_INSTS = 64,
+    VM_JIT_MAX_EXITS = VM_JIT_MAX_BLOCK_INSTS + 2,
+    VM_JIT_MAX_BLOCK_CODE = 64 * 1024,
+    /* Fallthrough and taken edge of the terminator. */
+    VM_JIT_MAX_LINKS = 2,
+    VM_JIT_IBTC_BITS = 10,
+};
+#define VM_JIT_TABLE_SIZE (1u << VM_JIT_TABLE_BITS)
+#define VM_JIT_CODE_SIZE ((size_t)32 << 20)
+/* One byte per 4 KiB page of the 32-bit guest address space. */
+#define VM_JIT_MAP_PAGES ((size_t)1 << 20)
+#define VM_JIT_PAGE_LOAD 0x01u
+#define VM_JIT_PAGE_STORE 0x02u
+/* STORE taken away until the page's first store after a checkpoint. */
+#define VM_JIT_PAGE_STORE_PARKED 0x04u
+#define VM_JIT_IBTC_SIZE (1u << VM_JIT_IBTC_BITS)
+
+typedef struct VM_JitBlock VM_JitBlock;
+typedef struct VM_JitLink VM_JitLink;
+
+/*
+ * Runs translated code from cpu->ip for up to `budget` guest instructions
+ * and returns how many retired. When it stops at a chainable exit that is
+ * not linked yet, *link is set to that exit.
+ */
+typedef uint32_t (*vm_jit_entry_fn)(VCPU *cpu, uint32_t budget, VM_JitLink **link);
+
+/* A chainable exit: a jmp rel32 that either leaves or enters `target`. */
+struct VM_JitLink {
+    VM_JitBlock *from;
+    VM_JitBlock *target; /* NULL while unlinked */
+    uint8_t *rel;
+    int32_t unlinked_rel;
+    VM_JitLink *in_next; /* next link into the same target */
+};
+
+struct VM_JitBlock {
+    vm_jit_entry_fn entry;
+    /* Entered from other blocks with rbx/r12/r13 and the frame already set up. */
+    const uint8_t *chain;
+    vm_addr_t start;
+    vm_addr_t end; /* exclusive */
+    atomic_bool valid;
+    int page_count;
+    size_t page[2];
+    VM_JitBlock *page_next[2];
+    VM_JitBlock *all_next;
+    VM_JitLink links[VM_JIT_MAX_LINKS];
+    int link_count;
+    VM_JitLink *incoming;
+};
+
+struct VM_Jit {
+    pthread_mutex_t lock;
+    uint8_t *code;
+    size_t code_used;
+    /* The last compile did not fit in `code`; nothing is compiled until vm_jit_flush(). */
+    atomic_bool full;
+    _Atomic uint8_t *page_map;
+    /* Per decode page: blocks with instructions in that page. */
+    _Atomic(VM_JitBlock *) *page_blocks;
+    size_t page_count;
+    VM_JitBlock *all_blocks;
+    _Atomic(VM_JitBlock *) table[VM_JIT_TABLE_SIZE];
+    _Atomic uint16_t hits[VM_JIT_TABLE_SIZE];
+    /* Indirect-branch targets, indexed by (ip >> 3), probed by RET/CALLR. */
+    _Atomic(VM_JitBlock *) ibtc[VM_JIT_IBTC_SIZE];
+};
+
+/* ---------------------------------------------------------------------------
+ * x86-64 encoder
+ * ------------------------------------------------------------------------- */
+
+enum {
+    X86_RAX, X86_RCX, X86_RDX, X86_RBX, X86_RSP, X86_RBP, X86_RSI, X86_RDI,
+    X86_R8, X86_R9, X86_R10, X86_R11, X86_R12, X86_R13, X86_R14, X86_R15,
+};
+
+enum {
+    X86_CC_B = 0x2,
+    X86_CC_AE = 0x3,
+    X86_CC_E = 0x4,
+    X86_CC_NE = 0x5,
+    X86_CC_A = 0x7,
+    X86_CC_L = 0xC,
+    X86_CC_GE = 0xD,
+    X86_CC_LE = 0xE,
+    X86_CC_G = 0xF,
+};
+
+/* "op r32, r/m32" opcodes. */
+enum {
+    X86_ADD = 0x03,
+    X86_OR = 0x0B,
+    X86_AND = 0x23,
+    X86_SUB = 0x2B,
+    X86_XOR = 0x33,
+    X86_CMP = 0x3B,
+    X86_TEST = 0x85,
+    X86_MOV_LOAD = 0x8B,
+    X86_MOV_STORE = 0x89,
+    X86_IMUL = 0x0FAF,
+};
+
+/* /digit extensions for the 0x81/0x83 immediate group and shifts. */
+enum {
+    X86_EXT_ADD = 0, X86_EXT_OR = 1, X86_EXT_AND = 4, X86_EXT_SUB = 5, X86_EXT_XOR = 6, X86_EXT_CMP = 7,
+};
+enum {
+    X86_SH_ROL = 0, X86_SH_ROR = 1, X86_SH_SHL = 4, X86_SH_SHR = 5,
+};
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    int overflow;
+} JitEmitter;
+
+static void emit_u8(JitEmitter *e, uint8_t b) {
+    if (e->len >= e->cap) {
+        e->overflow = 1;
+        return;
+    }
+    e->buf[e->len++] = b;
+}
+
+static void emit_u32(JitEmitter *e, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        emit_u8(e, (uint8_t)(v >> (8 * i)));
+}
+
+static void emit_u64(JitEmitter *e, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        emit_u8(e, (uint8_t)(v >> (8 * i)));
+}
+
+static void emit_rex(JitEmitter *e, int w, int reg, int index, int base) {
+    const uint8_t rex = (uint8_t)(0x40 | (w << 3) | ((reg >> 3) & 1) << 2 | ((index >> 3) & 1) << 1 |
+                                  ((base >> 3) & 1));
+    if (rex != 0x40)
+        emit_u8(e, rex);
+}
+
+static void emit_opcode(JitEmitter *e, unsigned opc) {
+    if (opc > 0xFFu)
+        emit_u8(e, (uint8_t)(opc >> 8));
+    emit_u8(e, (uint8_t)opc);
+}
+
+static int fits_i8(int32_t v) {
+    return v >= -128 && v <= 127;
+}
+
+/* ModRM (+SIB, +disp) for [base + disp]. */
+static void emit_mem(JitEmitter *e, int reg, int base, int32_t disp) {
+    uint8_t mod = 0x80;
+    if (disp == 0 && (base & 7) != X86_RBP)
+        mod = 0x00;
+    else if (fits_i8(disp))
+        mod = 0x40;
+    emit_u8(e, (uint8_t)(mod | (reg & 7) << 3 | (base & 7)));
+    if ((base & 7) == X86_RSP)
+        emit_u8(e, 0x24);
+    if (mod == 0x40)
+        emit_u8(e, (uint8_t)disp);
+    else if (mod == 0x80)
+        emit_u32(e, (uint32_t)disp);
+}
+
+/* op reg, rm (both registers). */
+static void emit_rr(JitEmitter *e, unsigned opc, int reg, int rm) {
+    emit_rex(e, 0, reg, 0, rm);
+    emit_opcode(e, opc);
+    emit_u8(e, (uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+/* op reg, [base + disp] (or the store direction for X86_MOV_STORE). */
+static void emit_rm(JitEmitter *e, int w, unsigned opc, int reg, int base, int32_t disp) {
+    emit_rex(e, w, reg, 0, base);
+    emit_opcode(e, opc);
+    emit_mem(e, reg, base, disp);
+}
+
+/* op reg, [base + index]. */
+static void emit_rsib(JitEmitter *e, unsigned opc, int reg, int base, int index) {
+    emit_rex(e, 0, reg, index, base);
+    emit_opcode(e, opc);
+    emit_u8(e, (uint8_t)(0x44 | (reg & 7) << 3));
+    emit_u8(e, (uint8_t)((index & 7) << 3 | (base & 7)));
+    emit_u8(e, 0);
+}
+
+static void emit_alu_imm(JitEmitter *e, int ext, int rm, int32_t imm) {
+    emit_rex(e, 0, 0, 0, rm);
+    if (fits_i8(imm)) {
+        emit_u8(e, 0x83);
+        emit_u8(e, (uint8_t)(0xC0 | ext << 3 | (rm & 7)));
+        emit_u8(e, (uint8_t)imm);
+    } else {
+        emit_u8(e, 0x81);
+        emit_u8(e, (uint8_t)(0xC0 | ext << 3 | (rm & 7)));
+        emit_u32(e, (uint32_t)imm);
+    }
+}
+
+static void emit_alu_mem_imm(JitEmitter *e, int ext, int base, int32_t disp, int32_t imm) {
+    emit_rex(e, 0, 0, 0, base);
+    emit_u8(e, fits_i8(imm) ? 0x83 : 0x81);
+    emit_mem(e, ext, base, disp);
+    if (fits_i8(imm))
+        emit_u8(e, (uint8_t)imm);
+    else
+        emit_u32(e, (uint32_t)imm);
+}
+
+static void emit_mov_ri(JitEmitter *e, int r, uint32_t imm) {
+    emit_rex(e, 0, 0, 0, r);
+    emit_u8(e, (uint8_t)(0xB8 + (r & 7)));
+    emit_u32(e, imm);
+}
+
+static void emit_mov_ri64(JitEmitter *e, int r, uint64_t imm) {
+    emit_rex(e, 1, 0, 0, r);
+    emit_u8(e, (uint8_t)(0xB8 + (r & 7)));
+    emit_u64(e, imm);
+}
+
+static void emit_mov_rr64(JitEmitter *e, int dst, int src) {
+    emit_rex(e, 1, src, 0, dst);
+    emit_u8(e, 0x89);
+    emit_u8(e, (uint8_t)(0xC0 | (src & 7) << 3 | (dst & 7)));
+}
+
+static void emit_mov_mem_imm32(JitEmitter *e, int base, int32_t disp, uint32_t imm) {
+    emit_rex(e, 0, 0, 0, base);
+    emit_u8(e, 0xC7);
+    emit_mem(e, 0, base, disp);
+    emit_u32(e, imm);
+}
+
+static void emit_mov_mem_imm8(JitEmitter *e, int base, int32_t disp, uint8_t imm) {
+    emit_rex(e, 0, 0, 0, base);
+    emit_u8(e, 0xC6);
+    emit_mem(e, 0, base, disp);
+    emit_u8(e, imm);
+}
+
+static void emit_shift_cl(JitEmitter *e, int ext, int rm) {
+    emit_rex(e, 0, 0, 0, rm);
+    emit_u8(e, 0xD3);
+    emit_u8(e, (uint8_t)(0xC0 | ext << 3 | (rm & 7)));
+}
+
+static void emit_shift_imm(JitEmitter *e, int ext, int rm, uint8_t sh) {
+    if (sh == 0)
+        return;
+    emit_rex(e, 0, 0, 0, rm);
+    emit_u8(e, 0xC1);
+    emit_u8(e, (uint8_t)(0xC0 | ext << 3 | (rm & 7)));
+    emit_u8(e, sh);
+}
+
+static void emit_not(JitEmitter *e, int rm) {
+    emit_rex(e, 0, 0, 0, rm);
+    emit_u8(e, 0xF7);
+    emit_u8(e, (uint8_t)(0xC0 | 2 << 3 | (rm & 7)));
+}
+
+/* test byte [base + index], imm8 */
+static void emit_test_map(JitEmitter *e, int base, int index, uint8_t imm) {
+    emit_rex(e, 0, 0, index, base);
+    emit_u8(e, 0xF6);
+    emit_u8(e, 0x44);
+    emit_u8(e, (uint8_t)((index & 7) << 3 | (base & 7)));
+    emit_u8(e, 0);
+    emit_u8(e, imm);
+}
+
+static size_t emit_jcc(JitEmitter *e, int cc) {
+    emit_u8(e, 0x0F);
+    emit_u8(e, (uint8_t)(0x80 | cc));
+    emit_u32(e, 0);
+    return e->len - 4;
+}
+
+static size_t emit_jmp(JitEmitter *e) {
+    emit_u8(e, 0xE9);
+    emit_u32(e, 0);
+    return e->len - 4;
+}
+
+/* Point the rel32 at `at` to the current position. */
+static void bind(JitEmitter *e, size_t at) {
+    if (e->overflow)
+        return;
+    const int32_t rel = (int32_t)(e->len - (at + 4));
+    memcpy(&e->buf[at], &rel, sizeof(rel));
+}
+
+static void emit_push(JitEmitter *e, int r) {
+    emit_rex(e, 0, 0, 0, r);
+    emit_u8(e, (uint8_t)(0x50 + (r & 7)));
+}
+
+static void emit_pop(JitEmitter *e, int r) {
+    emit_rex(e, 0, 0, 0, r);
+    emit_u8(e, (uint8_t)(0x58 + (r & 7)));
+}
+
+static void emit_call_abs(JitEmitter *e, uint64_t fn) {
+    emit_mov_ri64(e, X86_RAX, fn);
+    emit_u8(e, 0xFF);
+    emit_u8(e, 0xD0);
+}
+
+/* ---------------------------------------------------------------------------
+ * Runtime helpers called from translated code
+ * ------------------------------------------------------------------------- */
+
+static uint32_t jit_helper_read32(VM *vm, uint32_t addr) {
+    return vm_read32(vm, addr);
+}
+
+/* Returns nonzero when the write invalidated the running block. */
+static uint32_t jit_helper_write32(VM *vm, VM_JitBlock *blk, uint32_t addr, uint32_t value) {
+    vm_write32(vm, addr, value);
+    return !atomic_load_explicit(&blk->valid, memory_order_relaxed);
+}
+
+static void jit_helper_call_push(VM *vm, VCPU *cpu, uint32_t ret_ip) {
+    call_push(vm, cpu, (uint64_t)ret_ip);
+}
+
+static uint32_t jit_helper_ret_pop(VM *vm, VCPU *cpu) {
+    return (vm_addr_t)call_pop(vm, cpu);
+}
+
+static uint32_t jit_helper_flags(VCPU *cpu) {
+    return vm_flags_materialize(cpu);
+}
+
+/* ---------------------------------------------------------------------------
+ * Translator
+ * ------------------------------------------------------------------------- */
+
+#define CPU_OFF(field) ((int32_t)offsetof(VCPU, field))
+#define GUEST_REG_OFF(g) (CPU_OFF(regs) + 4 * (int32_t)(g))
+
+/* Host registers that may hold guest registers, in allocation order. */
+static const int8_t jit_reg_pool[] = {
+    X86_RBP, X86_R14, X86_R15, X86_RSI, X86_RDI, X86_R8, X86_R9, X86_R10, X86_R11,
+};
+
+static int host_is_caller_saved(int r) {
+    return r == X86_RSI || r == X86_RDI || (r >= X86_R8 && r <= X86_R11);
+}
+
+typedef struct {
+    vm_addr_t ip;
+    VM_DecodedInst in;
+} JitInst;
+
+typedef struct {
+    size_t patch;
+    vm_addr_t ip;
+    vm_addr_t last_ip;
+    uint32_t count;
+    uint32_t dirty;
+    int chain;
+} JitExit;
+
+/* What the translator knows about the flags at the current point. */
+typedef struct {
+    int kind; /* VM_FLAGS_*, or -1 when set before the block */
+    int b_is_imm;
+    int32_t b_imm;
+} JitFlags;
+
+typedef struct {
+    VM *vm;
+    VM_Jit *jit;
+    VM_JitBlock *blk;
+    JitEmitter e;
+    int8_t host[REG_COUNT];
+    uint32_t dirty;
+    JitFlags flags;
+    JitExit exits[VM_JIT_MAX_EXITS];
+    int exit_count;
+    size_t chain_offset;
+    size_t link_rel[VM_JIT_MAX_LINKS];
+} JitCtx;
+
+static int jit_op_supported(uint8_t op) {
+    switch (op) {
+    case OP_ADD: case OP_SUB: case OP_MUL:
+    case OP_AND: case OP_OR: case OP_XOR: case OP_NOT:
+    case OP_SHL: case OP_SHR: case OP_ROL: case OP_ROR:
+    case OP_ADDI: case OP_SUBI: case OP_ANDI: case OP_ORI: case OP_XORI:
+    case OP_SHLI: case OP_SHRI: case OP_ROLI: case OP_RORI:
+    case OP_INC: case OP_CMP: case OP_CMPI: case OP_MOV: case OP_MOVI:
+    case OP_LOAD32: case OP_LOADX32: case OP_STORE32: case OP_STOREX32:
+    case OP_CPUID: case OP_FENCE:
+    case OP_JMP: case OP_RJMP: case OP_JZ: case OP_RJZ: case OP_JNZ: case OP_RJNZ:
+    case OP_JG: case OP_JGE: case OP_JL: case OP_JLE: case OP_JC: case OP_JNC:
+    case OP_CALL: case OP_RCALL: case OP_CALLR: case OP_RET:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int jit_op_ends_block(uint8_t op) {
+    switch (op) {
+    case OP_JMP: case OP_RJMP: case OP_JZ: case OP_RJZ: case OP_JNZ: case OP_RJNZ:
+    case OP_JG: case OP_JGE: case OP_JL: case OP_JLE: case OP_JC: case OP_JNC:
+    case OP_CALL: case OP_RCALL: case OP_CALLR: case OP_RET:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Does the instruction replace the lazy flag state? */
+static int jit_op_sets_flags(uint8_t op) {
+    switch (op) {
+    case OP_STORE32: case OP_STOREX32: case OP_FENCE:
+        return 0;
+    default:
+        return !jit_op_ends_block(op);
+    }
+}
+
+/* Guest registers an instruction reads or writes. */
+static uint32_t jit_inst_regs(const VM_DecodedInst *in) {
+    const uint32_t rd = 1u << in->rd;
+    const uint32_t rs1 = 1u << in->rs1;
+    const uint32_t rs2 = 1u << in->rs2;
+    switch (in->op) {
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_AND: case OP_OR: case OP_XOR:
+    case OP_SHL: case OP_SHR: case OP_SAR: case OP_ROL: case OP_ROR:
+    case OP_LOADX32: case OP_STOREX32:
+        return rd | rs1 | rs2;
+    case OP_NOT: case OP_ADDI: case OP_SUBI: case OP_ANDI: case OP_ORI: case OP_XORI:
+    case OP_SHLI: case OP_SHRI: case OP_ROLI: case OP_RORI:
+    case OP_CMP: case OP_MOV: case OP_LOAD32: case OP_STORE32:
+        return rd | rs1;
+    case OP_INC: case OP_CMPI: case OP_MOVI: case OP_CPUID: case OP_CALLR:
+        return rd;
+    default:
+        return 0;
+    }
+}
+
+static void load_guest(JitCtx *c, int dst, uint8_t g) {
+    if (c->host[g] >= 0) {
+        if (c->host[g] != dst)
+            emit_rr(&c->e, X86_MOV_LOAD, dst, c->host[g]);
+    } else {
+        emit_rm(&c->e, 0, X86_MOV_LOAD, dst, X86_RBX, GUEST_REG_OFF(g));
+    }
+}
+
+/* dst = dst <op> guest[g] */
+static void alu_guest(JitCtx *c, unsigned opc, int dst, uint8_t g) {
+    if (c->host[g] >= 0)
+        emit_rr(&c->e, opc, dst, c->host[g]);
+    else
+        emit_rm(&c->e, 0, opc, dst, X86_RBX, GUEST_REG_OFF(g));
+}
+
+static void store_guest(JitCtx *c, uint8_t g, int src) {
+    if (c->host[g] >= 0) {
+        emit_rr(&c->e, X86_MOV_LOAD, c->host[g], src);
+        c->dirty |= 1u << g;
+    } else {
+        emit_rm(&c->e, 0, X86_MOV_STORE, src, X86_RBX, GUEST_REG_OFF(g));
+    }
+}
+
+static void emit_store_cpu32(JitCtx *c, int32_t off, int src) {
+    emit_rm(&c->e, 0, X86_MOV_STORE, src, X86_RBX, off);
+}
+
+/* Write modified guest registers home before calling into C. */
+static void emit_spill(JitCtx *c) {
+    for (int g = 0; g < REG_COUNT; g++) {
+        if (c->host[g] >= 0 && (c->dirty & (1u << g)))
+            emit_rm(&c->e, 0, X86_MOV_STORE, c->host[g], X86_RBX, GUEST_REG_OFF(g));
+    }
+}
+
+static void emit_reload(JitCtx *c) {
+    for (int g = 0; g < REG_COUNT; g++) {
+        if (c->host[g] >= 0 && host_is_caller_saved(c->host[g]))
+            emit_rm(&c->e, 0, X86_MOV_LOAD, c->host[g], X86_RBX, GUEST_REG_OFF(g));
+    }
+}
+
+/* Make cpu->ip/last_ip match the interpreter before anything that can panic. */
+static void emit_sync_ip(JitCtx *c, vm_addr_t ip) {
+    emit_mov_ri(&c->e, X86_RCX, ip);
+    emit_rm(&c->e, 1, X86_MOV_STORE, X86_RCX, X86_RBX, CPU_OFF(last_ip));
+    emit_mov_ri(&c->e, X86_RCX, ip + 8u);
+    emit_rm(&c->e, 1, X86_MOV_STORE, X86_RCX, X86_RBX, CPU_OFF(ip));
+}
+
+/*
+ * Frame shared by every block in a chain:
+ *   [rsp + 0] remaining budget, [rsp + 4] budget at entry, [rsp + 8] link out.
+ */
+#define FRAME_REMAINING 0
+#define FRAME_BUDGET 4
+#define FRAME_LINK 8
+
+static void emit_prologue(JitCtx *c) {
+    JitEmitter *e = &c->e;
+    emit_push(e, X86_RBX);
+    emit_push(e, X86_RBP);
+    emit_push(e, X86_R12);
+    emit_push(e, X86_R13);
+    emit_push(e, X86_R14);
+    emit_push(e, X86_R15);
+    emit_u8(e, 0x48); /* sub rsp, 24: frame, keeps calls 16-byte aligned */
+    emit_u8(e, 0x83);
+    emit_u8(e, 0xEC);
+    emit_u8(e, 0x18);
+    emit_rm(e, 0, X86_MOV_STORE, X86_RSI, X86_RSP, FRAME_REMAINING);
+    emit_rm(e, 0, X86_MOV_STORE, X86_RSI, X86_RSP, FRAME_BUDGET);
+    emit_rm(e, 1, X86_MOV_STORE, X86_RDX, X86_RSP, FRAME_LINK);
+    emit_mov_rr64(e, X86_RBX, X86_RDI);
+    emit_mov_ri64(e, X86_RAX, (uint64_t)(uintptr_t)c->vm);
+    emit_rm(e, 1, X86_MOV_LOAD, X86_R12, X86_RAX, (int32_t)offsetof(VM, memory));
+    emit_mov_ri64(e, X86_R13, (uint64_t)(uintptr_t)c->jit->page_map);
+    c->chain_offset = e->len;
+    for (int g = 0; g < REG_COUNT; g++) {
+        if (c->host[g] >= 0)
+            emit_rm(e, 0, X86_MOV_LOAD, c->host[g], X86_RBX, GUEST_REG_OFF(g));
+    }
+}
+
+static void emit_writeback(JitCtx *c, uint32_t dirty) {
+    for (int g = 0; g < REG_COUNT; g++) {
+        if (c->host[g] >= 0 && (dirty & (1u << g)))
+            emit_rm(&c->e, 0, X86_MOV_STORE, c->host[g], X86_RBX, GUEST_REG_OFF(g));
+    }
+}
+
+/* Charge `count` instructions to the budget; flags: remaining <= 0. */
+static void emit_charge(JitCtx *c, uint32_t count) {
+    emit_alu_mem_imm(&c->e, X86_EXT_SUB, X86_RSP, FRAME_REMAINING, (int32_t)count);
+}
+
+/* Return budget - remaining to vm_jit_execute(). */
+static void emit_return(JitCtx *c) {
+    JitEmitter *e = &c->e;
+    emit_rm(e, 0, X86_MOV_LOAD, X86_RAX, X86_RSP, FRAME_BUDGET);
+    emit_rm(e, 0, X86_SUB, X86_RAX, X86_RSP, FRAME_REMAINING);
+    emit_u8(e, 0x48); /* add rsp, 24 */
+    emit_u8(e, 0x83);
+    emit_u8(e, 0xC4);
+    emit_u8(e, 0x18);
+    emit_pop(e, X86_R15);
+    emit_pop(e, X86_R14);
+    emit_pop(e, X86_R13);
+    emit_pop(e, X86_R12);
+    emit_pop(e, X86_RBP);
+    emit_pop(e, X86_RBX);
+    emit_u8(e, 0xC3);
+}
+
+static void emit_store_ips(JitCtx *c, vm_addr_t ip, vm_addr_t last_ip) {
+    emit_mov_ri(&c->e, X86_RAX, ip);
+    emit_rm(&c->e, 1, X86_MOV_STORE, X86_RAX, X86_RBX, CPU_OFF(ip));
+    emit_mov_ri(&c->e, X86_RCX, last_ip);
+    emit_rm(&c->e, 1, X86_MOV_STORE, X86_RCX, X86_RBX, CPU_OFF(last_ip));
+}
+
+/*
+ * Leave the block at a constant guest ip. A chainable exit ends in a
+ * 4-byte aligned jmp rel32 so vm_jit_execute() can later retarget it with a
+ * single atomic store; until then it falls into the normal return path.
+ */
+static void emit_exit_static(JitCtx *c, uint32_t dirty, vm_addr_t ip, vm_addr_t last_ip, uint32_t count,
+                             int chain) {
+    JitEmitter *e = &c->e;
+    emit_writeback(c, dirty);
+    emit_charge(c, count);
+    if (!chain || c->blk->link_count >= VM_JIT_MAX_LINKS) {
+        emit_store_ips(c, ip, last_ip);
+        emit_return(c);
+        return;
+    }
+    VM_JitLink *link = &c->blk->links[c->blk->link_count];
+    const size_t spent = emit_jcc(e, X86_CC_LE);
+    while ((e->len + 1u) & 3u)
+        emit_u8(e, 0x90);
+    const size_t rel = emit_jmp(e);
+    c->link_rel[c->blk->link_count++] = rel;
+    bind(e, spent);
+    bind(e, rel);
+    emit_store_ips(c, ip, last_ip);
+    emit_rm(e, 1, X86_MOV_LOAD, X86_RAX, X86_RSP, FRAME_LINK);
+    emit_mov_ri64(e, X86_RCX, (uint64_t)(uintptr_t)link);
+    emit_rm(e, 1, X86_MOV_STORE, X86_RCX, X86_RAX, 0);
+    emit_return(c);
+}
+
+/*
+ * Leave the block at the guest ip held in eax, continuing directly into the
+ * target block when the ibtc has a valid translation for it.
+ */
+static void emit_exit_dynamic(JitCtx *c, vm_addr_t last_ip, uint32_t count) {
+    JitEmitter *e = &c->e;
+    emit_rr(e, X86_MOV_LOAD, X86_RAX, X86_RAX); /* zero-extend */
+    emit_writeback(c, c->dirty);
+    emit_rm(e, 1, X86_MOV_STORE, X86_RAX, X86_RBX, CPU_OFF(ip));
+    emit_mov_ri(e, X86_RCX, last_ip);
+    emit_rm(e, 1, X86_MOV_STORE, X86_RCX, X86_RBX, CPU_OFF(last_ip));
+    emit_charge(c, count);
+    const size_t spent = emit_jcc(e, X86_CC_LE);
+    emit_rr(e, X86_MOV_LOAD, X86_RCX, X86_RAX);
+    emit_shift_imm(e, X86_SH_SHR, X86_RCX, 3);
+    emit_alu_imm(e, X86_EXT_AND, X86_RCX, VM_JIT_IBTC_SIZE - 1);
+    emit_mov_ri64(e, X86_RDX, (uint64_t)(uintptr_t)c->jit->ibtc);
+    emit_u8(e, 0x48); /* mov rdx, [rdx + rcx * 8] */
+    emit_u8(e, 0x8B);
+    emit_u8(e, 0x14);
+    emit_u8(e, 0xCA);
+    emit_u8(e, 0x48); /* test rdx, rdx */
+    emit_u8(e, 0x85);
+    emit_u8(e, 0xD2);
+    const size_t miss1 = emit_jcc(e, X86_CC_E);
+    emit_rm(e, 0, X86_CMP, X86_RAX, X86_RDX, (int32_t)offsetof(VM_JitBlock, start));
+    const size_t miss2 = emit_jcc(e, X86_CC_NE);
+    emit_u8(e, 0x80); /* cmp byte [rdx + valid], 0 */
+    emit_mem(e, 7, X86_RDX, (int32_t)offsetof(VM_JitBlock, valid));
+    emit_u8(e, 0);
+    const size_t miss3 = emit_jcc(e, X86_CC_E);
+    emit_u8(e, 0xFF); /* jmp [rdx + chain] */
+    emit_mem(e, 4, X86_RDX, (int32_t)offsetof(VM_JitBlock, chain));
+    bind(e, spent);
+    bind(e, miss1);
+    bind(e, miss2);
+    bind(e, miss3);
+    emit_return(c);
+}
+
+/* Queue an out-of-line exit reached through the rel32 at `patch`. */
+static void add_exit(JitCtx *c, size_t patch, vm_addr_t ip, vm_addr_t last_ip, uint32_t count, int chain) {
+    if (c->exit_count >= VM_JIT_MAX_EXITS) {
+        c->e.overflow = 1;
+        return;
+    }
+    JitExit *x = &c->exits[c->exit_count++];
+    x->patch = patch;
+    x->ip = ip;
+    x->last_ip = last_ip;
+    x->count = count;
+    x->dirty = c->dirty;
+    x->chain = chain;
+}
+
+/* eax = guest address -> edx = value. */
+static void emit_read32(JitCtx *c, vm_addr_t ip) {
+    JitEmitter *e = &c->e;
+    emit_rr(e, X86_MOV_LOAD, X86_RCX, X86_RAX);
+    emit_shift_imm(e, X86_SH_SHR, X86_RCX, 12);
+    emit_test_map(e, X86_R13, X86_RCX, VM_JIT_PAGE_LOAD);
+    const size_t slow1 = emit_jcc(e, X86_CC_E);
+    emit_rr(e, X86_MOV_LOAD, X86_RCX, X86_RAX);
+    emit_alu_imm(e, X86_EXT_AND, X86_RCX, 0xFFF);
+    emit_alu_imm(e, X86_EXT_CMP, X86_RCX, 0xFFC);
+    const size_t slow2 = emit_jcc(e, X86_CC_A);
+    emit_rsib(e, X86_MOV_LOAD, X86_RDX, X86_R12, X86_RAX);
+    const size_t done = emit_jmp(e);
+
+    bind(e, slow1);
+    bind(e, slow2);
+    emit_sync_ip(c, ip);
+    emit_spill(c);
+    emit_rr(e, X86_MOV_LOAD, X86_RSI, X86_RAX);
+    emit_mov_ri64(e, X86_RDI, (uint64_t)(uintptr_t)c->vm);
+    emit_call_abs(e, (uint64_t)(uintptr_t)jit_helper_read32);
+    emit_rr(e, X86_MOV_LOAD, X86_RDX, X86_RAX);
+    emit_reload(c);
+    bind(e, done);
+}
+
+/* eax = guest address, edx = value. `index` is the store's position. */
+static void emit_write32(JitCtx *c, vm_addr_t ip, uint32_t index) {
+    JitEmitter *e = &c->e;
+    emit_rr(e, X86_MOV_LOAD, X86_RCX, X86_RAX);
+    emit_shift_imm(e, X86_SH_SHR, X86_RCX, 12);
+    emit_test_map(e, X86_R13, X86_RCX, VM_JIT_PAGE_STORE);
+    const size_t slow1 = emit_jcc(e, X86_CC_E);
+    emit_rr(e, X86_MOV_LOAD, X86_RCX, X86_RAX);
+    emit_alu_imm(e, X86_EXT_AND, X86_RCX, 0xFFF);
+    emit_alu_imm(e, X86_EXT_CMP, X86_RCX, 0xFFC);
+    const size_t slow2 = emit_jcc(e, X86_CC_A);
+    emit_rsib(e, X86_MOV_STORE, X86_RDX, X86_R12, X86_RAX);
+    const size_t done = emit_jmp(e);
+
+    bind(e, slow1);
+    bind(e, slow2);
+    emit_sync_ip(c, ip);
+    emit_spill(c);
+    emit_rr(e, X86_MOV_LOAD, X86_RCX, X86_RDX);
+    emit_rr(e, X86_MOV_LOAD, X86_RDX, X86_RAX);
+    emit_mov_ri64(e, X86_RSI, (uint64_t)(uintptr_t)c->blk);
+    emit_mov_ri64(e, X86_RDI, (uint64_t)(uintptr_t)c->vm);
+    emit_call_abs(e, (uint64_t)(uintptr_t)jit_helper_write32);
+    emit_reload(c);
+    emit_rr(e, X86_TEST, X86_RAX, X86_RAX);
+    add_exit(c, emit_jcc(e, X86_CC_NE), ip + 8u, ip, index + 1u, 0);
+    bind(e, done);
+}
+
+static void record_flags_kind(JitCtx *c, int kind) {
+    emit_mov_mem_imm8(&c->e, X86_RBX, CPU_OFF(flags_kind), (uint8_t)kind);
+}
+
+/*
+ * eax = a, ecx = b (or b_imm) -> eax = a +/- b, flag state recorded when
+ * `record` is set.
+ */
+static void emit_addsub(JitCtx *c, int is_sub, int b_is_imm, int32_t b_imm, int record) {
+    JitEmitter *e = &c->e;
+    if (record) {
+        emit_store_cpu32(c, CPU_OFF(flags_a), X86_RAX);
+        if (b_is_imm)
+            emit_mov_mem_imm32(e, X86_RBX, CPU_OFF(flags_b), (uint32_t)b_imm);
+        else
+            emit_store_cpu32(c, CPU_OFF(flags_b), X86_RCX);
+    }
+    if (b_is_imm)
+        emit_alu_imm(e, is_sub ? X86_EXT_SUB : X86_EXT_ADD, X86_RAX, b_imm);
+    else
+        emit_rr(e, is_sub ? X86_SUB : X86_ADD, X86_RAX, X86_RCX);
+    if (record) {
+        emit_store_cpu32(c, CPU_OFF(flags_res), X86_RAX);
+        record_flags_kind(c, is_sub ? VM_FLAGS_SUB : VM_FLAGS_ADD);
+    }
+    c->flags.kind = is_sub ? VM_FLAGS_SUB : VM_FLAGS_ADD;
+    c->flags.b_is_imm = b_is_imm;
+    c->flags.b_imm = b_imm;
+}
+
+/* `reg` holds a result that sets ZF/SF and clears CF/OF. */
+static void emit_logic_flags(JitCtx *c, int reg, int record) {
+    if (record) {
+        emit_store_cpu32(c, CPU_OFF(flags_res), reg);
+        record_flags_kind(c, VM_FLAGS_LOGIC);
+    }
+    c->flags.kind = VM_FLAGS_LOGIC;
+    c->flags.b_is_imm = 0;
+}
+
+static int guest_cc(uint8_t op) {
+    switch (op) {
+    case OP_JZ: case OP_RJZ: return X86_CC_E;
+    case OP_JNZ: case OP_RJNZ: return X86_CC_NE;
+    case OP_JG: return X86_CC_G;
+    case OP_JGE: return X86_CC_GE;
+    case OP_JL: return X86_CC_L;
+    case OP_JLE: return X86_CC_LE;
+    case OP_JC: return X86_CC_B;
+    default: return X86_CC_AE; /* OP_JNC */
+    }
+}
+
+/*
+ * Conditional branch: jump to a taken exit (queued) or fall through to the
+ * returned position with the condition false.
+ */
+static void emit_cond_branch(JitCtx *c, uint8_t op, vm_addr_t taken, vm_addr_t ip, uint32_t count) {
+    JitEmitter *e = &c->e;
+    const int cc = guest_cc(op);
+    const int is_signed = (cc == X86_CC_G || cc == X86_CC_GE || cc == X86_CC_L || cc == X86_CC_LE);
+    const JitFlags f = c->flags;
+    int native = (f.kind == VM_FLAGS_ADD || f.kind == VM_FLAGS_SUB || f.kind == VM_FLAGS_LOGIC);
+    int edge_check = 0;
+
+    /*
+     * The guest's OF differs from the host's for exactly one operand pair:
+     * 0 - INT_MIN for SUB and INT_MIN + INT_MIN for ADD. ZF and CF always
+     * agree, so only signed conditions need to look out for it.
+     */
+    if (native && is_signed && f.kind != VM_FLAGS_LOGIC) {
+        if (f.b_is_imm)
+            native = (f.b_imm != INT32_MIN);
+        else
+            edge_check = 1;
+    }
+
+    size_t to_generic[2] = {0, 0};
+    int generic_refs = 0;
+    size_t to_not_taken = 0;
+    int have_not_taken = 0;
+
+    if (native) {
+        if (edge_check) {
+            emit_alu_mem_imm(e, X86_EXT_CMP, X86_RBX, CPU_OFF(flags_b), INT32_MIN);
+            const size_t ok = emit_jcc(e, X86_CC_NE);
+            emit_alu_mem_imm(e, X86_EXT_CMP, X86_RBX, CPU_OFF(flags_a),
+                             f.kind == VM_FLAGS_SUB ? 0 : INT32_MIN);
+            to_generic[generic_refs++] = emit_jcc(e, X86_CC_E);
+            bind(e, ok);
+        }
+        if (f.kind == VM_FLAGS_LOGIC) {
+            emit_rm(e, 0, X86_MOV_LOAD, X86_RAX, X86_RBX, CPU_OFF(flags_res));
+            emit_rr(e, X86_TEST, X86_RAX, X86_RAX);
+        } else {
+            emit_rm(e, 0, X86_MOV_LOAD, X86_RAX, X86_RBX, CPU_OFF(flags_a));
+            emit_rm(e, 0, f.kind == VM_FLAGS_SUB ? X86_CMP : X86_ADD, X86_RAX, X86_RBX, CPU_OFF(flags_b));
+        }
+        add_exit(c, emit_jcc(e, cc), taken, ip, count, 1);
+        if (!generic_refs)
+            return;
+        to_not_taken = emit_jmp(e);
+        have_not_taken = 1;
+    }
+
+    for (int i = 0; i < generic_refs; i++)
+        bind(e, to_generic[i]);
+    emit_spill(c);
+    emit_mov_rr64(e, X86_RDI, X86_RBX);
+    emit_call_abs(e, (uint64_t)(uintptr_t)jit_helper_flags);
+    emit_reload(c);
+    if (is_signed) {
+        /* ecx = SF != OF (bit 4), plus ZF for G/LE */
+        emit_rr(e, X86_MOV_LOAD, X86_RCX, X86_RAX);
+        emit_shift_imm(e, X86_SH_SHR, X86_RCX, 1);
+        emit_rr(e, X86_XOR, X86_RCX, X86_RAX);
+        emit_alu_imm(e, X86_EXT_AND, X86_RCX, FLAG_SF);
+        if (cc == X86_CC_G || cc == X86_CC_LE) {
+            emit_alu_imm(e, X86_EXT_AND, X86_RAX, FLAG_ZF);
+            emit_rr(e, X86_OR, X86_RCX, X86_RAX);
+        }
+        emit_rr(e, X86_TEST, X86_RCX, X86_RCX);
+        add_exit(c, emit_jcc(e, (cc == X86_CC_L || cc == X86_CC_LE) ? X86_CC_NE : X86_CC_E), taken, ip, count, 1);
+    } else {
+        const int32_t bit = (cc == X86_CC_E || cc == X86_CC_NE) ? FLAG_ZF : FLAG_CF;
+        emit_alu_imm(e, X86_EXT_AND, X86_RAX, bit);
+        add_exit(c, emit_jcc(e, (cc == X86_CC_E || cc == X86_CC_B) ? X86_CC_NE : X86_CC_E), taken, ip, count, 1);
+    }
+    if (have_not_taken)
+        bind(e, to_not_taken);
+}
+
+static vm_addr_t rel_target(vm_addr_t ip, int32_t imm) {
+    return (vm_addr_t)((int64_t)ip + (int64_t)imm);
+}
+
+/* Translate one instruction; `record` says whether its flag state must be kept. */
+static void emit_inst(JitCtx *c, const JitInst *ji, uint32_t index, int record) {
+    JitEmitter *e = &c->e;
+    const VM_DecodedInst *in = &ji->in;
+    const vm_addr_t ip = ji->ip;
+    const uint32_t count = index + 1u;
+
+    switch (in->op) {
+    case OP_MOVI:
+        emit_mov_ri(e, X86_RAX, (uint32_t)in->imm);
+        emit_logic_flags(c, X86_RAX, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    case OP_MOV:
+        load_guest(c, X86_RAX, in->rs1);
+        emit_logic_flags(c, X86_RAX, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    case OP_CPUID:
+        emit_rm(e, 0, X86_MOV_LOAD, X86_RAX, X86_RBX, CPU_OFF(core_id));
+        emit_logic_flags(c, X86_RAX, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    case OP_ADD:
+    case OP_SUB:
+        load_guest(c, X86_RAX, in->rs1);
+        load_guest(c, X86_RCX, in->rs2);
+        emit_addsub(c, in->op == OP_SUB, 0, 0, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    case OP_ADDI:
+    case OP_SUBI:
+        load_guest(c, X86_RAX, in->rs1);
+        emit_addsub(c, in->op == OP_SUBI, 1, in->imm, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    case OP_INC:
+        load_guest(c, X86_RAX, in->rd);
+        emit_addsub(c, 0, 1, 1, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    case OP_CMP:
+        if (record) {
+            load_guest(c, X86_RAX, in->rd);
+            load_guest(c, X86_RCX, in->rs1);
+        }
+        if (record)
+            emit_addsub(c, 1, 0, 0, 1);
+        else
+            c->flags.kind = VM_FLAGS_SUB;
+        break;
+    case OP_CMPI:
+        if (record) {
+            load_guest(c, X86_RAX, in->rd);
+            emit_addsub(c, 1, 1, in->imm, 1);
+        } else {
+            c->flags.kind = VM_FLAGS_SUB;
+        }
+        break;
+    case OP_MUL:
+        load_guest(c, X86_RAX, in->rs1);
+        alu_guest(c, X86_IMUL, X86_RAX, in->rs2);
+        emit_logic_flags(c, X86_RAX, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+        load_guest(c, X86_RAX, in->rs1);
+        alu_guest(c, in->op == OP_AND ? X86_AND : (in->op == OP_OR ? X86_OR : X86_XOR), X86_RAX, in->rs2);
+        emit_logic_flags(c, X86_RAX, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    case OP_ANDI:
+    case OP_ORI:
+    case OP_XORI:
+        load_guest(c, X86_RAX, in->rs1);
+        emit_alu_imm(e, in->op == OP_ANDI ? X86_EXT_AND : (in->op == OP_ORI ? X86_EXT_OR : X86_EXT_XOR),
+                     X86_RAX, in->imm);
+        emit_logic_flags(c, X86_RAX, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    case OP_NOT:
+        load_guest(c, X86_RAX, in->rs1);
+        emit_not(e, X86_RAX);
+        emit_logic_flags(c, X86_RAX, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    case OP_SHL:
+    case OP_SHR:
+    case OP_ROL:
+    case OP_ROR: {
+        /* 32-bit host shifts and rotates mask the count to 5 bits, like the guest. */
+        const int ext = in->op == OP_SHL ? X86_SH_SHL
+                      : in->op == OP_SHR ? X86_SH_SHR
+                      : in->op == OP_ROL ? X86_SH_ROL
+                                         : X86_SH_ROR;
+        load_guest(c, X86_RCX, in->rs2);
+        load_guest(c, X86_RAX, in->rs1);
+        emit_shift_cl(e, ext, X86_RAX);
+        emit_logic_flags(c, X86_RAX, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    }
+    case OP_SHLI:
+    case OP_SHRI:
+    case OP_ROLI:
+    case OP_RORI: {
+        const int ext = in->op == OP_SHLI ? X86_SH_SHL
+                      : in->op == OP_SHRI ? X86_SH_SHR
+                      : in->op == OP_ROLI ? X86_SH_ROL
+                                          : X86_SH_ROR;
+        load_guest(c, X86_RAX, in->rs1);
+        emit_shift_imm(e, ext, X86_RAX, (uint8_t)((uint32_t)in->imm & 31u));
+        emit_logic_flags(c, X86_RAX, record);
+        store_guest(c, in->rd, X86_RAX);
+        break;
+    }
+    case OP_LOAD32:
+    case OP_LOADX32:
+        load_guest(c, X86_RAX, in->rs1);
+        if (in->op == OP_LOADX32)
+            alu_guest(c, X86_ADD, X86_RAX, in->rs2);
+        if (in->imm != 0)
+            emit_alu_imm(e, X86_EXT_ADD, X86_RAX, in->imm);
+        emit_read32(c, ip);
+        emit_logic_flags(c, X86_RDX, record);
+        store_guest(c, in->rd, X86_RDX);
+        break;
+    case OP_STORE32:
+    case OP_STOREX32:
+        load_guest(c, X86_RAX, in->rs1);
+        if (in->op == OP_STOREX32)
+            alu_guest(c, X86_ADD, X86_RAX, in->rs2);
+        if (in->imm != 0)
+            emit_alu_imm(e, X86_EXT_ADD, X86_RAX, in->imm);
+        load_guest(c, X86_RDX, in->rd);
+        emit_write32(c, ip, index);
+        break;
+    case OP_FENCE:
+        emit_u8(e, 0x0F); /* mfence */
+        emit_u8(e, 0xAE);
+        emit_u8(e, 0xF0);
+        break;
+    case OP_JMP:
+        emit_exit_static(c, c->dirty, (vm_addr_t)in->imm, ip, count, 1);
+        break;
+    case OP_RJMP:
+        emit_exit_static(c, c->dirty, rel_target(ip, in->imm), ip, count, 1);
+        break;
+    case OP_JZ: case OP_JNZ: case OP_JG: case OP_JGE: case OP_JL: case OP_JLE: case OP_JC: case OP_JNC:
+        emit_cond_branch(c, in->op, (vm_addr_t)in->imm, ip, count);
+        emit_exit_static(c, c->dirty, ip + 8u, ip, count, 1);
+        break;
+    case OP_RJZ:
+    case OP_RJNZ:
+        emit_cond_branch(c, in->op, rel_target(ip, in->imm), ip, count);
+        emit_exit_static(c, c->dirty, ip + 8u, ip, count, 1);
+        break;
+    case OP_CALL:
+    case OP_RCALL:
+        emit_sync_ip(c, ip);
+        emit_spill(c);
+        emit_mov_ri(e, X86_RDX, ip + 8u);
+        emit_mov_rr64(e, X86_RSI, X86_RBX);
+        emit_mov_ri64(e, X86_RDI, (uint64_t)(uintptr_t)c->vm);
+        emit_call_abs(e, (uint64_t)(uintptr_t)jit_helper_call_push);
+        emit_reload(c);
+        emit_exit_static(c, c->dirty,
+                         in->op == OP_CALL ? (vm_addr_t)in->imm : rel_target(ip, in->imm), ip, count, 1);
+        break;
+    case OP_CALLR:
+        emit_sync_ip(c, ip);
+        emit_spill(c);
+        emit_mov_ri(e, X86_RDX, ip + 8u);
+        emit_mov_rr64(e, X86_RSI, X86_RBX);
+        emit_mov_ri64(e, X86_RDI, (uint64_t)(uintptr_t)c->vm);
+        emit_call_abs(e, (uint64_t)(uintptr_t)jit_helper_call_push);
+        emit_reload(c);
+        load_guest(c, X86_RAX, in->rd);
+        emit_exit_dynamic(c, ip, count);
+        break;
+    case OP_RET:
+        emit_sync_ip(c, ip);
+        emit_spill(c);
+        emit_mov_rr64(e, X86_RSI, X86_RBX);
+        emit_mov_ri64(e, X86_RDI, (uint64_t)(uintptr_t)c->vm);
+        emit_call_abs(e, (uint64_t)(uintptr_t)jit_helper_ret_pop);
+        emit_reload(c);
+        emit_exit_dynamic(c, ip, count);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Pick host registers for the guest registers the block uses most. */
+static void allocate_registers(JitCtx *c, const JitInst *insts, uint32_t n) {
+    uint32_t uses[REG_COUNT] = {0};
+    for (uint32_t i = 0; i < n; i++) {
+        const uint32_t mask = jit_inst_regs(&insts[i].in);
+        for (int g = 0; g < REG_COUNT; g++) {
+            if (mask & (1u << g))
+                uses[g]++;
+        }
+    }
+    for (int g = 0; g < REG_COUNT; g++)
+        c->host[g] = -1;
+    for (size_t k = 0; k < sizeof(jit_reg_pool) / sizeof(jit_reg_pool[0]); k++) {
+        int best = -1;
+        for (int g = 0; g < REG_COUNT; g++) {
+            if (c->host[g] < 0 && uses[g] > 0 && (best < 0 || uses[g] > uses[best]))
+                best = g;
+        }
+        if (best < 0)
+            break;
+        c->host[best] = jit_reg_pool[k];
+        uses[best] = 0;
+    }
+}
+
+/* Copy the straight-line run starting at ip out of the decode cache. */
+static uint32_t gather_block(VM *vm, vm_addr_t ip, JitInst *insts) {
+    uint32_t n = 0;
+    const size_t first_page = (size_t)ip >> VM_DECODE_PAGE_SHIFT;
+    while (n < VM_JIT_MAX_BLOCK_INSTS) {
+        if ((size_t)ip + 8u > vm->memory_size)
+            break;
+        /* Keep every block within two pages so it fits the per-page lists. */
+        if (((size_t)(ip + 7u) >> VM_DECODE_PAGE_SHIFT) > first_page + 1u)
+            break;
+        const VM_DecodedInst *in = vm_decode_fill(vm, ip);
+        if (!in || !jit_op_supported(vm_decode_base_op(in->op)))
+            break;
+        insts[n].ip = ip;
+        insts[n].in = *in;
+        /* Translate superinstructions one part at a time. */
+        insts[n].in.op = vm_decode_base_op(in->op);
+        n++;
+        if (jit_op_ends_block(in->op))
+            break;
+        ip += 8u;
+    }
+    return n;
+}
+
+static inline size_t jit_hash(vm_addr_t ip) {
+    return (size_t)((ip >> 3) ^ (ip >> (3 + VM_JIT_TABLE_BITS)) ^ (ip << 2)) & (VM_JIT_TABLE_SIZE - 1u);
+}
+
+static int page_slot(const VM_JitBlock *b, size_t page) {
+    return (b->page_count > 1 && b->page[1] == page) ? 1 : 0;
+}
+
+/* Called with jit->lock held. */
+static VM_JitBlock *jit_compile(VM *vm, VM_Jit *jit, vm_addr_t ip) {
+    JitInst insts[VM_JIT_MAX_BLOCK_INSTS];
+    const uint32_t n = gather_block(vm, ip, insts);
+    if (n == 0)
+        return NULL;
+
+    VM_JitBlock *blk = calloc(1, sizeof(VM_JitBlock));
+    if (!blk)
+        return NULL;
+
+    JitCtx *c = calloc(1, sizeof(JitCtx));
+    uint8_t *buf = malloc(VM_JIT_MAX_BLOCK_CODE);
+    if (!c || !buf) {
+        free(buf);
+        free(c);
+        free(blk);
+        return NULL;
+    }
+    c->vm = vm;
+    c->jit = jit;
+    c->blk = blk;
+    c->e.buf = buf;
+    c->e.cap = VM_JIT_MAX_BLOCK_CODE;
+    c->flags.kind = -1;
+    allocate_registers(c, insts, n);
+
+    /*
+     * Flag state only has to be written by the last producer before each
+     * point the block can be left: its end and every store (whose slow path
+     * may exit when it overwrites this block).
+     */
+    uint8_t record[VM_JIT_MAX_BLOCK_INSTS];
+    int needed = 1;
+    for (uint32_t i = n; i-- > 0;) {
+        const uint8_t op = insts[i].in.op;
+        record[i] = 0;
+        if (jit_op_sets_flags(op)) {
+            record[i] = (uint8_t)needed;
+            needed = 0;
+        }
+        if (op == OP_STORE32 || op == OP_STOREX32)
+            needed = 1;
+    }
+
+    emit_prologue(c);
+    for (uint32_t i = 0; i < n; i++)
+        emit_inst(c, &insts[i], i, record[i]);
+    const JitInst *last = &insts[n - 1];
+    if (!jit_op_ends_block(last->in.op))
+        emit_exit_static(c, c->dirty, last->ip + 8u, last->ip, n, 1);
+    for (int i = 0; i < c->exit_count; i++) {
+        const JitExit *x = &c->exits[i];
+        bind(&c->e, x->patch);
+        emit_exit_static(c, x->dirty, x->ip, x->last_ip, x->count, x->chain);
+    }
+
+    const size_t len = c->e.len;
+    const int overflow = c->e.overflow;
+    const size_t chain_offset = c->chain_offset;
+    size_t link_rel[VM_JIT_MAX_LINKS];
+    memcpy(link_rel, c->link_rel, sizeof(link_rel));
+    free(c);
+    if (overflow || jit->code_used + len > VM_JIT_CODE_SIZE) {
+        if (!overflow)
+            atomic_store_explicit(&jit->full, true, memory_order_relaxed);
+        free(buf);
+        free(blk);
+        return NULL;
+    }
+    uint8_t *code = jit->code + jit->code_used;
+    memcpy(code, buf, len);
+    free(buf);
+    jit->code_used = (jit->code_used + len + 15u) & ~(size_t)15u;
+    __builtin___clear_cache((char *)code, (char *)code + len);
+
+    void *code_ptr = code;
+    memcpy(&blk->entry, &code_ptr, sizeof(blk->entry));
+    blk->chain = code + chain_offset;
+    for (int i = 0; i < blk->link_count; i++) {
+        VM_JitLink *l = &blk->links[i];
+        l->from = blk;
+        l->rel = code + link_rel[i];
+        memcpy(&l->unlinked_rel, l->rel, sizeof(l->unlinked_rel));
+    }
+    blk->start = ip;
+    blk->end = last->ip + 8u;
+    atomic_init(&blk->valid, true);
+    blk->page[0] = (size_t)blk->start >> VM_DECODE_PAGE_SHIFT;
+    blk->page_count = 1;
+    if (((size_t)(blk->end - 1u) >> VM_DECODE_PAGE_SHIFT) != blk->page[0]) {
+        blk->page[1] = blk->page[0] + 1u;
+        blk->page_count = 2;
+    }
+    for (int i = 0; i < blk->page_count; i++) {
+        const size_t p = blk->page[i];
+        blk->page_next[i] = atomic_load_explicit(&jit->page_blocks[p], memory_order_relaxed);
+        atomic_store_explicit(&jit->page_blocks[p], blk, memory_order_release);
+    }
+    blk->all_next = jit->all_blocks;
+    jit->all_blocks = blk;
+    atomic_store_explicit(&jit->table[jit_hash(ip)], blk, memory_order_release);
+    return blk;
+}
+
+static inline size_t ibtc_slot(vm_addr_t ip) {
+    return (size_t)(ip >> 3) & (VM_JIT_IBTC_SIZE - 1u);
+}
+
+static void set_rel(VM_JitLink *l, int32_t rel) {
+    /* 4-byte aligned, so blocks running on other cores see old or new. */
+    __atomic_store_n((int32_t *)(void *)l->rel, rel, __ATOMIC_RELEASE);
+}
+
+/* Point `l` straight at `to`. Called with jit->lock held. */
+static void jit_link(VM_JitLink *l, VM_JitBlock *to) {
+    if (l->target || !atomic_load_explicit(&l->from->valid, memory_order_relaxed) ||
+        !atomic_load_explicit(&to->valid, memory_order_relaxed))
+        return;
+    l->target = to;
+    l->in_next = to->incoming;
+    to->incoming = l;
+    set_rel(l, (int32_t)(to->chain - (l->rel + 4)));
+}
+
+/* Send every chained jump into `b` back through its exit path. Called with jit->lock held. */
+static void jit_unlink_incoming(VM_JitBlock *b) {
+    for (VM_JitLink *l = b->incoming; l; l = l->in_next) {
+        set_rel(l, l->unlinked_rel);
+        l->target = NULL;
+    }
+    b->incoming = NULL;
+}
+
+void vm_jit_init(VM *vm) {
+    const char *env = getenv("VM_JIT");
+    if (env && env[0] == '0')
+        return;
+
+    VM_Jit *jit = calloc(1, sizeof(VM_Jit));
+    if (!jit)
+        return;
+    jit->page_map = calloc(VM_JIT_MAP_PAGES, sizeof(*jit->page_map));
+    jit->page_count = vm->decode_page_count;
+    jit->page_blocks = calloc(jit->page_count ? jit->page_count : 1, sizeof(*jit->page_blocks));
+    void *code = mmap(NULL, VM_JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!jit->page_map || !jit->page_blocks || code == MAP_FAILED) {
+        if (code != MAP_FAILED)
+            munmap(code, VM_JIT_CODE_SIZE);
+        free(jit->page_blocks);
+        free(jit->page_map);
+        free(jit);
+        return;
+    }
+    jit->code = code;
+    pthread_mutex_init(&jit->lock, NULL);
+
+    /* Plain RAM pages (see vm->region_map) can skip vm_read32/vm_write32. */
+    for (size_t p = 0; p < VM_JIT_MAP_PAGES; p++) {
+        if (atomic_load_explicit(&vm->region_map[p], memory_order_relaxed) == VM_REGION_RAM)
+            atomic_init(&jit->page_map[p], VM_JIT_PAGE_LOAD | VM_JIT_PAGE_STORE);
+    }
+    vm->jit = jit;
+}
+
+static void jit_free_blocks(VM_Jit *jit) {
+    VM_JitBlock *b = jit->all_blocks;
+    while (b) {
+        VM_JitBlock *next = b->all_next;
+        free(b);
+        b = next;
+    }
+    jit->all_blocks = NULL;
+}
+
+void vm_jit_flush(VM *vm) {
+    VM_Jit *jit = vm->jit;
+    if (!jit)
+        return;
+    pthread_mutex_lock(&jit->lock);
+    for (size_t i = 0; i < VM_JIT_TABLE_SIZE; i++)
+        atomic_store_explicit(&jit->table[i], NULL, memory_order_relaxed);
+    for (size_t i = 0; i < VM_JIT_IBTC_SIZE; i++)
+        atomic_store_explicit(&jit->ibtc[i], NULL, memory_order_relaxed);
+    for (size_t p = 0; p < jit->page_count; p++)
+        atomic_store_explicit(&jit->page_blocks[p], NULL, memory_order_relaxed);
+    jit_free_blocks(jit);
+    jit->code_used = 0;
+    atomic_store_explicit(&jit->full, false, memory_order_relaxed);
+    pthread_mutex_unlock(&jit->lock);
+}
+
+void vm_jit_destroy(VM *vm) {
+    VM_Jit *jit = vm->jit;
+    if (!jit)
+        return;
+    jit_free_blocks(jit);
+    munmap(jit->code, VM_JIT_CODE_SIZE);
+    pthread_mutex_destroy(&jit->lock);
+    free(jit->page_blocks);
+    free(jit->page_map);
+    free(jit);
+    vm->jit = NULL;
+}
+
+uint32_t vm_jit_execute(VM *vm, VCPU *cpu, uint32_t budget) {
+    VM_Jit *jit = vm->jit;
+    uint32_t executed = 0;
+    VM_JitLink *pending = NULL;
+    if (!jit)
+        return 0;
+
+    while (executed < budget) {
+        const vm_addr_t ip = (vm_addr_t)cpu->ip;
+        const size_t slot = jit_hash(ip);
+        VM_JitBlock *blk = atomic_load_explicit(&jit->table[slot], memory_order_acquire);
+        if (!blk || blk->start != ip || !atomic_load_explicit(&blk->valid, memory_order_relaxed)) {
+            const uint16_t hits = (uint16_t)(atomic_load_explicit(&jit->hits[slot], memory_order_relaxed) + 1u);
+            if (hits < VM_JIT_HOT_THRESHOLD) {
+                atomic_store_explicit(&jit->hits[slot], hits, memory_order_relaxed);
+                break;
+            }
+            atomic_store_explicit(&jit->hits[slot], 0, memory_order_relaxed);
+            int filled = 0;
+            pthread_mutex_lock(&jit->lock);
+            blk = atomic_load_explicit(&jit->table[slot], memory_order_acquire);
+            if (!blk || blk->start != ip || !atomic_load_explicit(&blk->valid, memory_order_relaxed)) {
+                blk = NULL;
+                if (!atomic_load_explicit(&jit->full, memory_order_relaxed)) {
+                    blk = jit_compile(vm, jit, ip);
+                    filled = atomic_load_explicit(&jit->full, memory_order_relaxed);
+                }
+            }
+            pthread_mutex_unlock(&jit->lock);
+            /* Only this vCPU saw the buffer fill up, so only it flushes. */
+            if (filled)
+                vm_cpu_attention(cpu, VM_ATTN_JIT_FULL);
+            if (!blk)
+                break;
+        }
+        atomic_store_explicit(&jit->ibtc[ibtc_slot(ip)], blk, memory_order_release);
+        if (pending) {
+            pthread_mutex_lock(&jit->lock);
+            jit_link(pending, blk);
+            pthread_mutex_unlock(&jit->lock);
+            pending = NULL;
+        }
+        executed += blk->entry(cpu, budget - executed, &pending);
+        if (vm->halted || vm->panic)
+            break;
+    }
+    return executed;
+}
+
+void vm_jit_note_code_page(VM *vm, size_t page_index) {
+    VM_Jit *jit = vm->jit;
+    if (!jit)
+        return;
+    /* An instruction at the end of this page can reach into the next one. */
+    for (size_t p = page_index; p <= page_index + 1u && p < VM_JIT_MAP_PAGES; p++)
+        atomic_fetch_and_explicit(&jit->page_map[p], (uint8_t)~(VM_JIT_PAGE_STORE | VM_JIT_PAGE_STORE_PARKED),
+                                  memory_order_relaxed);
+}
+
+/* Swap one page_map bit for the other, unless a code page cleared both meanwhile. */
+static void jit_page_move_bit(VM *vm, size_t page_index, uint8_t from, uint8_t to) {
+    VM_Jit *jit = vm->jit;
+    if (!jit || page_index >= VM_JIT_MAP_PAGES)
+        return;
+    uint8_t bits = atomic_load_explicit(&jit->page_map[page_index], memory_order_relaxed);
+    while ((bits & from) &&
+           !atomic_compare_exchange_weak_explicit(&jit->page_map[page_index], &bits,
+                                                  (uint8_t)((bits & ~from) | to),
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void vm_jit_protect_page(VM *vm, size_t page_index) {
+    jit_page_move_bit(vm, page_index, VM_JIT_PAGE_STORE, VM_JIT_PAGE_STORE_PARKED);
+}
+
+void vm_jit_unprotect_page(VM *vm, size_t page_index) {
+    jit_page_move_bit(vm, page_index, VM_JIT_PAGE_STORE_PARKED, VM_JIT_PAGE_STORE);
+}
+
+void vm_jit_invalidate(VM *vm, vm_addr_t addr, size_t size) {
+    VM_Jit *jit = vm->jit;
+    if (!jit || size == 0 || jit->page_count == 0)
+        return;
+    const size_t first = (size_t)addr >> VM_DECODE_PAGE_SHIFT;
+    size_t last = ((size_t)addr + size - 1u) >> VM_DECODE_PAGE_SHIFT;
+    if (last >= jit->page_count)
+        last = jit->page_count - 1u;
+
+    int any = 0;
+    for (size_t p = first; p <= last; p++) {
+        if (atomic_load_explicit(&jit->page_blocks[p], memory_order_relaxed)) {
+            any = 1;
+            break;
+        }
+    }
+    if (!any)
+        return;
+
+    const uint64_t lo = addr;
+    const uint64_t hi = (uint64_t)addr + size;
+    pthread_mutex_lock(&jit->lock);
+    for (size_t p = first; p <= last; p++) {
+        VM_JitBlock *prev = NULL;
+        VM_JitBlock *b = atomic_load_explicit(&jit->page_blocks[p], memory_order_relaxed);
+        while (b) {
+            VM_JitBlock *next = b->page_next[page_slot(b, p)];
+            if (b->start < hi && lo < b->end && atomic_load_explicit(&b->valid, memory_order_relaxed)) {
+                atomic_store_explicit(&b->valid, false, memory_order_relaxed);
+                jit_unlink_incoming(b);
+                VM_JitBlock *expected = b;
+                atomic_compare_exchange_strong_explicit(&jit->table[jit_hash(b->start)],
+                                                        &expected,
+                                                        NULL,
+                                                        memory_order_acq_rel,
+                                                        memory_order_relaxed);
+                expected = b;
+                atomic_compare_exchange_strong_explicit(&jit->ibtc[ibtc_slot(b->start)],
+                                                        &expected,
+                                                        NULL,
+                                                        memory_order_acq_rel,
+                                                        memory_order_relaxed);
+            }
+            if (!atomic_load_explicit(&b->valid, memory_order_relaxed)) {
+                if (prev)
+                    prev->page_next[page_slot(prev, p)] = next;
+                else
+                    atomic_store_explicit(&jit->page_blocks[p], next, memory_order_relaxed);
+            } else {
+                prev = b;
+            }
+            b = next;
+        }
+    }
+    pthread_mutex_unlock(&jit->lock);
+}
+
+#endif // VM_JIT
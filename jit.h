@@ -0,0 +1,75 @@
+#ifndef VM_JIT_H
+#define VM_JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+ * Basic-block translator from guest code to x86-64, see jit.c.
+ *
+ * Only built when VM_JIT is defined (CMake option of the same name). Without
+ * it every entry point is a no-op and vm->jit stays NULL, so callers never
+ * need their own #ifdef.
+ */
+#ifdef VM_JIT
+
+void vm_jit_init(VM *vm);
+void vm_jit_destroy(VM *vm);
+
+/*
+ * Run translated blocks starting at cpu->ip for up to roughly `budget` guest
+ * instructions. Returns the number of guest instructions retired; 0 means
+ * there is no translation for cpu->ip (yet) and the interpreter should run.
+ */
+uint32_t vm_jit_execute(VM *vm, VCPU *cpu, uint32_t budget);
+
+/* A decode page was created for `page_index`: stores there must be checked. */
+void vm_jit_note_code_page(VM *vm, size_t page_index);
+
+/* Checkpoint write tracking (see memory.c): route stores to a page through vm_write32, or stop doing so. */
+void vm_jit_protect_page(VM *vm, size_t page_index);
+void vm_jit_unprotect_page(VM *vm, size_t page_index);
+
+/* Drop translations overlapping [addr, addr + size). */
+void vm_jit_invalidate(VM *vm, vm_addr_t addr, size_t size);
+
+/*
+ * Drop every translation and start the code buffer over. No vCPU may be
+ * inside translated code: call it between batches with the others parked.
+ */
+void vm_jit_flush(VM *vm);
+
+#else
+
+static inline void vm_jit_init(VM *vm) { (void)vm; }
+static inline void vm_jit_destroy(VM *vm) { (void)vm; }
+static inline uint32_t vm_jit_execute(VM *vm, VCPU *cpu, uint32_t budget) {
+    (void)vm;
+    (void)cpu;
+    (void)budget;
+    return 0;
+}
+static inline void vm_jit_note_code_page(VM *vm, size_t page_index) {
+    (void)vm;
+    (void)page_index;
+}
+static inline void vm_jit_protect_page(VM *vm, size_t page_index) {
+    (void)vm;
+    (void)page_index;
+}
+static inline void vm_jit_unprotect_page(VM *vm, size_t page_index) {
+    (void)vm;
+    (void)page_index;
+}
+static inline void vm_jit_invalidate(VM *vm, vm_addr_t addr, size_t size) {
+    (void)vm;
+    (void)addr;
+    (void)size;
+}
+static inline void vm_jit_flush(VM *vm) { (void)vm; }
+
+#endif
+
+#endif // VM_JIT_H
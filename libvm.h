@@ -0,0 +1,81 @@
+#ifndef VM_LIBVM_H
+#define VM_LIBVM_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Embedding interface of the libvm library target.
+ *
+ * Every VM is self-contained: devices, display, serial output and panics
+ * all hang off the VM, so one process can create, run and destroy any
+ * number of them side by side. A VM is driven either by vm_run_headless(),
+ * which gives each vCPU its own thread, or by repeated vm_step() calls on
+ * a thread of the embedder's choosing; never both at once.
+ */
+typedef struct VM VM;
+
+/* RAM has to cover the legacy MMIO windows, and RAM plus the framebuffer after it must fit in 32 bits. */
+#define VM_MEM_MIN ((size_t)16 << 20)
+#define VM_MEM_MAX ((size_t)4080 << 20)
+
+/* How guest RAM is backed (see vm_ram_map). */
+enum {
+    VM_RAM_BACKING_DEFAULT = 0,  /* 4 KiB pages */
+    VM_RAM_BACKING_THP,          /* MADV_HUGEPAGE */
+    VM_RAM_BACKING_HUGETLB,      /* MAP_HUGETLB, falls back to THP */
+};
+
+/* How the block queue device reaches the disk image. */
+enum {
+    VM_DISK_IO_THREADS = 0, /* a small pool of blocking worker threads */
+    VM_DISK_IO_URING,       /* one io_uring per VM; falls back to threads where unavailable */
+};
+
+typedef struct {
+    const char *binary;       /* program image, see loadbin.h */
+    const char *snapshot;     /* restore this instead of booting `binary`; see snapshot.h */
+    const char *disk_path;    /* raw or overlay image; NULL: ./disk.img, created if missing */
+    size_t mem_size;          /* 0: 64 MiB; ignored for snapshots */
+    int smp_cores;            /* 0: 1; ignored for snapshots */
+    int ram_backing;          /* VM_RAM_BACKING_* */
+    int disk_io;              /* VM_DISK_IO_* */
+    /* Guest serial output, one byte per call on the vCPU that wrote it. NULL: stdout. */
+    void (*serial_out)(void *opaque, uint8_t c);
+    void *serial_opaque;
+} VM_Config;
+
+enum {
+    VM_STATE_RUNNING = 0,
+    VM_STATE_HALTED,   /* HLT, VM_CONTROL_CMD_EXIT or vm_halt(); see vm_exit_code() */
+    VM_STATE_PANICKED, /* see vm_panic_message() */
+};
+
+/* Boot (or restore) a VM as `config` says. Returns NULL on failure. */
+VM *vm_open(const VM_Config *config);
+
+/*
+ * Run every vCPU on its own thread, without a display, until the VM stops
+ * or `timeout_ms` passes (then it is halted). Returns 0 if it panicked.
+ */
+int vm_run_headless(VM *vm, uint64_t timeout_ms);
+
+/*
+ * Run up to `budget` guest instructions on the calling thread, taking
+ * turns between the started vCPUs a dispatch batch at a time. Returns how
+ * many ran; 0 once the VM has stopped. Any thread may step a VM, one at a
+ * time. Device threads (disk, timer) keep running between calls.
+ */
+uint32_t vm_step(VM *vm, uint32_t budget);
+
+/* Stop the VM at the next batch boundary; safe from any thread. */
+void vm_stop(VM *vm);
+
+int vm_state(const VM *vm);
+int vm_exit_code(const VM *vm);
+const char *vm_panic_message(const VM *vm);
+/* Guest instructions retired so far, summed over all vCPUs. */
+uint64_t vm_cycles(const VM *vm);
+
+void vm_destroy(VM *vm);
+
+#endif // VM_LIBVM_H
@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "debug.h"
+
+/* The `vm` executable: command line front end over libvm. */
+
+static void print_usage(const char *prog) {
+    printf("Usage: %s [--bin <file>] [--disk <file>] [--smp <cores>] [--mem <size>[K|M|G]] [--hugepages <thp|hugetlb>]\n"
+           "       [--snapshot-save <file>] [--checkpoint-interval <ms>] [--snapshot-load <file>]\n"
+           "       [--clone-dir <dir>] [--disk-io <threads|uring>] [--selftest]\n",
+           prog);
+    printf("Defaults: --bin boot.bin --disk disk.img --smp 1 --mem 64M\n");
+    printf("--mem other than 64M needs a guest built for that size; the bundled kernel assumes 64M.\n");
+    printf("--disk takes a raw image or an overlay made with vm-disk.\n");
+    printf("--snapshot-load restores RAM size and core count from the snapshot; --bin, --smp and --mem are ignored.\n");
+    printf("--checkpoint-interval writes a delta of the pages written since the last one to <file>.1, <file>.2, ...\n");
+    printf("--disk-io picks how the block queue device reaches the disk image (default: threads).\n");
+    printf("--clone-dir is where clones forked by the guest keep their disk overlay and serial log (default: .).\n");
+}
+
+static int parse_positive_int(const char *s, int *out) {
+    char *end = NULL;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v < 1 || v > 64)
+        return 0;
+    *out = (int)v;
+    return 1;
+}
+
+/* Bytes with an optional binary K/M/G suffix, a whole number of MiB in [VM_MEM_MIN, VM_MEM_MAX]. */
+static int parse_mem_size(const char *s, size_t *out) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno != 0 || end == s || *s == '-')
+        return 0;
+    unsigned int shift = 0;
+    if (*end == 'K' || *end == 'k')
+        shift = 10;
+    else if (*end == 'M' || *end == 'm')
+        shift = 20;
+    else if (*end == 'G' || *end == 'g')
+        shift = 30;
+    if (shift != 0)
+        end++;
+    if (*end != '\0' || v > (VM_MEM_MAX >> shift))
+        return 0;
+    v <<= shift;
+    if (v < VM_MEM_MIN || (v & (((size_t)1 << 20) - 1)) != 0)
+        return 0;
+    *out = (size_t)v;
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    VM_Config config = {0};
+    config.binary = "boot.bin";
+    config.smp_cores = 1;
+    const char *snapshot_save = NULL;
+    uint32_t checkpoint_interval_ms = 0;
+    const char *clone_dir = NULL;
+    int selftest = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bin") == 0) {
+            if (i + 1 >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            config.binary = argv[++i];
+        } else if (strcmp(argv[i], "--disk") == 0) {
+            if (i + 1 >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            config.disk_path = argv[++i];
+        } else if (strcmp(argv[i], "--smp") == 0) {
+            if (i + 1 >= argc || !parse_positive_int(argv[i + 1], &config.smp_cores)) {
+                printf("Invalid --smp value. Expected integer in [1, 64].\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--mem") == 0) {
+            if (i + 1 >= argc || !parse_mem_size(argv[i + 1], &config.mem_size)) {
+                printf("Invalid --mem value. Expected a multiple of 1M in [16M, 4080M].\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--snapshot-save") == 0) {
+            if (i + 1 >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            snapshot_save = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-interval") == 0) {
+            char *end = NULL;
+            const unsigned long ms = i + 1 < argc ? strtoul(argv[i + 1], &end, 10) : 0;
+            if (i + 1 >= argc || end == argv[i + 1] || *end != '\0' || ms < 1 || ms > 86400000ul) {
+                printf("Invalid --checkpoint-interval value. Expected milliseconds in [1, 86400000].\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            checkpoint_interval_ms = (uint32_t)ms;
+            i++;
+        } else if (strcmp(argv[i], "--clone-dir") == 0) {
+            if (i + 1 >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            clone_dir = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot-load") == 0) {
+            if (i + 1 >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            config.snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--hugepages") == 0) {
+            if (i + 1 < argc && strcmp(argv[i + 1], "thp") == 0) {
+                config.ram_backing = VM_RAM_BACKING_THP;
+            } else if (i + 1 < argc && strcmp(argv[i + 1], "hugetlb") == 0) {
+                config.ram_backing = VM_RAM_BACKING_HUGETLB;
+            } else {
+                printf("Invalid --hugepages value. Expected thp or hugetlb.\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--disk-io") == 0) {
+            if (i + 1 < argc && strcmp(argv[i + 1], "threads") == 0) {
+                config.disk_io = VM_DISK_IO_THREADS;
+            } else if (i + 1 < argc && strcmp(argv[i + 1], "uring") == 0) {
+                config.disk_io = VM_DISK_IO_URING;
+            } else {
+                printf("Invalid --disk-io value. Expected threads or uring.\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (strcmp(argv[i], "--selftest") == 0) {
+            selftest = 1;
+        } else {
+            printf("Unknown argument: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (selftest) {
+        return vm_selftest();
+    }
+    if (checkpoint_interval_ms && !snapshot_save) {
+        printf("--checkpoint-interval needs --snapshot-save.\n");
+        return 1;
+    }
+
+    VM *vm = vm_open(&config);
+    if (!vm)
+        return 1;
+    vm->snapshot_path = snapshot_save;
+    vm->checkpoint_interval_ms = checkpoint_interval_ms;
+    vm->clone_dir = clone_dir;
+    if (vm->smp_cores > 1) {
+        printf("SMP mode enabled: %d cores (per-core architectural state, shared memory).\n", vm->smp_cores);
+    }
+    printf("Loaded VM. \n Call Stack size: %d\n Data Stack size: %d \n Memory Size: %zu\n Memory "
+           "Head: %p\n",
+           CALL_STACK_SIZE,
+           DATA_STACK_SIZE,
+           vm->memory_size,
+           (void *) vm->memory);
+    vm_run(vm);
+#ifdef DBEUG
+    vm_dump(vm, 1024);
+#endif
+
+    printf("Execution complete in %lu cycles.\n",
+           (unsigned long)vm_cycles(vm));
+    vm_debug_print_stats(vm);
+    int exit_code = vm->panic ? 1 : vm->exit_code;
+    if (vm_reap_clones(vm) > 0 && exit_code == 0)
+        exit_code = 1;
+    vm_destroy(vm);
+    return exit_code;
+}
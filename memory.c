@@ -1,10 +1,19 @@
 //
 // Created by Max Wang on 2026/1/3.
 //
+/* MAP_ANONYMOUS and MADV_HUGEPAGE, see jit.c. */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include "memory.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
+#include "decode.h"
+#include "jit.h"
 #include "mmio.h"
 #include "panic.h"
 #include "vm.h"
@@ -13,17 +22,161 @@ static inline int in_ram(VM *vm, vm_addr_t addr, size_t size) {
     return addr + size <= vm->memory_size;
 }
 
+static inline uint8_t region_of(const VM *vm, vm_addr_t addr) {
+    return atomic_load_explicit(&vm->region_map[addr >> VM_REGION_PAGE_SHIFT], memory_order_relaxed);
+}
+
+static inline int in_one_page(vm_addr_t addr, uint32_t size) {
+    return (addr & (VM_REGION_PAGE_SIZE - 1u)) <= VM_REGION_PAGE_SIZE - size;
+}
+
+/* `size` bytes at addr are plain RAM within one page: no MMIO, no bounds check needed. */
+static inline int ram_fast(const VM *vm, vm_addr_t addr, uint32_t size) {
+    return (region_of(vm, addr) & ~VM_REGION_WRITE_PROTECT) == VM_REGION_RAM && in_one_page(addr, size);
+}
+
+/* As ram_fast, and the page is not waiting for its first store since the last checkpoint. */
+static inline int ram_fast_store(const VM *vm, vm_addr_t addr, uint32_t size) {
+    return region_of(vm, addr) == VM_REGION_RAM && in_one_page(addr, size);
+}
+
+/*
+ * Every RAM store that does not pass ram_fast_store ends up here: drop
+ * VM_REGION_WRITE_PROTECT from the pages it touched so the next checkpoint
+ * saves them, then let the decode cache see the write.
+ */
+static inline void ram_note_write(VM *vm, vm_addr_t addr, size_t size) {
+    const size_t first = addr >> VM_REGION_PAGE_SHIFT;
+    const size_t last = ((size_t)addr + size - 1u) >> VM_REGION_PAGE_SHIFT;
+    for (size_t p = first; p <= last && p < VM_REGION_PAGES; p++) {
+        if (atomic_load_explicit(&vm->region_map[p], memory_order_relaxed) & VM_REGION_WRITE_PROTECT) {
+            atomic_fetch_and_explicit(&vm->region_map[p], (uint8_t)~VM_REGION_WRITE_PROTECT,
+                                      memory_order_relaxed);
+            vm_jit_unprotect_page(vm, p);
+        }
+    }
+    vm_decode_note_write(vm, addr, size);
+}
+
+/* Guest memory is little-endian; memcpy compiles to a single host load/store. */
+static inline uint32_t load_le32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t load_le64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline void store_le32(uint8_t *p, uint32_t v) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void store_le64(uint8_t *p, uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+int vm_region_map_init(VM *vm) {
+    vm->region_map = calloc(VM_REGION_PAGES, sizeof(*vm->region_map));
+    if (!vm->region_map)
+        return 0;
+    const size_t ram_pages = vm->memory_size >> VM_REGION_PAGE_SHIFT;
+    for (size_t p = 0; p < ram_pages && p < VM_REGION_PAGES; p++)
+        atomic_init(&vm->region_map[p], VM_REGION_RAM);
+    for (int i = 0; i < vm->mmio_count; i++) {
+        const MMIO_Device *dev = &vm->mmio_table[i];
+        for (uint64_t p = dev->start >> VM_REGION_PAGE_SHIFT; p <= (dev->end >> VM_REGION_PAGE_SHIFT); p++)
+            atomic_init(&vm->region_map[p], VM_REGION_MMIO);
+    }
+    return 1;
+}
+
+void vm_region_map_destroy(VM *vm) {
+    free(vm->region_map);
+    vm->region_map = NULL;
+}
+
+/*
+ * Pages that are RAM only in part (an MMIO device sharing the page) are
+ * tracked too: their RAM bytes are written through the checked paths,
+ * which all end in ram_note_write.
+ */
+void vm_ram_protect_page(VM *vm, size_t page) {
+    atomic_fetch_or_explicit(&vm->region_map[page], VM_REGION_WRITE_PROTECT, memory_order_relaxed);
+    vm_jit_protect_page(vm, page);
+}
+
+int vm_ram_page_written(const VM *vm, size_t page) {
+    return !(atomic_load_explicit(&vm->region_map[page], memory_order_relaxed) & VM_REGION_WRITE_PROTECT);
+}
+
+void vm_ram_note_write(VM *vm, vm_addr_t addr, size_t size) {
+    if (size > 0)
+        ram_note_write(vm, addr, size);
+}
+
+#define VM_HUGE_PAGE_SIZE ((size_t)2u << 20)
+
+/*
+ * Guest RAM is an anonymous private mapping: the kernel hands out zeroed
+ * pages on first touch, so RAM the guest never uses costs nothing.
+ */
+uint8_t *vm_ram_map(size_t size, int backing, size_t *mapped_size) {
+    const int prot = PROT_READ | PROT_WRITE;
+#ifdef MAP_HUGETLB
+    if (backing == VM_RAM_BACKING_HUGETLB) {
+        /* No MAP_NORESERVE: an empty hugetlbfs pool fails here rather than SIGBUS on first touch. */
+        const size_t len = (size + VM_HUGE_PAGE_SIZE - 1) & ~(VM_HUGE_PAGE_SIZE - 1);
+        void *p = mmap(NULL, len, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *mapped_size = len;
+            return p;
+        }
+        printf("hugetlbfs pages unavailable, using transparent huge pages\n");
+    }
+#endif
+    void *p = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (backing != VM_RAM_BACKING_DEFAULT)
+        (void)madvise(p, size, MADV_HUGEPAGE);
+#endif
+    *mapped_size = size;
+    return p;
+}
+
+void vm_ram_unmap(uint8_t *memory, size_t mapped_size) {
+    if (memory)
+        munmap(memory, mapped_size);
+}
+
 static inline _Atomic uint32_t *atomic32_ptr_or_panic(VM *vm, vm_addr_t addr, const char *op_name) {
     if ((addr % _Alignof(_Atomic uint32_t)) != 0) {
-        panic(panic_format("%s unaligned address: 0x%08x", op_name, addr), vm);
+        panicf(vm, "%s unaligned address: 0x%08x", op_name, addr);
         return NULL;
     }
     if (!in_ram(vm, addr, sizeof(uint32_t))) {
-        panic(panic_format("%s out of bounds: 0x%08x", op_name, addr), vm);
+        panicf(vm, "%s out of bounds: 0x%08x", op_name, addr);
         return NULL;
     }
     if (find_mmio(vm, addr) != NULL) {
-        panic(panic_format("%s does not support MMIO addr: 0x%08x", op_name, addr), vm);
+        panicf(vm, "%s does not support MMIO addr: 0x%08x", op_name, addr);
         return NULL;
     }
     return (_Atomic uint32_t *)(void *)(&vm->memory[addr]);
@@ -45,22 +198,19 @@ static inline int fb_byte_index(VM *vm, vm_addr_t addr, size_t *out_index) {
 #ifdef VM_MEMCHECK
 static inline void memcheck_align(VM *vm, vm_addr_t addr, size_t align, const char *op) {
     if ((addr % align) != 0) {
-        panic(panic_format("%s unaligned address: 0x%08x", op, addr), vm);
+        panicf(vm, "%s unaligned address: 0x%08x", op, addr);
     }
 }
 #endif
 
 uint8_t vm_read8(VM *vm, vm_addr_t addr) {
+    if (ram_fast(vm, addr, 1))
+        return vm->memory[addr];
     size_t fb_index = 0;
-    if (fb_byte_index(vm, addr, &fb_index)) {
-        const size_t row = vm_fb_row_from_byte_index(fb_index);
-        vm_fb_row_lock(vm, row);
-        uint8_t v = ((uint8_t *) vm->fb)[fb_index];
-        vm_fb_row_unlock(vm, row);
-        return v;
-    }
+    if (fb_byte_index(vm, addr, &fb_index))
+        return ((uint8_t *) vm->fb)[fb_index];
     if (!in_ram(vm, addr, 1)) {
-        panic(panic_format("READ8 out of bounds: 0x%08x", addr), vm);
+        panicf(vm, "READ8 out of bounds: 0x%08x", addr);
         return 0;
     }
     return vm->memory[addr];
@@ -70,36 +220,26 @@ uint32_t vm_read32(VM *vm, vm_addr_t addr) {
 #ifdef VM_MEMCHECK
     memcheck_align(vm, addr, 4, "READ32");
 #endif
+    if (ram_fast(vm, addr, 4))
+        return load_le32(&vm->memory[addr]);
     MMIO_Device *dev = find_mmio(vm, addr);
-    if (dev) {
-        size_t fb_index = 0;
-        if (fb_byte_index(vm, addr, &fb_index)) {
-            return vm_mmio_read32(vm, addr);
-        }
-        // MMIO reads must be synchronized with device state.
-        vm_shared_lock(vm);
-        uint32_t v = vm_mmio_read32(vm, addr);
-        vm_shared_unlock(vm);
-        return v;
-    }
+    if (dev)
+        return vm_mmio_read32(vm, dev, addr);
 
     if (!in_ram(vm, addr, 4)) {
-        panic(panic_format("READ32 out of bounds: 0x%08x", addr), vm);
+        panicf(vm, "READ32 out of bounds: 0x%08x", addr);
         return 0;
     }
 
-    uint32_t v = 0;
-    v |= (uint32_t)vm->memory[addr + 0] << 0;
-    v |= (uint32_t)vm->memory[addr + 1] << 8;
-    v |= (uint32_t)vm->memory[addr + 2] << 16;
-    v |= (uint32_t)vm->memory[addr + 3] << 24;
-    return v;
+    return load_le32(&vm->memory[addr]);
 }
 
 uint64_t vm_read64(VM *vm, vm_addr_t addr) {
 #ifdef VM_MEMCHECK
     memcheck_align(vm, addr, 8, "READ64");
 #endif
+    if (ram_fast(vm, addr, 8))
+        return load_le64(&vm->memory[addr]);
     uint64_t lo = vm_read32(vm, addr);
     uint64_t hi = vm_read32(vm, addr + 4);
     return lo | (hi << 32);
@@ -119,6 +259,7 @@ void vm_atomic_store32_release(VM *vm, vm_addr_t addr, uint32_t value) {
         return;
     }
     atomic_store_explicit(ptr, value, memory_order_release);
+    ram_note_write(vm, addr, sizeof(uint32_t));
 }
 
 uint32_t vm_atomic_exchange32_seqcst(VM *vm, vm_addr_t addr, uint32_t value) {
@@ -126,7 +267,9 @@ uint32_t vm_atomic_exchange32_seqcst(VM *vm, vm_addr_t addr, uint32_t value) {
     if (!ptr) {
         return 0;
     }
-    return atomic_exchange_explicit(ptr, value, memory_order_seq_cst);
+    const uint32_t old = atomic_exchange_explicit(ptr, value, memory_order_seq_cst);
+    ram_note_write(vm, addr, sizeof(uint32_t));
+    return old;
 }
 
 uint32_t vm_atomic_fetch_add32_seqcst(VM *vm, vm_addr_t addr, uint32_t value) {
@@ -134,7 +277,9 @@ uint32_t vm_atomic_fetch_add32_seqcst(VM *vm, vm_addr_t addr, uint32_t value) {
     if (!ptr) {
         return 0;
     }
-    return atomic_fetch_add_explicit(ptr, value, memory_order_seq_cst);
+    const uint32_t old = atomic_fetch_add_explicit(ptr, value, memory_order_seq_cst);
+    ram_note_write(vm, addr, sizeof(uint32_t));
+    return old;
 }
 
 uint32_t vm_atomic_compare_exchange32_seqcst(VM *vm,
@@ -158,52 +303,55 @@ uint32_t vm_atomic_compare_exchange32_seqcst(VM *vm,
     if (success) {
         *success = ok ? 1 : 0;
     }
+    if (ok) {
+        ram_note_write(vm, addr, sizeof(uint32_t));
+    }
     return observed;
 }
 
 void vm_write8(VM *vm, vm_addr_t addr, uint8_t value) {
+    if (ram_fast_store(vm, addr, 1)) {
+        vm->memory[addr] = value;
+        vm_decode_note_write(vm, addr, 1);
+        return;
+    }
     size_t fb_index = 0;
     if (fb_byte_index(vm, addr, &fb_index)) {
-        const size_t row = vm_fb_row_from_byte_index(fb_index);
-        vm_fb_row_lock(vm, row);
         ((uint8_t *) vm->fb)[fb_index] = value;
-        vm_fb_row_unlock(vm, row);
+        vm_fb_mark_dirty(vm, vm_fb_row_from_byte_index(fb_index));
         return;
     }
 
     if (!in_ram(vm, addr, 1)) {
-        panic(panic_format("WRITE8 out of bounds: 0x%08x", addr), vm);
+        panicf(vm, "WRITE8 out of bounds: 0x%08x", addr);
         return;
     }
 
     vm->memory[addr] = value;
+    ram_note_write(vm, addr, 1);
 }
 
 void vm_write32(VM *vm, vm_addr_t addr, uint32_t value) {
 #ifdef VM_MEMCHECK
     memcheck_align(vm, addr, 4, "WRITE32");
 #endif
+    if (ram_fast_store(vm, addr, 4)) {
+        store_le32(&vm->memory[addr], value);
+        vm_decode_note_write(vm, addr, 4);
+        return;
+    }
     MMIO_Device *dev = find_mmio(vm, addr);
-    if (dev && dev->write32) {
-        size_t fb_index = 0;
-        if (fb_byte_index(vm, addr, &fb_index)) {
-            dev->write32(vm, addr, value);
-            return;
-        }
-        vm_shared_lock(vm);
-        dev->write32(vm, addr, value);
-        vm_shared_unlock(vm);
+    if (dev) {
+        vm_mmio_write32(vm, dev, addr, value);
         return;
     }
     if (!in_ram(vm, addr, 4)) {
-        panic(panic_format("WRITE32 out of bounds: 0x%08x", addr), vm);
+        panicf(vm, "WRITE32 out of bounds: 0x%08x", addr);
         return;
     }
 
-    vm->memory[addr + 0] = (uint8_t)((value >> 0) & 0xFF);
-    vm->memory[addr + 1] = (uint8_t)((value >> 8) & 0xFF);
-    vm->memory[addr + 2] = (uint8_t)((value >> 16) & 0xFF);
-    vm->memory[addr + 3] = (uint8_t)((value >> 24) & 0xFF);
+    store_le32(&vm->memory[addr], value);
+    ram_note_write(vm, addr, 4);
 }
 
 void vm_write64(VM *vm, vm_addr_t addr, uint64_t value) {
@@ -211,15 +359,110 @@ void vm_write64(VM *vm, vm_addr_t addr, uint64_t value) {
     memcheck_align(vm, addr, 8, "WRITE64");
 #endif
     if (!in_ram(vm, addr, 8)) {
-        panic(panic_format("WRITE64 out of bounds: 0x%08x", addr), vm);
+        panicf(vm, "WRITE64 out of bounds: 0x%08x", addr);
+        return;
+    }
+    store_le64(&vm->memory[addr], value);
+    ram_note_write(vm, addr, 8);
+}
+
+/*
+ * Bulk byte operations behind OP_MEMSET/OP_MEMCPY. The guest range is walked
+ * in spans that stay inside one backing store (RAM, or one framebuffer row
+ * through either window), so each span is a single host memset/memcpy and
+ * at most one dirty-row update. The result, including overlapping copies and where an out-of-range access
+ * panics, matches a byte loop over vm_read8/vm_write8.
+ */
+typedef struct {
+    uint8_t *ptr;
+    size_t len;
+    size_t fb_row; /* SIZE_MAX for RAM */
+} ByteSpan;
+
+/* Returns 0 when addr is neither RAM nor framebuffer. */
+static int byte_span(VM *vm, vm_addr_t addr, ByteSpan *span) {
+    size_t fb_index = 0;
+    if (fb_byte_index(vm, addr, &fb_index)) {
+        const size_t row_bytes = (size_t)FB_WIDTH * FB_BPP;
+        span->ptr = (uint8_t *)vm->fb + fb_index;
+        span->len = row_bytes - fb_index % row_bytes;
+        span->fb_row = vm_fb_row_from_byte_index(fb_index);
+    } else if (in_ram(vm, addr, 1)) {
+        size_t end = vm->memory_size;
+        if (addr < FB_LEGACY_BASE && end > FB_LEGACY_BASE)
+            end = FB_LEGACY_BASE;
+        span->ptr = &vm->memory[addr];
+        span->len = end - addr;
+        span->fb_row = SIZE_MAX;
+    } else {
+        return 0;
+    }
+    /* Guest addresses wrap at 4 GiB like the byte loop did. */
+    const uint64_t to_wrap = (uint64_t)UINT32_MAX + 1u - addr;
+    if (span->len > to_wrap)
+        span->len = (size_t)to_wrap;
+    return 1;
+}
+
+/* memmove, except that a destination overlapping the tail of the source repeats it like a forward byte copy. */
+static void copy_forward(uint8_t *dst, const uint8_t *src, size_t n) {
+    const uintptr_t d = (uintptr_t)dst;
+    const uintptr_t s = (uintptr_t)src;
+    if (d <= s || d >= s + n) {
+        memmove(dst, src, n);
         return;
     }
-    vm->memory[addr + 0] = (uint8_t)((value >> 0) & 0xFF);
-    vm->memory[addr + 1] = (uint8_t)((value >> 8) & 0xFF);
-    vm->memory[addr + 2] = (uint8_t)((value >> 16) & 0xFF);
-    vm->memory[addr + 3] = (uint8_t)((value >> 24) & 0xFF);
-    vm->memory[addr + 4] = (uint8_t)((value >> 32) & 0xFF);
-    vm->memory[addr + 5] = (uint8_t)((value >> 40) & 0xFF);
-    vm->memory[addr + 6] = (uint8_t)((value >> 48) & 0xFF);
-    vm->memory[addr + 7] = (uint8_t)((value >> 56) & 0xFF);
+    const size_t gap = (size_t)(d - s);
+    while (n > 0) {
+        const size_t k = n < gap ? n : gap;
+        memcpy(dst, src, k);
+        dst += k;
+        src += k;
+        n -= k;
+    }
+}
+
+void vm_memset(VM *vm, vm_addr_t dst, uint8_t value, uint32_t count) {
+    while (count > 0) {
+        ByteSpan d;
+        if (!byte_span(vm, dst, &d)) {
+            panicf(vm, "WRITE8 out of bounds: 0x%08x", dst);
+            return;
+        }
+        const size_t n = d.len < count ? d.len : count;
+        memset(d.ptr, value, n);
+        if (d.fb_row != SIZE_MAX)
+            vm_fb_mark_dirty(vm, d.fb_row);
+        else
+            ram_note_write(vm, dst, n);
+        dst += (vm_addr_t)n;
+        count -= (uint32_t)n;
+    }
+}
+
+void vm_memcpy(VM *vm, vm_addr_t dst, vm_addr_t src, uint32_t count) {
+    while (count > 0) {
+        ByteSpan s;
+        ByteSpan d;
+        if (!byte_span(vm, src, &s)) {
+            panicf(vm, "READ8 out of bounds: 0x%08x", src);
+            return;
+        }
+        if (!byte_span(vm, dst, &d)) {
+            panicf(vm, "WRITE8 out of bounds: 0x%08x", dst);
+            return;
+        }
+        size_t n = s.len < d.len ? s.len : d.len;
+        if (n > count)
+            n = count;
+        copy_forward(d.ptr, s.ptr, n);
+        if (d.fb_row != SIZE_MAX)
+            vm_fb_mark_dirty(vm, d.fb_row);
+        else
+            ram_note_write(vm, dst, n);
+
+        dst += (vm_addr_t)n;
+        src += (vm_addr_t)n;
+        count -= (uint32_t)n;
+    }
 }
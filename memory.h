@@ -23,7 +23,32 @@ uint32_t vm_atomic_compare_exchange32_seqcst(VM *vm,
                                              uint32_t desired,
                                              int *success);
 
+/*
+ * Zero-filled on demand, backed as `backing` (VM_RAM_BACKING_*, see
+ * libvm.h) asks. Pass *mapped_size back to vm_ram_unmap.
+ */
+uint8_t *vm_ram_map(size_t size, int backing, size_t *mapped_size);
+void vm_ram_unmap(uint8_t *memory, size_t mapped_size);
+
+/* Classify every page once RAM and all MMIO devices are in place. */
+int vm_region_map_init(VM *vm);
+void vm_region_map_destroy(VM *vm);
+
+/*
+ * Checkpoint write tracking, see VM_REGION_WRITE_PROTECT. Protect a page at
+ * a checkpoint; it reads as written again after its next store. Code that
+ * stores into vm->memory directly (disk DMA) reports it through
+ * vm_ram_note_write.
+ */
+void vm_ram_protect_page(VM *vm, size_t page);
+int vm_ram_page_written(const VM *vm, size_t page);
+void vm_ram_note_write(VM *vm, vm_addr_t addr, size_t size);
+
 void vm_write8(VM *vm, vm_addr_t addr, uint8_t value);
 void vm_write32(VM *vm, vm_addr_t addr, uint32_t value);
 void vm_write64(VM *vm, vm_addr_t addr, uint64_t value);
+
+/* Byte-granular bulk operations with the same semantics as looping over vm_read8/vm_write8. */
+void vm_memset(VM *vm, vm_addr_t dst, uint8_t value, uint32_t count);
+void vm_memcpy(VM *vm, vm_addr_t dst, vm_addr_t src, uint32_t count);
 #endif // VM_MEMORY_H
@@ -6,20 +6,58 @@
 
 #include "panic.h"
 
-uint32_t vm_mmio_read32(VM* vm, uint32_t addr) {
-    MMIO_Device *dev = find_mmio(vm,addr);
-    if (!dev || !dev->read32) {
-        panic(panic_format("READ32 invalid MMIO at 0x%08x", addr),vm);
+int vm_mmio_register(VM *vm, const MMIO_Device *dev) {
+    if (vm->mmio_count >= MAX_MMIO_DEVICES)
+        return -1;
+    vm->mmio_table[vm->mmio_count++] = *dev;
+    return vm->mmio_count;
+}
+
+void vm_mmio_publish(VM *vm) {
+    for (int i = 1; i < vm->mmio_count; i++) {
+        const MMIO_Device dev = vm->mmio_table[i];
+        int j = i - 1;
+        while (j >= 0 && vm->mmio_table[j].start > dev.start) {
+            vm->mmio_table[j + 1] = vm->mmio_table[j];
+            j--;
+        }
+        vm->mmio_table[j + 1] = dev;
+    }
+    for (int i = 1; i < vm->mmio_count; i++) {
+        if (vm->mmio_table[i].start <= vm->mmio_table[i - 1].end) {
+            panicf(vm, "MMIO ranges overlap at 0x%08x", vm->mmio_table[i].start);
+            return;
+        }
+    }
+}
+
+static inline void mmio_enter(VM *vm, const MMIO_Device *dev) {
+    if (dev->sync == VM_MMIO_SYNC_GLOBAL)
+        vm_shared_lock(vm);
+}
+
+static inline void mmio_leave(VM *vm, const MMIO_Device *dev) {
+    if (dev->sync == VM_MMIO_SYNC_GLOBAL)
+        vm_shared_unlock(vm);
+}
+
+uint32_t vm_mmio_read32(VM *vm, MMIO_Device *dev, uint32_t addr) {
+    if (!dev->read32) {
+        panicf(vm, "READ32 invalid MMIO at 0x%08x", addr);
         return 0;
     }
-    return dev->read32(vm,addr);
+    mmio_enter(vm, dev);
+    const uint32_t v = dev->read32(vm, addr);
+    mmio_leave(vm, dev);
+    return v;
 }
 
-void vm_mmio_write32(VM *vm, uint32_t addr, uint32_t val) {
-    MMIO_Device *dev = find_mmio(vm,addr);
-    if (!dev || !dev->write32) {
-        panic(panic_format("WRITE32 invalid MMIO at 0x%08x", addr),vm);
+void vm_mmio_write32(VM *vm, MMIO_Device *dev, uint32_t addr, uint32_t val) {
+    if (!dev->write32) {
+        panicf(vm, "WRITE32 invalid MMIO at 0x%08x", addr);
         return;
     }
-    dev->write32(vm,addr,val);
+    mmio_enter(vm, dev);
+    dev->write32(vm, addr, val);
+    mmio_leave(vm, dev);
 }
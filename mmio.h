@@ -6,28 +6,43 @@
 #define VM_MMIO_H
 #include "vm.h"
 
+/*
+ * Copy `dev` into vm->mmio_table. Only valid while vm_create sets up
+ * devices; returns the new device count, or -1 when the table is full.
+ */
+int vm_mmio_register(VM *vm, const MMIO_Device *dev);
+
+/* Sort the table by start address; it is read-only from here on. */
+void vm_mmio_publish(VM *vm);
+
 static inline MMIO_Device *find_mmio(VM *vm, uint32_t addr) {
-    //most MMIO traffic repeatedly touches a small range.
-    MMIO_Device *cached = vm->mmio_cache_dev;
-    if (cached && addr >= vm->mmio_cache_start && addr <= vm->mmio_cache_end) {
-        return cached;
+    // Most MMIO traffic on a core repeatedly touches the same device.
+    VCPU *cpu = vm_tls_vcpu;
+    if (cpu) {
+        const MMIO_Device *cached = cpu->mmio_cache;
+        if (cached && addr >= cached->start && addr <= cached->end)
+            return (MMIO_Device *)cached;
     }
 
-    for (int i = 0; i < vm->mmio_count; i++) {
-        MMIO_Device *dev = vm->mmio_devices[i];
-        if (addr >= dev->start && addr <= dev->end) {
-            vm->mmio_cache_dev = dev;
-            vm->mmio_cache_start = dev->start;
-            vm->mmio_cache_end = dev->end;
+    int lo = 0;
+    int hi = vm->mmio_count - 1;
+    while (lo <= hi) {
+        const int mid = (lo + hi) / 2;
+        MMIO_Device *dev = &vm->mmio_table[mid];
+        if (addr < dev->start) {
+            hi = mid - 1;
+        } else if (addr > dev->end) {
+            lo = mid + 1;
+        } else {
+            if (cpu)
+                cpu->mmio_cache = dev;
             return dev;
         }
     }
-
-    vm->mmio_cache_dev = NULL;
     return NULL;
 }
 
-
-uint32_t vm_mmio_read32(VM* vm, uint32_t addr);
-void vm_mmio_write32(VM* vm, uint32_t addr, uint32_t val);
+/* Call into `dev` under the lock its sync mode asks for. */
+uint32_t vm_mmio_read32(VM *vm, MMIO_Device *dev, uint32_t addr);
+void vm_mmio_write32(VM *vm, MMIO_Device *dev, uint32_t addr, uint32_t val);
 #endif //VM_MMIO_H
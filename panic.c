@@ -1,19 +1,12 @@
 #include <stdio.h>
-#include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include "vm.h"
+#include "panic.h"
 //
 // Created by Max Wang on 2025/12/29.
 //
-const char *panic_format(const char *fmt, ...) {
-    static char buffer[256];
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(buffer, sizeof(buffer), fmt, args);
-    va_end(args);
-    return buffer;
-}
 
 static uint64_t calculate_cycles(const VM *vm) {
     uint64_t cycles = 0;
@@ -24,6 +17,18 @@ static uint64_t calculate_cycles(const VM *vm) {
 }
 
 void panic(const char *msg, VM *vm) {
+    if (vm) {
+        /* Only the first report is printed and kept; later ones just stop the VM again. */
+        if (atomic_exchange(&vm->panic_reported, true)) {
+            vm->panic = 1;
+            vm_attention_all(vm, VM_ATTN_STOP);
+            return;
+        }
+        snprintf(vm->panic_message, sizeof(vm->panic_message), "%s", msg);
+        const size_t len = strlen(vm->panic_message);
+        if (len > 0 && vm->panic_message[len - 1] == '\n')
+            vm->panic_message[len - 1] = '\0';
+    }
     VCPU *cpu = vm_current_cpu(vm);
     uint64_t cycles = vm ? calculate_cycles(vm) : 0;
     size_t ip_now = cpu ? cpu->ip : 0;
@@ -57,7 +62,17 @@ void panic(const char *msg, VM *vm) {
     }
     printf("Creating VM dump...");
     vm_dump(vm, DUMP_MEM_SEEK_LEN);
-    if (vm)
+    if (vm) {
         vm->panic = 1;
-    exit(1);
+        vm_attention_all(vm, VM_ATTN_STOP);
+    }
+}
+
+void panicf(VM *vm, const char *fmt, ...) {
+    char msg[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    panic(msg, vm);
 }
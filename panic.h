@@ -7,6 +7,12 @@
 
 typedef struct VM VM;
 
-const char *panic_format(const char *fmt, ...);
+/*
+ * Report a fatal guest or host error: print it with a dump, keep the first
+ * message in vm->panic_message, set vm->panic and stop every vCPU at its next
+ * batch boundary. Returns to the caller, which must back out of whatever it
+ * was doing; the process and any other VM in it carry on.
+ */
 void panic(const char *input, VM *vm);
+void panicf(VM *vm, const char *fmt, ...);
 #endif // VM_PANIC_H
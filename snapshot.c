@@ -0,0 +1,812 @@
+/* MAP_FIXED file mappings over guest RAM, see jit.c. */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "interrupt.h"
+#include "io.h"
+#include "io_devices/blk/blk_mmio_register.h"
+#include "io_devices/disk/disk.h"
+#include "memory.h"
+
+/*
+ * File layout: header, machine record, one record per vCPU, the interrupt
+ * bitmaps, the framebuffer, then RAM at ram_offset. RAM pages that are all
+ * zero are left as holes, so a snapshot of a lightly used guest is small
+ * on disk and its untouched pages stay uncommitted after restore.
+ *
+ * A checkpoint delta has the same records behind its own header, then the
+ * indices of the RAM pages written since its parent (the full snapshot or
+ * the previous delta) and those pages.
+ */
+#define SNAPSHOT_MAGIC "LAMPSNP1"
+#define SNAPSHOT_DELTA_MAGIC "LAMPDLT1"
+#define SNAPSHOT_VERSION 3u
+/* Larger than any host page size, so RAM can always be mapped straight from the file. */
+#define SNAPSHOT_RAM_ALIGN 65536u
+#define SNAPSHOT_PAGE_SIZE 4096u
+#define SNAPSHOT_NAME_MAX 256u
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t smp_cores;
+    uint64_t memory_size;
+    uint64_t ram_offset;
+    uint64_t chain_id;
+} SnapshotHeader;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t smp_cores;
+    uint64_t memory_size;
+    uint64_t chain_id;
+    uint32_t sequence; /* 1 for the first delta after the full snapshot */
+    uint32_t page_count;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    char parent[SNAPSHOT_NAME_MAX]; /* file name, in the same directory */
+} SnapshotDeltaHeader;
+
+/* A block queue's registers; nothing is in flight when they are saved. */
+typedef struct {
+    uint32_t sq_addr;
+    uint32_t cq_addr;
+    uint32_t size;
+    uint32_t sq_tail;
+    uint32_t sq_head;
+    uint32_t cq_tail;
+    uint32_t cq_head;
+    uint32_t irq_coalesce;
+    uint32_t unsignalled;
+} SnapshotBlkQueue;
+
+typedef struct {
+    int32_t io[IO_SIZE];
+    uint8_t serial_rx_fifo[256];
+    uint16_t serial_rx_head;
+    uint16_t serial_rx_tail;
+    uint64_t boot_elapsed_ns;
+    uint64_t start_realtime_ns;
+    uint64_t stack_pool_size;
+    uint32_t stack_pool_base;
+    uint32_t timer_period_us;
+    uint32_t timer_enabled;
+    uint32_t disk_lba;
+    uint32_t disk_mem_addr;
+    uint32_t disk_count;
+    uint32_t disk_status;
+    uint32_t disk_op_complete;
+    SnapshotBlkQueue blk[BLK_QUEUES];
+} SnapshotMachine;
+
+typedef struct {
+    uint32_t regs[REG_COUNT];
+    uint64_t ip;
+    uint64_t last_ip;
+    uint64_t execution_times;
+    uint64_t latched_realtime;
+    uint64_t latched_monotonic;
+    uint64_t latched_boottime;
+    uint32_t flags;
+    uint32_t flags_kind;
+    int32_t flags_a;
+    int32_t flags_b;
+    int32_t flags_res;
+    int32_t dsp;
+    int32_t csp;
+    int32_t isp;
+    int32_t in_interrupt;
+    int32_t irq_masked;
+    uint32_t call_stack_base;
+    uint32_t data_stack_base;
+    uint32_t isr_stack_base;
+    uint32_t released;
+} SnapshotCpu;
+
+typedef struct {
+    off_t machine;
+    off_t cpus;
+    off_t irq;
+    off_t fb;
+    off_t ram;
+} SnapshotLayout;
+
+static SnapshotLayout snapshot_layout(size_t header_size, uint32_t cores) {
+    SnapshotLayout l;
+    l.machine = (off_t)header_size;
+    l.cpus = l.machine + (off_t)sizeof(SnapshotMachine);
+    l.irq = l.cpus + (off_t)(cores * sizeof(SnapshotCpu));
+    l.fb = l.irq + (off_t)(cores * IRQ_BITMAP_WORDS * sizeof(uint64_t));
+    const off_t end = l.fb + (off_t)FB_SIZE;
+    l.ram = (end + SNAPSHOT_RAM_ALIGN - 1) & ~(off_t)(SNAPSHOT_RAM_ALIGN - 1);
+    return l;
+}
+
+static int write_at(int fd, const void *buf, size_t len, off_t off) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        const ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 1;
+}
+
+static int read_at(int fd, void *buf, size_t len, off_t off) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        const ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 1;
+}
+
+static void capture_machine(VM *vm, SnapshotMachine *m) {
+    memset(m, 0, sizeof(*m));
+
+    /* Let an in-flight DMA land before RAM or the disk registers are read. */
+    pthread_mutex_lock(&vm->disk.mutex);
+    while (vm->disk.current_cmd != DISK_CMD_NONE) {
+        pthread_mutex_unlock(&vm->disk.mutex);
+        sched_yield();
+        pthread_mutex_lock(&vm->disk.mutex);
+    }
+    m->disk_lba = vm->disk.lba;
+    m->disk_mem_addr = vm->disk.mem_addr;
+    m->disk_count = vm->disk.count;
+    m->disk_status = vm->disk.status;
+    m->disk_op_complete = vm->disk.op_complete;
+
+    blk_quiesce(vm);
+    for (uint32_t i = 0; i < BLK_QUEUES; i++) {
+        const BlkQueue *q = &vm->blk.queues[i];
+        SnapshotBlkQueue *s = &m->blk[i];
+        s->sq_addr = q->sq_addr;
+        s->cq_addr = q->cq_addr;
+        s->size = q->size;
+        s->sq_tail = q->sq_tail;
+        s->sq_head = q->sq_head;
+        s->cq_tail = q->cq_tail;
+        s->cq_head = q->cq_head;
+        s->irq_coalesce = q->irq_coalesce;
+        s->unsignalled = q->unsignalled;
+    }
+    blk_resume(vm);
+
+    vm_serial_lock(vm);
+    for (int i = 0; i < IO_SIZE; i++)
+        m->io[i] = vm->io[i];
+    memcpy(m->serial_rx_fifo, vm->serial_rx_fifo, sizeof(m->serial_rx_fifo));
+    m->serial_rx_head = vm->serial_rx_head;
+    m->serial_rx_tail = vm->serial_rx_tail;
+    vm_serial_unlock(vm);
+    pthread_mutex_unlock(&vm->disk.mutex);
+
+    m->boot_elapsed_ns = host_monotonic_time_ns() - vm->start_monotonic_ns;
+    m->start_realtime_ns = vm->start_realtime_ns;
+    m->stack_pool_base = vm->stack_pool_base;
+    m->stack_pool_size = vm->stack_pool_size;
+    m->timer_period_us = atomic_load(&vm->timer_period_us);
+    m->timer_enabled = atomic_load(&vm->timer_enabled) ? 1u : 0u;
+}
+
+static void restore_machine(VM *vm, const SnapshotMachine *m) {
+    for (int i = 0; i < IO_SIZE; i++)
+        vm->io[i] = m->io[i];
+    memcpy(vm->serial_rx_fifo, m->serial_rx_fifo, sizeof(vm->serial_rx_fifo));
+    vm->serial_rx_head = m->serial_rx_head;
+    vm->serial_rx_tail = m->serial_rx_tail;
+    vm->io[VM_CONTROL] = VM_CONTROL_STATUS_RESTORED;
+
+    pthread_mutex_lock(&vm->disk.mutex);
+    vm->disk.lba = m->disk_lba;
+    vm->disk.mem_addr = m->disk_mem_addr;
+    vm->disk.count = m->disk_count;
+    vm->disk.status = (uint8_t)m->disk_status;
+    vm->disk.op_complete = m->disk_op_complete != 0;
+    vm->disk.current_cmd = DISK_CMD_NONE;
+    pthread_mutex_unlock(&vm->disk.mutex);
+    /* A command that finished just before the save still owes its interrupt. */
+    if (vm->disk.status == DISK_STATUS_BUSY && vm->disk.op_complete)
+        vm_cpu_attention(&vm->cpus[BSP_CORE], VM_ATTN_DISK);
+
+    pthread_mutex_lock(&vm->blk.lock);
+    for (uint32_t i = 0; i < BLK_QUEUES; i++) {
+        BlkQueue *q = &vm->blk.queues[i];
+        const SnapshotBlkQueue *s = &m->blk[i];
+        q->sq_addr = s->sq_addr;
+        q->cq_addr = s->cq_addr;
+        q->size = s->size <= BLK_QUEUE_SIZE_MAX && (s->size & (s->size - 1u)) == 0 ? s->size : 0;
+        q->sq_tail = s->sq_tail;
+        q->sq_head = s->sq_head;
+        q->cq_tail = s->cq_tail;
+        q->cq_head = s->cq_head;
+        q->irq_coalesce = s->irq_coalesce;
+        q->unsignalled = s->unsignalled;
+    }
+    pthread_mutex_unlock(&vm->blk.lock);
+
+    /* Boot time keeps counting from where it was; the timer re-arms from now. */
+    vm->start_monotonic_ns = host_monotonic_time_ns() - m->boot_elapsed_ns;
+    vm->start_realtime_ns = m->start_realtime_ns;
+    vm->stack_pool_base = m->stack_pool_base;
+    vm->stack_pool_size = (size_t)m->stack_pool_size;
+    atomic_store(&vm->timer_period_us, m->timer_period_us);
+    atomic_store(&vm->timer_next_deadline_ns, 0);
+    atomic_store(&vm->timer_enabled, m->timer_enabled != 0);
+}
+
+static void capture_cpu(VM *vm, int i, SnapshotCpu *c) {
+    const VCPU *cpu = &vm->cpus[i];
+    memset(c, 0, sizeof(*c));
+    memcpy(c->regs, cpu->regs, sizeof(c->regs));
+    c->ip = cpu->ip;
+    c->last_ip = cpu->last_ip;
+    c->execution_times = atomic_load_explicit(&cpu->execution_times, memory_order_relaxed);
+    c->latched_realtime = cpu->latched_realtime;
+    c->latched_monotonic = cpu->latched_monotonic;
+    c->latched_boottime = cpu->latched_boottime;
+    c->flags = cpu->flags;
+    c->flags_kind = cpu->flags_kind;
+    c->flags_a = cpu->flags_a;
+    c->flags_b = cpu->flags_b;
+    c->flags_res = cpu->flags_res;
+    c->dsp = cpu->dsp;
+    c->csp = cpu->csp;
+    c->isp = cpu->isp;
+    c->in_interrupt = cpu->in_interrupt;
+    c->irq_masked = cpu->irq_masked;
+    c->call_stack_base = cpu->call_stack_base;
+    c->data_stack_base = cpu->data_stack_base;
+    c->isr_stack_base = cpu->isr_stack_base;
+    c->released = atomic_load_explicit(&vm->core_released[i], memory_order_acquire) ? 1u : 0u;
+}
+
+static void restore_cpu(VM *vm, int i, const SnapshotCpu *c) {
+    VCPU *cpu = &vm->cpus[i];
+    memcpy(cpu->regs, c->regs, sizeof(cpu->regs));
+    cpu->ip = (size_t)c->ip;
+    cpu->last_ip = (size_t)c->last_ip;
+    atomic_store_explicit(&cpu->execution_times, c->execution_times, memory_order_relaxed);
+    cpu->latched_realtime = c->latched_realtime;
+    cpu->latched_monotonic = c->latched_monotonic;
+    cpu->latched_boottime = c->latched_boottime;
+    cpu->flags = c->flags;
+    cpu->flags_kind = (uint8_t)c->flags_kind;
+    cpu->flags_a = c->flags_a;
+    cpu->flags_b = c->flags_b;
+    cpu->flags_res = c->flags_res;
+    cpu->dsp = c->dsp;
+    cpu->csp = c->csp;
+    cpu->isp = c->isp;
+    cpu->in_interrupt = c->in_interrupt;
+    cpu->irq_masked = c->irq_masked;
+    cpu->call_stack_base = c->call_stack_base;
+    cpu->data_stack_base = c->data_stack_base;
+    cpu->isr_stack_base = c->isr_stack_base;
+    atomic_store_explicit(&vm->core_released[i], c->released != 0, memory_order_release);
+    /* Pending interrupts were restored underneath the vCPU. */
+    vm_cpu_attention(cpu, VM_ATTN_IRQ);
+}
+
+/* Only pages with data are written; the rest stay holes from ftruncate. */
+static int write_ram(int fd, const VM *vm, off_t base) {
+    static const uint8_t zero_page[SNAPSHOT_PAGE_SIZE];
+    const size_t size = vm->memory_size;
+    size_t pos = 0;
+    while (pos < size) {
+        size_t len = size - pos < SNAPSHOT_PAGE_SIZE ? size - pos : SNAPSHOT_PAGE_SIZE;
+        if (memcmp(vm->memory + pos, zero_page, len) == 0) {
+            pos += len;
+            continue;
+        }
+        size_t end = pos + len;
+        while (end < size) {
+            len = size - end < SNAPSHOT_PAGE_SIZE ? size - end : SNAPSHOT_PAGE_SIZE;
+            if (memcmp(vm->memory + end, zero_page, len) == 0)
+                break;
+            end += len;
+        }
+        if (!write_at(fd, vm->memory + pos, end - pos, base + (off_t)pos))
+            return 0;
+        pos = end;
+    }
+    return 1;
+}
+
+/* Everything but RAM. */
+typedef struct {
+    SnapshotMachine machine;
+    SnapshotCpu *cpus;
+    uint64_t *irq;
+} SnapshotState;
+
+static void free_state(SnapshotState *state) {
+    free(state->irq);
+    free(state->cpus);
+}
+
+static int alloc_state(SnapshotState *state, uint32_t cores) {
+    state->cpus = calloc(cores, sizeof(SnapshotCpu));
+    state->irq = calloc((size_t)cores * IRQ_BITMAP_WORDS, sizeof(uint64_t));
+    if (state->cpus && state->irq)
+        return 1;
+    free_state(state);
+    return 0;
+}
+
+static int capture_state(VM *vm, SnapshotState *state) {
+    const uint32_t cores = (uint32_t)vm->smp_cores;
+    if (!alloc_state(state, cores)) {
+        printf("[snapshot] out of memory\n");
+        return 0;
+    }
+    capture_machine(vm, &state->machine);
+    for (uint32_t i = 0; i < cores; i++)
+        capture_cpu(vm, (int)i, &state->cpus[i]);
+    for (size_t w = 0; w < (size_t)cores * IRQ_BITMAP_WORDS; w++)
+        state->irq[w] = atomic_load(&vm->interrupt_bitmap[w]);
+    return 1;
+}
+
+static void restore_state(VM *vm, const SnapshotState *state) {
+    const uint32_t cores = (uint32_t)vm->smp_cores;
+    restore_machine(vm, &state->machine);
+    for (size_t w = 0; w < (size_t)cores * IRQ_BITMAP_WORDS; w++)
+        atomic_store(&vm->interrupt_bitmap[w], state->irq[w]);
+    for (uint32_t i = 0; i < cores; i++)
+        restore_cpu(vm, (int)i, &state->cpus[i]);
+}
+
+/* The state records and the framebuffer. */
+static int write_state(int fd, const VM *vm, const SnapshotState *state, const SnapshotLayout *layout) {
+    const uint32_t cores = (uint32_t)vm->smp_cores;
+    return write_at(fd, &state->machine, sizeof(state->machine), layout->machine) &&
+           write_at(fd, state->cpus, cores * sizeof(SnapshotCpu), layout->cpus) &&
+           write_at(fd, state->irq, (size_t)cores * IRQ_BITMAP_WORDS * sizeof(uint64_t), layout->irq) &&
+           write_at(fd, vm->fb, FB_SIZE, layout->fb);
+}
+
+static int read_state(int fd, uint32_t cores, const SnapshotLayout *layout, SnapshotState *state) {
+    if (!alloc_state(state, cores))
+        return 0;
+    if (read_at(fd, &state->machine, sizeof(state->machine), layout->machine) &&
+        read_at(fd, state->cpus, cores * sizeof(SnapshotCpu), layout->cpus) &&
+        read_at(fd, state->irq, (size_t)cores * IRQ_BITMAP_WORDS * sizeof(uint64_t), layout->irq))
+        return 1;
+    free_state(state);
+    return 0;
+}
+
+/* Write beside the target and rename, so a failed save never clobbers a good file. */
+static int create_tmp(const char *path, char **tmp_path) {
+    *tmp_path = malloc(strlen(path) + 5);
+    if (!*tmp_path)
+        return -1;
+    strcpy(*tmp_path, path);
+    strcat(*tmp_path, ".tmp");
+    return open(*tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+static int commit_tmp(int fd, char *tmp_path, const char *path, int ok) {
+    if (fd >= 0) {
+        ok = (close(fd) == 0) && ok;
+        ok = ok && rename(tmp_path, path) == 0;
+        if (!ok)
+            unlink(tmp_path);
+    }
+    free(tmp_path);
+    return fd >= 0 && ok;
+}
+
+/* "<path>.<sequence>" for a delta, `path` itself for the full snapshot. */
+static char *chain_path(const char *path, uint32_t sequence) {
+    char *out = malloc(strlen(path) + 12);
+    if (!out)
+        return NULL;
+    if (sequence == 0)
+        strcpy(out, path);
+    else
+        sprintf(out, "%s.%u", path, sequence);
+    return out;
+}
+
+/* `name` in the directory of `path`. */
+static char *sibling_path(const char *path, const char *name) {
+    const char *slash = strrchr(path, '/');
+    const size_t dir_len = slash ? (size_t)(slash - path) + 1u : 0u;
+    char *out = malloc(dir_len + strlen(name) + 1);
+    if (!out)
+        return NULL;
+    memcpy(out, path, dir_len);
+    strcpy(out + dir_len, name);
+    return out;
+}
+
+static uint64_t new_chain_id(void) {
+    /* Only has to tell one full save from the next. */
+    const uint64_t id = host_unix_time_ns() ^ ((uint64_t)getpid() << 40);
+    return id ? id : 1u;
+}
+
+int vm_snapshot_save(VM *vm, const char *path) {
+    const uint32_t cores = (uint32_t)vm->smp_cores;
+    const SnapshotLayout layout = snapshot_layout(sizeof(SnapshotHeader), cores);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.smp_cores = cores;
+    header.memory_size = vm->memory_size;
+    header.ram_offset = (uint64_t)layout.ram;
+    header.chain_id = new_chain_id();
+
+    SnapshotState state;
+    if (!capture_state(vm, &state))
+        return 0;
+    char *tmp_path = NULL;
+    const int fd = create_tmp(path, &tmp_path);
+    int ok = fd >= 0 &&
+             ftruncate(fd, layout.ram + (off_t)vm->memory_size) == 0 &&
+             write_at(fd, &header, sizeof(header), 0) &&
+             write_state(fd, vm, &state, &layout) &&
+             write_ram(fd, vm, layout.ram);
+    ok = commit_tmp(fd, tmp_path, path, ok);
+    free_state(&state);
+    if (!ok) {
+        perror("[snapshot] save failed");
+        return 0;
+    }
+    printf("[snapshot] saved %s\n", path);
+
+    /* Start a new checkpoint chain: from here on only pages the guest writes need saving. */
+    const size_t ram_pages = vm->memory_size >> VM_REGION_PAGE_SHIFT;
+    for (size_t p = 0; p < ram_pages; p++)
+        vm_ram_protect_page(vm, p);
+    vm->checkpoint_chain = header.chain_id;
+    vm->checkpoint_seq = 0;
+    return 1;
+}
+
+/* Runs of consecutive pages go out in one write. */
+static int write_pages(int fd, const VM *vm, const uint32_t *pages, uint32_t count, off_t base) {
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t run = 1;
+        while (i + run < count && pages[i + run] == pages[i] + run)
+            run++;
+        if (!write_at(fd, vm->memory + (size_t)pages[i] * VM_REGION_PAGE_SIZE,
+                      (size_t)run * VM_REGION_PAGE_SIZE, base + (off_t)i * VM_REGION_PAGE_SIZE))
+            return 0;
+        i += run;
+    }
+    return 1;
+}
+
+int vm_snapshot_checkpoint(VM *vm, const char *path) {
+    if (vm->checkpoint_chain == 0)
+        return vm_snapshot_save(vm, path);
+
+    const uint32_t cores = (uint32_t)vm->smp_cores;
+    const uint32_t sequence = vm->checkpoint_seq + 1u;
+    const SnapshotLayout layout = snapshot_layout(sizeof(SnapshotDeltaHeader), cores);
+    const size_t ram_pages = vm->memory_size >> VM_REGION_PAGE_SHIFT;
+
+    /* capture_state waits out any DMA, so the written-page scan below is final. */
+    SnapshotState state;
+    if (!capture_state(vm, &state))
+        return 0;
+    uint32_t *pages = malloc(ram_pages * sizeof(uint32_t));
+    char *delta_path = chain_path(path, sequence);
+    char *parent_path = chain_path(path, sequence - 1u);
+    const char *parent_name = parent_path ? strrchr(parent_path, '/') : NULL;
+    parent_name = parent_name ? parent_name + 1 : parent_path;
+    if (!pages || !delta_path || !parent_path || strlen(parent_name) >= SNAPSHOT_NAME_MAX) {
+        printf("[snapshot] cannot checkpoint to %s\n", path);
+        free(parent_path);
+        free(delta_path);
+        free(pages);
+        free_state(&state);
+        return 0;
+    }
+    uint32_t count = 0;
+    for (size_t p = 0; p < ram_pages; p++) {
+        if (vm_ram_page_written(vm, p))
+            pages[count++] = (uint32_t)p;
+    }
+
+    SnapshotDeltaHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_DELTA_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.smp_cores = cores;
+    header.memory_size = vm->memory_size;
+    header.chain_id = vm->checkpoint_chain;
+    header.sequence = sequence;
+    header.page_count = count;
+    header.index_offset = (uint64_t)layout.ram;
+    header.data_offset = ((uint64_t)layout.ram + count * sizeof(uint32_t) + VM_REGION_PAGE_SIZE - 1u) &
+                         ~(uint64_t)(VM_REGION_PAGE_SIZE - 1u);
+    strcpy(header.parent, parent_name);
+
+    char *tmp_path = NULL;
+    const int fd = create_tmp(delta_path, &tmp_path);
+    int ok = fd >= 0 &&
+             write_at(fd, &header, sizeof(header), 0) &&
+             write_state(fd, vm, &state, &layout) &&
+             write_at(fd, pages, count * sizeof(uint32_t), layout.ram) &&
+             write_pages(fd, vm, pages, count, (off_t)header.data_offset);
+    ok = commit_tmp(fd, tmp_path, delta_path, ok);
+    if (ok) {
+        for (uint32_t i = 0; i < count; i++)
+            vm_ram_protect_page(vm, pages[i]);
+        vm->checkpoint_seq = sequence;
+        printf("[snapshot] checkpoint %s: %u pages\n", delta_path, count);
+    } else {
+        /* The pages stay written, so the next attempt still covers them. */
+        perror("[snapshot] checkpoint failed");
+    }
+
+    free(parent_path);
+    free(delta_path);
+    free(pages);
+    free_state(&state);
+    return ok;
+}
+
+static VM *load_full(const char *path, const char *disk_path, int ram_backing, uint64_t *chain_id) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    SnapshotHeader header;
+    if (!read_at(fd, &header, sizeof(header), 0) ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION ||
+        header.smp_cores < 1 || header.smp_cores > 64 ||
+        header.memory_size == 0 || header.memory_size > UINT32_MAX) {
+        printf("[snapshot] %s is not a snapshot this VM can load\n", path);
+        close(fd);
+        return NULL;
+    }
+    const uint32_t cores = header.smp_cores;
+    const SnapshotLayout layout = snapshot_layout(sizeof(SnapshotHeader), cores);
+    struct stat st;
+    if ((off_t)header.ram_offset != layout.ram || fstat(fd, &st) != 0 ||
+        st.st_size < layout.ram + (off_t)header.memory_size) {
+        printf("[snapshot] %s is truncated or from another build\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    SnapshotState state;
+    if (!read_state(fd, cores, &layout, &state)) {
+        printf("[snapshot] cannot read %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    VM *vm = vm_create((size_t)header.memory_size, NULL, 0, NULL, 0, NULL, (int)cores, ram_backing);
+    if (!vm) {
+        free_state(&state);
+        close(fd);
+        return NULL;
+    }
+    disk_init(vm, disk_path);
+
+    /*
+     * Map RAM privately from the file: pages fault in on first touch and are
+     * copied only when the guest writes them. Hugetlb-backed RAM can refuse a
+     * partial remap, so fall back to reading it in.
+     */
+    int ok = read_at(fd, vm->fb, FB_SIZE, layout.fb);
+    if (ok) {
+        void *ram = mmap(vm->memory, vm->memory_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_FIXED, fd, layout.ram);
+        if (ram == MAP_FAILED)
+            ok = read_at(fd, vm->memory, vm->memory_size, layout.ram);
+    }
+    close(fd);
+    if (!ok) {
+        printf("[snapshot] cannot read %s\n", path);
+        free_state(&state);
+        vm_destroy(vm);
+        return NULL;
+    }
+
+    restore_state(vm, &state);
+    free_state(&state);
+    *chain_id = header.chain_id;
+    return vm;
+}
+
+typedef struct {
+    char *path;
+    SnapshotDeltaHeader header;
+} ChainLink;
+
+/* Read and sanity-check the header of the delta at `path`. */
+static int read_delta_header(const char *path, SnapshotDeltaHeader *header) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 0;
+    }
+    struct stat st;
+    int ok = read_at(fd, header, sizeof(*header), 0) &&
+             memcmp(header->magic, SNAPSHOT_DELTA_MAGIC, sizeof(header->magic)) == 0 &&
+             header->version == SNAPSHOT_VERSION &&
+             header->smp_cores >= 1 && header->smp_cores <= 64 &&
+             header->memory_size != 0 && header->memory_size <= UINT32_MAX &&
+             header->sequence >= 1 &&
+             memchr(header->parent, '\0', sizeof(header->parent)) != NULL &&
+             (off_t)header->index_offset == snapshot_layout(sizeof(*header), header->smp_cores).ram &&
+             header->data_offset >= header->index_offset + header->page_count * sizeof(uint32_t) &&
+             fstat(fd, &st) == 0 &&
+             (uint64_t)st.st_size >= header->data_offset + (uint64_t)header->page_count * VM_REGION_PAGE_SIZE;
+    close(fd);
+    if (!ok)
+        printf("[snapshot] %s is not a checkpoint this VM can load\n", path);
+    return ok;
+}
+
+/* Copy the pages of one delta that no newer delta has supplied. */
+static int apply_delta_pages(VM *vm, const ChainLink *link, uint8_t *applied) {
+    const uint32_t count = link->header.page_count;
+    if (count == 0)
+        return 1;
+    const int fd = open(link->path, O_RDONLY);
+    uint32_t *pages = malloc(count * sizeof(uint32_t));
+    int ok = fd >= 0 && pages && read_at(fd, pages, count * sizeof(uint32_t), (off_t)link->header.index_offset);
+    const size_t ram_pages = vm->memory_size >> VM_REGION_PAGE_SHIFT;
+    uint32_t i = 0;
+    while (ok && i < count) {
+        if (pages[i] >= ram_pages) {
+            ok = 0;
+            break;
+        }
+        if (applied[pages[i]]) {
+            i++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (i + run < count && pages[i + run] == pages[i] + run && pages[i + run] < ram_pages &&
+               !applied[pages[i + run]])
+            run++;
+        ok = read_at(fd, vm->memory + (size_t)pages[i] * VM_REGION_PAGE_SIZE, (size_t)run * VM_REGION_PAGE_SIZE,
+                     (off_t)link->header.data_offset + (off_t)i * VM_REGION_PAGE_SIZE);
+        memset(&applied[pages[i]], 1, run);
+        i += run;
+    }
+    free(pages);
+    if (fd >= 0)
+        close(fd);
+    return ok;
+}
+
+/* State and framebuffer come from the newest delta alone. */
+static int apply_delta_state(VM *vm, const ChainLink *link) {
+    const int fd = open(link->path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    const SnapshotLayout layout = snapshot_layout(sizeof(SnapshotDeltaHeader), link->header.smp_cores);
+    SnapshotState state;
+    int ok = read_state(fd, link->header.smp_cores, &layout, &state);
+    if (ok) {
+        ok = read_at(fd, vm->fb, FB_SIZE, layout.fb);
+        if (ok)
+            restore_state(vm, &state);
+        free_state(&state);
+    }
+    close(fd);
+    return ok;
+}
+
+/*
+ * Walk parent links back to the full snapshot, load that, then lay the
+ * deltas over it newest first so each page is read from one file only.
+ */
+static VM *load_chain(const char *path, const char *disk_path, int ram_backing) {
+    ChainLink *links = NULL;
+    size_t link_count = 0;
+    VM *vm = NULL;
+    uint8_t *applied = NULL;
+    char *next = strdup(path);
+    int ok = next != NULL;
+    while (ok) {
+        SnapshotDeltaHeader header;
+        ok = read_delta_header(next, &header);
+        if (ok && link_count > 0) {
+            const SnapshotDeltaHeader *child = &links[link_count - 1].header;
+            ok = header.sequence + 1u == child->sequence && header.chain_id == child->chain_id &&
+                 header.smp_cores == child->smp_cores && header.memory_size == child->memory_size;
+            if (!ok)
+                printf("[snapshot] %s does not continue into %s\n", next, links[link_count - 1].path);
+        }
+        ChainLink *grown = ok ? realloc(links, (link_count + 1u) * sizeof(*links)) : NULL;
+        if (!grown) {
+            ok = 0;
+            break;
+        }
+        links = grown;
+        links[link_count].path = next;
+        links[link_count].header = header;
+        link_count++;
+        next = sibling_path(next, header.parent);
+        ok = next != NULL;
+        if (header.sequence == 1)
+            break;
+    }
+
+    if (ok) {
+        uint64_t chain_id = 0;
+        vm = load_full(next, disk_path, ram_backing, &chain_id);
+        ok = vm != NULL;
+        if (ok && (chain_id != links[0].header.chain_id || (uint32_t)vm->smp_cores != links[0].header.smp_cores ||
+                   vm->memory_size != links[0].header.memory_size)) {
+            printf("[snapshot] %s is not the snapshot %s was taken against\n", next, path);
+            ok = 0;
+        }
+    }
+    if (ok) {
+        applied = calloc(vm->memory_size >> VM_REGION_PAGE_SHIFT, 1);
+        ok = applied != NULL;
+    }
+    for (size_t i = 0; ok && i < link_count; i++)
+        ok = apply_delta_pages(vm, &links[i], applied);
+    ok = ok && apply_delta_state(vm, &links[0]);
+    if (!ok && vm) {
+        printf("[snapshot] cannot read checkpoint chain of %s\n", path);
+        vm_destroy(vm);
+        vm = NULL;
+    }
+
+    free(applied);
+    free(next);
+    for (size_t i = 0; i < link_count; i++)
+        free(links[i].path);
+    free(links);
+    return vm;
+}
+
+VM *vm_snapshot_load(const char *path, const char *disk_path, int ram_backing) {
+    char magic[8];
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    const int delta = read_at(fd, magic, sizeof(magic), 0) &&
+                      memcmp(magic, SNAPSHOT_DELTA_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    uint64_t chain_id = 0;
+    return delta ? load_chain(path, disk_path, ram_backing)
+                 : load_full(path, disk_path, ram_backing, &chain_id);
+}
@@ -0,0 +1,46 @@
+#ifndef VM_SNAPSHOT_H
+#define VM_SNAPSHOT_H
+
+#include "vm.h"
+
+/*
+ * Whole-VM snapshots for --snapshot-save / --snapshot-load.
+ *
+ * A snapshot holds RAM, the framebuffer, every vCPU and the device state a
+ * guest can observe (I/O ports, serial FIFO, pending interrupts, timer,
+ * disk registers). The disk image itself is not included: restore against
+ * the image the snapshot was taken with. Files use the host's byte order
+ * and are only meant to be loaded by the same build.
+ */
+
+/*
+ * Write `vm` to `path`. Runs on a vCPU at a batch boundary with every other
+ * vCPU parked (see vm_service_control). Returns 0 on failure.
+ *
+ * A successful save also starts a checkpoint chain: every RAM page is
+ * write-protected (VM_REGION_WRITE_PROTECT) so the guest's next store to it
+ * is recorded.
+ */
+int vm_snapshot_save(VM *vm, const char *path);
+
+/*
+ * Write only what changed since the last save or checkpoint: the device and
+ * vCPU state, the framebuffer and the RAM pages written since, as
+ * `<path>.1`, `<path>.2`, ... Each delta names its parent, so loading the
+ * newest one restores the whole chain. Falls back to vm_snapshot_save when
+ * no chain has been started. Same calling rules as vm_snapshot_save.
+ */
+int vm_snapshot_checkpoint(VM *vm, const char *path);
+
+/*
+ * Create a VM in the state saved at `path`, with its disk on `disk_path` and
+ * RAM backed as `ram_backing` (VM_RAM_BACKING_*).
+ * `path` is a full snapshot or any delta of a chain, whose files must sit
+ * in one directory. RAM is mapped copy-on-write from the full snapshot, so
+ * restore cost grows with the pages in the deltas, not with guest RAM size.
+ * The block queues stay stopped until blk_restart(), so the caller can pick
+ * their backend first. Returns NULL on failure.
+ */
+VM *vm_snapshot_load(const char *path, const char *disk_path, int ram_backing);
+
+#endif // VM_SNAPSHOT_H
@@ -7,10 +7,12 @@
 #include "memory.h"
 #include "panic.h"
 
-static inline void data_push(VM *vm, uint32_t val) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
+/*
+ * All stacks live in guest memory and belong to one vCPU; callers on the
+ * execution path already hold that VCPU and pass it in.
+ */
+
+static inline void data_push(VM *vm, VCPU *cpu, uint32_t val) {
     if (cpu->dsp == 0) {
         panic("Data stack overflow", vm);
         return;
@@ -19,10 +21,7 @@ static inline void data_push(VM *vm, uint32_t val) {
     vm_write32(vm, cpu->data_stack_base + (vm_addr_t)(cpu->dsp * 4), val);
 }
 
-static inline uint32_t data_pop(VM *vm) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return 0;
+static inline uint32_t data_pop(VM *vm, VCPU *cpu) {
     if (cpu->dsp >= DATA_STACK_SIZE) {
         panic("Data stack underflow", vm);
         return 0;
@@ -32,10 +31,7 @@ static inline uint32_t data_pop(VM *vm) {
     return val;
 }
 
-static inline void call_push(VM *vm, uint64_t val) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
+static inline void call_push(VM *vm, VCPU *cpu, uint64_t val) {
     if (cpu->csp == 0) {
         panic("Call stack overflow", vm);
         return;
@@ -44,10 +40,7 @@ static inline void call_push(VM *vm, uint64_t val) {
     vm_write64(vm, cpu->call_stack_base + (vm_addr_t)(cpu->csp * 8), val);
 }
 
-static inline uint64_t call_pop(VM *vm) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return 0;
+static inline uint64_t call_pop(VM *vm, VCPU *cpu) {
     if (cpu->csp >= CALL_STACK_SIZE) {
         panic("Call stack underflow", vm);
         return 0;
@@ -56,10 +49,8 @@ static inline uint64_t call_pop(VM *vm) {
     cpu->csp++;
     return val;
 }
-static inline void isr_push(VM *vm, uint64_t val) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
+
+static inline void isr_push(VM *vm, VCPU *cpu, uint64_t val) {
     if (cpu->isp == 0) {
         panic("Interrupt stack overflow", vm);
         return;
@@ -68,10 +59,7 @@ static inline void isr_push(VM *vm, uint64_t val) {
     vm_write64(vm, cpu->isr_stack_base + (vm_addr_t)(cpu->isp * 8), val);
 }
 
-static inline uint64_t isr_pop(VM *vm) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return 0;
+static inline uint64_t isr_pop(VM *vm, VCPU *cpu) {
     if (cpu->isp >= ISR_STACK_SIZE) {
         panic("Interrupt stack underflow", vm);
         return 0;
@@ -4,7 +4,10 @@
 #define __USE_MISC
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include <SDL2/SDL_timer.h>
 #include <pthread.h>
 
@@ -16,7 +19,10 @@
 #include "loadbin.h"
 #include "interrupt.h"
 #include "memory.h"
+#include "mmio.h"
+#include "io_devices/blk/blk_mmio_register.h"
 #include "io_devices/disk/disk.h"
+#include "io_devices/disk/disk_cow.h"
 #include "io_devices/frame/frame.h"
 #include "io_devices/sysinfo/sysinfo_mmio_register.h"
 #include "io_devices/time/time_mmio_register.h"
@@ -25,9 +31,18 @@
 #include "float.h"
 #include "flags.h"
 #include "debug.h"
+#include "jit.h"
+#include "snapshot.h"
 
-const size_t MEM_SIZE = 1048576 * 64; // 64MB
+const size_t MEM_SIZE = 1048576 * 64; // 64MB, default for --mem
 enum { EXECUTION_TIMES_FLUSH_INTERVAL = 1024 };
+#ifdef VM_DEBUG
+/* The debugger pauses on instruction boundaries, so never batch. */
+enum { VM_DISPATCH_BATCH = 1 };
+#else
+/* Upper bound on instructions run between cpu->attention checks. */
+enum { VM_DISPATCH_BATCH = 64 };
+#endif
 
 typedef struct {
     VM *vm;
@@ -36,79 +51,13 @@ typedef struct {
 
 _Thread_local VCPU *vm_tls_vcpu = NULL;
 
-void update_zf_sf(VM *vm, int32_t result) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
-    if (result == 0)
-        cpu->flags |= FLAG_ZF;
-    else
-        cpu->flags &= ~FLAG_ZF;
-
-    if (result < 0)
-        cpu->flags |= FLAG_SF;
-    else
-        cpu->flags &= ~FLAG_SF;
-}
-
-void update_add_flags(VM *vm, int32_t a, int32_t b, int32_t result) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
-    if ((uint32_t) a + (uint32_t) b < (uint32_t) a)
-        cpu->flags |= FLAG_CF;
-    else
-        cpu->flags &= ~FLAG_CF;
-
-    if (((a > 0 && b > 0 && result < 0) || (a < 0 && b < 0 && result > 0)))
-        cpu->flags |= FLAG_OF;
-    else
-        cpu->flags &= ~FLAG_OF;
-
-    update_zf_sf(vm, result);
-}
-
-void update_sub_flags(VM *vm, int32_t a, int32_t b, int32_t result) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
-    if ((uint32_t) a < (uint32_t) b)
-        cpu->flags |= FLAG_CF;
-    else
-        cpu->flags &= ~FLAG_CF;
-
-    if (((a > 0 && b < 0 && result < 0) || (a < 0 && b > 0 && result > 0)))
-        cpu->flags |= FLAG_OF;
-    else
-        cpu->flags &= ~FLAG_OF;
-
-    update_zf_sf(vm, result);
-}
-
-static inline void clear_cf_of(VM *vm) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
-    cpu->flags &= ~(FLAG_CF | FLAG_OF);
-}
-
-static inline void update_logic_flags(VM *vm, int32_t result) {
-    clear_cf_of(vm);
-    update_zf_sf(vm, result);
-}
-
-static inline void set_cas_flags(VM *vm, int success) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
-    cpu->flags &= ~(FLAG_ZF | FLAG_SF | FLAG_CF | FLAG_OF);
-    if (success)
-        cpu->flags |= FLAG_ZF;
+static inline void set_cas_flags(VCPU *cpu, int success) {
+    vm_flags_set(cpu, success ? FLAG_ZF : 0u);
 }
 
 static inline void ensure_atomic_aligned_or_panic(VM *vm, vm_addr_t addr, const char *op_name) {
     if ((addr & 0x3u) != 0) {
-        panic(panic_format("%s unaligned address: 0x%08x", op_name, addr), vm);
+        panicf(vm, "%s unaligned address: 0x%08x", op_name, addr);
     }
 }
 
@@ -134,632 +83,1223 @@ static inline uint32_t rotr32(uint32_t v, uint32_t sh) {
     return (v >> sh) | (v << (32u - sh));
 }
 
-void vm_instruction_case(VM *vm) {
-    VCPU *cpu = vm_current_cpu(vm);
-    if (!cpu)
-        return;
-    uint8_t op, rd, rs1, rs2;
-    int32_t imm;
-    FETCH64(vm, op, rd, rs1, rs2, imm);
-    vm_debug_count_instruction(vm, op);
-    //printf("IP=%lu, executing opcode=%d\n", cpu->ip, op);
-    //printf("0x%08x,0x%08x,0x%08x,0x%08x\n", rd,rs1,rs2,imm);
-    switch (op) {
-        case OP_ADD: {
-            const int32_t a = cpu->regs[rs1];
-            const int32_t b = cpu->regs[rs2];
-            const int32_t res = a + b;
-            cpu->regs[rd] = res;
-            update_add_flags(vm, a, b, res);
-            break;
-        }
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void op_add(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int32_t a = cpu->regs[in->rs1];
+    const int32_t b = cpu->regs[in->rs2];
+    const int32_t res = a + b;
+    cpu->regs[in->rd] = res;
+    update_add_flags(cpu, a, b, res);
+}
 
-        case OP_SUB: {
-            int32_t a = cpu->regs[rs1];
-            int32_t b = cpu->regs[rs2];
-            int32_t res = a - b;
-            cpu->regs[rd] = res;
-            update_sub_flags(vm, a, b, res);
-            break;
-        }
-        case OP_MUL: {
-            cpu->regs[rd] = cpu->regs[rs1] * cpu->regs[rs2];
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_HALT: {
-            vm->halted = 1;
+static void op_sub(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    int32_t a = cpu->regs[in->rs1];
+    int32_t b = cpu->regs[in->rs2];
+    int32_t res = a - b;
+    cpu->regs[in->rd] = res;
+    update_sub_flags(cpu, a, b, res);
+}
+
+static void op_mul(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] * cpu->regs[in->rs2];
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_halt(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    vm_halt(vm);
+}
+
+static void op_jmp(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->ip = (size_t)(vm_addr_t)in->imm;
+}
+
+static void op_rjmp(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->ip = (size_t)rel_target_from_last_ip(cpu, in->imm);
+}
+
+static void op_push(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    data_push(vm, cpu, cpu->regs[in->rd]);
+}
+
+static void op_pop(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = data_pop(vm, cpu);
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_call(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    call_push(vm, cpu, (uint64_t)(vm_addr_t)cpu->ip);
+    cpu->ip = (size_t)(vm_addr_t)in->imm;
+}
+
+static void op_rcall(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    call_push(vm, cpu, (uint64_t)(vm_addr_t)cpu->ip);
+    cpu->ip = (size_t)rel_target_from_last_ip(cpu, in->imm);
+}
+
+static void op_callr(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    call_push(vm, cpu, (uint64_t)(vm_addr_t)cpu->ip);
+    cpu->ip = (size_t)(vm_addr_t)cpu->regs[in->rd];
+}
+
+static void op_ret(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->ip = (size_t)(vm_addr_t)call_pop(vm, cpu);
+}
+
+static void op_load(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    cpu->regs[in->rd] = (uint32_t) vm_read8(vm, addr);
+    update_zf_sf(cpu, cpu->regs[in->rd]);
+}
+
+static void op_load32(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    cpu->regs[in->rd] = vm_read32(vm, addr);
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_loadx32(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + cpu->regs[in->rs2] + in->imm;
+    cpu->regs[in->rd] = vm_read32(vm, addr);
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_store(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    vm_write8(vm, addr, (uint8_t) cpu->regs[in->rd]);
+}
+
+static void op_store32(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    vm_write32(vm, addr, (uint32_t) cpu->regs[in->rd]);
+}
+
+static void op_storex32(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + cpu->regs[in->rs2] + in->imm;
+    vm_write32(vm, addr, (uint32_t) cpu->regs[in->rd]);
+}
+
+static void op_cmp(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int32_t val1 = cpu->regs[in->rd];
+    const int32_t val2 = cpu->regs[in->rs1];
+    const int32_t res = val1 - val2;
+    update_sub_flags(cpu, val1, val2, res);
+}
+
+static void op_cmpi(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int32_t val1 = cpu->regs[in->rd];
+    const int32_t val2 = in->imm;
+    const int32_t res = val1 - val2;
+    update_sub_flags(cpu, val1, val2, res);
+}
+
+static void op_mov(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1];
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_movi(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = in->imm;
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_memset(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const uint32_t base = (uint32_t) cpu->regs[in->rd];
+    const uint8_t value = (uint8_t) cpu->regs[in->rs1];
+    const uint32_t count = (uint32_t) in->imm;
+
+    vm_memset(vm, base, value, count);
+}
+
+static void op_memcpy(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const uint32_t dest = (uint32_t) cpu->regs[in->rd];
+    const uint32_t src = (uint32_t) cpu->regs[in->rs1];
+    const uint32_t count = (uint32_t) in->imm;
+
+    vm_memcpy(vm, dest, src, count);
+}
+
+static void op_in(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int addr = cpu->regs[in->rs1];
+    if (addr >= 0 && addr < IO_SIZE) {
+        if (addr == CPU_CTX_CSP) {
+            cpu->regs[in->rd] = cpu->csp;
             return;
         }
-        case OP_JMP: {
-            cpu->ip = (size_t)(vm_addr_t)imm;
-            break;
-        }
-        case OP_RJMP: {
-            cpu->ip = (size_t)rel_target_from_last_ip(cpu, imm);
-            break;
-        }
-        case OP_PUSH: {
-            data_push(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_POP: {
-            cpu->regs[rd] = data_pop(vm);
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_CALL: {
-            call_push(vm, (uint64_t)(vm_addr_t)cpu->ip);
-            cpu->ip = (size_t)(vm_addr_t)imm;
-            break;
-        }
-        case OP_RCALL: {
-            call_push(vm, (uint64_t)(vm_addr_t)cpu->ip);
-            cpu->ip = (size_t)rel_target_from_last_ip(cpu, imm);
-            break;
-        }
-        case OP_CALLR: {
-            call_push(vm, (uint64_t)(vm_addr_t)cpu->ip);
-            cpu->ip = (size_t)(vm_addr_t)cpu->regs[rd];
-            break;
-        }
-        case OP_RET: {
-            cpu->ip = (size_t)(vm_addr_t)call_pop(vm);
-            break;
-        }
-        case OP_LOAD: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            cpu->regs[rd] = (uint32_t) vm_read8(vm, addr);
-            update_zf_sf(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_LOAD32: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            cpu->regs[rd] = vm_read32(vm, addr);
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_LOADX32: {
-            const vm_addr_t addr = cpu->regs[rs1] + cpu->regs[rs2] + imm;
-            cpu->regs[rd] = vm_read32(vm, addr);
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_STORE: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            vm_write8(vm, addr, (uint8_t) cpu->regs[rd]);
-            break;
-        }
-        case OP_STORE32: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            vm_write32(vm, addr, (uint32_t) cpu->regs[rd]);
-            break;
-        }
-        case OP_STOREX32: {
-            const vm_addr_t addr = cpu->regs[rs1] + cpu->regs[rs2] + imm;
-            vm_write32(vm, addr, (uint32_t) cpu->regs[rd]);
-            break;
-        }
-        case OP_CMP: {
-            const int32_t val1 = cpu->regs[rd];
-            const int32_t val2 = cpu->regs[rs1];
-            const int32_t res = val1 - val2;
-            update_sub_flags(vm, val1, val2, res);
-            break;
-        }
-        case OP_CMPI: {
-            const int32_t val1 = cpu->regs[rd];
-            const int32_t val2 = imm;
-            const int32_t res = val1 - val2;
-            update_sub_flags(vm, val1, val2, res);
-            break;
-        }
-        case OP_MOV: {
-            cpu->regs[rd] = cpu->regs[rs1];
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
+        if (addr == CPU_CTX_DSP) {
+            cpu->regs[in->rd] = cpu->dsp;
+            return;
         }
-        case OP_MOVI: {
-            cpu->regs[rd] = imm;
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
+        if (addr == CPU_CTX_IRQ_MASK) {
+            cpu->regs[in->rd] = cpu->irq_masked ? 1 : 0;
+            return;
         }
-        case OP_MEMSET: {
-            const uint32_t base = (uint32_t) cpu->regs[rd];
-            const uint8_t value = (uint8_t) cpu->regs[rs1];
-            const uint32_t count = (uint32_t) imm;
+        cpu->regs[in->rd] = (uint32_t)read_io(vm, addr);
+    } else {
+        panicf(vm, "IN invalid IO address %d", addr);
+    }
+}
 
-            for (uint32_t i = 0; i < count; i++) {
-                vm_write8(vm, base + i, value);
-            }
-            break;
-        }
-        case OP_MEMCPY: {
-            const uint32_t dest = (uint32_t) cpu->regs[rd];
-            const uint32_t src = (uint32_t) cpu->regs[rs1];
-            const uint32_t count = (uint32_t) imm;
-
-            for (uint32_t i = 0; i < count; i++) {
-                uint8_t v = vm_read8(vm, src + i);
-                vm_write8(vm, dest + i, v);
-            }
-            break;
-        }
-        case OP_IN: {
-            const int addr = cpu->regs[rs1];
-            if (addr >= 0 && addr < IO_SIZE) {
-                if (addr == CPU_CTX_CSP) {
-                    cpu->regs[rd] = cpu->csp;
-                    break;
-                }
-                if (addr == CPU_CTX_DSP) {
-                    cpu->regs[rd] = cpu->dsp;
-                    break;
-                }
-                if (addr == CPU_CTX_IRQ_MASK) {
-                    cpu->regs[rd] = cpu->irq_masked ? 1 : 0;
-                    break;
-                }
-                vm_shared_lock(vm);
-                if (addr == KEYBOARD) {
-                    int v = 0;
-                    if (vm->serial_rx_tail != vm->serial_rx_head) {
-                        v = (int)vm->serial_rx_fifo[vm->serial_rx_tail];
-                        vm->serial_rx_tail = (uint16_t)((vm->serial_rx_tail + 1u) & 0xFFu);
-                    }
-                    cpu->regs[rd] = v;
-                    if (vm->serial_rx_tail != vm->serial_rx_head) {
-                        vm->io[KEYBOARD] = (int)vm->serial_rx_fifo[vm->serial_rx_tail];
-                        vm->io[SCREEN_ATTRIBUTE] |= SERIAL_STATUS_RX_READY;
-                    } else {
-                        vm->io[KEYBOARD] = 0;
-                        vm->io[SCREEN_ATTRIBUTE] &= ~SERIAL_STATUS_RX_READY;
-                    }
-                    /*
-                     * RX read acts as IRQ acknowledge: clear serial/keyboard bits on core 0.
-                     * This prevents stale pending bits from retriggering the same input forever.
-                     */
-                    {
-                        const size_t word_idx = ((size_t)INT_SERIAL >> 6);
-                        const uint_fast64_t serial_mask = (uint_fast64_t)(1ULL << (INT_SERIAL & 63u));
-                        const uint_fast64_t keyboard_mask = (uint_fast64_t)(1ULL << (INT_KEYBOARD & 63u));
-                        const uint_fast64_t clear_mask = ~(serial_mask | keyboard_mask);
-                        atomic_fetch_and(&vm->interrupt_bitmap[word_idx], clear_mask);
-                    }
-                    if (vm->serial_rx_tail != vm->serial_rx_head &&
-                        ((vm->io[SCREEN_ATTRIBUTE] >> 8) & SERIAL_CTRL_RX_INT_ENABLE)) {
-                        trigger_interrupt(vm, INT_SERIAL);
-                    }
-                } else if (addr == SCREEN_ATTRIBUTE) {
-                    cpu->regs[rd] = vm->io[SCREEN_ATTRIBUTE] & 0xFF;
-                } else {
-                    cpu->regs[rd] = vm->io[addr];
-                }
-                vm_shared_unlock(vm);
-            } else {
-                panic(panic_format("IN invalid IO address %d", addr), vm);
-            }
-            break;
-        }
-        case OP_OUT: {
-            const int addr = cpu->regs[rs1];
-            if (addr >= 0 && addr < IO_SIZE) {
-                if (addr == CPU_CTX_CSP) {
-                    const int v = cpu->regs[rd];
-                    if (v >= 0 && v <= CALL_STACK_SIZE) {
-                        cpu->csp = v;
-                    }
-                    break;
-                }
-                if (addr == CPU_CTX_DSP) {
-                    const int v = cpu->regs[rd];
-                    if (v >= 0 && v <= DATA_STACK_SIZE) {
-                        cpu->dsp = v;
-                    }
-                    break;
-                }
-                if (addr == CPU_CTX_IRQ_MASK) {
-                    cpu->irq_masked = (cpu->regs[rd] != 0);
-                    break;
-                }
-                accept_io(vm, addr, cpu->regs[rd]);
-            } else {
-                panic(panic_format("OUT invalid IO address %d\n", addr), vm);
-            }
-            break;
-        }
-        case OP_INT: {
-            const uint32_t int_no = cpu->regs[rd];
-            vm_enter_interrupt(vm, int_no);
-            break;
-        }
-        case OP_IRET: {
-            vm_iret(vm);
-            break;
-        }
-        case OP_AND: {
-            cpu->regs[rd] = cpu->regs[rs1] & cpu->regs[rs2];
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_OR: {
-            cpu->regs[rd] = cpu->regs[rs1] | cpu->regs[rs2];
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_XOR: {
-            cpu->regs[rd] = cpu->regs[rs1] ^ cpu->regs[rs2];
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_NOT: {
-            cpu->regs[rd] = ~cpu->regs[rs1];
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_SHL: {
-            uint32_t sh = (uint32_t)cpu->regs[rs2] & 31u;
-            cpu->regs[rd] = (int32_t)((uint32_t)cpu->regs[rs1] << sh);
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_SHR: {
-            uint32_t sh = (uint32_t)cpu->regs[rs2] & 31u;
-            cpu->regs[rd] = (int32_t)((uint32_t)cpu->regs[rs1] >> sh); // 逻辑右移
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_SAR: {
-            uint32_t sh = (uint32_t)cpu->regs[rs2] & 31u;
-            cpu->regs[rd] = cpu->regs[rs1] >> sh;
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_ROL: {
-            uint32_t sh = (uint32_t)cpu->regs[rs2] & 31u;
-            cpu->regs[rd] = (int32_t)rotl32((uint32_t)cpu->regs[rs1], sh);
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_ROR: {
-            uint32_t sh = (uint32_t)cpu->regs[rs2] & 31u;
-            cpu->regs[rd] = (int32_t)rotr32((uint32_t)cpu->regs[rs1], sh);
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_DIV: {
-            if (cpu->regs[rs2] != 0) {
-                cpu->regs[rd] = cpu->regs[rs1] / cpu->regs[rs2];
-                update_logic_flags(vm, cpu->regs[rd]);
-            } else {
-                trigger_interrupt(vm, INT_DIVIDE_BY_ZERO);
+static void op_out(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int addr = cpu->regs[in->rs1];
+    if (addr >= 0 && addr < IO_SIZE) {
+        if (addr == CPU_CTX_CSP) {
+            const int v = cpu->regs[in->rd];
+            if (v >= 0 && v <= CALL_STACK_SIZE) {
+                cpu->csp = v;
             }
-            break;
+            return;
         }
-        case OP_MOD: {
-            if (cpu->regs[rs2] != 0) {
-                cpu->regs[rd] = cpu->regs[rs1] % cpu->regs[rs2];
-                update_logic_flags(vm, cpu->regs[rd]);
-            } else {
-                trigger_interrupt(vm, INT_DIVIDE_BY_ZERO);
+        if (addr == CPU_CTX_DSP) {
+            const int v = cpu->regs[in->rd];
+            if (v >= 0 && v <= DATA_STACK_SIZE) {
+                cpu->dsp = v;
             }
-            break;
+            return;
         }
-        case OP_INC: {
-            const int32_t a = cpu->regs[rd];
-            const int32_t b = 1;
-            const int32_t res = a + b;
-            cpu->regs[rd] = res;
-            update_add_flags(vm, a, b, res);
-            break;
+        if (addr == CPU_CTX_IRQ_MASK) {
+            cpu->irq_masked = (cpu->regs[in->rd] != 0);
+            if (!cpu->irq_masked)
+                vm_cpu_attention(cpu, VM_ATTN_IRQ);
+            return;
         }
+        accept_io(vm, addr, cpu->regs[in->rd]);
+    } else {
+        panicf(vm, "OUT invalid IO address %d\n", addr);
+    }
+}
 
-        case OP_JZ: {
-            if (cpu->flags & FLAG_ZF) {
-                cpu->ip = (size_t)(vm_addr_t)imm;
-            }
-            break;
-        }
-        case OP_RJZ: {
-            if (cpu->flags & FLAG_ZF) {
-                cpu->ip = (size_t)rel_target_from_last_ip(cpu, imm);
-            }
-            break;
-        }
-        case OP_JNZ: {
-            if (!(cpu->flags & FLAG_ZF)) {
-                cpu->ip = (size_t)(vm_addr_t)imm;
-            }
-            break;
-        }
-        case OP_RJNZ: {
-            if (!(cpu->flags & FLAG_ZF)) {
-                cpu->ip = (size_t)rel_target_from_last_ip(cpu, imm);
-            }
-            break;
-        }
-        case OP_JG: {
-            if (!(cpu->flags & FLAG_ZF) && ((cpu->flags & FLAG_SF) == (cpu->flags & FLAG_OF))) {
-                cpu->ip = (size_t)(vm_addr_t)imm;
-            }
-            break;
-        }
-        case OP_JGE: {
-            if ((cpu->flags & FLAG_SF) == (cpu->flags & FLAG_OF)) {
-                cpu->ip = (size_t)(vm_addr_t)imm;
-            }
-            break;
-        }
-        case OP_JL: {
-            if ((cpu->flags & FLAG_SF) != (cpu->flags & FLAG_OF)) {
-                cpu->ip = (size_t)(vm_addr_t)imm;
-            }
-            break;
-        }
-        case OP_JLE: {
-            if ((cpu->flags & FLAG_ZF) || (cpu->flags & FLAG_SF) != (cpu->flags & FLAG_OF)) {
-                cpu->ip = (size_t)(vm_addr_t)imm;
-            }
-            break;
-        }
-        case OP_JC: {
-            if (cpu->flags & FLAG_CF) {
-                cpu->ip = (size_t)(vm_addr_t)imm;
-            }
-            break;
-        }
-        case OP_JNC: {
-            if (!(cpu->flags & FLAG_CF)) {
-                cpu->ip = (size_t)(vm_addr_t)imm;
-            }
-            break;
-        }
+static void op_int(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const uint32_t int_no = cpu->regs[in->rd];
+    vm_enter_interrupt(vm, cpu, int_no);
+}
 
-        case OP_FADD: {
-            float a = reg_as_f32(cpu->regs[rs1]);
-            float b = reg_as_f32(cpu->regs[rs2]);
-            float r = a + b;
-            cpu->regs[rd] = f32_as_reg(r);
-            update_logic_flags(vm, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
-            break;
-        }
-        case OP_FSUB: {
-            float a = reg_as_f32(cpu->regs[rs1]);
-            float b = reg_as_f32(cpu->regs[rs2]);
-            float r = a - b;
-            cpu->regs[rd] = f32_as_reg(r);
-            update_logic_flags(vm, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
-            break;
-        }
-        case OP_FMUL: {
-            float a = reg_as_f32(cpu->regs[rs1]);
-            float b = reg_as_f32(cpu->regs[rs2]);
-            float r = a * b;
-            cpu->regs[rd] = f32_as_reg(r);
-            update_logic_flags(vm, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
-            break;
-        }
-        case OP_FDIV: {
-            float a = reg_as_f32(cpu->regs[rs1]);
-            float b = reg_as_f32(cpu->regs[rs2]);
-            float r = a / b;
-            cpu->regs[rd] = f32_as_reg(r);
-            update_logic_flags(vm, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
-            break;
-        }
-        case OP_FNEG: {
-            float a = reg_as_f32(cpu->regs[rs1]);
-            float r = -a;
-            cpu->regs[rd] = f32_as_reg(r);
-            update_logic_flags(vm, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
-            break;
-        }
-        case OP_FABS: {
-            float a = reg_as_f32(cpu->regs[rs1]);
-            float r = fabsf(a);
-            cpu->regs[rd] = f32_as_reg(r);
-            update_logic_flags(vm, (r == 0.0f) ? 0 : 1);
-            break;
-        }
-        case OP_FSQRT: {
-            float a = reg_as_f32(cpu->regs[rs1]);
-            float r = sqrtf(a);
-            cpu->regs[rd] = f32_as_reg(r);
-            update_logic_flags(vm, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
-            break;
-        }
-        case OP_ITOF: {
-            int32_t i = cpu->regs[rs1];
-            float f = (float) i;
-            cpu->regs[rd] = f32_as_reg(f);
-            update_logic_flags(vm, (f == 0.0f) ? 0 : (f < 0.0f ? -1 : 1));
-            break;
-        }
-        case OP_FTOI: {
-            float f = reg_as_f32(cpu->regs[rs1]);
-            if (f32_is_nan(f) || f > 2147483647.0f || f < -2147483648.0f) {
-                cpu->regs[rd] = 0;
-                cpu->flags |= FLAG_OF;
-                cpu->flags &= ~(FLAG_ZF | FLAG_SF | FLAG_CF);
-            } else {
-                int32_t i = (int32_t) f;
-                cpu->regs[rd] = i;
-                update_logic_flags(vm, i);
-            }
-            break;
-        }
+static void op_iret(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    vm_iret(vm, cpu);
+}
 
-        case OP_FLOAD32: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            uint32_t bits = (uint32_t) vm_read32(vm, addr);
-            cpu->regs[rd] = (int32_t) bits;
-            float f = reg_as_f32(cpu->regs[rd]);
-            update_logic_flags(vm, (f == 0.0f) ? 0 : (f < 0.0f ? -1 : 1));
-            break;
-        }
-        case OP_FSTORE32: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            vm_write32(vm, addr, (uint32_t) cpu->regs[rd]);
-            break;
-        }
-        case OP_FCMP: {
-            float a = reg_as_f32(cpu->regs[rd]);
-            float b = reg_as_f32(cpu->regs[rs1]);
-            update_fcmp_flags(vm, a, b);
-            break;
-        }
-        case OP_ADDI: {
-            const int32_t a = cpu->regs[rs1];
-            const int32_t b = imm;
-            const int32_t res = a + b;
-            cpu->regs[rd] = res;
-            update_add_flags(vm, a, b, res);
-            break;
-        }
-        case OP_SUBI: {
-            const int32_t a = cpu->regs[rs1];
-            const int32_t b = imm;
-            const int32_t res = a - b;
-            cpu->regs[rd] = res;
-            update_sub_flags(vm, a, b, res);
-            break;
-        }
-        case OP_ANDI: {
-            cpu->regs[rd] = cpu->regs[rs1] & imm;
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_ORI: {
-            cpu->regs[rd] = cpu->regs[rs1] | imm;
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_XORI: {
-            cpu->regs[rd] = cpu->regs[rs1] ^ imm;
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_SHLI: {
-            uint32_t sh = (uint32_t)imm & 31u;
-            cpu->regs[rd] = (int32_t)((uint32_t)cpu->regs[rs1] << sh);
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_SHRI: {
-            uint32_t sh = (uint32_t)imm & 31u;
-            cpu->regs[rd] = (int32_t)((uint32_t)cpu->regs[rs1] >> sh);
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_ROLI: {
-            uint32_t sh = (uint32_t)imm & 31u;
-            cpu->regs[rd] = (int32_t)rotl32((uint32_t)cpu->regs[rs1], sh);
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_RORI: {
-            uint32_t sh = (uint32_t)imm & 31u;
-            cpu->regs[rd] = (int32_t)rotr32((uint32_t)cpu->regs[rs1], sh);
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        case OP_CAS: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            ensure_atomic_aligned_or_panic(vm, addr, "CAS");
-            const uint32_t expected = (uint32_t)cpu->regs[rd];
-            const uint32_t desired = (uint32_t)cpu->regs[rs2];
-            int success = 0;
-            const uint32_t old = vm_atomic_compare_exchange32_seqcst(vm, addr, expected, desired, &success);
-            set_cas_flags(vm, success);
-            cpu->regs[rd] = (int32_t)old;
-            break;
-        }
-        case OP_XADD: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            ensure_atomic_aligned_or_panic(vm, addr, "XADD");
-            const uint32_t addend = (uint32_t)cpu->regs[rs2];
-            const uint32_t old = vm_atomic_fetch_add32_seqcst(vm, addr, addend);
-            const uint32_t newv = old + addend;
-            cpu->regs[rd] = (int32_t)old;
-            update_add_flags(vm, (int32_t)old, (int32_t)addend, (int32_t)newv);
+static void op_and(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] & cpu->regs[in->rs2];
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_or(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] | cpu->regs[in->rs2];
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_xor(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] ^ cpu->regs[in->rs2];
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_not(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = ~cpu->regs[in->rs1];
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_shl(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    uint32_t sh = (uint32_t)cpu->regs[in->rs2] & 31u;
+    cpu->regs[in->rd] = (int32_t)((uint32_t)cpu->regs[in->rs1] << sh);
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_shr(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    uint32_t sh = (uint32_t)cpu->regs[in->rs2] & 31u;
+    cpu->regs[in->rd] = (int32_t)((uint32_t)cpu->regs[in->rs1] >> sh); // 逻辑右移
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_sar(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    uint32_t sh = (uint32_t)cpu->regs[in->rs2] & 31u;
+    cpu->regs[in->rd] = cpu->regs[in->rs1] >> sh;
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_rol(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    uint32_t sh = (uint32_t)cpu->regs[in->rs2] & 31u;
+    cpu->regs[in->rd] = (int32_t)rotl32((uint32_t)cpu->regs[in->rs1], sh);
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_ror(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    uint32_t sh = (uint32_t)cpu->regs[in->rs2] & 31u;
+    cpu->regs[in->rd] = (int32_t)rotr32((uint32_t)cpu->regs[in->rs1], sh);
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_div(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    if (cpu->regs[in->rs2] != 0) {
+        cpu->regs[in->rd] = cpu->regs[in->rs1] / cpu->regs[in->rs2];
+        update_logic_flags(cpu, cpu->regs[in->rd]);
+    } else {
+        trigger_interrupt(vm, INT_DIVIDE_BY_ZERO);
+    }
+}
+
+static void op_mod(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    if (cpu->regs[in->rs2] != 0) {
+        cpu->regs[in->rd] = cpu->regs[in->rs1] % cpu->regs[in->rs2];
+        update_logic_flags(cpu, cpu->regs[in->rd]);
+    } else {
+        trigger_interrupt(vm, INT_DIVIDE_BY_ZERO);
+    }
+}
+
+static void op_inc(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int32_t a = cpu->regs[in->rd];
+    const int32_t b = 1;
+    const int32_t res = a + b;
+    cpu->regs[in->rd] = res;
+    update_add_flags(cpu, a, b, res);
+}
+
+static void op_jz(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    if (vm_flags_materialize(cpu) & FLAG_ZF) {
+        cpu->ip = (size_t)(vm_addr_t)in->imm;
+    }
+}
+
+static void op_rjz(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    if (vm_flags_materialize(cpu) & FLAG_ZF) {
+        cpu->ip = (size_t)rel_target_from_last_ip(cpu, in->imm);
+    }
+}
+
+static void op_jnz(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    if (!(vm_flags_materialize(cpu) & FLAG_ZF)) {
+        cpu->ip = (size_t)(vm_addr_t)in->imm;
+    }
+}
+
+static void op_rjnz(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    if (!(vm_flags_materialize(cpu) & FLAG_ZF)) {
+        cpu->ip = (size_t)rel_target_from_last_ip(cpu, in->imm);
+    }
+}
+
+static void op_jg(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const unsigned int f = vm_flags_materialize(cpu);
+    if (!(f & FLAG_ZF) && !vm_flags_signed_less(f)) {
+        cpu->ip = (size_t)(vm_addr_t)in->imm;
+    }
+}
+
+static void op_jge(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const unsigned int f = vm_flags_materialize(cpu);
+    if (!vm_flags_signed_less(f)) {
+        cpu->ip = (size_t)(vm_addr_t)in->imm;
+    }
+}
+
+static void op_jl(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const unsigned int f = vm_flags_materialize(cpu);
+    if (vm_flags_signed_less(f)) {
+        cpu->ip = (size_t)(vm_addr_t)in->imm;
+    }
+}
+
+static void op_jle(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const unsigned int f = vm_flags_materialize(cpu);
+    if ((f & FLAG_ZF) || vm_flags_signed_less(f)) {
+        cpu->ip = (size_t)(vm_addr_t)in->imm;
+    }
+}
+
+static void op_jc(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    if (vm_flags_materialize(cpu) & FLAG_CF) {
+        cpu->ip = (size_t)(vm_addr_t)in->imm;
+    }
+}
+
+static void op_jnc(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    if (!(vm_flags_materialize(cpu) & FLAG_CF)) {
+        cpu->ip = (size_t)(vm_addr_t)in->imm;
+    }
+}
+
+static void op_fadd(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    float a = reg_as_f32(cpu->regs[in->rs1]);
+    float b = reg_as_f32(cpu->regs[in->rs2]);
+    float r = a + b;
+    cpu->regs[in->rd] = f32_as_reg(r);
+    update_logic_flags(cpu, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
+}
+
+static void op_fsub(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    float a = reg_as_f32(cpu->regs[in->rs1]);
+    float b = reg_as_f32(cpu->regs[in->rs2]);
+    float r = a - b;
+    cpu->regs[in->rd] = f32_as_reg(r);
+    update_logic_flags(cpu, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
+}
+
+static void op_fmul(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    float a = reg_as_f32(cpu->regs[in->rs1]);
+    float b = reg_as_f32(cpu->regs[in->rs2]);
+    float r = a * b;
+    cpu->regs[in->rd] = f32_as_reg(r);
+    update_logic_flags(cpu, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
+}
+
+static void op_fdiv(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    float a = reg_as_f32(cpu->regs[in->rs1]);
+    float b = reg_as_f32(cpu->regs[in->rs2]);
+    float r = a / b;
+    cpu->regs[in->rd] = f32_as_reg(r);
+    update_logic_flags(cpu, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
+}
+
+static void op_fneg(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    float a = reg_as_f32(cpu->regs[in->rs1]);
+    float r = -a;
+    cpu->regs[in->rd] = f32_as_reg(r);
+    update_logic_flags(cpu, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
+}
+
+static void op_fabs(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    float a = reg_as_f32(cpu->regs[in->rs1]);
+    float r = fabsf(a);
+    cpu->regs[in->rd] = f32_as_reg(r);
+    update_logic_flags(cpu, (r == 0.0f) ? 0 : 1);
+}
+
+static void op_fsqrt(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    float a = reg_as_f32(cpu->regs[in->rs1]);
+    float r = sqrtf(a);
+    cpu->regs[in->rd] = f32_as_reg(r);
+    update_logic_flags(cpu, (r == 0.0f) ? 0 : (r < 0.0f ? -1 : 1));
+}
+
+static void op_itof(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    int32_t i = cpu->regs[in->rs1];
+    float f = (float) i;
+    cpu->regs[in->rd] = f32_as_reg(f);
+    update_logic_flags(cpu, (f == 0.0f) ? 0 : (f < 0.0f ? -1 : 1));
+}
+
+static void op_ftoi(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    float f = reg_as_f32(cpu->regs[in->rs1]);
+    if (f32_is_nan(f) || f > 2147483647.0f || f < -2147483648.0f) {
+        cpu->regs[in->rd] = 0;
+        vm_flags_set(cpu, FLAG_OF);
+    } else {
+        int32_t i = (int32_t) f;
+        cpu->regs[in->rd] = i;
+        update_logic_flags(cpu, i);
+    }
+}
+
+static void op_fload32(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    uint32_t bits = (uint32_t) vm_read32(vm, addr);
+    cpu->regs[in->rd] = (int32_t) bits;
+    float f = reg_as_f32(cpu->regs[in->rd]);
+    update_logic_flags(cpu, (f == 0.0f) ? 0 : (f < 0.0f ? -1 : 1));
+}
+
+static void op_fstore32(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    vm_write32(vm, addr, (uint32_t) cpu->regs[in->rd]);
+}
+
+static void op_fcmp(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    float a = reg_as_f32(cpu->regs[in->rd]);
+    float b = reg_as_f32(cpu->regs[in->rs1]);
+    update_fcmp_flags(cpu, a, b);
+}
+
+static void op_addi(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int32_t a = cpu->regs[in->rs1];
+    const int32_t b = in->imm;
+    const int32_t res = a + b;
+    cpu->regs[in->rd] = res;
+    update_add_flags(cpu, a, b, res);
+}
+
+static void op_subi(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int32_t a = cpu->regs[in->rs1];
+    const int32_t b = in->imm;
+    const int32_t res = a - b;
+    cpu->regs[in->rd] = res;
+    update_sub_flags(cpu, a, b, res);
+}
+
+static void op_andi(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] & in->imm;
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_ori(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] | in->imm;
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_xori(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] ^ in->imm;
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_shli(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    uint32_t sh = (uint32_t)in->imm & 31u;
+    cpu->regs[in->rd] = (int32_t)((uint32_t)cpu->regs[in->rs1] << sh);
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_shri(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    uint32_t sh = (uint32_t)in->imm & 31u;
+    cpu->regs[in->rd] = (int32_t)((uint32_t)cpu->regs[in->rs1] >> sh);
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_roli(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    uint32_t sh = (uint32_t)in->imm & 31u;
+    cpu->regs[in->rd] = (int32_t)rotl32((uint32_t)cpu->regs[in->rs1], sh);
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_rori(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    uint32_t sh = (uint32_t)in->imm & 31u;
+    cpu->regs[in->rd] = (int32_t)rotr32((uint32_t)cpu->regs[in->rs1], sh);
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_cas(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    ensure_atomic_aligned_or_panic(vm, addr, "CAS");
+    const uint32_t expected = (uint32_t)cpu->regs[in->rd];
+    const uint32_t desired = (uint32_t)cpu->regs[in->rs2];
+    int success = 0;
+    const uint32_t old = vm_atomic_compare_exchange32_seqcst(vm, addr, expected, desired, &success);
+    set_cas_flags(cpu, success);
+    cpu->regs[in->rd] = (int32_t)old;
+}
+
+static void op_xadd(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    ensure_atomic_aligned_or_panic(vm, addr, "XADD");
+    const uint32_t addend = (uint32_t)cpu->regs[in->rs2];
+    const uint32_t old = vm_atomic_fetch_add32_seqcst(vm, addr, addend);
+    const uint32_t newv = old + addend;
+    cpu->regs[in->rd] = (int32_t)old;
+    update_add_flags(cpu, (int32_t)old, (int32_t)addend, (int32_t)newv);
+}
+
+static void op_xchg(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    ensure_atomic_aligned_or_panic(vm, addr, "XCHG");
+    const uint32_t newv = (uint32_t)cpu->regs[in->rs2];
+    const uint32_t old = vm_atomic_exchange32_seqcst(vm, addr, newv);
+    cpu->regs[in->rd] = (int32_t)old;
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_ldar(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    ensure_atomic_aligned_or_panic(vm, addr, "LDAR");
+    const uint32_t v = vm_atomic_load32_acquire(vm, addr);
+    cpu->regs[in->rd] = (int32_t)v;
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+static void op_stlr(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const vm_addr_t addr = cpu->regs[in->rs1] + in->imm;
+    ensure_atomic_aligned_or_panic(vm, addr, "STLR");
+    const uint32_t v = (uint32_t)cpu->regs[in->rd];
+    vm_atomic_store32_release(vm, addr, v);
+}
+
+static void op_fence(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void op_pause(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    sched_yield();
+}
+
+static void op_startap(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    if (!cpu->is_bsp)
+        return;
+    const int target = (int)cpu->regs[in->rd];
+    const vm_addr_t entry = (vm_addr_t)(cpu->regs[in->rs1] + in->imm);
+    if (target <= 0 || target >= vm->smp_cores)
+        return;
+    vm->cpus[target].ip = entry;
+    vm->cpus[target].last_ip = entry;
+    atomic_store_explicit(&vm->core_released[target], true, memory_order_release);
+}
+
+static void op_ipi(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int target = (int)cpu->regs[in->rd];
+    const uint32_t int_no = (uint32_t)cpu->regs[in->rs1];
+    trigger_interrupt_target(vm, target, int_no);
+}
+
+static void op_cpuid(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    cpu->regs[in->rd] = (uint32_t)cpu->core_id;
+    update_logic_flags(cpu, cpu->regs[in->rd]);
+}
+
+/*
+ * Superinstructions (see decode.h). `in` is the first slot of the sequence,
+ * in[1] and in[2] the ones after it. Between two parts, fused_step() moves
+ * ip/last_ip exactly like vm_fetch() would have.
+ */
+static inline void fused_step(VCPU *cpu) {
+    cpu->last_ip = cpu->ip;
+    cpu->ip += 8u;
+}
+
+static void op_cmpi_jnz(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int32_t val1 = cpu->regs[in->rd];
+    const int32_t res = val1 - in->imm;
+    update_sub_flags(cpu, val1, in->imm, res);
+    fused_step(cpu);
+    if (res != 0) {
+        cpu->ip = (size_t)(vm_addr_t)in[1].imm;
+    }
+}
+
+static void op_cmpi_rjnz(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    const int32_t val1 = cpu->regs[in->rd];
+    const int32_t res = val1 - in->imm;
+    update_sub_flags(cpu, val1, in->imm, res);
+    fused_step(cpu);
+    if (res != 0) {
+        cpu->ip = (size_t)rel_target_from_last_ip(cpu, in[1].imm);
+    }
+}
+
+static void op_movi_store32(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    op_movi(vm, cpu, in);
+    fused_step(cpu);
+    op_store32(vm, cpu, &in[1]);
+}
+
+static void op_addi_cmp_jl(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    op_addi(vm, cpu, in);
+    fused_step(cpu);
+    op_cmp(vm, cpu, &in[1]);
+    fused_step(cpu);
+    op_jl(vm, cpu, &in[2]);
+}
+
+static void op_load32_cmpi(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    op_load32(vm, cpu, in);
+    fused_step(cpu);
+    op_cmpi(vm, cpu, &in[1]);
+}
+#pragma GCC diagnostic pop
+
+/*
+ * Opcode -> handler table shared by both dispatch engines. The third column
+ * says whether the dispatcher may run straight into the next instruction
+ * (NEXT) or must return to vm_thread first (EXIT) because the handler can
+ * halt the VM, raise an interrupt for this core or touch devices.
+ * BRANCH behaves like NEXT unless the JIT is active, which needs to see
+ * every block entry to find hot code.
+ */
+#define VM_OPCODE_TABLE(X) \
+    X(OP_ADD, op_add, NEXT) \
+    X(OP_SUB, op_sub, NEXT) \
+    X(OP_MUL, op_mul, NEXT) \
+    X(OP_HALT, op_halt, EXIT) \
+    X(OP_JMP, op_jmp, BRANCH) \
+    X(OP_RJMP, op_rjmp, BRANCH) \
+    X(OP_PUSH, op_push, NEXT) \
+    X(OP_POP, op_pop, NEXT) \
+    X(OP_CALL, op_call, BRANCH) \
+    X(OP_RCALL, op_rcall, BRANCH) \
+    X(OP_CALLR, op_callr, BRANCH) \
+    X(OP_RET, op_ret, BRANCH) \
+    X(OP_LOAD, op_load, NEXT) \
+    X(OP_LOAD32, op_load32, NEXT) \
+    X(OP_LOADX32, op_loadx32, NEXT) \
+    X(OP_STORE, op_store, NEXT) \
+    X(OP_STORE32, op_store32, NEXT) \
+    X(OP_STOREX32, op_storex32, NEXT) \
+    X(OP_CMP, op_cmp, NEXT) \
+    X(OP_CMPI, op_cmpi, NEXT) \
+    X(OP_MOV, op_mov, NEXT) \
+    X(OP_MOVI, op_movi, NEXT) \
+    X(OP_MEMSET, op_memset, NEXT) \
+    X(OP_MEMCPY, op_memcpy, NEXT) \
+    X(OP_IN, op_in, EXIT) \
+    X(OP_OUT, op_out, EXIT) \
+    X(OP_INT, op_int, EXIT) \
+    X(OP_IRET, op_iret, EXIT) \
+    X(OP_AND, op_and, NEXT) \
+    X(OP_OR, op_or, NEXT) \
+    X(OP_XOR, op_xor, NEXT) \
+    X(OP_NOT, op_not, NEXT) \
+    X(OP_SHL, op_shl, NEXT) \
+    X(OP_SHR, op_shr, NEXT) \
+    X(OP_SAR, op_sar, NEXT) \
+    X(OP_ROL, op_rol, NEXT) \
+    X(OP_ROR, op_ror, NEXT) \
+    X(OP_DIV, op_div, EXIT) \
+    X(OP_MOD, op_mod, EXIT) \
+    X(OP_INC, op_inc, NEXT) \
+    X(OP_JZ, op_jz, BRANCH) \
+    X(OP_RJZ, op_rjz, BRANCH) \
+    X(OP_JNZ, op_jnz, BRANCH) \
+    X(OP_RJNZ, op_rjnz, BRANCH) \
+    X(OP_JG, op_jg, BRANCH) \
+    X(OP_JGE, op_jge, BRANCH) \
+    X(OP_JL, op_jl, BRANCH) \
+    X(OP_JLE, op_jle, BRANCH) \
+    X(OP_JC, op_jc, BRANCH) \
+    X(OP_JNC, op_jnc, BRANCH) \
+    X(OP_FADD, op_fadd, NEXT) \
+    X(OP_FSUB, op_fsub, NEXT) \
+    X(OP_FMUL, op_fmul, NEXT) \
+    X(OP_FDIV, op_fdiv, NEXT) \
+    X(OP_FNEG, op_fneg, NEXT) \
+    X(OP_FABS, op_fabs, NEXT) \
+    X(OP_FSQRT, op_fsqrt, NEXT) \
+    X(OP_ITOF, op_itof, NEXT) \
+    X(OP_FTOI, op_ftoi, NEXT) \
+    X(OP_FLOAD32, op_fload32, NEXT) \
+    X(OP_FSTORE32, op_fstore32, NEXT) \
+    X(OP_FCMP, op_fcmp, NEXT) \
+    X(OP_ADDI, op_addi, NEXT) \
+    X(OP_SUBI, op_subi, NEXT) \
+    X(OP_ANDI, op_andi, NEXT) \
+    X(OP_ORI, op_ori, NEXT) \
+    X(OP_XORI, op_xori, NEXT) \
+    X(OP_SHLI, op_shli, NEXT) \
+    X(OP_SHRI, op_shri, NEXT) \
+    X(OP_ROLI, op_roli, NEXT) \
+    X(OP_RORI, op_rori, NEXT) \
+    X(OP_CAS, op_cas, NEXT) \
+    X(OP_XADD, op_xadd, NEXT) \
+    X(OP_XCHG, op_xchg, NEXT) \
+    X(OP_LDAR, op_ldar, NEXT) \
+    X(OP_STLR, op_stlr, NEXT) \
+    X(OP_FENCE, op_fence, NEXT) \
+    X(OP_PAUSE, op_pause, EXIT) \
+    X(OP_STARTAP, op_startap, EXIT) \
+    X(OP_IPI, op_ipi, EXIT) \
+    X(OP_CPUID, op_cpuid, NEXT)
+
+/*
+ * Superinstructions: opcode, handler, kind of the last part and how many
+ * guest instructions the slot retires.
+ */
+#define VM_FUSED_TABLE(X) \
+    X(VM_OP_FUSED_CMPI_JNZ, op_cmpi_jnz, BRANCH, 2) \
+    X(VM_OP_FUSED_CMPI_RJNZ, op_cmpi_rjnz, BRANCH, 2) \
+    X(VM_OP_FUSED_MOVI_STORE32, op_movi_store32, NEXT, 2) \
+    X(VM_OP_FUSED_ADDI_CMP_JL, op_addi_cmp_jl, BRANCH, 3) \
+    X(VM_OP_FUSED_LOAD32_CMPI, op_load32_cmpi, NEXT, 2)
+
+#define VM_HANDLER_ENTRY(opc, fn, kind) [opc] = fn,
+const vm_op_handler_fn vm_op_handlers[256] = {
+    VM_OPCODE_TABLE(VM_HANDLER_ENTRY)
+};
+#undef VM_HANDLER_ENTRY
+
+#define VM_FUSED_HANDLER_ENTRY(opc, fn, kind, len) [opc] = fn,
+const vm_op_handler_fn vm_fused_handlers[256] = {
+    VM_FUSED_TABLE(VM_FUSED_HANDLER_ENTRY)
+};
+#undef VM_FUSED_HANDLER_ENTRY
+
+/*
+ * Installed by the decoder (as VM_OP_INVALID) for undefined opcodes and for
+ * register fields that index past REG_COUNT. The raw word is re-read for the
+ * diagnostic since the decoded slot no longer carries the original opcode.
+ */
+void vm_op_invalid(VM *vm, VCPU *cpu, const VM_DecodedInst *in) {
+    (void)in;
+    uint64_t inst = 0;
+    memcpy(&inst, &vm->memory[cpu->last_ip], sizeof(uint64_t));
+    const uint8_t op = (uint8_t)((inst >> 56) & 0xFF);
+    if (!vm_op_handlers[op]) {
+        panicf(vm, "Unknown opcode %d\n", op);
+        return;
+    }
+    panicf(vm,
+           "Invalid register operand: op=%u rd=%u rs1=%u rs2=%u\n",
+           op,
+           (unsigned)((inst >> 48) & 0xFF),
+           (unsigned)((inst >> 40) & 0xFF),
+           (unsigned)((inst >> 32) & 0xFF));
+}
+
+#ifdef VM_THREADED_DISPATCH
+/*
+ * Threaded dispatch: every handler body ends in its own indirect jump to the
+ * next instruction's label, so the host predictor sees one branch site per
+ * opcode instead of a single shared switch jump.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+uint32_t vm_execute(VM *vm, VCPU *cpu, uint32_t budget) {
+#define VM_LABEL_ENTRY(opc, fn, kind) [opc] = &&L_##fn,
+#define VM_FUSED_LABEL_ENTRY(opc, fn, kind, len) [opc] = &&L_##fn,
+    static const void *const labels[256] = {
+        [VM_OP_INVALID] = &&L_invalid,
+        VM_OPCODE_TABLE(VM_LABEL_ENTRY)
+        VM_FUSED_TABLE(VM_FUSED_LABEL_ENTRY)
+    };
+#undef VM_FUSED_LABEL_ENTRY
+#undef VM_LABEL_ENTRY
+    uint32_t executed = 0;
+    const VM_DecodedInst *in = NULL;
+
+/* A handler that panicked (or halted the VM) returns like any other; nothing may run after it. */
+#define VM_DISPATCH()                                                                              \
+    do {                                                                                           \
+        if (executed >= budget || vm->halted || vm->panic)                                         \
+            goto out;                                                                              \
+        in = vm_fetch(vm, cpu);                                                                    \
+        if (!in)                                                                                   \
+            goto out;                                                                              \
+        executed++;                                                                                \
+        vm_debug_count_instruction(vm, cpu, in->op, (vm_addr_t)cpu->last_ip);                      \
+        goto *labels[in->op];                                                                      \
+    } while (0)
+#define VM_AFTER_NEXT VM_DISPATCH()
+#define VM_AFTER_EXIT goto out
+#define VM_AFTER_BRANCH                                                                            \
+    if (vm->jit)                                                                                   \
+        goto out;                                                                                  \
+    VM_DISPATCH()
+#define VM_LABEL_BODY(opc, fn, kind)                                                               \
+    L_##fn:                                                                                        \
+    fn(vm, cpu, in);                                                                               \
+    VM_AFTER_##kind;
+#define VM_FUSED_LABEL_BODY(opc, fn, kind, len)                                                    \
+    L_##fn:                                                                                        \
+    fn(vm, cpu, in);                                                                               \
+    executed += (len) - 1u;                                                                        \
+    VM_AFTER_##kind;
+
+    VM_DISPATCH();
+    VM_OPCODE_TABLE(VM_LABEL_BODY)
+    VM_FUSED_TABLE(VM_FUSED_LABEL_BODY)
+L_invalid:
+    vm_op_invalid(vm, cpu, in);
+out:
+    return executed;
+
+#undef VM_FUSED_LABEL_BODY
+#undef VM_LABEL_BODY
+#undef VM_AFTER_BRANCH
+#undef VM_AFTER_EXIT
+#undef VM_AFTER_NEXT
+#undef VM_DISPATCH
+}
+#pragma GCC diagnostic pop
+#else
+/* Portable dispatch: one indirect call per instruction through the decoded slot. */
+#define VM_EXIT_ENTRY(opc, fn, kind) [opc] = VM_ENDS_BATCH_##kind,
+#define VM_FUSED_EXIT_ENTRY(opc, fn, kind, len) [opc] = VM_ENDS_BATCH_##kind,
+enum { VM_ENDS_BATCH_NEXT = 0, VM_ENDS_BATCH_EXIT = 1, VM_ENDS_BATCH_BRANCH = 2 };
+static const uint8_t ends_batch[256] = {
+    [VM_OP_INVALID] = 1,
+    VM_OPCODE_TABLE(VM_EXIT_ENTRY)
+    VM_FUSED_TABLE(VM_FUSED_EXIT_ENTRY)
+};
+#undef VM_FUSED_EXIT_ENTRY
+#undef VM_EXIT_ENTRY
+
+/* Guest instructions retired by a slot beyond the first. */
+#define VM_FUSED_EXTRA_ENTRY(opc, fn, kind, len) [opc] = (len) - 1u,
+static const uint8_t fused_extra[256] = {
+    VM_FUSED_TABLE(VM_FUSED_EXTRA_ENTRY)
+};
+#undef VM_FUSED_EXTRA_ENTRY
+
+uint32_t vm_execute(VM *vm, VCPU *cpu, uint32_t budget) {
+    uint32_t executed = 0;
+    while (executed < budget) {
+        const VM_DecodedInst *in = vm_fetch(vm, cpu);
+        if (!in)
+            break;
+        executed += 1u + fused_extra[in->op];
+        vm_debug_count_instruction(vm, cpu, in->op, (vm_addr_t)cpu->last_ip);
+        atomic_load_explicit(&in->handler, memory_order_relaxed)(vm, cpu, in);
+        const uint8_t ends = ends_batch[in->op];
+        if (ends == VM_ENDS_BATCH_EXIT || (ends == VM_ENDS_BATCH_BRANCH && vm->jit))
+            break;
+        /* A handler that panicked (or halted the VM) returns like any other; nothing may run after it. */
+        if (vm->halted || vm->panic)
             break;
-        }
-        case OP_XCHG: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            ensure_atomic_aligned_or_panic(vm, addr, "XCHG");
-            const uint32_t newv = (uint32_t)cpu->regs[rs2];
-            const uint32_t old = vm_atomic_exchange32_seqcst(vm, addr, newv);
-            cpu->regs[rd] = (int32_t)old;
-            update_logic_flags(vm, cpu->regs[rd]);
+    }
+    return executed;
+}
+#endif
+
+static inline void vm_flush_execution_times(VCPU *cpu, uint64_t *local_cycles) {
+    if (*local_cycles == 0) {
+        return;
+    }
+    /* Each counter has a single writer, its own vCPU thread: no RMW needed. */
+    const uint64_t total = atomic_load_explicit(&cpu->execution_times, memory_order_relaxed);
+    atomic_store_explicit(&cpu->execution_times, total + *local_cycles, memory_order_relaxed);
+    *local_cycles = 0;
+}
+
+/* Apply what other threads posted to vm->events and vm->irq_posted (uniprocessor mode). */
+static void vm_drain_events(VM *vm) {
+    uint_fast64_t raised = 0;
+    for (size_t w = 0; w < IRQ_BITMAP_WORDS; w++) {
+        const uint_fast64_t bits = atomic_exchange_explicit(&vm->irq_posted[w], 0, memory_order_acquire);
+        if (!bits)
+            continue;
+        const uint_fast64_t word = atomic_load_explicit(&vm->interrupt_bitmap[w], memory_order_relaxed);
+        atomic_store_explicit(&vm->interrupt_bitmap[w], word | bits, memory_order_relaxed);
+        raised |= bits;
+    }
+    if (raised)
+        vm_cpu_attention(&vm->cpus[0], VM_ATTN_IRQ);
+
+    uint32_t kind = 0;
+    uint32_t arg = 0;
+    while (vm_event_pop(&vm->events, &kind, &arg)) {
+        switch (kind) {
+        case VM_EVENT_SERIAL_RX:
+            (void)vm_serial_rx_push(vm, (uint8_t)arg);
             break;
-        }
-        case OP_LDAR: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            ensure_atomic_aligned_or_panic(vm, addr, "LDAR");
-            const uint32_t v = vm_atomic_load32_acquire(vm, addr);
-            cpu->regs[rd] = (int32_t)v;
-            update_logic_flags(vm, cpu->regs[rd]);
+        default:
             break;
         }
-        case OP_STLR: {
-            const vm_addr_t addr = cpu->regs[rs1] + imm;
-            ensure_atomic_aligned_or_panic(vm, addr, "STLR");
-            const uint32_t v = (uint32_t)cpu->regs[rd];
-            vm_atomic_store32_release(vm, addr, v);
+    }
+}
+
+/* VM_ATTN_PAUSE: wait here, at a batch boundary, until vm_resume_others(). */
+static void vm_park(VM *vm) {
+    pthread_mutex_lock(&vm->pause_lock);
+    vm->paused_cores++;
+    while (vm->pause_requested)
+        pthread_cond_wait(&vm->pause_cond, &vm->pause_lock);
+    vm->paused_cores--;
+    pthread_mutex_unlock(&vm->pause_lock);
+}
+
+/*
+ * Park every other running vCPU so `self` sees the whole machine at rest.
+ * Device threads keep running. Returns 0 if the VM stopped first; either
+ * way the caller must follow up with vm_resume_others().
+ */
+static int vm_pause_others(VM *vm, VCPU *self) {
+    /* vm_step() runs the others on this thread, between batches already. */
+    if (vm->stepped)
+        return 1;
+    int want = 0;
+    pthread_mutex_lock(&vm->pause_lock);
+    /* Another vCPU is pausing the machine (a JIT flush against a control command): let it finish first. */
+    while (vm->pause_requested) {
+        pthread_mutex_unlock(&vm->pause_lock);
+        vm_park(vm);
+        pthread_mutex_lock(&vm->pause_lock);
+    }
+    vm->pause_requested = 1;
+    for (int i = 0; i < vm->smp_cores; i++) {
+        /* Unreleased APs are not running and only a running vCPU can release them. */
+        if (&vm->cpus[i] == self || !atomic_load_explicit(&vm->core_released[i], memory_order_acquire))
+            continue;
+        want++;
+        vm_cpu_attention(&vm->cpus[i], VM_ATTN_PAUSE);
+    }
+    while (vm->paused_cores < want && !vm->halted && !vm->panic) {
+        pthread_mutex_unlock(&vm->pause_lock);
+        sched_yield();
+        pthread_mutex_lock(&vm->pause_lock);
+    }
+    const int ok = vm->paused_cores >= want;
+    pthread_mutex_unlock(&vm->pause_lock);
+    return ok;
+}
+
+static void vm_resume_others(VM *vm) {
+    pthread_mutex_lock(&vm->pause_lock);
+    vm->pause_requested = 0;
+    pthread_cond_broadcast(&vm->pause_cond);
+    pthread_mutex_unlock(&vm->pause_lock);
+}
+
+#define VM_CLONE_MAX 1024
+
+void *vm_thread(void *arg);
+
+typedef struct {
+    VM *vm;
+    pthread_t forker;
+    int forker_core;
+} CloneMainArg;
+
+/*
+ * A clone's stand-in for main(): bring up the vCPU threads fork() left
+ * behind, wait for the VM to stop and exit with its status. The clone has
+ * no display; its serial output goes to a log instead.
+ */
+static void *vm_clone_main(void *arg) {
+    CloneMainArg *clone = arg;
+    VM *vm = clone->vm;
+    const pthread_t forker = clone->forker;
+    const int forker_core = clone->forker_core;
+    free(clone);
+
+    pthread_t *thread_ids = malloc(sizeof(pthread_t) * (size_t)vm->smp_cores);
+    int created_threads = 0;
+    for (int i = 0; thread_ids && i < vm->smp_cores; i++) {
+        if (i == forker_core)
+            continue;
+        CpuThreadArg *thread_arg = malloc(sizeof(CpuThreadArg));
+        if (!thread_arg) {
+            vm_halt(vm);
             break;
         }
-        case OP_FENCE: {
-            (void)rd;
-            (void)rs1;
-            (void)rs2;
-            (void)imm;
-            atomic_thread_fence(memory_order_seq_cst);
+        thread_arg->vm = vm;
+        thread_arg->core_id = i;
+        if (pthread_create(&thread_ids[created_threads], NULL, vm_thread, thread_arg) != 0) {
+            free(thread_arg);
+            vm_halt(vm);
             break;
         }
-        case OP_PAUSE: {
-            (void)rd;
-            (void)rs1;
-            (void)rs2;
-            (void)imm;
+        created_threads++;
+    }
+    if (!thread_ids)
+        vm_halt(vm);
+
+    pthread_join(forker, NULL);
+    for (int i = 0; i < created_threads; i++)
+        pthread_join(thread_ids[i], NULL);
+    free(thread_ids);
+    /* What the clone wrote outlives it in its overlay; see vm-disk commit. */
+    if (!disk_flush(&vm->disk))
+        fprintf(stderr, "[clone] disk flush failed: %s\n", strerror(errno));
+    fflush(stdout);
+    /* Skip the parent's atexit handlers (SDL) and let the status through. */
+    _exit(vm->panic ? 1 : vm->exit_code);
+}
+
+/* `<clone_dir>/clone-<index>.<ext>` */
+static char *vm_clone_path(const VM *vm, int index, const char *ext) {
+    const char *dir = vm->clone_dir ? vm->clone_dir : ".";
+    char *path = malloc(strlen(dir) + strlen(ext) + 24);
+    if (path)
+        sprintf(path, "%s/clone-%d.%s", dir, index, ext);
+    return path;
+}
+
+/* First thing in a new clone: only the calling vCPU thread made it across fork(). */
+static void vm_clone_setup(VM *vm, VCPU *cpu, int index) {
+    /* The parked vCPUs are gone, and so is anyone who was waiting on these. */
+    vm->pause_requested = 0;
+    vm->paused_cores = 0;
+    pthread_cond_init(&vm->pause_cond, NULL);
+    vm->clone_index = index;
+    vm->clone_count = 0;
+    free(vm->clone_pids);
+    vm->clone_pids = NULL;
+    /* Clones would overwrite each other's snapshots. */
+    vm->snapshot_path = NULL;
+    vm->checkpoint_interval_ms = 0;
+
+    char *log_path = vm_clone_path(vm, index, "log");
+    char *disk_path = vm_clone_path(vm, index, "disk");
+    const int log_fd = log_path ? open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    int ok = log_fd >= 0 && dup2(log_fd, STDOUT_FILENO) >= 0;
+    if (log_fd >= 0)
+        close(log_fd);
+    ok = ok && disk_path && disk_fork_child(vm, disk_path);
+    if (ok) {
+        time_fork_child(vm);
+        blk_fork_child(vm);
+    }
+
+    CloneMainArg *clone = ok ? malloc(sizeof(CloneMainArg)) : NULL;
+    pthread_t main_thread;
+    if (clone) {
+        clone->vm = vm;
+        clone->forker = pthread_self();
+        clone->forker_core = (int)(cpu - vm->cpus);
+        ok = pthread_create(&main_thread, NULL, vm_clone_main, clone) == 0;
+        if (ok)
+            pthread_detach(main_thread);
+    }
+    if (!clone || !ok) {
+        fprintf(stderr, "[clone] %d: setup failed\n", index);
+        _exit(1);
+    }
+    free(disk_path);
+    free(log_path);
+}
+
+/*
+ * VM_CONTROL_CMD_FORK: fork `count` clones of this process at the current
+ * instruction boundary, RAM and all shared copy-on-write. Runs with every
+ * other vCPU parked and the disk and block queues idle; the locks other host threads take
+ * are held across fork() so none is copied mid-update. Returns the status
+ * the guest reads in this process.
+ */
+static int vm_fork_clones(VM *vm, VCPU *cpu, uint32_t count) {
+    /* A clone only gets the forking thread, and a stepped VM's embedder is not in it. */
+    if (count == 0 || count > VM_CLONE_MAX || vm->clone_index != 0 || vm->clone_pids || vm->stepped) {
+        printf("[clone] cannot fork %u clones here\n", count);
+        return VM_CONTROL_STATUS_FAILED;
+    }
+    vm->clone_pids = calloc(count, sizeof(pid_t));
+    if (!vm->clone_pids)
+        return VM_CONTROL_STATUS_FAILED;
+
+    int forked = 0;
+    if (vm_pause_others(vm, cpu)) {
+        if (vm->uniprocessor)
+            vm_drain_events(vm);
+        pthread_mutex_lock(&vm->disk.mutex);
+        while (vm->disk.current_cmd != DISK_CMD_NONE) {
+            pthread_mutex_unlock(&vm->disk.mutex);
             sched_yield();
-            break;
-        }
-        case OP_STARTAP: {
-            if (!cpu->is_bsp)
-                break;
-            const int target = (int)cpu->regs[rd];
-            const vm_addr_t entry = (vm_addr_t)(cpu->regs[rs1] + imm);
-            if (target <= 0 || target >= vm->smp_cores)
+            pthread_mutex_lock(&vm->disk.mutex);
+        }
+        blk_quiesce(vm);
+        for (uint32_t i = 0; i < count; i++) {
+            pthread_mutex_lock(&vm->pause_lock);
+            pthread_mutex_lock(&vm->shared_lock);
+            pthread_mutex_lock(&vm->serial_lock);
+            flockfile(stdout);
+            fflush(stdout);
+            const pid_t pid = fork();
+            funlockfile(stdout);
+            pthread_mutex_unlock(&vm->serial_lock);
+            pthread_mutex_unlock(&vm->shared_lock);
+            pthread_mutex_unlock(&vm->pause_lock);
+            if (pid == 0) {
+                blk_resume(vm);
+                pthread_mutex_unlock(&vm->disk.mutex);
+                vm_clone_setup(vm, cpu, forked + 1);
+                return VM_CONTROL_STATUS_CLONE | (vm->clone_index << VM_CONTROL_ARG_SHIFT);
+            }
+            if (pid < 0) {
+                perror("[clone] fork");
                 break;
-            vm->cpus[target].ip = entry;
-            vm->cpus[target].last_ip = entry;
-            atomic_store_explicit(&vm->core_released[target], true, memory_order_release);
-            break;
-        }
-        case OP_IPI: {
-            const int target = (int)cpu->regs[rd];
-            const uint32_t int_no = (uint32_t)cpu->regs[rs1];
-            trigger_interrupt_target(vm, target, int_no);
-            break;
-        }
-        case OP_CPUID: {
-            cpu->regs[rd] = (uint32_t)cpu->core_id;
-            update_logic_flags(vm, cpu->regs[rd]);
-            break;
-        }
-        default: {
-            panic(panic_format("Unknown opcode %d\n", op), vm);
-            return;
+            }
+            vm->clone_pids[forked++] = pid;
+        }
+        blk_resume(vm);
+        /* The clones' overlays read the original's image, so it must not be written from here on. */
+        if (forked) {
+            char *disk_path = vm_clone_path(vm, 0, "disk");
+            if (disk_path && disk_fork_parent(vm, disk_path))
+                blk_fork_parent(vm);
+            else
+                panic("[clone] original cannot move onto a disk overlay of its own\n", vm);
+            free(disk_path);
+        }
+        pthread_mutex_unlock(&vm->disk.mutex);
+    }
+    vm_resume_others(vm);
+    vm->clone_count = forked;
+    printf("[clone] forked %d clones\n", forked);
+    return forked ? VM_CONTROL_STATUS_FORKED | (forked << VM_CONTROL_ARG_SHIFT) : VM_CONTROL_STATUS_FAILED;
+}
+
+int vm_reap_clones(VM *vm) {
+    int failed = 0;
+    for (int i = 0; i < vm->clone_count; i++) {
+        int status = 0;
+        while (waitpid(vm->clone_pids[i], &status, 0) < 0 && errno == EINTR) {
         }
+        const int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        printf("[clone] %d exited with status %d\n", i + 1, code);
+        failed += code != 0;
     }
+    return failed;
 }
 
-static inline void vm_flush_execution_times(VCPU *cpu, uint64_t *local_cycles) {
-    if (*local_cycles == 0) {
+void vm_control_request(VM *vm, uint32_t cmd) {
+    unsigned int idle = 0;
+    /* One command in flight per VM; a vCPU racing another one's command loses it. */
+    if (cmd == 0 || !atomic_compare_exchange_strong(&vm->control_cmd, &idle, cmd))
         return;
+    vm_cpu_attention(vm_current_cpu(vm), VM_ATTN_CONTROL);
+}
+
+static void vm_set_control_status(VM *vm, int status) {
+    vm_shared_lock(vm);
+    vm->io[VM_CONTROL] = status;
+    vm_shared_unlock(vm);
+}
+
+static void vm_service_control(VM *vm, VCPU *cpu) {
+    const unsigned int raw = atomic_load_explicit(&vm->control_cmd, memory_order_acquire);
+    const unsigned int cmd = raw & ((1u << VM_CONTROL_ARG_SHIFT) - 1u);
+    const unsigned int arg = (raw & ~VM_CONTROL_FROM_HOST) >> VM_CONTROL_ARG_SHIFT;
+    int status = VM_CONTROL_STATUS_FAILED;
+    switch (cmd) {
+    case VM_CONTROL_CMD_SNAPSHOT:
+    case VM_CONTROL_CMD_CHECKPOINT: {
+        int ok = 0;
+        if (!vm->snapshot_path) {
+            printf("[snapshot] guest asked for a snapshot but --snapshot-save was not given\n");
+        } else if (vm_pause_others(vm, cpu)) {
+            /* Queued device events belong to the saved interrupt state. */
+            if (vm->uniprocessor)
+                vm_drain_events(vm);
+            ok = cmd == VM_CONTROL_CMD_CHECKPOINT ? vm_snapshot_checkpoint(vm, vm->snapshot_path)
+                                                  : vm_snapshot_save(vm, vm->snapshot_path);
+        }
+        vm_resume_others(vm);
+        status = ok ? VM_CONTROL_STATUS_SAVED : VM_CONTROL_STATUS_FAILED;
+        break;
     }
-    atomic_fetch_add_explicit(&cpu->execution_times, *local_cycles, memory_order_relaxed);
-    *local_cycles = 0;
+    case VM_CONTROL_CMD_FORK:
+        status = vm_fork_clones(vm, cpu, arg);
+        break;
+    case VM_CONTROL_CMD_EXIT:
+        vm->exit_code = (int)(arg & 0xFFu);
+        vm_halt(vm);
+        status = VM_CONTROL_STATUS_NONE;
+        break;
+    default:
+        break;
+    }
+    /* The guest did not ask, so it sees no change on the port. */
+    if (!(raw & VM_CONTROL_FROM_HOST))
+        vm_set_control_status(vm, status);
+    atomic_store_explicit(&vm->control_cmd, 0, memory_order_release);
+}
+
+/*
+ * Slow path of the run loop, entered only when cpu->attention is non-zero.
+ * Returns 0 when the vCPU thread should exit.
+ */
+static int vm_service_attention(VM *vm, VCPU *cpu) {
+    const unsigned int attn = atomic_exchange_explicit(&cpu->attention, 0, memory_order_acquire);
+    if ((attn & VM_ATTN_STOP) || vm->halted || vm->panic)
+        return 0;
+    if (attn & VM_ATTN_PAUSE) {
+        vm_park(vm);
+        if (vm->halted || vm->panic)
+            return 0;
+    }
+    if (attn & VM_ATTN_JIT_FULL) {
+        if (vm_pause_others(vm, cpu))
+            vm_jit_flush(vm);
+        vm_resume_others(vm);
+    }
+    if (attn & VM_ATTN_DEBUG) {
+        vm_debug_pause_if_needed(vm, (uint32_t) cpu->ip);
+        if (vm->halted)
+            return 0;
+        /* Breakpoints and single-step are checked before every batch. */
+        vm_cpu_attention(cpu, VM_ATTN_DEBUG);
+    }
+    /* Before IRQs, so the snapshot is taken right after the OUT that asked for it. */
+    if (attn & VM_ATTN_CONTROL)
+        vm_service_control(vm, cpu);
+    if (attn & VM_ATTN_EVENTS)
+        vm_drain_events(vm);
+    if (attn & VM_ATTN_DISK)
+        disk_tick(vm);
+    if (attn & VM_ATTN_IRQ)
+        vm_handle_interrupts(vm, cpu);
+    return 1;
 }
 
 void *vm_thread(void *arg) {
@@ -767,47 +1307,92 @@ void *vm_thread(void *arg) {
     VM *vm = thread_arg->vm;
     int core_id = thread_arg->core_id;
     free(thread_arg);
-    vm_tls_vcpu = &vm->cpus[core_id];
+    VCPU *cpu = &vm->cpus[core_id];
+    /* Only for slow paths (panic, debugger, devices); the loop passes cpu. */
+    vm_tls_vcpu = cpu;
     uint64_t local_cycles = 0;
 
+    /* APs wait here until the BSP runs STARTAP for them. */
+    while (!atomic_load_explicit(&vm->core_released[core_id], memory_order_acquire)) {
+        if (vm->halted || vm->panic)
+            return NULL;
+        sched_yield();
+    }
+#ifdef VM_DEBUG
+    if (core_id == 0)
+        vm_cpu_attention(cpu, VM_ATTN_DEBUG);
+#endif
+
+    /*
+     * Straight-line execution until something raises cpu->attention: the
+     * common path is one relaxed load per batch and no atomic writes.
+     */
     while (1) {
-        if (vm->halted || vm->panic) {
+        if (atomic_load_explicit(&cpu->attention, memory_order_relaxed) &&
+            !vm_service_attention(vm, cpu))
             break;
-        }
-        if (core_id != 0 && !atomic_load_explicit(&vm->core_released[core_id], memory_order_acquire)) {
-            sched_yield();
-            continue;
-        }
-        if (core_id == 0) {
-            vm_debug_pause_if_needed(vm, (uint32_t) vm_tls_vcpu->ip);
-        }
-        vm_handle_interrupts(vm);
-        vm_instruction_case(vm);
-        local_cycles++;
+        uint32_t executed = vm_jit_execute(vm, cpu, VM_DISPATCH_BATCH);
+        if (executed == 0)
+            executed = vm_execute(vm, cpu, VM_DISPATCH_BATCH);
+        local_cycles += executed;
         if (local_cycles >= EXECUTION_TIMES_FLUSH_INTERVAL) {
-            vm_flush_execution_times(vm_tls_vcpu, &local_cycles);
-        }
-        if (core_id == 0) {
-            disk_tick(vm);
+            vm_flush_execution_times(cpu, &local_cycles);
         }
     }
-    vm_flush_execution_times(vm_tls_vcpu, &local_cycles);
+    vm_flush_execution_times(cpu, &local_cycles);
     return NULL;
 }
 
+uint32_t vm_step(VM *vm, uint32_t budget) {
+    /* The caller may itself be a vCPU thread of another VM. */
+    VCPU *const outer = vm_tls_vcpu;
+    uint32_t total = 0;
+    vm->stepped = 1;
+    while (total < budget && !vm->halted && !vm->panic) {
+        const uint32_t round_start = total;
+        for (int i = 0; i < vm->smp_cores && total < budget; i++) {
+            if (!atomic_load_explicit(&vm->core_released[i], memory_order_acquire))
+                continue;
+            VCPU *cpu = &vm->cpus[i];
+            vm_tls_vcpu = cpu;
+            if (atomic_load_explicit(&cpu->attention, memory_order_relaxed) &&
+                !vm_service_attention(vm, cpu))
+                break;
+            const uint32_t slice = budget - total < VM_DISPATCH_BATCH ? budget - total : VM_DISPATCH_BATCH;
+            uint32_t executed = vm_jit_execute(vm, cpu, slice);
+            if (executed == 0)
+                executed = vm_execute(vm, cpu, slice);
+            uint64_t local_cycles = executed;
+            vm_flush_execution_times(cpu, &local_cycles);
+            total += executed;
+        }
+        if (total == round_start)
+            break;
+    }
+    vm_tls_vcpu = outer;
+    return total;
+}
+
 void display_loop(VM *vm) {
-    vga_display_init();
+    display d;
+    vga_display_init(&d);
     const int frame_delay = 16; // ~60FPS
-    while (!vm->halted) {
+    uint32_t next_checkpoint = SDL_GetTicks() + vm->checkpoint_interval_ms;
+    while (!vm->halted && !vm->panic) {
         uint32_t frame_start = SDL_GetTicks();
         display_poll_events(vm);
-        display_update(vm);
+        display_update(&d, vm);
+        if (vm->checkpoint_interval_ms && (int32_t)(frame_start - next_checkpoint) >= 0) {
+            /* Lands on the BSP like a guest OUT; skipped if a command is already pending. */
+            vm_control_request(vm, VM_CONTROL_CMD_CHECKPOINT | VM_CONTROL_FROM_HOST);
+            next_checkpoint = frame_start + vm->checkpoint_interval_ms;
+        }
         uint32_t frame_time = SDL_GetTicks() - frame_start;
         if (frame_time < frame_delay) {
             SDL_Delay(frame_delay - frame_time);
         }
     }
-    display_shutdown();
+    display_shutdown(&d);
 }
 
 void vm_run(VM *vm) {
@@ -823,7 +1408,7 @@ void vm_run(VM *vm) {
         CpuThreadArg *arg = malloc(sizeof(CpuThreadArg));
         if (!arg) {
             panic("Failed to allocate CPU thread argument", vm);
-            vm->halted = 1;
+            vm_halt(vm);
             break;
         }
         arg->vm = vm;
@@ -831,7 +1416,7 @@ void vm_run(VM *vm) {
         if (pthread_create(&thread_ids[i], NULL, vm_thread, arg) != 0) {
             free(arg);
             panic("Failed to create CPU thread", vm);
-            vm->halted = 1;
+            vm_halt(vm);
             break;
         }
         created_threads++;
@@ -845,7 +1430,7 @@ void vm_run(VM *vm) {
     free(thread_ids);
 }
 
-static int vm_run_headless(VM *vm, uint64_t timeout_ms) {
+int vm_run_headless(VM *vm, uint64_t timeout_ms) {
     const int cores = (vm->smp_cores > 0) ? vm->smp_cores : 1;
     pthread_t *thread_ids = malloc(sizeof(pthread_t) * (size_t)cores);
     if (!thread_ids) {
@@ -857,14 +1442,14 @@ static int vm_run_headless(VM *vm, uint64_t timeout_ms) {
     for (int i = 0; i < cores; i++) {
         CpuThreadArg *arg = malloc(sizeof(CpuThreadArg));
         if (!arg) {
-            vm->halted = 1;
+            vm_halt(vm);
             break;
         }
         arg->vm = vm;
         arg->core_id = i;
         if (pthread_create(&thread_ids[i], NULL, vm_thread, arg) != 0) {
             free(arg);
-            vm->halted = 1;
+            vm_halt(vm);
             break;
         }
         created_threads++;
@@ -874,7 +1459,7 @@ static int vm_run_headless(VM *vm, uint64_t timeout_ms) {
     while (!vm->halted && !vm->panic) {
         const uint64_t elapsed_ms = (host_monotonic_time_ns() - start_ns) / 1000000ull;
         if (elapsed_ms > timeout_ms) {
-            vm->halted = 1;
+            vm_halt(vm);
             break;
         }
         usleep(1000);
@@ -933,11 +1518,11 @@ void vm_dump(const VM *vm, int mem_preview) {
         printf("<empty>\n");
     }
     printf("Memory (first %d cells):\n", mem_preview);
-    for (int i = 0; i < mem_preview && i < (ssize_t)MEM_SIZE; i++) {
+    for (int i = 0; i < mem_preview && (size_t)i < vm->memory_size; i++) {
         printf("[%d] = %d\n", i, vm->memory[i]);
     }
     printf("IP = %lu\n", cpu->ip);
-    printf("ZF = %d\n", (cpu->flags & FLAG_ZF) != 0);
+    printf("ZF = %d\n", (vm_flags_value(cpu) & FLAG_ZF) != 0);
 }
 
 VM *vm_create(size_t memory_size,
@@ -946,13 +1531,19 @@ VM *vm_create(size_t memory_size,
               const uint8_t *data,
               size_t data_size,
               const ProgramLayout *layout,
-              int smp_cores) {
+              int smp_cores,
+              int ram_backing) {
     VM *vm = malloc(sizeof(VM));
     if (!vm)
         return NULL;
 
     memset(vm, 0, sizeof(VM));
     vm->smp_cores = (smp_cores > 0) ? smp_cores : 1;
+    vm->uniprocessor = (vm->smp_cores == 1);
+    vm_event_queue_init(&vm->events);
+    for (size_t w = 0; w < IRQ_BITMAP_WORDS; w++)
+        atomic_init(&vm->irq_posted[w], 0);
+    atomic_init(&vm->control_cmd, 0);
     vm->cpus = calloc((size_t)vm->smp_cores, sizeof(VCPU));
     if (!vm->cpus) {
         free(vm);
@@ -973,14 +1564,13 @@ VM *vm_create(size_t memory_size,
         return NULL;
     }
 
-    pthread_mutexattr_t shared_attr;
-    pthread_mutexattr_init(&shared_attr);
-    pthread_mutexattr_settype(&shared_attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&vm->shared_lock, &shared_attr);
-    pthread_mutexattr_destroy(&shared_attr);
+    pthread_mutex_init(&vm->shared_lock, NULL);
+    pthread_mutex_init(&vm->serial_lock, NULL);
+    pthread_mutex_init(&vm->pause_lock, NULL);
+    pthread_cond_init(&vm->pause_cond, NULL);
 
     vm->memory_size = memory_size;
-    vm->memory = malloc(memory_size);
+    vm->memory = vm_ram_map(memory_size, ram_backing, &vm->memory_map_size);
     if (!vm->memory) {
         free(vm->interrupt_bitmap);
         free(vm->core_released);
@@ -988,16 +1578,21 @@ VM *vm_create(size_t memory_size,
         free(vm);
         return NULL;
     }
-    memset(vm->memory, 0, memory_size);
+    if (!vm_decode_init(vm)) {
+        vm_ram_unmap(vm->memory, vm->memory_map_size);
+        free(vm->interrupt_bitmap);
+        free(vm->core_released);
+        free(vm->cpus);
+        free(vm);
+        return NULL;
+    }
 
     size_t fb_base = FB_BASE(memory_size);
 
     vm->fb = malloc(FB_SIZE);
-    vm->fb_front = malloc(FB_SIZE);
-    if (!vm->fb || !vm->fb_front) {
-        free(vm->fb_front);
-        free(vm->fb);
-        free(vm->memory);
+    if (!vm->fb) {
+        vm_decode_destroy(vm);
+        vm_ram_unmap(vm->memory, vm->memory_map_size);
         free(vm->interrupt_bitmap);
         free(vm->core_released);
         free(vm->cpus);
@@ -1005,33 +1600,31 @@ VM *vm_create(size_t memory_size,
         return NULL;
     }
     memset(vm->fb, 0, FB_SIZE);
-    memset(vm->fb_front, 0, FB_SIZE);
-    for (size_t row = 0; row < FB_HEIGHT; row++) {
-        if (pthread_mutex_init(&vm->fb_row_locks[row], NULL) != 0) {
-            for (size_t done = 0; done < row; done++) {
-                pthread_mutex_destroy(&vm->fb_row_locks[done]);
-            }
-            free(vm->fb_front);
-            free(vm->fb);
-            free(vm->memory);
-            free(vm->interrupt_bitmap);
-            free(vm->core_released);
-            free(vm->cpus);
-            free(vm);
-            return NULL;
-        }
-    }
+    /* The first frame uploads every row. */
+    for (size_t i = 0; i < FB_DIRTY_WORDS; i++)
+        atomic_init(&vm->fb_dirty[i], UINT64_MAX);
     printf("vm->fb = %p\n", (void *) vm->fb);
     printf("fb_base = 0x%zx\n", fb_base);
     printf("fb address mod 4 = %zu\n", ((size_t) vm->fb) % 4);
 
     printf("Initializing MMIO.... \n");
     vm->mmio_count = 0;
-    memset(vm->mmio_devices, 0, sizeof(vm->mmio_devices));
     vm->disk_size_bytes = DISK_SIZE;
     register_fb_mmio(vm);
     register_time_mmio(vm);
     register_sysinfo_mmio(vm);
+    register_blk_mmio(vm);
+    vm_mmio_publish(vm);
+    /* Overlapping devices or a timer thread that would not start, already reported. */
+    if (vm->panic) {
+        vm_destroy(vm);
+        return NULL;
+    }
+    if (!vm_region_map_init(vm)) {
+        printf("Failed to allocate region map\n");
+        vm_destroy(vm);
+        return NULL;
+    }
     size_t prog_bytes = program_size * sizeof(uint64_t);
     uint32_t text_base = PROGRAM_BASE;
     uint32_t data_base = PROGRAM_BASE + (uint32_t) prog_bytes;
@@ -1050,8 +1643,9 @@ VM *vm_create(size_t memory_size,
     }
 
     if ((size_t) text_base + prog_bytes > memory_size) {
-        panic("Program too large\n", vm);
-        return vm;
+        printf("Program too large\n");
+        vm_destroy(vm);
+        return NULL;
     }
 
     const size_t call_stack_bytes = (size_t)CALL_STACK_SIZE * 8u;
@@ -1070,46 +1664,33 @@ VM *vm_create(size_t memory_size,
     } else {
         vm->stack_pool_size = per_core_stack_bytes * (size_t)vm->smp_cores;
         if (vm->stack_pool_size >= memory_size) {
-            panic("SMP stack pool too large for RAM", vm);
-            return vm;
+            printf("SMP stack pool too large for RAM\n");
+            vm_destroy(vm);
+            return NULL;
         }
         vm->stack_pool_base = (vm_addr_t)(memory_size - vm->stack_pool_size);
         if (image_end > vm->stack_pool_base) {
-            panic("Program/data overlaps SMP stack pool", vm);
-            return vm;
+            printf("Program/data overlaps SMP stack pool\n");
+            vm_destroy(vm);
+            return NULL;
         }
     }
 
-    memcpy(vm->memory + text_base, program, prog_bytes);
+    if (prog_bytes > 0)
+        memcpy(vm->memory + text_base, program, prog_bytes);
     if (data && data_size > 0) {
         if ((size_t) data_base + data_size > memory_size) {
-            panic("Data segment out of range\n", vm);
-            return vm;
+            printf("Data segment out of range\n");
+            vm_destroy(vm);
+            return NULL;
         }
         memcpy(vm->memory + data_base, data, data_size);
     }
-    if (bss_size > 0) {
-        if ((size_t) bss_base + bss_size > memory_size) {
-            panic("BSS segment out of range\n", vm);
-            return vm;
-        }
-        memset(vm->memory + bss_base, 0, bss_size);
-        {
-            size_t sample = bss_size < 64 ? bss_size : 64;
-            size_t bad = 0;
-            for (size_t i = 0; i < sample; i++) {
-                if (vm->memory[bss_base + i] != 0) {
-                    bad++;
-                }
-            }
-            printf("BSS clear: base=0x%08x size=%u first=%u last=%u bad_in_first_%zu=%zu\n",
-                   bss_base,
-                   bss_size,
-                   vm->memory[bss_base],
-                   vm->memory[bss_base + bss_size - 1],
-                   sample,
-                   bad);
-        }
+    /* BSS needs no clearing: RAM is a fresh zero-filled mapping. */
+    if (bss_size > 0 && (size_t) bss_base + bss_size > memory_size) {
+        printf("BSS segment out of range\n");
+        vm_destroy(vm);
+        return NULL;
     }
 
     for (int i = 0; i < vm->smp_cores; i++) {
@@ -1117,6 +1698,7 @@ VM *vm_create(size_t memory_size,
             ? CALL_STACK_BASE
             : vm->stack_pool_base + (vm_addr_t)(per_core_stack_bytes * (size_t)i);
         atomic_init(&vm->cpus[i].execution_times, 0);
+        atomic_init(&vm->cpus[i].attention, 0);
         vm->cpus[i].core_id = i;
         vm->cpus[i].is_bsp = (i == 0) ? 1 : 0;
         vm->cpus[i].ip = text_base;
@@ -1136,6 +1718,7 @@ VM *vm_create(size_t memory_size,
     vm->suspend_count = 0;
     vm->io[SCREEN_ATTRIBUTE] = SERIAL_STATUS_TX_READY;
     vm_debug_init(vm);
+    vm_jit_init(vm);
     return vm;
 }
 
@@ -1150,125 +1733,534 @@ void vm_destroy(VM *vm) {
         vm->timer_thread_started = 0;
     }
 
+    vm_jit_destroy(vm);
     vm_debug_destroy(vm);
+    blk_close(vm);
     disk_close(vm);
     pthread_mutex_destroy(&vm->shared_lock);
-    for (size_t row = 0; row < FB_HEIGHT; row++) {
-        pthread_mutex_destroy(&vm->fb_row_locks[row]);
-    }
+    pthread_mutex_destroy(&vm->serial_lock);
+    pthread_mutex_destroy(&vm->pause_lock);
+    pthread_cond_destroy(&vm->pause_cond);
     if (vm->interrupt_bitmap)
         free(vm->interrupt_bitmap);
     if (vm->core_released)
         free(vm->core_released);
     if (vm->cpus)
         free(vm->cpus);
+    vm_decode_destroy(vm);
+    vm_region_map_destroy(vm);
+    free(vm->clone_pids);
     if (vm->memory)
-        free(vm->memory);
+        vm_ram_unmap(vm->memory, vm->memory_map_size);
     if (vm->fb)
         free(vm->fb);
-    if (vm->fb_front)
-        free(vm->fb_front);
     free(vm);
 }
 
-static void print_usage(const char *prog) {
-    printf("Usage: %s [--bin <file>] [--smp <cores>] [--selftest]\n", prog);
-    printf("Defaults: --bin boot.bin --smp 1\n");
+/* Boot from config->binary, the way --bin does. */
+static VM *vm_boot(const VM_Config *config, const char *disk_path) {
+    size_t program_size = 0;
+    size_t data_size = 0;
+    uint64_t *program = NULL;
+    uint8_t *data = NULL;
+    ProgramLayout layout;
+    const char *filename = config->binary ? config->binary : "boot.bin";
+
+    if (!load_program_single(filename, &program, &program_size, &data, &data_size, &layout)) {
+        printf("Failed to load program from %s\n", filename);
+        return NULL;
+    }
+
+    printf("Loaded program from %s, %zu instructions.\n", filename, program_size);
+    printf("Loaded data: %zu bytes.\n", data_size);
+    printf("Layout: TEXT_BASE=0x%08X TEXT_SIZE=%u DATA_BASE=0x%08X DATA_SIZE=%u BSS_BASE=0x%08X BSS_SIZE=%u\n",
+           layout.text_base, layout.text_size,
+           layout.data_base, layout.data_size,
+           layout.bss_base, layout.bss_size);
+
+    VM *vm = vm_create(config->mem_size ? config->mem_size : MEM_SIZE,
+                       program, program_size, data, data_size, &layout,
+                       config->smp_cores, config->ram_backing);
+    free(program);
+    free(data);
+    if (!vm) {
+        printf("Failed to create VM.\n");
+        return NULL;
+    }
+    disk_init(vm, disk_path);
+    init_ivt(vm);
+    return vm;
+}
+
+VM *vm_open(const VM_Config *config) {
+    const char *disk_path = config->disk_path ? config->disk_path : "./disk.img";
+    VM *vm = NULL;
+    if (config->snapshot) {
+        vm = vm_snapshot_load(config->snapshot, disk_path, config->ram_backing);
+        if (!vm) {
+            printf("Failed to restore snapshot from %s\n", config->snapshot);
+            return NULL;
+        }
+        printf("Restored snapshot from %s\n", config->snapshot);
+    } else {
+        vm = vm_boot(config, disk_path);
+        if (!vm)
+            return NULL;
+    }
+    /* The disk image could not be opened or its worker started. */
+    if (vm->panic) {
+        vm_destroy(vm);
+        return NULL;
+    }
+    vm->serial_out = config->serial_out;
+    vm->serial_opaque = config->serial_opaque;
+    vm->blk.backend = config->disk_io;
+    /* Entries queued behind a full completion ring, and interrupts still owed. */
+    if (config->snapshot)
+        blk_restart(vm);
+    return vm;
+}
+
+void vm_stop(VM *vm) {
+    vm_halt(vm);
+}
+
+int vm_state(const VM *vm) {
+    if (vm->panic)
+        return VM_STATE_PANICKED;
+    return vm->halted ? VM_STATE_HALTED : VM_STATE_RUNNING;
 }
 
-static int parse_positive_int(const char *s, int *out) {
-    char *end = NULL;
-    errno = 0;
-    long v = strtol(s, &end, 10);
-    if (errno != 0 || end == s || *end != '\0' || v < 1 || v > 64)
+int vm_exit_code(const VM *vm) {
+    return vm->exit_code;
+}
+
+const char *vm_panic_message(const VM *vm) {
+    return vm->panic ? vm->panic_message : NULL;
+}
+
+uint64_t vm_cycles(const VM *vm) {
+    uint64_t cycles = 0;
+    for (int i = 0; i < vm->smp_cores; i++)
+        cycles += atomic_load_explicit(&vm->cpus[i].execution_times, memory_order_relaxed);
+    return cycles;
+}
+
+static int run_selftest_startap_cpuid(void) {
+    const vm_addr_t flag_addr = 0x3000;
+    const vm_addr_t ap_entry = PROGRAM_BASE + 11 * 8;
+    uint64_t program[] = {
+        /* BSP */
+        INST(OP_MOVI, 1, 0, 0, 1),                    /* r1 = target core */
+        INST(OP_MOVI, 2, 0, 0, ap_entry),             /* r2 = ap entry */
+        INST(OP_STARTAP, 1, 2, 0, 0),                 /* start AP1 */
+        INST(OP_MOVI, 4, 0, 0, flag_addr),            /* r4 = flag addr */
+        INST(OP_LOAD32, 3, 4, 0, 0),                  /* r3 = *flag */
+        INST(OP_CMPI, 3, 0, 0, 1),                    /* r3 == 1 ? */
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 4 * 8),  /* loop */
+        INST(OP_HALT, 0, 0, 0, 0),
+        INST(OP_PAUSE, 0, 0, 0, 0),
+        INST(OP_PAUSE, 0, 0, 0, 0),
+        INST(OP_PAUSE, 0, 0, 0, 0),
+        /* AP entry */
+        INST(OP_CPUID, 5, 0, 0, 0),                   /* r5 = core_id */
+        INST(OP_MOVI, 6, 0, 0, flag_addr),
+        INST(OP_STORE32, 5, 6, 0, 0),                 /* *flag = core_id */
+        INST(OP_PAUSE, 0, 0, 0, 0),
+        INST(OP_JMP, 0, 0, 0, ap_entry + 3 * 8),
+    };
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 2,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
         return 0;
-    *out = (int)v;
-    return 1;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    int ok = vm_run_headless(vm, 2000);
+    uint32_t v = vm_read32(vm, flag_addr);
+    ok = ok && (v == 1);
+    vm_destroy(vm);
+    return ok;
+}
+
+static int run_selftest_ipi(void) {
+    const vm_addr_t ready_addr = 0x3010;
+    const vm_addr_t ipi_addr = 0x3014;
+    const vm_addr_t ap_entry = PROGRAM_BASE + 14 * 8;
+    const vm_addr_t isr_entry = PROGRAM_BASE + 20 * 8;
+    uint64_t program[] = {
+        /* BSP */
+        INST(OP_MOVI, 1, 0, 0, 1),
+        INST(OP_MOVI, 2, 0, 0, ap_entry),
+        INST(OP_STARTAP, 1, 2, 0, 0),
+        INST(OP_MOVI, 10, 0, 0, ready_addr),
+        INST(OP_LOAD32, 11, 10, 0, 0),
+        INST(OP_CMPI, 11, 0, 0, 1),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 4 * 8),
+        INST(OP_MOVI, 12, 0, 0, 5),                   /* vector=5 */
+        INST(OP_IPI, 1, 12, 0, 0),                    /* send IPI to core1 */
+        INST(OP_MOVI, 13, 0, 0, ipi_addr),
+        INST(OP_LOAD32, 14, 13, 0, 0),
+        INST(OP_CMPI, 14, 0, 0, 1),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 10 * 8),
+        INST(OP_HALT, 0, 0, 0, 0),
+        /* AP entry */
+        INST(OP_MOVI, 6, 0, 0, ready_addr),
+        INST(OP_MOVI, 7, 0, 0, 1),
+        INST(OP_STORE32, 7, 6, 0, 0),
+        INST(OP_PAUSE, 0, 0, 0, 0),
+        INST(OP_JMP, 0, 0, 0, ap_entry + 3 * 8),
+        INST(OP_PAUSE, 0, 0, 0, 0),
+        /* ISR(vector=5) */
+        INST(OP_MOVI, 8, 0, 0, ipi_addr),
+        INST(OP_MOVI, 9, 0, 0, 1),
+        INST(OP_STORE32, 9, 8, 0, 0),
+        INST(OP_IRET, 0, 0, 0, 0),
+    };
+
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 2,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    register_isr(vm, 5, isr_entry);
+    int ok = vm_run_headless(vm, 2500);
+    uint32_t ipi = vm_read32(vm, ipi_addr);
+    ok = ok && (ipi == 1);
+    vm_destroy(vm);
+    return ok;
+}
+
+static int run_selftest_disk_irq(void) {
+    const vm_addr_t done_addr = 0x3030;
+    const vm_addr_t isr_entry = PROGRAM_BASE + 16 * 8;
+    uint64_t program[] = {
+        INST(OP_MOVI, 1, 0, 0, DISK_MEM),
+        INST(OP_MOVI, 2, 0, 0, 0x4000),
+        INST(OP_OUT, 2, 1, 0, 0),              /* DMA target */
+        INST(OP_MOVI, 1, 0, 0, DISK_LBA),
+        INST(OP_MOVI, 2, 0, 0, 0),
+        INST(OP_OUT, 2, 1, 0, 0),
+        INST(OP_MOVI, 1, 0, 0, DISK_COUNT),
+        INST(OP_MOVI, 2, 0, 0, 1),
+        INST(OP_OUT, 2, 1, 0, 0),
+        INST(OP_MOVI, 1, 0, 0, DISK_CMD),
+        INST(OP_MOVI, 2, 0, 0, DISK_CMD_READ),
+        INST(OP_OUT, 2, 1, 0, 0),
+        INST(OP_MOVI, 3, 0, 0, done_addr),
+        INST(OP_LOAD32, 4, 3, 0, 0),           /* spin until the ISR ran */
+        INST(OP_CMPI, 4, 0, 0, 1),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 13 * 8),
+        /* ISR(INT_DISK_COMPLETE) */
+        INST(OP_MOVI, 5, 0, 0, done_addr),
+        INST(OP_MOVI, 6, 0, 0, 1),
+        INST(OP_STORE32, 6, 5, 0, 0),
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
+
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    register_isr(vm, INT_DISK_COMPLETE, isr_entry);
+    int ok = vm_run_headless(vm, 2500);
+    ok = ok && vm_read32(vm, done_addr) == 1;
+    vm_destroy(vm);
+    return ok;
+}
+
+static int run_selftest_up_timer_irq(void) {
+    const vm_addr_t done_addr = 0x3040;
+    const vm_addr_t isr_entry = PROGRAM_BASE + 7 * 8;
+    uint64_t program[] = {
+        INST(OP_MOVI, 1, 0, 0, TIME_BASE),
+        INST(OP_MOVI, 2, 0, 0, 1000),          /* 1ms period */
+        INST(OP_STORE32, 2, 1, 0, 0),
+        INST(OP_MOVI, 3, 0, 0, done_addr),
+        INST(OP_LOAD32, 4, 3, 0, 0),           /* spin until the ISR ran */
+        INST(OP_CMPI, 4, 0, 0, 1),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 4 * 8),
+        /* ISR(INT_TIMER), raised from the timer thread via vm->irq_posted */
+        INST(OP_MOVI, 5, 0, 0, done_addr),
+        INST(OP_MOVI, 6, 0, 0, 1),
+        INST(OP_STORE32, 6, 5, 0, 0),
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
+
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    register_isr(vm, INT_TIMER, isr_entry);
+    int ok = vm->uniprocessor && vm_run_headless(vm, 2500);
+    ok = ok && vm_read32(vm, done_addr) == 1;
+    vm_destroy(vm);
+    return ok;
+}
+
+/* An interrupt raised off the vCPU thread still arrives when the event queue is full of serial bytes. */
+static int run_selftest_up_irq_queue_full(void) {
+    const vm_addr_t done_addr = 0x3048;
+    const vm_addr_t isr_entry = PROGRAM_BASE + 4 * 8;
+    uint64_t program[] = {
+        INST(OP_MOVI, 3, 0, 0, done_addr),
+        INST(OP_LOAD32, 4, 3, 0, 0),           /* spin until the ISR ran */
+        INST(OP_CMPI, 4, 0, 0, 1),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 1 * 8),
+        /* ISR(INT_TIMER), raised below from this thread */
+        INST(OP_MOVI, 5, 0, 0, done_addr),
+        INST(OP_MOVI, 6, 0, 0, 1),
+        INST(OP_STORE32, 6, 5, 0, 0),
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
+
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    register_isr(vm, INT_TIMER, isr_entry);
+    unsigned int queued = 0;
+    while (queued <= VM_EVENT_QUEUE_SIZE && vm_serial_rx_enqueue(vm, 'x'))
+        queued++;
+    trigger_interrupt(vm, INT_TIMER);
+    int ok = vm->uniprocessor && queued == VM_EVENT_QUEUE_SIZE && vm_run_headless(vm, 2500);
+    ok = ok && vm_read32(vm, done_addr) == 1;
+    vm_destroy(vm);
+    return ok;
 }
 
-static int run_selftest_startap_cpuid(void) {
-    const vm_addr_t flag_addr = 0x3000;
-    const vm_addr_t ap_entry = PROGRAM_BASE + 11 * 8;
+/*
+ * Eight requests through a block queue in two batches: four writes, then
+ * reads of the same sectors. With a coalescing count of 4 each batch should
+ * interrupt once, not once per request.
+ */
+/* `disk_io` is a VM_DISK_IO_* backend; uring falls back to the threads where unavailable. */
+static int run_selftest_blk_queue(int disk_io) {
+    const vm_addr_t sq_addr = 0x4000;
+    const vm_addr_t cq_addr = 0x4100;
+    const vm_addr_t src_addr = 0x5000;
+    const vm_addr_t dst_addr = 0x6000;
+    const vm_addr_t isr_addr = 0x3050; /* CQ_TAIL seen by the last ISR, then the ISR count */
+    const vm_addr_t isr_entry = PROGRAM_BASE + 26 * 8;
+    const uint32_t q0 = BLK_BASE + BLK_QUEUE_REGS;
     uint64_t program[] = {
-        /* BSP */
-        INST(OP_MOVI, 1, 0, 0, 1),                    /* r1 = target core */
-        INST(OP_MOVI, 2, 0, 0, ap_entry),             /* r2 = ap entry */
-        INST(OP_STARTAP, 1, 2, 0, 0),                 /* start AP1 */
-        INST(OP_MOVI, 4, 0, 0, flag_addr),            /* r4 = flag addr */
-        INST(OP_LOAD32, 3, 4, 0, 0),                  /* r3 = *flag */
-        INST(OP_CMPI, 3, 0, 0, 1),                    /* r3 == 1 ? */
-        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 4 * 8),  /* loop */
+        INST(OP_MOVI, 1, 0, 0, q0),
+        INST(OP_MOVI, 2, 0, 0, sq_addr),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_SQ_ADDR),
+        INST(OP_MOVI, 2, 0, 0, cq_addr),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_CQ_ADDR),
+        INST(OP_MOVI, 2, 0, 0, 4),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_IRQ_COALESCE),
+        INST(OP_MOVI, 2, 0, 0, 8),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_SIZE),
+        INST(OP_MOVI, 2, 0, 0, 4),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_SQ_TAIL),     /* the writes */
+        INST(OP_LOAD32, 3, 1, 0, BLK_Q_CQ_TAIL),
+        INST(OP_CMPI, 3, 0, 0, 4),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 11 * 8),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_CQ_HEAD),
+        INST(OP_MOVI, 2, 0, 0, 8),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_SQ_TAIL),     /* the reads */
+        INST(OP_LOAD32, 3, 1, 0, BLK_Q_CQ_TAIL),
+        INST(OP_CMPI, 3, 0, 0, 8),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 17 * 8),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_CQ_HEAD),
+        INST(OP_MOVI, 9, 0, 0, isr_addr),
+        INST(OP_LOAD32, 3, 9, 0, 0),                  /* spin until an ISR saw all eight */
+        INST(OP_CMPI, 3, 0, 0, 8),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 22 * 8),
         INST(OP_HALT, 0, 0, 0, 0),
-        INST(OP_PAUSE, 0, 0, 0, 0),
-        INST(OP_PAUSE, 0, 0, 0, 0),
-        INST(OP_PAUSE, 0, 0, 0, 0),
-        /* AP entry */
-        INST(OP_CPUID, 5, 0, 0, 0),                   /* r5 = core_id */
-        INST(OP_MOVI, 6, 0, 0, flag_addr),
-        INST(OP_STORE32, 5, 6, 0, 0),                 /* *flag = core_id */
-        INST(OP_PAUSE, 0, 0, 0, 0),
-        INST(OP_JMP, 0, 0, 0, ap_entry + 3 * 8),
+        /* ISR(INT_BLK_COMPLETE) */
+        INST(OP_MOVI, 5, 0, 0, q0),
+        INST(OP_LOAD32, 6, 5, 0, BLK_Q_CQ_TAIL),
+        INST(OP_MOVI, 7, 0, 0, isr_addr),
+        INST(OP_STORE32, 6, 7, 0, 0),
+        INST(OP_LOAD32, 8, 7, 0, 4),
+        INST(OP_INC, 8, 0, 0, 0),
+        INST(OP_STORE32, 8, 7, 0, 4),
+        INST(OP_IRET, 0, 0, 0, 0),
     };
-    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 2);
+
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
     if (!vm)
         return 0;
     disk_init(vm, "./disk.img");
     init_ivt(vm);
-    int ok = vm_run_headless(vm, 2000);
-    uint32_t v = vm_read32(vm, flag_addr);
-    ok = ok && (v == 1);
+    register_isr(vm, INT_BLK_COMPLETE, isr_entry);
+    vm->blk.backend = disk_io;
+    for (uint32_t i = 0; i < 8; i++) {
+        const uint32_t sector = i & 3u;
+        const vm_addr_t buf = (i < 4 ? src_addr : dst_addr) + sector * DISK_SECTOR_SIZE;
+        const vm_addr_t sqe = sq_addr + i * BLK_SQE_SIZE;
+        const uint32_t op = i < 3 ? BLK_OP_WRITE : i == 3 ? BLK_OP_WRITE_FUA : BLK_OP_READ;
+        vm_write32(vm, sqe, op | (i << 16));
+        vm_write32(vm, sqe + 4, 64 + sector);
+        vm_write32(vm, sqe + 8, buf);
+        vm_write32(vm, sqe + 12, 1);
+        if (i < 4)
+            vm_memset(vm, buf, (uint8_t)(0xA0 + i), DISK_SECTOR_SIZE);
+    }
+    int ok = vm_read32(vm, BLK_BASE + BLK_REG_MAGIC) == BLK_MAGIC && vm_run_headless(vm, 2500);
+    uint32_t seen = 0;
+    for (uint32_t i = 0; ok && i < 8; i++) {
+        const uint32_t cqe = vm_read32(vm, cq_addr + i * BLK_CQE_SIZE);
+        ok = (cqe >> 16) == BLK_STATUS_OK && (cqe & 0xFFFFu) < 8;
+        seen |= 1u << (cqe & 0xFFFFu);
+    }
+    const uint32_t irqs = vm_read32(vm, isr_addr + 4);
+    ok = ok && seen == 0xFFu && irqs >= 1 && irqs <= 2 &&
+         memcmp(&vm->memory[src_addr], &vm->memory[dst_addr], 4 * DISK_SECTOR_SIZE) == 0;
     vm_destroy(vm);
     return ok;
 }
 
-static int run_selftest_ipi(void) {
-    const vm_addr_t ready_addr = 0x3010;
-    const vm_addr_t ipi_addr = 0x3014;
-    const vm_addr_t ap_entry = PROGRAM_BASE + 14 * 8;
-    const vm_addr_t isr_entry = PROGRAM_BASE + 20 * 8;
+/*
+ * A large read first, then three one-sector reads that overtake it. Once
+ * those are consumed the guest submits a fifth request into the large read's
+ * SQ slot while that read may still be in flight; all five must come back
+ * under their own tags.
+ */
+static int run_selftest_blk_out_of_order(int disk_io) {
+    const vm_addr_t sq_addr = 0x4000;
+    const vm_addr_t cq_addr = 0x4100;
+    const vm_addr_t save_addr = 0x4200;  /* the first three CQEs, before the fifth reuses the ring */
+    const vm_addr_t fifth_addr = 0x4300; /* the fifth SQE, copied into slot 0 by the guest */
+    const vm_addr_t small_addr = 0x5000;
+    const vm_addr_t big_addr = 0x01000000;
+    const uint32_t big_sectors = (16u << 20) / DISK_SECTOR_SIZE;
+    const vm_addr_t isr_entry = PROGRAM_BASE + 24 * 8;
+    const uint32_t q0 = BLK_BASE + BLK_QUEUE_REGS;
     uint64_t program[] = {
-        /* BSP */
-        INST(OP_MOVI, 1, 0, 0, 1),
-        INST(OP_MOVI, 2, 0, 0, ap_entry),
-        INST(OP_STARTAP, 1, 2, 0, 0),
-        INST(OP_MOVI, 10, 0, 0, ready_addr),
-        INST(OP_LOAD32, 11, 10, 0, 0),
-        INST(OP_CMPI, 11, 0, 0, 1),
-        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 4 * 8),
-        INST(OP_MOVI, 12, 0, 0, 5),                   /* vector=5 */
-        INST(OP_IPI, 1, 12, 0, 0),                    /* send IPI to core1 */
-        INST(OP_MOVI, 13, 0, 0, ipi_addr),
-        INST(OP_LOAD32, 14, 13, 0, 0),
-        INST(OP_CMPI, 14, 0, 0, 1),
-        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 10 * 8),
+        INST(OP_MOVI, 1, 0, 0, q0),
+        INST(OP_MOVI, 2, 0, 0, sq_addr),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_SQ_ADDR),
+        INST(OP_MOVI, 2, 0, 0, cq_addr),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_CQ_ADDR),
+        INST(OP_MOVI, 2, 0, 0, 4),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_SIZE),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_SQ_TAIL),     /* the large read and the small ones */
+        INST(OP_LOAD32, 3, 1, 0, BLK_Q_CQ_TAIL),
+        INST(OP_CMPI, 3, 0, 0, 3),
+        INST(OP_JL, 0, 0, 0, PROGRAM_BASE + 8 * 8),
+        INST(OP_MOVI, 9, 0, 0, save_addr),
+        INST(OP_MOVI, 8, 0, 0, cq_addr),
+        INST(OP_MEMCPY, 9, 8, 0, 3 * BLK_CQE_SIZE),
+        INST(OP_STORE32, 3, 1, 0, BLK_Q_CQ_HEAD),
+        INST(OP_MOVI, 8, 0, 0, sq_addr),
+        INST(OP_MOVI, 9, 0, 0, fifth_addr),
+        INST(OP_MEMCPY, 8, 9, 0, BLK_SQE_SIZE),
+        INST(OP_MOVI, 2, 0, 0, 5),
+        INST(OP_STORE32, 2, 1, 0, BLK_Q_SQ_TAIL),     /* the fifth */
+        INST(OP_LOAD32, 3, 1, 0, BLK_Q_CQ_TAIL),
+        INST(OP_CMPI, 3, 0, 0, 5),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 20 * 8),
         INST(OP_HALT, 0, 0, 0, 0),
-        /* AP entry */
-        INST(OP_MOVI, 6, 0, 0, ready_addr),
-        INST(OP_MOVI, 7, 0, 0, 1),
-        INST(OP_STORE32, 7, 6, 0, 0),
-        INST(OP_PAUSE, 0, 0, 0, 0),
-        INST(OP_JMP, 0, 0, 0, ap_entry + 3 * 8),
-        INST(OP_PAUSE, 0, 0, 0, 0),
-        /* ISR(vector=5) */
-        INST(OP_MOVI, 8, 0, 0, ipi_addr),
-        INST(OP_MOVI, 9, 0, 0, 1),
-        INST(OP_STORE32, 9, 8, 0, 0),
+        /* ISR(INT_BLK_COMPLETE) */
         INST(OP_IRET, 0, 0, 0, 0),
     };
 
-    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 2);
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
     if (!vm)
         return 0;
     disk_init(vm, "./disk.img");
     init_ivt(vm);
-    register_isr(vm, 5, isr_entry);
+    register_isr(vm, INT_BLK_COMPLETE, isr_entry);
+    vm->blk.backend = disk_io;
+    for (uint32_t i = 0; i < 5; i++) {
+        const vm_addr_t sqe = i < 4 ? sq_addr + i * BLK_SQE_SIZE : fifth_addr;
+        vm_write32(vm, sqe, BLK_OP_READ | (i << 16));
+        vm_write32(vm, sqe + 4, i == 0 ? 0 : 64 + i);
+        vm_write32(vm, sqe + 8, i == 0 ? big_addr : small_addr + i * DISK_SECTOR_SIZE);
+        vm_write32(vm, sqe + 12, i == 0 ? big_sectors : 1);
+    }
     int ok = vm_run_headless(vm, 2500);
-    uint32_t ipi = vm_read32(vm, ipi_addr);
-    ok = ok && (ipi == 1);
+    uint32_t seen = 0;
+    for (uint32_t i = 0; ok && i < 5; i++) {
+        /* CQ entries 0-2 as the guest saved them, 3 still in the ring, 4 in ring slot 0. */
+        const vm_addr_t at = i < 3 ? save_addr + i * BLK_CQE_SIZE : cq_addr + (i & 3u) * BLK_CQE_SIZE;
+        const uint32_t cqe = vm_read32(vm, at);
+        ok = (cqe >> 16) == BLK_STATUS_OK && (cqe & 0xFFFFu) < 5;
+        seen |= 1u << (cqe & 0xFFFFu);
+    }
+    ok = ok && seen == 0x1Fu;
     vm_destroy(vm);
     return ok;
 }
 
+/* Every byte of the sector is `expect`. */
+static int selftest_sector_is(const uint8_t *sector, uint8_t expect) {
+    for (uint32_t i = 0; i < DISK_SECTOR_SIZE; i++)
+        if (sector[i] != expect)
+            return 0;
+    return 1;
+}
+
+static int run_selftest_disk_overlay(void) {
+    const uint32_t far = 3u << (DISK_COW_CLUSTER_BITS - 9u); /* a sector in another cluster */
+    uint8_t sector[DISK_SECTOR_SIZE];
+    uint8_t three[3 * DISK_SECTOR_SIZE];
+    int ok = 1;
+
+    /* Base: 1 MiB, first sectors 0x11. */
+    const int base = open("./selftest.base", O_RDWR | O_CREAT | O_TRUNC, 0666);
+    memset(three, 0x11, sizeof(three));
+    ok = base >= 0 && ftruncate(base, 1 << 20) == 0 && disk_file_io(base, DISK_CMD_WRITE, 0, three, 3);
+    if (base >= 0)
+        close(base);
+    ok = ok && disk_cow_create("./selftest.cow", "selftest.base", 0);
+
+    uint64_t program[] = {INST(OP_HALT, 0, 0, 0, 0)};
+    VM *vm = ok ? vm_create(MEM_SIZE, program, 1, NULL, 0, NULL, 1, VM_RAM_BACKING_DEFAULT) : NULL;
+    if (vm) {
+        disk_init(vm, "./selftest.cow");
+        ok = !vm->panic && vm->disk.cow && vm->disk_size_bytes == 1u << 20;
+        memset(sector, 0x22, sizeof(sector));
+        ok = ok && disk_transfer(&vm->disk, DISK_CMD_WRITE, 1, sector, 1) &&
+             disk_transfer(&vm->disk, DISK_CMD_WRITE, far, sector, 1);
+        /* Both new clusters are in the file's table already, with no flush. */
+        const int fua_fd = open("./selftest.cow", O_RDONLY);
+        DiskCow *seen = fua_fd >= 0 ? disk_cow_open("./selftest.cow", fua_fd, 0) : NULL;
+        ok = ok && seen && disk_cow_allocated(seen) == 2;
+        disk_cow_close(seen);
+        /* The rest of a written cluster still reads as the base. */
+        ok = ok && disk_transfer(&vm->disk, DISK_CMD_READ, 0, three, 3) &&
+             selftest_sector_is(three, 0x11) && selftest_sector_is(three + DISK_SECTOR_SIZE, 0x22) &&
+             selftest_sector_is(three + 2 * DISK_SECTOR_SIZE, 0x11);
+        ok = ok && disk_transfer(&vm->disk, DISK_CMD_READ, far, sector, 1) && selftest_sector_is(sector, 0x22) &&
+             disk_transfer(&vm->disk, DISK_CMD_READ, far + 1, sector, 1) && selftest_sector_is(sector, 0);
+        ok = ok && disk_cow_allocated(vm->disk.cow) == 2;
+        vm_destroy(vm);
+    } else {
+        ok = 0;
+    }
+
+    /* The base is untouched until a commit, which empties the overlay. */
+    int fd = open("./selftest.base", O_RDONLY);
+    ok = ok && fd >= 0 && disk_file_io(fd, DISK_CMD_READ, 1, sector, 1) && selftest_sector_is(sector, 0x11);
+    if (fd >= 0)
+        close(fd);
+    ok = ok && disk_cow_compact("./selftest.cow") && disk_cow_commit("./selftest.cow");
+    fd = open("./selftest.base", O_RDONLY);
+    ok = ok && fd >= 0 && disk_file_io(fd, DISK_CMD_READ, 1, sector, 1) && selftest_sector_is(sector, 0x22);
+    if (fd >= 0)
+        close(fd);
+    fd = ok ? open("./selftest.cow", O_RDWR) : -1;
+    DiskCow *cow = fd >= 0 ? disk_cow_open("./selftest.cow", fd, 0) : NULL;
+    ok = ok && cow && disk_cow_allocated(cow) == 0;
+    disk_cow_close(cow);
+    remove("./selftest.cow");
+    remove("./selftest.base");
+    return ok;
+}
+
 static int run_selftest_relctrl(void) {
     const vm_addr_t flag_addr = 0x3020;
     uint64_t program[] = {
@@ -1295,7 +2287,8 @@ static int run_selftest_relctrl(void) {
         INST(OP_RET, 0, 0, 0, 0),
     };
 
-    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1);
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
     if (!vm)
         return 0;
     disk_init(vm, "./disk.img");
@@ -1332,7 +2325,8 @@ static int run_selftest_zero_branch_flags(void) {
         INST(OP_HALT, 0, 0, 0, 0),
     };
 
-    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1);
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
     if (!vm)
         return 0;
     disk_init(vm, "./disk.img");
@@ -1344,103 +2338,560 @@ static int run_selftest_zero_branch_flags(void) {
     return ok;
 }
 
-static int run_selftests(void) {
-    int ok1 = run_selftest_startap_cpuid();
-    int ok2 = run_selftest_ipi();
-    int ok3 = run_selftest_relctrl();
-    int ok4 = run_selftest_zero_branch_flags();
-    printf("[selftest] startap_cpuid: %s\n", ok1 ? "PASS" : "FAIL");
-    printf("[selftest] ipi: %s\n", ok2 ? "PASS" : "FAIL");
-    printf("[selftest] relctrl: %s\n", ok3 ? "PASS" : "FAIL");
-    printf("[selftest] zero_branch_flags: %s\n", ok4 ? "PASS" : "FAIL");
-    return (ok1 && ok2 && ok3 && ok4) ? 0 : 1;
-}
-
-int main(int argc, char **argv) {
-    const char *filename = "boot.bin";
-    int smp_cores = 1;
-    int selftest = 0;
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--bin") == 0) {
-            if (i + 1 >= argc) {
-                print_usage(argv[0]);
-                return 1;
-            }
-            filename = argv[++i];
-        } else if (strcmp(argv[i], "--smp") == 0) {
-            if (i + 1 >= argc || !parse_positive_int(argv[i + 1], &smp_cores)) {
-                printf("Invalid --smp value. Expected integer in [1, 64].\n");
-                print_usage(argv[0]);
-                return 1;
-            }
-            i++;
-        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
-            print_usage(argv[0]);
-            return 0;
-        } else if (strcmp(argv[i], "--selftest") == 0) {
-            selftest = 1;
-        } else {
-            printf("Unknown argument: %s\n", argv[i]);
-            print_usage(argv[0]);
-            return 1;
-        }
-    }
-    if (selftest) {
-        return run_selftests();
-    }
+static int run_selftest_self_modifying_code(void) {
+    const vm_addr_t flag_addr = 0x3028;
+    const vm_addr_t patch_addr = PROGRAM_BASE + 5 * 8;
+    uint64_t program[] = {
+        INST(OP_MOVI, 10, 0, 0, flag_addr),             /* r10 = flag addr */
+        INST(OP_MOVI, 3, 0, 0, 0),                      /* r3 = pass */
+        INST(OP_MOVI, 4, 0, 0, patch_addr),             /* r4 = insn to patch */
+        INST(OP_MOVI, 5, 0, 0, 2),                      /* new imm */
+        INST(OP_MOVI, 6, 0, 0, (uint32_t)OP_MOVI << 24 | 2u << 16),
+        INST(OP_MOVI, 2, 0, 0, 1),                      /* patched to r2 = 2 */
+        INST(OP_CMPI, 3, 0, 0, 0),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 12 * 8),
+        INST(OP_MOVI, 3, 0, 0, 1),
+        INST(OP_STORE32, 5, 4, 0, 0),                   /* low word: imm */
+        INST(OP_STORE32, 6, 4, 0, 4),                   /* high word: op/rd/rs1/rs2 */
+        INST(OP_JMP, 0, 0, 0, patch_addr),              /* run the patched insn */
+        INST(OP_STORE32, 2, 10, 0, 0),                  /* *flag = r2 */
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
 
-    size_t program_size = 0;
-    size_t data_size = 0;
-    uint64_t *program = NULL;
-    uint8_t *data = NULL;
-    ProgramLayout layout;
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    int ok = vm_run_headless(vm, 1000);
+    uint32_t flag = vm_read32(vm, flag_addr);
+    ok = ok && (flag == 2);
+    vm_destroy(vm);
+    return ok;
+}
 
-    if (!load_program_single(filename, &program, &program_size, &data, &data_size, &layout)) {
-        printf("Failed to load program from %s\n", filename);
-        return 1;
-    }
+static int run_selftest_fused_branch_patch(void) {
+    const vm_addr_t flag_addr = 0x302C;
+    const vm_addr_t loop = PROGRAM_BASE + 4 * 8;
+    uint64_t program[] = {
+        INST(OP_MOVI, 10, 0, 0, flag_addr),
+        INST(OP_MOVI, 1, 0, 0, 0),
+        INST(OP_MOVI, 4, 0, 0, PROGRAM_BASE + 6 * 8),   /* r4 = the JNZ */
+        INST(OP_MOVI, 5, 0, 0, PROGRAM_BASE + 10 * 8),  /* r5 = its new target */
+        INST(OP_INC, 1, 0, 0, 0),
+        INST(OP_CMPI, 1, 0, 0, 3),                      /* fused with the JNZ */
+        INST(OP_JNZ, 0, 0, 0, loop),
+        INST(OP_STORE32, 5, 4, 0, 0),                   /* retarget the JNZ */
+        INST(OP_MOVI, 1, 0, 0, 0),
+        INST(OP_JMP, 0, 0, 0, loop),
+        INST(OP_STORE32, 1, 10, 0, 0),                  /* *flag = r1 */
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
 
-    printf("Loaded program from %s, %zu instructions.\n", filename, program_size);
-    printf("Loaded data: %zu bytes.\n", data_size);
-    printf("Layout: TEXT_BASE=0x%08X TEXT_SIZE=%u DATA_BASE=0x%08X DATA_SIZE=%u BSS_BASE=0x%08X BSS_SIZE=%u\n",
-           layout.text_base, layout.text_size,
-           layout.data_base, layout.data_size,
-           layout.bss_base, layout.bss_size);
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    int ok = vm_run_headless(vm, 1000);
+    uint32_t flag = vm_read32(vm, flag_addr);
+    ok = ok && (flag == 1);
+    vm_destroy(vm);
+    return ok;
+}
 
-    VM *vm = vm_create(MEM_SIZE, program, program_size, data, data_size, &layout, smp_cores);
-    if (!vm) {
-        printf("Failed to create VM.\n");
-        free(program);
-        free(data);
-        return 1;
-    }
+static int run_selftest_hot_loop(void) {
+    const vm_addr_t data_addr = 0x5000;
+    const vm_addr_t result_addr = 0x30F0;
+    const vm_addr_t loop = PROGRAM_BASE + 6 * 8;
+    const vm_addr_t patch_addr = PROGRAM_BASE + 9 * 8;
+    uint64_t program[] = {
+        INST(OP_MOVI, 10, 0, 0, data_addr),
+        INST(OP_MOVI, 1, 0, 0, 0),                      /* r1 = i */
+        INST(OP_MOVI, 2, 0, 0, 0),                      /* r2 = sum */
+        INST(OP_MOVI, 7, 0, 0, 0x80000000u),            /* r7 = INT_MIN */
+        INST(OP_MOVI, 13, 0, 0, (uint32_t)OP_SUB << 24 | 2u << 16 | 2u << 8 | 4u),
+        INST(OP_MOVI, 14, 0, 0, patch_addr),
+        /* loop */
+        INST(OP_SHLI, 3, 1, 0, 2),
+        INST(OP_STOREX32, 1, 10, 3, 0),                 /* data[i] = i */
+        INST(OP_LOADX32, 4, 10, 3, 0),
+        INST(OP_ADD, 2, 2, 4, 0),                       /* patched to SUB at i == 600 */
+        INST(OP_RCALL, 0, 0, 0, 15 * 8),                /* fn at idx 25 */
+        INST(OP_MOVI, 6, 0, 0, 0),
+        INST(OP_CMP, 6, 7, 0, 0),                       /* 0 - INT_MIN: SF=1, OF=0 */
+        INST(OP_JL, 0, 0, 0, PROGRAM_BASE + 15 * 8),
+        INST(OP_ADDI, 8, 8, 0, 1),                      /* must not run */
+        INST(OP_ADD, 9, 7, 7, 0),                       /* INT_MIN + INT_MIN: SF=0, OF=0 */
+        INST(OP_JGE, 0, 0, 0, PROGRAM_BASE + 18 * 8),
+        INST(OP_ADDI, 8, 8, 0, 100),                    /* must not run */
+        INST(OP_INC, 1, 0, 0, 0),
+        INST(OP_CMPI, 1, 0, 0, 600),
+        INST(OP_JNZ, 0, 0, 0, PROGRAM_BASE + 22 * 8),
+        INST(OP_STORE32, 13, 14, 0, 4),                 /* rewrite the ADD */
+        INST(OP_CMPI, 1, 0, 0, 1000),
+        INST(OP_JL, 0, 0, 0, loop),
+        INST(OP_JMP, 0, 0, 0, PROGRAM_BASE + 27 * 8),
+        INST(OP_XORI, 11, 11, 0, 5),                    /* fn */
+        INST(OP_RET, 0, 0, 0, 0),
+        INST(OP_MOVI, 12, 0, 0, result_addr),
+        INST(OP_STORE32, 2, 12, 0, 0),
+        INST(OP_STORE32, 8, 12, 0, 4),
+        INST(OP_STORE32, 11, 12, 0, 8),
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
+
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
     disk_init(vm, "./disk.img");
     init_ivt(vm);
-    if (smp_cores > 1) {
-        printf("SMP mode enabled: %d cores (per-core architectural state, shared memory).\n", smp_cores);
-    }
-    printf("Loaded VM. \n Call Stack size: %d\n Data Stack size: %d \n Memory Size: %lu\n Memory "
-           "Head: %p\n",
-           CALL_STACK_SIZE,
-           DATA_STACK_SIZE,
-           MEM_SIZE,
-           (void *) vm->memory);
-    init_screen();
-    vm_run(vm);
-#ifdef DBEUG
-    vm_dump(vm, 1024);
-#endif
+    int ok = vm_run_headless(vm, 2000);
+    const int32_t sum = (int32_t)vm_read32(vm, result_addr);
+    const uint32_t skipped = vm_read32(vm, result_addr + 4);
+    const uint32_t calls = vm_read32(vm, result_addr + 8);
+    /* sum(0..599) - sum(600..999) */
+    ok = ok && (sum == 179700 - 319800) && (skipped == 0) && (calls == 0);
+    ok = ok && (vm_read32(vm, data_addr + 999 * 4) == 999);
+    vm_destroy(vm);
+    return ok;
+}
 
-    uint64_t total_execution_times = 0;
-    for (int i = 0; i < vm->smp_cores; i++) {
-        total_execution_times += atomic_load_explicit(&vm->cpus[i].execution_times, memory_order_relaxed);
-    }
+/*
+ * Signed branches after compares that overflow (SF=1, OF=1). The loop runs
+ * past VM_JIT_HOT_THRESHOLD, so the interpreter decides the first iterations
+ * and translated code the rest; the counts only come out exact if both agree.
+ */
+static int run_selftest_signed_overflow(void) {
+    const vm_addr_t result_addr = 0x3100;
+    const vm_addr_t loop = PROGRAM_BASE + 4 * 8;
+    uint64_t program[] = {
+        INST(OP_MOVI, 1, 0, 0, 0x7FFFFFFFu),            /* r1 = INT_MAX */
+        INST(OP_MOVI, 2, 0, 0, 0xFFFFFFFFu),            /* r2 = -1 */
+        INST(OP_MOVI, 11, 0, 0, 1),
+        INST(OP_MOVI, 10, 0, 0, 0),                     /* r10 = i */
+        /* loop: INT_MAX > -1 and INT_MAX + 1 wraps, each with SF=1, OF=1 */
+        INST(OP_CMP, 1, 2, 0, 0),
+        INST(OP_JL, 0, 0, 0, PROGRAM_BASE + 7 * 8),
+        INST(OP_INC, 3, 0, 0, 0),                       /* JL not taken */
+        INST(OP_CMP, 1, 2, 0, 0),
+        INST(OP_JLE, 0, 0, 0, PROGRAM_BASE + 10 * 8),
+        INST(OP_INC, 4, 0, 0, 0),                       /* JLE not taken */
+        INST(OP_CMP, 1, 2, 0, 0),
+        INST(OP_JG, 0, 0, 0, PROGRAM_BASE + 13 * 8),
+        INST(OP_INC, 5, 0, 0, 0),                       /* must not run */
+        INST(OP_CMPI, 1, 0, 0, 0xFFFFFFFFu),
+        INST(OP_JGE, 0, 0, 0, PROGRAM_BASE + 16 * 8),
+        INST(OP_INC, 6, 0, 0, 0),                       /* must not run */
+        INST(OP_ADD, 9, 1, 11, 0),
+        INST(OP_JL, 0, 0, 0, PROGRAM_BASE + 19 * 8),
+        INST(OP_INC, 7, 0, 0, 0),                       /* JL not taken */
+        INST(OP_INC, 10, 0, 0, 0),
+        INST(OP_CMPI, 10, 0, 0, 100),
+        INST(OP_JL, 0, 0, 0, loop),
+        INST(OP_MOVI, 12, 0, 0, result_addr),
+        INST(OP_STORE32, 3, 12, 0, 0),
+        INST(OP_STORE32, 4, 12, 0, 4),
+        INST(OP_STORE32, 5, 12, 0, 8),
+        INST(OP_STORE32, 6, 12, 0, 12),
+        INST(OP_STORE32, 7, 12, 0, 16),
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
+    const uint32_t expect[] = {100, 100, 0, 0, 100};
 
-    printf("Execution complete in %lu cycles.\n",
-           (unsigned long)total_execution_times);
-    vm_debug_print_stats(vm);
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    init_ivt(vm);
+    int ok = vm_run_headless(vm, 2000);
+    for (uint32_t i = 0; ok && i < sizeof(expect) / sizeof(expect[0]); i++)
+        ok = vm_read32(vm, result_addr + i * 4) == expect[i];
     vm_destroy(vm);
-    free(program);
-    free(data);
-    return 0;
+    return ok;
+}
+
+static int run_selftest_bulk_mem(void) {
+    const vm_addr_t buf = 0x6000;
+    const uint32_t row_bytes = FB_WIDTH * FB_BPP;
+    const vm_addr_t fb_dst = (vm_addr_t)MEM_SIZE + row_bytes - 8;  /* straddles rows 0 and 1 */
+    uint64_t program[] = {
+        INST(OP_MOVI, 1, 0, 0, buf),
+        INST(OP_MOVI, 2, 0, 0, 0xAB),
+        INST(OP_MEMSET, 1, 2, 0, 16),
+        INST(OP_MOVI, 3, 0, 0, 0x04030201),
+        INST(OP_STORE32, 3, 1, 0, 0),
+        INST(OP_MOVI, 4, 0, 0, buf + 4),
+        INST(OP_MEMCPY, 4, 1, 0, 12),                   /* overlapping: repeats the word */
+        INST(OP_MOVI, 5, 0, 0, buf + 1),
+        INST(OP_MEMCPY, 1, 5, 0, 15),                   /* scroll down by one byte */
+        INST(OP_MOVI, 6, 0, 0, fb_dst),
+        INST(OP_MEMCPY, 6, 1, 0, 16),
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
+
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    int ok = vm_run_headless(vm, 1000);
+    ok = ok && (vm_read32(vm, buf) == 0x01040302u);
+    ok = ok && (vm_read32(vm, buf + 12) == 0x04040302u);
+    /* Read the framebuffer back through the legacy window. */
+    ok = ok && (vm_read32(vm, FB_LEGACY_BASE + row_bytes - 8) == 0x01040302u);
+    ok = ok && (vm_read32(vm, FB_LEGACY_BASE + row_bytes + 4) == 0x04040302u);
+    vm_destroy(vm);
+    return ok;
+}
+
+static int run_selftest_snapshot(void) {
+    const char *path = "./selftest.snap";
+    const vm_addr_t counter_addr = 0x3100;
+    const vm_addr_t ap_entry = PROGRAM_BASE + 13 * 8;
+    uint64_t program[] = {
+        /* BSP */
+        INST(OP_MOVI, 1, 0, 0, 1),
+        INST(OP_MOVI, 2, 0, 0, ap_entry),
+        INST(OP_STARTAP, 1, 2, 0, 0),
+        INST(OP_MOVI, 4, 0, 0, counter_addr),
+        INST(OP_LOAD32, 3, 4, 0, 0),                    /* wait for the AP to run */
+        INST(OP_CMPI, 3, 0, 0, 0),
+        INST(OP_JZ, 0, 0, 0, PROGRAM_BASE + 4 * 8),
+        INST(OP_MOVI, 6, 0, 0, VM_CONTROL),
+        INST(OP_MOVI, 7, 0, 0, VM_CONTROL_CMD_SNAPSHOT),
+        INST(OP_OUT, 7, 6, 0, 0),
+        INST(OP_IN, 8, 6, 0, 0),                        /* SAVED, or RESTORED after load */
+        INST(OP_STORE32, 8, 4, 0, 4),
+        INST(OP_HALT, 0, 0, 0, 0),
+        /* AP: count forever */
+        INST(OP_MOVI, 11, 0, 0, counter_addr),
+        INST(OP_LOAD32, 10, 11, 0, 0),
+        INST(OP_ADDI, 10, 10, 0, 1),
+        INST(OP_STORE32, 10, 11, 0, 0),
+        INST(OP_PAUSE, 0, 0, 0, 0),
+        INST(OP_JMP, 0, 0, 0, ap_entry + 1 * 8),
+    };
+
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 2,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    vm->snapshot_path = path;
+    int ok = vm_run_headless(vm, 2000);
+    ok = ok && (vm_read32(vm, counter_addr + 4) == VM_CONTROL_STATUS_SAVED);
+    vm_destroy(vm);
+
+    VM *restored = ok ? vm_snapshot_load(path, "./disk.img", VM_RAM_BACKING_DEFAULT) : NULL;
+    remove(path);
+    if (!restored)
+        return 0;
+    const uint32_t count_at_save = vm_read32(restored, counter_addr);
+    ok = vm_run_headless(restored, 2000);
+    ok = ok && (vm_read32(restored, counter_addr + 4) == VM_CONTROL_STATUS_RESTORED);
+    ok = ok && (count_at_save != 0) && (restored->smp_cores == 2);
+    vm_destroy(restored);
+    return ok;
+}
+
+static int run_selftest_checkpoint(void) {
+    const char *path = "./selftest.ckpt";
+    const vm_addr_t marker_addr = 0x3200;
+    const vm_addr_t data_addr = 0x20000;
+    const vm_addr_t loop = PROGRAM_BASE + 9 * 8;
+    uint64_t program[] = {
+        INST(OP_MOVI, 6, 0, 0, VM_CONTROL),
+        INST(OP_MOVI, 7, 0, 0, VM_CONTROL_CMD_CHECKPOINT),
+        INST(OP_OUT, 7, 6, 0, 0),                       /* no chain yet: full snapshot */
+        INST(OP_MOVI, 4, 0, 0, marker_addr),
+        INST(OP_MOVI, 5, 0, 0, 0x11),
+        INST(OP_STORE32, 5, 4, 0, 0),
+        INST(OP_OUT, 7, 6, 0, 0),                       /* .1 */
+        INST(OP_MOVI, 10, 0, 0, data_addr),
+        INST(OP_MOVI, 1, 0, 0, 0),
+        /* loop: data[i] = i; the second page is first written by translated code */
+        INST(OP_SHLI, 3, 1, 0, 2),
+        INST(OP_STOREX32, 1, 10, 3, 0),
+        INST(OP_INC, 1, 0, 0, 0),
+        INST(OP_CMPI, 1, 0, 0, 1500),
+        INST(OP_JL, 0, 0, 0, loop),
+        INST(OP_OUT, 7, 6, 0, 0),                       /* .2 */
+        INST(OP_IN, 8, 6, 0, 0),                        /* SAVED, or RESTORED after load */
+        INST(OP_STORE32, 8, 4, 0, 4),
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
+
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    vm->snapshot_path = path;
+    int ok = vm_run_headless(vm, 2000);
+    ok = ok && (vm_read32(vm, marker_addr + 4) == VM_CONTROL_STATUS_SAVED) && (vm->checkpoint_seq == 2);
+    vm_destroy(vm);
+
+    /* Each link restores the RAM of its own point in time. */
+    VM *first = ok ? vm_snapshot_load("./selftest.ckpt.1", "./disk.img", VM_RAM_BACKING_DEFAULT) : NULL;
+    ok = first && (vm_read32(first, marker_addr) == 0x11) && (vm_read32(first, data_addr + 1499 * 4) == 0);
+    if (first)
+        vm_destroy(first);
+    VM *last = ok ? vm_snapshot_load("./selftest.ckpt.2", "./disk.img", VM_RAM_BACKING_DEFAULT) : NULL;
+    remove("./selftest.ckpt.2");
+    remove("./selftest.ckpt.1");
+    remove(path);
+    if (!last)
+        return 0;
+    ok = vm_run_headless(last, 2000);
+    ok = ok && (vm_read32(last, marker_addr) == 0x11);
+    ok = ok && (vm_read32(last, data_addr + 4) == 1) && (vm_read32(last, data_addr + 1499 * 4) == 1499);
+    ok = ok && (vm_read32(last, marker_addr + 4) == VM_CONTROL_STATUS_RESTORED);
+    vm_destroy(last);
+    return ok;
+}
+
+static int run_selftest_fork(void) {
+    const vm_addr_t counter_addr = 0x3300;
+    const vm_addr_t wait_loop = PROGRAM_BASE + 15 * 8;
+    const vm_addr_t parent_exit = PROGRAM_BASE + 26 * 8;
+    const vm_addr_t ap_entry = PROGRAM_BASE + 27 * 8;
+    const uint32_t forked_status = VM_CONTROL_STATUS_FORKED | (2u << VM_CONTROL_ARG_SHIFT);
+    uint64_t program[] = {
+        /* BSP */
+        INST(OP_MOVI, 1, 0, 0, 1),
+        INST(OP_MOVI, 2, 0, 0, ap_entry),
+        INST(OP_STARTAP, 1, 2, 0, 0),
+        INST(OP_MOVI, 4, 0, 0, counter_addr),
+        INST(OP_LOAD32, 3, 4, 0, 0),                    /* wait for the AP to run */
+        INST(OP_CMPI, 3, 0, 0, 0),
+        INST(OP_JZ, 0, 0, 0, PROGRAM_BASE + 4 * 8),
+        INST(OP_MOVI, 6, 0, 0, VM_CONTROL),
+        INST(OP_MOVI, 7, 0, 0, (2u << VM_CONTROL_ARG_SHIFT) | VM_CONTROL_CMD_FORK),
+        INST(OP_OUT, 7, 6, 0, 0),
+        INST(OP_IN, 8, 6, 0, 0),
+        INST(OP_STORE32, 8, 4, 0, 4),
+        INST(OP_CMPI, 8, 0, 0, forked_status),
+        INST(OP_JZ, 0, 0, 0, parent_exit),
+        /* clone: the AP must have been brought back up */
+        INST(OP_LOAD32, 9, 4, 0, 0),
+        INST(OP_LOAD32, 10, 4, 0, 0),
+        INST(OP_CMP, 10, 9, 0, 0),
+        INST(OP_JZ, 0, 0, 0, wait_loop),
+        INST(OP_SHRI, 11, 8, 0, VM_CONTROL_ARG_SHIFT),  /* clone index */
+        INST(OP_ADDI, 12, 11, 0, '0'),
+        INST(OP_MOVI, 13, 0, 0, SCREEN),
+        INST(OP_OUT, 12, 13, 0, 0),                     /* to this clone's log */
+        INST(OP_SHLI, 11, 11, 0, VM_CONTROL_ARG_SHIFT),
+        INST(OP_ORI, 11, 11, 0, VM_CONTROL_CMD_EXIT),
+        INST(OP_OUT, 11, 6, 0, 0),                      /* exit status = index */
+        INST(OP_HALT, 0, 0, 0, 0),
+        INST(OP_HALT, 0, 0, 0, 0),                      /* parent */
+        /* AP: count forever */
+        INST(OP_MOVI, 11, 0, 0, counter_addr),
+        INST(OP_LOAD32, 10, 11, 0, 0),
+        INST(OP_ADDI, 10, 10, 0, 1),
+        INST(OP_STORE32, 10, 11, 0, 0),
+        INST(OP_PAUSE, 0, 0, 0, 0),
+        INST(OP_JMP, 0, 0, 0, ap_entry + 1 * 8),
+    };
+
+    VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 2,
+                       VM_RAM_BACKING_DEFAULT);
+    if (!vm)
+        return 0;
+    disk_init(vm, "./disk.img");
+    init_ivt(vm);
+    int ok = vm_run_headless(vm, 2000);
+    ok = ok && (vm_read32(vm, counter_addr + 4) == forked_status) && (vm->clone_count == 2);
+
+    /* Each clone exits with its index after writing it to its own log. */
+    const uint64_t deadline = host_monotonic_time_ns() + 5000000000ull;
+    for (int i = 0; i < vm->clone_count; i++) {
+        int status = 0;
+        pid_t done;
+        while ((done = waitpid(vm->clone_pids[i], &status, WNOHANG)) == 0 && host_monotonic_time_ns() < deadline)
+            usleep(1000);
+        if (done == 0) {
+            kill(vm->clone_pids[i], SIGKILL);
+            waitpid(vm->clone_pids[i], &status, 0);
+        }
+        ok = ok && done > 0 && WIFEXITED(status) && WEXITSTATUS(status) == i + 1;
+
+        char *log_path = vm_clone_path(vm, i + 1, "log");
+        char *disk_path = vm_clone_path(vm, i + 1, "disk");
+        FILE *log = log_path ? fopen(log_path, "rb") : NULL;
+        char text[64] = {0};
+        if (log) {
+            (void)fread(text, 1, sizeof(text) - 1, log);
+            fclose(log);
+        }
+        ok = ok && strchr(text, '0' + i + 1) != NULL;
+        ok = ok && disk_path && access(disk_path, F_OK) == 0;
+        if (log_path)
+            remove(log_path);
+        if (disk_path)
+            remove(disk_path);
+        free(log_path);
+        free(disk_path);
+    }
+    /* The original writes its own overlay now, not the image under the clones'. */
+    char *own_disk = vm_clone_path(vm, 0, "disk");
+    ok = ok && own_disk && vm->disk.cow && vm->disk.path && strcmp(vm->disk.path, own_disk) == 0;
+    vm->clone_count = 0;
+    vm_destroy(vm);
+    if (own_disk)
+        remove(own_disk);
+    free(own_disk);
+    return ok;
 }
+
+typedef struct {
+    char text[8];
+    size_t len;
+} SerialCapture;
+
+static void capture_serial(void *opaque, uint8_t c) {
+    SerialCapture *cap = opaque;
+    if (cap->len + 1 < sizeof(cap->text))
+        cap->text[cap->len++] = (char)c;
+}
+
+/*
+ * Two VMs stepped in turn on this thread: one finishes a loop and prints
+ * through its own serial hook, the other panics without taking the process
+ * (or its neighbour) down.
+ */
+/* Nothing after a panicking instruction may run, on vCPU threads or through vm_step(). */
+static int run_selftest_panic_stops(void) {
+    const vm_addr_t flag_addr = 0x3000;
+    uint64_t program[] = {
+        INST(OP_MOVI, 1, 0, 0, 0xF0000000u),
+        INST(OP_LOAD32, 2, 1, 0, 0),            /* panics */
+        INST(OP_MOVI, 3, 0, 0, 0x1234),
+        INST(OP_MOVI, 4, 0, 0, flag_addr),
+        INST(OP_STORE32, 3, 4, 0, 0),
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
+    int ok = 1;
+    for (int stepped = 0; stepped < 2; stepped++) {
+        VM *vm = vm_create(MEM_SIZE, program, sizeof(program) / sizeof(program[0]), NULL, 0, NULL, 1,
+                           VM_RAM_BACKING_DEFAULT);
+        if (!vm)
+            return 0;
+        init_ivt(vm);
+        if (stepped)
+            vm_step(vm, 64);
+        else
+            (void)vm_run_headless(vm, 1000);
+        ok = ok && vm_state(vm) == VM_STATE_PANICKED && vm_read32(vm, flag_addr) == 0;
+        vm_destroy(vm);
+    }
+    return ok;
+}
+
+static int run_selftest_instances(void) {
+    const vm_addr_t result_addr = 0x3100;
+    uint64_t good[] = {
+        INST(OP_MOVI, 1, 0, 0, 0),              /* r1 = i */
+        INST(OP_MOVI, 2, 0, 0, 0),              /* r2 = sum */
+        INST(OP_ADD, 2, 2, 1, 0),               /* loop */
+        INST(OP_INC, 1, 0, 0, 0),
+        INST(OP_CMPI, 1, 0, 0, 5000),
+        INST(OP_JL, 0, 0, 0, PROGRAM_BASE + 2 * 8),
+        INST(OP_MOVI, 10, 0, 0, result_addr),
+        INST(OP_STORE32, 2, 10, 0, 0),
+        INST(OP_MOVI, 13, 0, 0, SCREEN),
+        INST(OP_MOVI, 3, 0, 0, 'o'),
+        INST(OP_OUT, 3, 13, 0, 0),
+        INST(OP_MOVI, 3, 0, 0, 'k'),
+        INST(OP_OUT, 3, 13, 0, 0),
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
+    uint64_t bad[] = {
+        INST(OP_MOVI, 1, 0, 0, 0xF0000000u),
+        INST(OP_LOAD32, 2, 1, 0, 0),            /* nothing mapped there */
+        INST(OP_HALT, 0, 0, 0, 0),
+    };
+
+    VM *a = vm_create(MEM_SIZE, good, sizeof(good) / sizeof(good[0]), NULL, 0, NULL, 1,
+                      VM_RAM_BACKING_DEFAULT);
+    VM *b = vm_create(MEM_SIZE, bad, sizeof(bad) / sizeof(bad[0]), NULL, 0, NULL, 1,
+                      VM_RAM_BACKING_DEFAULT);
+    int ok = a && b;
+    SerialCapture cap = {{0}, 0};
+    if (ok) {
+        init_ivt(a);
+        init_ivt(b);
+        a->serial_out = capture_serial;
+        a->serial_opaque = &cap;
+        for (int i = 0; i < 10000 && (vm_state(a) == VM_STATE_RUNNING || vm_state(b) == VM_STATE_RUNNING); i++) {
+            vm_step(a, 100);
+            vm_step(b, 100);
+        }
+        const char *msg = vm_panic_message(b);
+        ok = vm_state(a) == VM_STATE_HALTED && vm_panic_message(a) == NULL &&
+             vm_read32(a, result_addr) == 12497500u && strcmp(cap.text, "ok") == 0 &&
+             vm_cycles(a) >= 5000u * 4u &&
+             vm_state(b) == VM_STATE_PANICKED && msg && strstr(msg, "READ32 out of bounds") != NULL;
+    }
+    vm_destroy(a);
+    vm_destroy(b);
+    return ok;
+}
+
+int vm_selftest(void) {
+    int ok1 = run_selftest_startap_cpuid();
+    int ok2 = run_selftest_ipi();
+    int ok3 = run_selftest_relctrl();
+    int ok4 = run_selftest_zero_branch_flags();
+    int ok5 = run_selftest_self_modifying_code();
+    int ok6 = run_selftest_hot_loop();
+    int ok7 = run_selftest_fused_branch_patch();
+    int ok8 = run_selftest_disk_irq();
+    int ok9 = run_selftest_up_timer_irq();
+    int ok10 = run_selftest_bulk_mem();
+    int ok11 = run_selftest_snapshot();
+    int ok12 = run_selftest_checkpoint();
+    int ok13 = run_selftest_fork();
+    int ok14 = run_selftest_instances();
+    int ok15 = run_selftest_blk_queue(VM_DISK_IO_THREADS);
+    int ok16 = run_selftest_blk_queue(VM_DISK_IO_URING);
+    int ok17 = run_selftest_disk_overlay();
+    int ok18 = run_selftest_panic_stops();
+    int ok19 = run_selftest_blk_out_of_order(VM_DISK_IO_THREADS);
+    int ok20 = run_selftest_blk_out_of_order(VM_DISK_IO_URING);
+    int ok21 = run_selftest_signed_overflow();
+    int ok22 = run_selftest_up_irq_queue_full();
+    printf("[selftest] startap_cpuid: %s\n", ok1 ? "PASS" : "FAIL");
+    printf("[selftest] ipi: %s\n", ok2 ? "PASS" : "FAIL");
+    printf("[selftest] relctrl: %s\n", ok3 ? "PASS" : "FAIL");
+    printf("[selftest] zero_branch_flags: %s\n", ok4 ? "PASS" : "FAIL");
+    printf("[selftest] self_modifying_code: %s\n", ok5 ? "PASS" : "FAIL");
+    printf("[selftest] hot_loop: %s\n", ok6 ? "PASS" : "FAIL");
+    printf("[selftest] fused_branch_patch: %s\n", ok7 ? "PASS" : "FAIL");
+    printf("[selftest] disk_irq: %s\n", ok8 ? "PASS" : "FAIL");
+    printf("[selftest] up_timer_irq: %s\n", ok9 ? "PASS" : "FAIL");
+    printf("[selftest] bulk_mem: %s\n", ok10 ? "PASS" : "FAIL");
+    printf("[selftest] snapshot: %s\n", ok11 ? "PASS" : "FAIL");
+    printf("[selftest] checkpoint: %s\n", ok12 ? "PASS" : "FAIL");
+    printf("[selftest] fork: %s\n", ok13 ? "PASS" : "FAIL");
+    printf("[selftest] instances: %s\n", ok14 ? "PASS" : "FAIL");
+    printf("[selftest] blk_queue: %s\n", ok15 ? "PASS" : "FAIL");
+    printf("[selftest] blk_queue_uring: %s\n", ok16 ? "PASS" : "FAIL");
+    printf("[selftest] disk_overlay: %s\n", ok17 ? "PASS" : "FAIL");
+    printf("[selftest] panic_stops: %s\n", ok18 ? "PASS" : "FAIL");
+    printf("[selftest] blk_out_of_order: %s\n", ok19 ? "PASS" : "FAIL");
+    printf("[selftest] blk_out_of_order_uring: %s\n", ok20 ? "PASS" : "FAIL");
+    printf("[selftest] signed_overflow: %s\n", ok21 ? "PASS" : "FAIL");
+    printf("[selftest] up_irq_queue_full: %s\n", ok22 ? "PASS" : "FAIL");
+    return (ok1 && ok2 && ok3 && ok4 && ok5 && ok6 && ok7 && ok8 && ok9 && ok10 && ok11 && ok12 && ok13 &&
+            ok14 && ok15 && ok16 && ok17 && ok18 && ok19 && ok20 && ok21 && ok22) ? 0 : 1;
+}
+
@@ -14,6 +14,11 @@
 #include <time.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <sys/types.h>
+
+#include "event_queue.h"
+#include "libvm.h"
+#include "loadbin.h"
 
 static inline uint64_t INST(uint8_t op, uint8_t rd, uint8_t rs1, uint8_t rs2, uint32_t imm) {
     return ((uint64_t)op << 56 | (uint64_t)rd << 48 | (uint64_t)rs1 << 40 | (uint64_t)rs2 << 32) |
@@ -21,6 +26,8 @@ static inline uint64_t INST(uint8_t op, uint8_t rd, uint8_t rs1, uint8_t rs2, ui
 }
 typedef struct VM VM;
 typedef struct VCPU VCPU;
+typedef struct VM_DecodePage VM_DecodePage;
+typedef struct VM_Jit VM_Jit;
 #ifdef VM_DEBUG
 typedef struct VM_Debug VM_Debug;
 #endif
@@ -30,6 +37,7 @@ typedef struct VM_Debug VM_Debug;
 #define FB_HEIGHT 480
 #define FB_BPP 4
 #define FB_SIZE (FB_WIDTH * FB_HEIGHT * FB_BPP)
+#define FB_DIRTY_WORDS ((FB_HEIGHT + 63) / 64)
 
 #define IO_SIZE 256
 
@@ -55,6 +63,26 @@ typedef struct VM_Debug VM_Debug;
 #define PROGRAM_BASE (TIME_BASE + 28)
 
 #define FB_BASE(addr_space_size) (addr_space_size)
+
+/*
+ * Guest physical address space classification, one entry per 4 KiB page.
+ * Only VM_REGION_RAM pages (entirely RAM, no MMIO device overlapping) take
+ * the direct load/store path in memory.c; everything else is checked.
+ */
+#define VM_REGION_PAGE_SHIFT 12u
+#define VM_REGION_PAGE_SIZE (1u << VM_REGION_PAGE_SHIFT)
+#define VM_REGION_PAGES (1u << (32u - VM_REGION_PAGE_SHIFT))
+enum {
+    VM_REGION_UNMAPPED = 0,
+    VM_REGION_RAM,
+    VM_REGION_MMIO,
+};
+/*
+ * Set on RAM pages between checkpoints (see snapshot.h): loads still go
+ * direct, the first store takes the slow path and clears it, so a RAM page
+ * without the flag has been written since the last checkpoint.
+ */
+#define VM_REGION_WRITE_PROTECT 0x80u
 #define FB_LEGACY_BASE 0x00620000u
 #define SYSINFO_BASE (FB_LEGACY_BASE + FB_SIZE)
 #define SYSINFO_MAGIC 0x31494D56u /* "VMI1" */
@@ -92,10 +120,48 @@ typedef struct VM_Debug VM_Debug;
 #define SYSINFO_REG_BOOT_REALTIME_NS_LO 0x54u
 #define SYSINFO_REG_BOOT_REALTIME_NS_HI 0x58u
 #define SYSINFO_SIZE 0x5Cu
+#define SYSINFO_FEATURE_BLK_QUEUE (1u << 5)
+/* DISK_CMD_FLUSH / _WRITE_FUA and BLK_OP_FLUSH / _WRITE_FUA; without it, writes are durable at once. */
+#define SYSINFO_FEATURE_DISK_FLUSH (1u << 6)
+/*
+ * Block queue device (see io_devices/blk): the global registers, then one
+ * BLK_QUEUE_REGS window per queue pair, queue q at BLK_QUEUE_REGS * (q + 1).
+ */
+#define BLK_BASE (SYSINFO_BASE + 0x1000u)
+#define BLK_MAGIC 0x314B4C42u /* "BLK1" */
+#define BLK_QUEUES 4u
+#define BLK_QUEUE_SIZE_MAX 256u /* entries, a power of two */
+#define BLK_WORKERS 4
+#define BLK_REG_MAGIC 0x00u
+#define BLK_REG_QUEUES 0x04u
+#define BLK_REG_QUEUE_SIZE_MAX 0x08u
+#define BLK_REG_CAPACITY_LO 0x0Cu /* sectors */
+#define BLK_REG_CAPACITY_HI 0x10u
+#define BLK_QUEUE_REGS 0x20u
+#define BLK_Q_SQ_ADDR 0x00u
+#define BLK_Q_CQ_ADDR 0x04u
+#define BLK_Q_SIZE 0x08u
+#define BLK_Q_SQ_TAIL 0x0Cu
+#define BLK_Q_SQ_HEAD 0x10u
+#define BLK_Q_CQ_TAIL 0x14u
+#define BLK_Q_CQ_HEAD 0x18u
+#define BLK_Q_IRQ_COALESCE 0x1Cu
+#define BLK_SIZE (BLK_QUEUE_REGS * (BLK_QUEUES + 1u))
+#define BLK_SQE_SIZE 16u
+#define BLK_CQE_SIZE 8u
+#define BLK_OP_READ 1u
+#define BLK_OP_WRITE 2u
+#define BLK_OP_FLUSH 3u     /* lba, mem_addr and count are ignored */
+#define BLK_OP_WRITE_FUA 4u /* completes once the data is durable */
+#define BLK_STATUS_OK 0u
+#define BLK_STATUS_IO_ERROR 1u
+#define BLK_STATUS_BAD_REQUEST 2u
 typedef uint32_t vm_addr_t;
 
 typedef struct {
-    FILE *fp;
+    int fd;          /* raw image: valid while path is set and cow is not */
+    char *path;
+    struct DiskCow *cow; /* overlay image, see disk_cow.h */
 
     uint32_t lba;
     uint32_t mem_addr;
@@ -111,13 +177,81 @@ typedef struct {
     bool thread_running;
     bool op_complete;
 } Disk;
+
+typedef struct BlkRequest {
+    struct BlkRequest *next; /* on BlkDevice's pending list, or its queue's free list */
+    uint32_t queue;
+    uint16_t op;
+    uint16_t tag;
+    uint32_t lba;
+    uint32_t mem_addr;
+    uint32_t count;
+} BlkRequest;
+
+/*
+ * One submission/completion ring pair. Indices run freely and are masked
+ * with size - 1; everything is guarded by BlkDevice.lock.
+ */
+typedef struct {
+    uint32_t sq_addr;
+    uint32_t cq_addr;
+    uint32_t size;        /* 0 while the queue is disabled */
+    uint32_t sq_tail;     /* doorbell: the guest has queued entries up to here */
+    uint32_t sq_head;     /* the device has fetched up to here */
+    uint32_t cq_tail;     /* the device has completed up to here */
+    uint32_t cq_head;     /* the guest has consumed completions up to here */
+    uint32_t irq_coalesce; /* completions in the low half, microseconds in the high half */
+    uint32_t inflight;    /* fetched, not yet completed */
+    uint32_t unsignalled; /* completed since the last interrupt */
+    uint64_t irq_deadline_ns; /* when the coalescing timer fires, 0 if it is not armed */
+    /*
+     * Storage for fetched entries. Completions come back in any order, so a
+     * request holds its entry until blk_complete() puts it back on `free`,
+     * never by its SQ index.
+     */
+    BlkRequest reqs[BLK_QUEUE_SIZE_MAX];
+    BlkRequest *free;
+} BlkQueue;
+
+typedef struct {
+    BlkQueue queues[BLK_QUEUES];
+    /* Fetched requests no worker has picked up yet, oldest first. */
+    BlkRequest *pending_head;
+    BlkRequest *pending_tail;
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* pending work, a coalescing timer armed, or stop */
+    pthread_cond_t idle; /* a queue's inflight count dropped to 0 */
+    pthread_t workers[BLK_WORKERS];
+    int worker_count;    /* started on the first queue enable */
+    bool running;
+    /* VM_DISK_IO_*: what the first queue enable starts, see VM_Config.disk_io. */
+    int backend;
+    /* VM_DISK_IO_URING: requests go to this ring and `reaper` completes them. */
+    struct BlkUring *uring;
+    pthread_t reaper;
+} BlkDevice;
 typedef uint32_t (*mmio_read32_fn)(VM *vm, uint32_t addr);
 typedef void (*mmio_write32_fn)(VM *vm, uint32_t addr, uint32_t val);
+/*
+ * How vm_read32/vm_write32 serialize calls into an MMIO device:
+ *   GLOBAL - under vm->shared_lock; the default for devices that don't say.
+ *            Only for state no thread but the vCPUs touches, which is why
+ *            uniprocessor VMs skip it like any other vm_shared_lock().
+ *   NONE   - the handlers are safe to run concurrently on any vCPU. A device
+ *            whose state its own threads share takes its own lock, always
+ *            (see the block queue device).
+ */
+enum {
+    VM_MMIO_SYNC_GLOBAL = 0,
+    VM_MMIO_SYNC_NONE,
+};
+
 typedef struct {
     uint32_t start;
     uint32_t end;
     mmio_read32_fn read32;
     mmio_write32_fn write32;
+    uint8_t sync;
 } MMIO_Device;
 struct VCPU {
     uint32_t regs[REG_COUNT];
@@ -126,6 +260,11 @@ struct VCPU {
     size_t ip;
     size_t last_ip;
     unsigned int flags;
+    /* Pending lazy flag update, see flags.h. */
+    uint8_t flags_kind;
+    int32_t flags_a;
+    int32_t flags_b;
+    int32_t flags_res;
     int dsp;
     int csp;
     int isp;
@@ -136,6 +275,18 @@ struct VCPU {
     vm_addr_t data_stack_base;
     vm_addr_t isr_stack_base;
     int is_bsp;
+    /* Last device find_mmio() hit on this vCPU, points into vm->mmio_table. */
+    const MMIO_Device *mmio_cache;
+    /* TIME MMIO: a low-word read latches, the high word reads this vCPU's latch. */
+    uint64_t latched_realtime;
+    uint64_t latched_monotonic;
+    uint64_t latched_boottime;
+
+    /*
+     * VM_ATTN_* bits other threads (and the vCPU itself) set when the run loop
+     * has to leave straight-line execution. Only read once per dispatch batch.
+     */
+    atomic_uint attention;
 };
 
 extern _Thread_local VCPU *vm_tls_vcpu;
@@ -147,14 +298,14 @@ struct VM{
     int panic;
     uint8_t *memory;
     size_t memory_size;
+    size_t memory_map_size; /* length of the mapping behind memory, see vm_ram_map */
 
     /*
      * framebuffer is mapped after main memory:
      * [fb_base, fb_base + FB_SIZE)
      */
     uint32_t *fb;
-    uint32_t *fb_front;
-    pthread_mutex_t fb_row_locks[FB_HEIGHT];
+    atomic_uint_fast64_t fb_dirty[FB_DIRTY_WORDS]; /* one bit per row, cleared by the presenter */
 
     int io[IO_SIZE];
     uint8_t serial_rx_fifo[256];
@@ -162,34 +313,102 @@ struct VM{
     uint16_t serial_rx_tail;
 
     Disk disk;
+    BlkDevice blk;
     atomic_uint_fast64_t *interrupt_bitmap;
 
     uint64_t start_realtime_ns;
     uint64_t start_monotonic_ns;
-    uint64_t latched_realtime;
-    uint64_t latched_monotonic;
-    uint64_t latched_boottime;
     uint64_t disk_size_bytes;
     uint32_t sysinfo_vendor_words[SYSINFO_VENDOR_WORDS];
 
     int suspend_count;
 
-    MMIO_Device *mmio_devices[MAX_MMIO_DEVICES];
+    /*
+     * Sorted by start and frozen by vm_mmio_publish() before any vCPU runs,
+     * so lookups need no locking (see find_mmio()).
+     */
+    MMIO_Device mmio_table[MAX_MMIO_DEVICES];
     int mmio_count;
-    MMIO_Device *mmio_cache_dev;
-    uint32_t mmio_cache_start;
-    uint32_t mmio_cache_end;
+    /* VM_REGION_* per page, built once devices are registered. */
+    _Atomic uint8_t *region_map;
+
+    /*
+     * Pre-decoded instruction pages, one slot per 4 KiB of RAM (see decode.h).
+     */
+    _Atomic(VM_DecodePage *) *decode_pages;
+    size_t decode_page_count;
+
+    /* Translated hot blocks, NULL when the JIT is off (see jit.h). */
+    VM_Jit *jit;
 
     /*
      * SMP runtime configuration and state.
      */
     int smp_cores;
+    /*
+     * Set when smp_cores == 1. Only one thread then runs guest code, so the
+     * execution path skips shared_lock, serial_lock and atomic RMWs on the
+     * interrupt bitmap; other threads go through `events` and `irq_posted`. Device threads
+     * still run, so the locks of state they share (disk.mutex, blk.lock)
+     * are always taken.
+     */
+    int uniprocessor;
+    VM_EventQueue events;
+    /* Interrupts for core 0 raised off the vCPU thread (uniprocessor only). */
+    atomic_uint_fast64_t irq_posted[IRQ_BITMAP_WORDS];
     VCPU *cpus;
     atomic_bool *core_released;
+    /* GLOBAL-mode MMIO devices and the generic I/O ports. Not recursive. */
     pthread_mutex_t shared_lock;
+    /* Serial RX FIFO and the KEYBOARD/SCREEN_ATTRIBUTE ports. */
+    pthread_mutex_t serial_lock;
     vm_addr_t stack_pool_base;
     size_t stack_pool_size;
 
+    /*
+     * VM_CONTROL port (see io.h): a command waits in control_cmd until the
+     * issuing vCPU reaches a batch boundary. snapshot_path is the
+     * --snapshot-save target, NULL when snapshots are off.
+     */
+    atomic_uint control_cmd;
+    const char *snapshot_path;
+    /*
+     * Checkpoint chain on snapshot_path: checkpoint_chain identifies the last
+     * full save (0 before it), checkpoint_seq the last delta written after
+     * it. Only touched with every other vCPU parked.
+     */
+    uint64_t checkpoint_chain;
+    uint32_t checkpoint_seq;
+    /* --checkpoint-interval, 0 when the host does not schedule checkpoints. */
+    uint32_t checkpoint_interval_ms;
+    /*
+     * VM_CONTROL_CMD_FORK: clone_index is 0 in the original process and
+     * 1..n in the clones, which the original reaps through clone_pids.
+     * clone_dir (--clone-dir) holds each clone's disk overlay and serial log.
+     */
+    int clone_index;
+    int clone_count;
+    pid_t *clone_pids;
+    const char *clone_dir;
+    /* Process exit status once the VM stops, set by VM_CONTROL_CMD_EXIT. */
+    int exit_code;
+    /* The first panic() report, kept for embedders; see vm_panic_message(). */
+    char panic_message[256];
+    atomic_bool panic_reported;
+    /*
+     * Where bytes written to the SCREEN port go: serial_out(serial_opaque, c)
+     * on the vCPU that wrote them when set, stdout otherwise.
+     */
+    void (*serial_out)(void *opaque, uint8_t c);
+    void *serial_opaque;
+    /* Run by vm_step() on the caller's thread instead of one thread per vCPU. */
+    int stepped;
+    /* Rendezvous for vm_pause_others(): parked vCPUs wait on pause_cond. */
+    pthread_mutex_t pause_lock;
+    pthread_cond_t pause_cond;
+    int pause_requested;
+    int paused_cores;
+
     /*
      * Timer shared datas.
      */
@@ -213,16 +432,65 @@ static inline VCPU *vm_current_cpu(VM *vm) {
     return &vm->cpus[0];
 }
 
+enum {
+    VM_ATTN_IRQ = 1u << 0,   /* interrupt_bitmap may hold work for this core */
+    VM_ATTN_DISK = 1u << 1,  /* disk worker finished a command (BSP only) */
+    VM_ATTN_STOP = 1u << 2,  /* vm->halted or vm->panic was set */
+    VM_ATTN_DEBUG = 1u << 3, /* debugger wants to look before the next batch */
+    VM_ATTN_EVENTS = 1u << 4, /* vm->events or vm->irq_posted holds work (uniprocessor only) */
+    VM_ATTN_PAUSE = 1u << 5,  /* park until the pausing vCPU resumes us */
+    VM_ATTN_CONTROL = 1u << 6, /* this vCPU issued vm->control_cmd */
+    VM_ATTN_JIT_FULL = 1u << 7, /* this vCPU filled the JIT code buffer */
+};
+
+static inline void vm_cpu_attention(VCPU *cpu, unsigned int bits) {
+    atomic_fetch_or_explicit(&cpu->attention, bits, memory_order_release);
+}
+
+static inline void vm_attention_all(VM *vm, unsigned int bits) {
+    if (!vm || !vm->cpus)
+        return;
+    for (int i = 0; i < vm->smp_cores; i++)
+        vm_cpu_attention(&vm->cpus[i], bits);
+}
+
+/* Stop every vCPU at its next batch boundary. */
+static inline void vm_halt(VM *vm) {
+    vm->halted = 1;
+    vm_attention_all(vm, VM_ATTN_STOP);
+}
+
 static inline void vm_shared_lock(VM *vm) {
-    if (vm)
+    if (vm && !vm->uniprocessor)
         pthread_mutex_lock(&vm->shared_lock);
 }
 
 static inline void vm_shared_unlock(VM *vm) {
-    if (vm)
+    if (vm && !vm->uniprocessor)
         pthread_mutex_unlock(&vm->shared_lock);
 }
 
+static inline void vm_serial_lock(VM *vm) {
+    if (vm && !vm->uniprocessor)
+        pthread_mutex_lock(&vm->serial_lock);
+}
+
+static inline void vm_serial_unlock(VM *vm) {
+    if (vm && !vm->uniprocessor)
+        pthread_mutex_unlock(&vm->serial_lock);
+}
+
+/*
+ * Hand an event to the vCPU thread (uniprocessor mode). Returns 0 when the
+ * queue is full and the event was dropped.
+ */
+static inline int vm_post_event(VM *vm, uint32_t kind, uint32_t arg) {
+    if (!vm_event_push(&vm->events, kind, arg))
+        return 0;
+    vm_cpu_attention(&vm->cpus[0], VM_ATTN_EVENTS);
+    return 1;
+}
+
 static inline size_t vm_fb_row_from_byte_index(size_t fb_byte_index) {
     return fb_byte_index / (size_t)(FB_WIDTH * FB_BPP);
 }
@@ -231,16 +499,17 @@ static inline size_t vm_fb_row_from_pixel_index(size_t fb_pixel_index) {
     return fb_pixel_index / (size_t)FB_WIDTH;
 }
 
-static inline void vm_fb_row_lock(VM *vm, size_t row) {
-    if (vm && row < FB_HEIGHT) {
-        pthread_mutex_lock(&vm->fb_row_locks[row]);
-    }
-}
-
-static inline void vm_fb_row_unlock(VM *vm, size_t row) {
-    if (vm && row < FB_HEIGHT) {
-        pthread_mutex_unlock(&vm->fb_row_locks[row]);
-    }
+/*
+ * Framebuffer stores are plain and unlocked; call this after storing to a
+ * row. The bit is only written when it is clear, so a guest filling a row
+ * costs one relaxed load per store. The presenter tolerates the store and
+ * the bit becoming visible out of order, see display_update.
+ */
+static inline void vm_fb_mark_dirty(VM *vm, size_t row) {
+    atomic_uint_fast64_t *word = &vm->fb_dirty[row / 64];
+    const uint64_t bit = UINT64_C(1) << (row % 64);
+    if (!(atomic_load_explicit(word, memory_order_relaxed) & bit))
+        atomic_fetch_or_explicit(word, bit, memory_order_release);
 }
 
 enum {
@@ -327,7 +596,30 @@ enum {
     OP_RORI = 0x51,
 };
 
+VM *vm_create(size_t memory_size,
+              const uint64_t *program,
+              size_t program_size,
+              const uint8_t *data,
+              size_t data_size,
+              const ProgramLayout *layout,
+              int smp_cores,
+              int ram_backing);
+void vm_destroy(VM *vm);
+/* Run with one thread per vCPU and the SDL display until the VM stops. */
+void vm_run(VM *vm);
+/* Wait for every clone this process forked; returns how many did not exit with status 0. */
+int vm_reap_clones(VM *vm);
+/* The `--selftest` suite; returns 0 when every check passes. */
+int vm_selftest(void);
 void vm_dump(const VM *vm, int mem_preview);
+uint32_t vm_execute(VM *vm, VCPU *cpu, uint32_t budget);
+/*
+ * OUT to VM_CONTROL: queue `cmd` for the current vCPU's next batch boundary.
+ * Host threads land on the BSP and OR in VM_CONTROL_FROM_HOST, which leaves
+ * the guest-visible status alone.
+ */
+#define VM_CONTROL_FROM_HOST 0x80000000u
+void vm_control_request(VM *vm, uint32_t cmd);
 
 static inline uint64_t host_unix_time_ns(void) {
     struct timespec ts;